@@ -18,10 +18,19 @@
 #include <string.h>
 #include <math.h>
 #include <time.h>
+#include <unistd.h>
+#include "budget.h"
+#include "draw.h"
 #include "frames.h"
+#include "particles.h"
+#include "profile.h"
+#include "scene.h"
+#include "simulation.h"
+#include "snapshot.h"
+#include "export.h"
+#include "gpusim.h"
 
 #define MAX 1000000                             // limit the maximum number of particles
-#define PI 3.1415926
 #define RUN_SPEED 0.5                           // used in fly around view
 #define ORIGINAL_VIEW 2
 #define FLY_AROUND 3
@@ -30,129 +39,141 @@ static GLfloat angle = 0;                       // in degree
 static int changing;                            // indicate the mouse moveing the window or not
 static int previous;                            // previous location
 static int newView = 1;                         // when moving the mouse to get the new view
-static int numberParticles = 100;               // initial number of particles
-
-static GLfloat particleArray[MAX][3];           // structure to hold each particles
-static GLfloat particleTime[MAX];               // the lifetime of each particles
-static GLfloat particleVelocity[MAX][2];
-static GLfloat particleDirection[MAX][2];
-static GLfloat colorList[MAX][4];
-static int down[MAX];                           // indicate the particles are in down direction
+static struct particleSystem *ps;               // all the particles and the world they live in
 static int start = 1;                           // start or stop animation
-static GLfloat meanVelocity = 3.0;              // decide the speed of emitting
-static GLfloat gravity = 2.0;                   // decide the speed of dropping
+static struct simulation *simulation;           // steps ps, on a thread of its own unless sameThread
+static int sameThread = 0;                      // simulate between the frames instead
+static int compact = 0;                         // pack the frames drawn, 16 bytes a particle
+static int onGPU = 0;                           // step the particles on the GPU, between the frames
+static struct particleDevice *device;           // the GPU's particles, if stepped there
+static int maxSteps = 4;                        // simulation steps one frame may take
+static int analytic = 0;                        // start with positions computed from time
+static float emitRate = 200000;                 // particles emitted per second when the count grows
+static float lifetime = 0;                      // seconds a particle lives at most, 0 for no limit
+static const char *scenePath;                   // the scene to simulate instead of the waterfall
 static int current_view;
 static int point = 1;                           // the particles are rendered as points
 static int square = 0;                          // the particlse are rendered as billboarded sprite
 static int sphere = 0;                          // the particles are rendered as sphere
 static GLfloat squareSize = 0.02;               // initial size of billboarded sprite
 static int pointSize = 2;                       // initial size of the point
-static GLfloat slicesStacks = 2;                // initial size of stack and slice in sphere
+static int slicesStacks = 2;                    // initial size of stack and slice in sphere
 static int textureEnable = 0;                   // enable or disable the texture function
+static int buffered = 1;                        // draw from vertex buffers, spheres instanced
+static int sorted = 0;                          // draw the particles back to front
+static int culled = 1;                          // draw only what can be seen, far ones as points
+static float lodDistance = LOD_DISTANCE;
+static struct worldDraw *worldDraw;             // the grounds and the particles
+static int updateThreads;                       // threads sharing the particle update
+static long long seed = -1;                     // seed of all random values, -1 for the clock
+static struct profile *profile;                 // times the stages of every frame
+static const char *tracePath;                   // where to write the frame times, if anywhere
+static const char *snapshotPath = "particles.snap";    // where the w key saves the particles
+static struct snapshotWriter *snapshotFile;     // the last one saved, maybe still being written
+static const char *loadPath;                    // the snapshot to start from, if any
+static const char *recordPath;                  // where to record every frame drawn, if anywhere
+static struct snapshotWriter *recording;
+static const char *playPath;                    // the recording to draw instead of simulating
+static struct snapshot *playback;
+static int playFrame;                           // the next frame of it to draw
+static const char *exportPath;                  // where to stream the trajectories, if anywhere
+static struct exporter *exporter;
+static int exportEncoding = EXPORT_RAW;
+static int exportEvery = 1;                     // steps from one exported frame to the next
+static int exportStride = 1;                    // particles from one exported to the next
+static double frameBudget;                      // seconds of work a frame may take, 0 for no controller
+static struct budget *budget;                   // holds the frames to it
 
 static GLfloat  eyex,    eyey,    eyez;         // eye point
 static GLfloat  centerx, centery, centerz;      // look point
 
 
-// get the random value
-static double myRandom(void)
+// used in glutIdleFunc function: sets the global idle callback
+void idle(void)
 {
-    // return random double within range [0,1]
-    return rand() / (double) RAND_MAX;
+    // the simulation keeps to real time in fixed steps, however fast frames
+    // come; on its own thread it needs nothing from here
+    simulationUpdate(simulation);
+    glutPostRedisplay();
 }
-#define RANDOM_RANGE(lo, hi) ((lo) + (hi - lo) * myRandom())
 
-// the speed of time
-#define TIME_DELTA 0.025
+// the commands below change the particles on the thread simulating them
 
-// modelling units of ground extent in each X and Z direction
-#define EDGE 10
+// after every step, of those exportEvery apart
+void exportStep(struct particleSystem *ps)
+{
+    if (exporter == NULL || ps->step % exportEvery != 0)
+        return;
+    particleSystemFetch(ps);
+    if (!exportFrame(exporter, ps))
+    {
+        fprintf(stderr, "cannot export to %s, stopped exporting\n", exportPath);
+        exporterClose(exporter, NULL);
+        exporter = NULL;
+    }
+}
 
-// initialise each particle's attributes
-void pointInt(int i)
+void changeGravity(struct particleSystem *ps, int change)
 {
-    GLfloat angle, velocity, direction;
-    particleArray[i][0] = 0.0;                              // x coordinate
-    particleArray[i][1] = RANDOM_RANGE(8.0, 10.0);          // y coordinate
-    particleArray[i][2] = 0.0;                              // z coordinate
-    particleTime[i] = 0.0;                                  // initialise the life time of each particle
-    angle = (RANDOM_RANGE(60.0, 70.0)) * PI/180.0;          // emitting angle
-    direction = RANDOM_RANGE(-15.0, 15.0) * PI/180.0;       // angle for velocity
-    particleDirection[i][0] = cos(direction);               // x direction
-    particleDirection[i][1] = sin(direction);               // z direction
-    velocity = meanVelocity + RANDOM_RANGE(-1.0, 1.0);      // initialise basic velocity
-    particleVelocity[i][0] = velocity * cos(angle);         // velocity in xz plane
-    particleVelocity[i][1] = velocity * sin(angle);         // velocity in y direction
-    colorList[i][0] = RANDOM_RANGE(0.1, 1.0);               // red
-    colorList[i][1] = RANDOM_RANGE(0.1, 1.0);               // green
-    colorList[i][2] = RANDOM_RANGE(0.1, 1.0);               // blue
-    colorList[i][3] = RANDOM_RANGE(0.7, 1.0);               // alpha
-    down[i] = 1;                                            // indicate the particle is in down direction or not
+    if (change > 0 || ps->gravity > 3)      // limit the minimum gravity
+        ps->gravity += change;
 }
 
-// create particles
-void makeParticleArray(void)
+void changeVelocity(struct particleSystem *ps, int change)
 {
-    int i;
-    for (i = 0; i < numberParticles; i++)
-    {
-        pointInt(i);
-    }
+    if (change > 0 || ps->meanVelocity > 3) // limit the minimum velocity
+        ps->meanVelocity += change;
 }
 
-// there are lots of approxiation: 1. assume the velocity would be 80% whenever particles bounce
-// on the floor to appropriate the actual energy loss 2. assume the velocity in xz plane is constant
-// 3. assume the floor is flat and have perfect reflection 4. ignore the effect between each particle
-void updateParticleArray(void)
+void resetParticles(struct particleSystem *ps, int unused)
 {
-    GLfloat distance;
-    int i;
-    
-    // update all points
-    for (i = 0; i < numberParticles; i++) {
-        distance = particleVelocity[i][0] * particleTime[i];      // the distance in xz plane
-        
-        particleArray[i][0] = particleDirection[i][0] * distance; // x distance
-        particleArray[i][2] = particleDirection[i][1] * distance; // z distance
-        
-        // y
-        if (down[i])        // in down direction
-        {
-            // distance = distance - velocity * time_delta - 1/2 * gravity * (time_delta ^ 2)
-            particleArray[i][1] = particleArray[i][1] - (particleVelocity[i][1] + 0.5 * gravity * TIME_DELTA) * TIME_DELTA;
-            particleVelocity[i][1] += gravity * TIME_DELTA;    // velocity = velocity + gravity * time_delta
-        }
-        else                // in up direction
-        {   // approximation as we cannot get the velocity which is exactly equal to 0
-            if (particleVelocity[i][1] > 0)    // keep increasing
-            {
-                // distance = distance + velocity * time_delta - 1/2 * gravity * (time_delta ^ 2)
-                particleArray[i][1] += particleVelocity[i][1] * TIME_DELTA - 0.5 * gravity * TIME_DELTA * TIME_DELTA;
-                particleVelocity[i][1] -= gravity * TIME_DELTA;    // velocity = velocity - gravity * time_delta
-            }
-            else            // reach the peak
-                down[i] = 1;
-        }
-        
-        // if particles hit the ground, bounce the particles upward again
-        if ((particleArray[i][1] <= 5.0 && distance < 3) || (particleArray[i][1] <= 0.0 && distance > 3)) {
-            // if the distance in xz plane exceed the edge, then make this particle die and re-initialise this particle
-            if (distance > EDGE) {
-                pointInt(i);
-                continue;
-            }
-            down[i] = 0;
-            particleVelocity[i][1] *= 0.8;  // 80% of previous velocity
-        }
-        particleTime[i] += TIME_DELTA;
-    }
+    if (ps->scene != NULL)                  // the emitters of a scene keep their counts
+        return;
+    if (ps->numberParticles > 100)
+        particleSystemResize(ps, 100);
+    particleSystemSetTarget(ps, 100);
 }
 
-// used in glutIdleFunc function: sets the global idle callback
-void idle(void)
+// times ten when up, a tenth otherwise
+void scaleParticles(struct particleSystem *ps, int up)
 {
-    updateParticleArray();
-    glutPostRedisplay();
+    if (up && ps->targetParticles * 10 <= MAX)
+        particleSystemSetTarget(ps, ps->targetParticles * 10);
+    else if (!up && ps->targetParticles / 10 >= 1)
+        particleSystemSetTarget(ps, ps->targetParticles / 10);
+}
+
+void toggleAnalytic(struct particleSystem *ps, int unused)
+{
+    particleSystemSetAnalytic(ps, ps->analytic == NULL);
+}
+
+void restartParticles(struct particleSystem *ps, int unused)
+{
+    makeParticleArray(ps);
+}
+
+// from the budget controller, which leaves the emitters of a scene alone; a
+// frame over budget is one dropped, so fewer particles go at once instead of
+// as they land, while more are emitted over the next frames
+void setParticles(struct particleSystem *ps, int target)
+{
+    if (ps->scene != NULL)
+        return;
+    if (target < ps->numberParticles)
+        particleSystemResize(ps, target);
+    else
+        particleSystemSetTarget(ps, target);
+}
+
+// the last one is long written, as the w key is not pressed every frame
+void saveSnapshot(struct particleSystem *ps, int unused)
+{
+    particleSystemFetch(ps);
+    snapshotWriterClose(snapshotFile);
+    snapshotFile = snapshotWriterCreate(snapshotPath);
+    if (snapshotFile == NULL || !snapshotWrite(snapshotFile, ps, SNAPSHOT_FULL))
+        fprintf(stderr, "cannot save the particles to %s\n", snapshotPath);
 }
 
 // using mouse rotate the whole scene
@@ -188,104 +209,73 @@ void setView (void)
     }
 }
 
-// hardcode the texture, just use the red color as texture
-void glInitTexture(void)
+// what the menu and the options chose, for drawWorld()
+void currentSettings(struct drawSettings *settings)
 {
-    GLuint texture;
-    
-    glGenTextures(1, &texture);                   // generate texture names
-    glBindTexture(GL_TEXTURE_2D, texture);        // bind a named texture to a texturing target
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);  // sets the texture magnification function
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);  // sets the texture minifying function
-    unsigned char data[] = { 255, 0, 0, 255 };
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, data); // specify a two-dimensional texture image
+    settings->point = point;
+    settings->square = square;
+    settings->sphere = sphere;
+    settings->squareSize = squareSize;
+    settings->slicesStacks = slicesStacks;
+    settings->textured = textureEnable;
+    settings->buffered = buffered;
+    settings->sorted = sorted;
+    settings->culled = culled;
+    settings->lodDistance = lodDistance;
+    if (budget != NULL)
+        scaleDetail(settings, budgetDetail(budget));
+}
+
+// the work of the frame just closed, the update or the drawing, whichever took
+// longer as they overlap on two threads, to the budget controller
+void controlBudget(int numberParticles)
+{
+    double update = profileLast(profile, PROFILE_UPDATE);
+    double work = profileLast(profile, PROFILE_FRAME) - profileLast(profile, PROFILE_SWAP);
+
+    if (budgetFrame(budget, work > update ? work : update, numberParticles, !point))
+        simulationCall(simulation, setParticles, budgetParticles(budget));
 }
 
 void display(void)
 {
-    int i;
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    const struct particleSystem *latest = simulationFrame(simulation);
+    const struct particleSystem *drawn = playback != NULL ? snapshotView(playback, playFrame, latest->pool) : latest;
+    int numberParticles = drawn->numberParticles;
+    struct drawSettings settings;
     
-    frameStart();
+    profileBegin(profile, PROFILE_DRAW);        // less the uploads, timed inside
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
     
     if (newView)    // when using mouse rotate the scene
         recalcModelView();
     
-    // Enable the z buffer
-    glDepthMask(GL_TRUE);
+    currentSettings(&settings);
+    drawWorld(worldDraw, drawn, &settings);
     
-    // Draw the smaller ground
-    glColor3f(0.3, 0.0, 0.5);
-    glBegin(GL_QUADS);
-    glVertex3f(-3, 4.80, -3);
-    glVertex3f(3, 4.80, -3);
-    glVertex3f(3, 4.80, 3);
-    glVertex3f(-3, 4.80, 3);
-    glEnd();
-  
-    // Draw the bigger ground
-    glColor3f(0.5, 0.0, 0.5);
-    glBegin(GL_QUADS);
-    glVertex3f(-5, -0.1, -5);
-    glVertex3f(EDGE, -0.1, -5);
-    glVertex3f(EDGE, -0.1, 5);
-    glVertex3f(-5, -0.1, 5);
-    glEnd();
+    // set the view: original or fly around
+    setView();
+    drawFrameTimes(profile, numberParticles, GLUT_BITMAP_8_BY_13, 1.0, 1.0, 1.0, 0.02, 0.96);
+    profileEnd(profile, PROFILE_DRAW);
     
-    // check the rendering shape: point or square or sphere
-    if (point)          // rendering as point
-    {
-        glBegin(GL_POINTS);
-        for (i = 0; i < numberParticles; i++)
-        {
-            // draw particles
-            glColor4f(colorList[i][0],colorList[i][1],colorList[i][2],colorList[i][3]);
-            glVertex3fv(particleArray[i]);
-        }
-        glEnd();
-    }
-    else if (square)    // rendering as billboarded sprite
-    {
-        glBegin(GL_QUADS);
-        for (i = 0; i < numberParticles; i++)
-        {
-            // draw particles
-            glColor4f(colorList[i][0],colorList[i][1],colorList[i][2],colorList[i][3]);
-        
-            glVertex3f(particleArray[i][0]-squareSize, particleArray[i][1]+squareSize, particleArray[i][2]);     // left top
-            glVertex3f(particleArray[i][0]-squareSize, particleArray[i][1]-squareSize, particleArray[i][2]);     // left bottom
-            glVertex3f(particleArray[i][0]+squareSize, particleArray[i][1]-squareSize, particleArray[i][2]);     // right bottom
-            glVertex3f(particleArray[i][0]+squareSize, particleArray[i][1]+squareSize, particleArray[i][2]);     // right top
-        }
-        glEnd();
-    }
+    profileBegin(profile, PROFILE_SWAP);
+    glutSwapBuffers();
+    profileEnd(profile, PROFILE_SWAP);
+    profileFrame(profile, numberParticles);
+    if (budget != NULL && playback == NULL)
+        controlBudget(numberParticles);
     
-    else if (sphere)    // rendering as sphere
+    // the copy is made now, the file written behind the next frames
+    if (recording != NULL && playback == NULL)
+        particleSystemFetch(ps);
+    if (recording != NULL && !snapshotWrite(recording, drawn, SNAPSHOT_DRAWN))
     {
-        for (i = 0; i < numberParticles; i++)
-        {
-            glPushMatrix();
-            if (textureEnable)          // enable or disable the texture function
-            {
-                // set texture environment parameters specifies how texture values are interpreted when a fragment is textured
-                glTexEnvf(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_DECAL);
-                glEnable(GL_TEXTURE_2D);
-            }
-            // put the drawn particles in correct position
-            glTranslatef (particleArray[i][0], particleArray[i][1], particleArray[i][2]);
-            glColor4f(colorList[i][0],colorList[i][1],colorList[i][2],colorList[i][3]);
-            
-            // draw particles.
-            glutWireSphere(0.05, slicesStacks, slicesStacks);
-            glDisable(GL_TEXTURE_2D);
-            glPopMatrix();
-        }
+        fprintf(stderr, "cannot record to %s\n", recordPath);
+        snapshotWriterClose(recording);
+        recording = NULL;
     }
-    
-    // set the view: original or fly around
-    setView();
-    frameEnd(GLUT_BITMAP_HELVETICA_10, 1.0, 1.0, 1.0, 0.05, 0.95);
-    glutSwapBuffers();
+    if (playback != NULL)
+        playFrame = (playFrame + 1) % snapshotFrames(playback);
 }
 
 // manipulate the mouse
@@ -351,22 +341,16 @@ void menu(int option)
             current_view= FLY_AROUND;
             break;
         case 4:                             // increase the gravity
-            gravity += 1;
+            simulationCall(simulation, changeGravity, 1);
             break;
         case 5:                             // decrease the gravity
-            if (gravity > 3)                // limit the minimum gravity
-            {
-                gravity -= 1;
-            }
+            simulationCall(simulation, changeGravity, -1);
             break;
          case 6:                            // increase the velocity
-            meanVelocity += 1;
+            simulationCall(simulation, changeVelocity, 1);
             break;
         case 7:                             // decrease the velocity
-            if (meanVelocity > 3)           // limit the minimum velocity
-            {
-                meanVelocity -= 1;
-            }
+            simulationCall(simulation, changeVelocity, -1);
             break;
         case 8:                             // rendering as the point
             point = 1;
@@ -432,30 +416,32 @@ void menu(int option)
             }
             break;
         case 17:                            // initialise the number of particles
-            numberParticles = 100;
+            simulationCall(simulation, resetParticles, 0);
             break;
-        case 18:                            // increase the number of particles
-            if (numberParticles * 10 <= MAX)
-            {
-                int i;
-                int curNoPoint = numberParticles;
-                numberParticles = curNoPoint * 10;
-                for (i = curNoPoint; i < numberParticles; i++)
-                    pointInt(i);
-            }
+        case 18:                            // increase the number of particles, emitted over the next frames
+            simulationCall(simulation, scaleParticles, 1);
             break;
-        case 19:                            // decreases the number of particles
-            if (numberParticles / 10 >= 1)
-            {
-                numberParticles /= 10;
-            }
+        case 19:                            // decreases the number of particles as they land
+            simulationCall(simulation, scaleParticles, 0);
             break;
         case 20:                            // enable or disable the texture function
-            if (sphere)                     // texture is used in the sphere
+            if (sphere || square)           // texture is used in the sphere and the sprites
             {
                 textureEnable = 1 - textureEnable;
             }
             break;
+        case 21:                            // vertex buffers or immediate mode
+            buffered = 1 - buffered;
+            break;
+        case 22:                            // stepped or closed form simulation
+            simulationCall(simulation, toggleAnalytic, 0);
+            break;
+        case 23:                            // in array order or back to front
+            sorted = !sorted;
+            break;
+        case 24:                            // only what is in view, far ones as points, or all
+            culled = !culled;
+            break;
         case 666:
             exit(0);
     }
@@ -468,6 +454,7 @@ void keyboard(unsigned char c, int x, int y)
     switch (c) {
         case 13:                            // the enter key stop all animation
             start = 1 - start;
+            simulationPause(simulation, !start);    // the pause is not simulated
             if (start)
             {
                 glutIdleFunc(idle);
@@ -479,9 +466,15 @@ void keyboard(unsigned char c, int x, int y)
             break;
         case ' ':                           // the space key restart the whole system
             start = 1;
-            makeParticleArray();
+            profileBegin(profile, PROFILE_EMIT);    // on its own thread the update is charged with it
+            simulationCall(simulation, restartParticles, 0);
+            profileEnd(profile, PROFILE_EMIT);
+            simulationPause(simulation, 0);
             glutIdleFunc(idle);
             break;
+        case 'w':                           // save the particles, written in the background
+            simulationCall(simulation, saveSnapshot, 0);
+            break;
         case 'a':
             centery += RUN_SPEED;
             break;
@@ -526,6 +519,10 @@ void initGraphics(int argc, char *argv[])
     glutAddMenuEntry("x 10 points ", 18);
     glutAddMenuEntry("/ 10 points ", 19);
     glutAddMenuEntry("On/Off texture ", 20);
+    glutAddMenuEntry("Buffered/Immediate ", 21);
+    glutAddMenuEntry("Stepped/Analytic ", 22);
+    glutAddMenuEntry("Unsorted/Sorted ", 23);
+    glutAddMenuEntry("Culled/All ", 24);
     glutAddMenuEntry("Quit", 666);
     glutAttachMenu(GLUT_RIGHT_BUTTON);
     
@@ -539,8 +536,13 @@ void initGraphics(int argc, char *argv[])
     centery = 3.0;
     centerz = 0.0;
     
-    // initialise the texture
-    glInitTexture();
+    // the texture, the vertex buffers and the sphere mesh
+    worldDraw = worldDrawCreate(profile);
+    if (worldDraw == NULL)
+    {
+        fprintf(stderr, "cannot allocate the drawing state\n");
+        exit(1);
+    }
     
     // Set the initial point size
     glPointSize(pointSize);
@@ -548,27 +550,167 @@ void initGraphics(int argc, char *argv[])
 }
 
 
+// command line options, GLUT's own options are left for glutInit
+void readOptions(int argc, char **argv)
+{
+    int i;
+
+    // one update thread per processor unless told otherwise
+    updateThreads = sysconf(_SC_NPROCESSORS_ONLN);
+    for (i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+            updateThreads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+            seed = atoll(argv[++i]);
+        else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc)
+            tracePath = argv[++i];
+        else if (strcmp(argv[i], "--max-steps") == 0 && i + 1 < argc)
+            maxSteps = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--analytic") == 0)
+            analytic = 1;
+        else if (strcmp(argv[i], "--emit-rate") == 0 && i + 1 < argc)
+            emitRate = atof(argv[++i]);
+        else if (strcmp(argv[i], "--lifetime") == 0 && i + 1 < argc)
+            lifetime = atof(argv[++i]);
+        else if (strcmp(argv[i], "--scene") == 0 && i + 1 < argc)
+            scenePath = argv[++i];
+        else if (strcmp(argv[i], "--sorted") == 0)
+            sorted = 1;
+        else if (strcmp(argv[i], "--lod") == 0 && i + 1 < argc)
+            lodDistance = atof(argv[++i]);
+        else if (strcmp(argv[i], "--no-cull") == 0)
+            culled = 0;
+        else if (strcmp(argv[i], "--snapshot") == 0 && i + 1 < argc)
+            snapshotPath = argv[++i];
+        else if (strcmp(argv[i], "--load") == 0 && i + 1 < argc)
+            loadPath = argv[++i];
+        else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc)
+            recordPath = argv[++i];
+        else if (strcmp(argv[i], "--play") == 0 && i + 1 < argc)
+            playPath = argv[++i];
+        else if (strcmp(argv[i], "--export") == 0 && i + 1 < argc)
+            exportPath = argv[++i];
+        else if (strcmp(argv[i], "--export-every") == 0 && i + 1 < argc)
+            exportEvery = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--export-stride") == 0 && i + 1 < argc)
+            exportStride = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--export-delta") == 0)
+            exportEncoding = EXPORT_DELTA;
+        else if (strcmp(argv[i], "--budget") == 0 && i + 1 < argc)
+            frameBudget = atof(argv[++i]) / 1000;
+        else if (strcmp(argv[i], "--compact") == 0)
+            compact = 1;
+        else if (strcmp(argv[i], "--same-thread") == 0)
+            sameThread = 1;
+        else if (strcmp(argv[i], "--gpu") == 0)
+            onGPU = 1;
+    }
+    if (updateThreads < 1)
+        updateThreads = 1;
+    if (maxSteps < 1)
+        maxSteps = 1;
+    if (onGPU)                                  // the GL context is this thread's
+        sameThread = 1;
+}
+
+// glutMainLoop() never returns, so the simulation is stopped on exit(), before
+// what it writes to is closed
+void stopSimulation(void)
+{
+    simulationDestroy(simulation);
+    simulation = NULL;
+}
+
+// and the GPU's buffers freed, with the context still there
+void stopDevice(void)
+{
+    gpuSimulationDestroy(device);
+    device = NULL;
+}
+
+// and the trace is completed
+void closeProfile(void)
+{
+    profileDestroy(profile);
+    profile = NULL;
+}
+
+// and so are the snapshot and the recording
+void closeSnapshots(void)
+{
+    if (!snapshotWriterClose(snapshotFile))
+        fprintf(stderr, "cannot save the particles to %s\n", snapshotPath);
+    if (!snapshotWriterClose(recording))
+        fprintf(stderr, "cannot record to %s\n", recordPath);
+    snapshotClose(playback);
+    snapshotFile = recording = NULL;
+    playback = NULL;
+}
+
+// and the export, which says how fast it went
+void closeExport(void)
+{
+    struct exportStats stats;
+
+    if (exporter == NULL)
+        return;
+    if (!exporterClose(exporter, &stats))
+        fprintf(stderr, "cannot export to %s\n", exportPath);
+    else if (stats.seconds > 0)
+        printf("exported %llu frames, %.1f MB to %s: %.1f MB/s, %.0f ms waiting for the disk\n",
+               (unsigned long long) stats.frames, stats.bytes / (1024.0 * 1024.0), exportPath,
+               stats.bytes / (1024.0 * 1024.0) / stats.seconds, stats.waited * 1.0E3);
+    exporter = NULL;
+}
+
+// carry on from the last full frame of a snapshot instead of emitting afresh
+int loadSnapshot(const char *path)
+{
+    struct snapshot *snapshot = snapshotOpen(path);
+    int frame, loaded = 0;
+
+    if (snapshot == NULL)
+        return 0;
+    for (frame = snapshotFrames(snapshot) - 1; frame >= 0 && !loaded; frame--)
+    {
+        if (snapshotKind(snapshot, frame) == SNAPSHOT_FULL)
+            loaded = snapshotRestore(snapshot, frame, ps);
+    }
+    snapshotClose(snapshot);
+    if (!loaded)
+        fprintf(stderr, "cannot load the particles from %s\n", path);
+    return loaded;
+}
+
 int main(int argc, char **argv)
 {
-    // makes use of the computer's internal clock to control the choice of the seed.
-    srand(time(NULL));
+    readOptions(argc, argv);
     
-    initGraphics(argc, argv);
+    profile = profileCreate();
+    if (profile != NULL && tracePath != NULL && !profileTrace(profile, tracePath))
+        fprintf(stderr, "cannot write the frame times to %s\n", tracePath);
+    atexit(closeProfile);
     
-    // flat shading selects the computed color of just one vertex
-    // and assigns it to all the pixel fragments
-    glShadeModel(GL_FLAT);
+    ps = particleSystemCreate();
+    if (ps == NULL || !particleSystemResize(ps, 100))   // initial number of particles
+    {
+        fprintf(stderr, "cannot allocate the particles\n");
+        return 1;
+    }
     
-    // do depth comparisons and update the depth buffer
-    glEnable(GL_DEPTH_TEST);
+    // makes use of the computer's internal clock to control the choice of the seed,
+    // unless a seed is given to repeat a run exactly
+    ps->seed = seed >= 0 ? seed : time(NULL);
+    ps->maxSteps = maxSteps;
+    ps->emitRate = emitRate;
+    ps->lifetime = lifetime;
     
-    // if enabled, draw points with proper filtering. Otherwise, draw aliased points
-    glEnable(GL_POINT_SMOOTH);
+    if (!particleSystemSetThreads(ps, updateThreads))
+        fprintf(stderr, "cannot start %d update threads, updating on one\n", updateThreads);
+    
+    initGraphics(argc, argv);
     
-    // enable the alpha
-    glEnable(GL_BLEND);
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-
     glMatrixMode(GL_PROJECTION);
     gluPerspective(40.0,                       // field of view in degree
                    1.0,                        // aspect ratio
@@ -577,7 +719,61 @@ int main(int argc, char **argv)
 
     glPushMatrix();       // push so we can pop on model recalcModelView function
     
-    makeParticleArray();
+    makeParticleArray(ps);
+    if (scenePath != NULL)
+    {
+        struct scene *scene = sceneLoad(scenePath);
+        if (scene == NULL || !particleSystemSetScene(ps, scene, 0))
+            return 1;
+    }
+    if (loadPath != NULL && !loadSnapshot(loadPath))
+        return 1;
+    atexit(closeSnapshots);
+    if (playPath != NULL && (playback = snapshotOpen(playPath)) == NULL)
+        return 1;
+    if (recordPath != NULL && (recording = snapshotWriterCreate(recordPath)) == NULL)
+        fprintf(stderr, "cannot record to %s\n", recordPath);
+    atexit(closeExport);
+    if (exportEvery < 1)
+        exportEvery = 1;
+    if (exportPath != NULL &&
+        (exporter = exporterCreate(exportPath, exportEncoding, EXPORT_QUANTUM, exportEvery, exportStride)) == NULL)
+        fprintf(stderr, "cannot export to %s\n", exportPath);
+    if (analytic && !particleSystemSetAnalytic(ps, 1))
+        fprintf(stderr, "cannot allocate the analytic state, stepping instead\n");
+    if (onGPU && ps->scene == NULL && ps->analytic == NULL && playback == NULL)
+    {
+        device = gpuSimulationCreate();
+        if (device == NULL || !particleSystemSetDevice(ps, device))
+            fprintf(stderr, "cannot simulate on the GPU, simulating on the CPU\n");
+        atexit(stopDevice);
+    }
+    else if (onGPU)
+        fprintf(stderr, "only the waterfall can be simulated on the GPU, simulating on the CPU\n");
+    if (frameBudget > 0 && profile != NULL)
+    {
+        // the emitters of a scene keep their counts, so only the detail changes
+        int fewest = ps->scene != NULL ? ps->targetParticles : 100;
+        int most = ps->scene != NULL ? ps->targetParticles : MAX;
+
+        budget = budgetCreate(frameBudget, ps->targetParticles, fewest, most, stdout);
+    }
+    
+    // from here on the particles are the simulation's
+    simulation = simulationCreate(ps, profile, sameThread ? 0 : SIMULATION_THREADED | (compact ? SIMULATION_COMPACT : 0),
+                                  exportStep);
+    if (simulation == NULL && !sameThread)
+    {
+        fprintf(stderr, "cannot start the simulation thread, simulating between frames\n");
+        simulation = simulationCreate(ps, profile, 0, exportStep);
+        sameThread = 1;
+    }
+    if (simulation == NULL)
+        return 1;
+    if (compact && sameThread)                  // no frames are handed over, so none are packed
+        fprintf(stderr, "--compact only packs the simulation thread's frames, drawing the particles as floats\n");
+    atexit(stopSimulation);
+    simulationPause(simulation, playback != NULL);  // a recording plays without the simulation
     
     glutMainLoop();
     return 0;
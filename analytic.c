@@ -0,0 +1,413 @@
+//
+//  analytic.c
+//
+//
+//  Created by BOWEN LI
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "analytic.h"
+#include "update.h"
+#include "pool.h"
+
+#define EVENT_BUCKETS 1024                      // a power of two, one step of time each
+#define EPOCH_LENGTH 256.0                      // float times are moved back by this much once they reach it
+#define EVALUATE_CHUNK 16384                    // particles evaluated by one task
+
+#define SHELF 5.0f                              // height of the smaller ground
+#define SHELF_EDGE 3.0f                         // distance at which it ends
+#define BOUNCE 0.8f                             // speed kept by a bounce
+#define MAX_EVENTS 16                           // events one particle may have in a frame
+
+struct analyticState
+{
+    double epoch;                               // the time all float times count from
+    double now;                                 // the time simulated, counted from the epoch
+    float gravity;                              // the gravity the arcs were started with
+    int64_t processed;                          // the last step whose bucket was handled
+    int scheduled;                              // particles [0, scheduled) are in the buckets
+
+    // per particle, sized like the arrays of the particle system
+    float *birth;                               // when it was emitted
+    float *arcStart;                            // when its current arc began
+    float *arcY;                                // its height then
+    float *arcVelocity;                         // its upward speed then
+    float *arcGravity;                          // gravity, or 0 while it rests on the ground
+    float *eventTime;                           // when its next event is due
+    int32_t *next;                              // the next particle in its bucket, -1 ends
+    int32_t head[EVENT_BUCKETS];
+};
+
+static void listArrays(struct analyticState *state, void **arrays[ANALYTIC_ARRAYS])
+{
+    arrays[0] = (void **) &state->birth;
+    arrays[1] = (void **) &state->arcStart;
+    arrays[2] = (void **) &state->arcY;
+    arrays[3] = (void **) &state->arcVelocity;
+    arrays[4] = (void **) &state->arcGravity;
+    arrays[5] = (void **) &state->eventTime;
+    arrays[6] = (void **) &state->next;
+}
+
+int analyticArrays(struct analyticState *state, void **arrays[ANALYTIC_ARRAYS])
+{
+    if (state == NULL)
+        return 0;
+    listArrays(state, arrays);
+    return ANALYTIC_ARRAYS;
+}
+
+// the step a time falls in, which picks its bucket
+static inline int64_t stepOf(const struct analyticState *state, float time)
+{
+    return (int64_t) floor((state->epoch + time) / TIME_DELTA);
+}
+
+static inline void schedule(struct analyticState *state, int i)
+{
+    int bucket = stepOf(state, state->eventTime[i]) & (EVENT_BUCKETS - 1);
+    state->next[i] = state->head[bucket];
+    state->head[bucket] = i;
+}
+
+static void scheduleAll(struct analyticState *state, int count)
+{
+    int i;
+    for (i = 0; i < EVENT_BUCKETS; i++)
+        state->head[i] = -1;
+    for (i = 0; i < count; i++)
+        schedule(state, i);
+    state->scheduled = count;
+}
+
+// when the arc of particle i next meets a ground: the shelf if it comes down
+// on it before SHELF_EDGE, the ground below otherwise; or, while it rests,
+// when it slides off the shelf or out past EDGE. The end of its lifetime
+// comes first if it is sooner.
+static void groundEvent(const struct particleSystem *ps, struct analyticState *state, int i)
+{
+    float velocityXZ = ps->velocityXZ[i];
+    float start = state->arcStart[i], age = start - state->birth[i];
+    float y = state->arcY[i], v = state->arcVelocity[i], g = state->arcGravity[i];
+    float shelf = v * v + 2 * g * (y - SHELF);
+    float tau;
+
+    if (g == 0)
+    {
+        state->eventTime[i] = state->birth[i] + (y > 0 ? SHELF_EDGE : EDGE) / velocityXZ;
+        return;
+    }
+    if (shelf >= 0)
+    {
+        tau = (v + sqrtf(shelf)) / g;           // coming down through the shelf height
+        if (tau > 0 && velocityXZ * (age + tau) < SHELF_EDGE)
+        {
+            state->eventTime[i] = start + tau;
+            return;
+        }
+    }
+    tau = (v + sqrtf(fmaxf(v * v + 2 * g * y, 0))) / g;
+    state->eventTime[i] = start + tau;
+}
+
+static inline int expired(const struct particleSystem *ps, const struct analyticState *state, int i, float t)
+{
+    return ps->lifetime > 0 && t >= state->birth[i] + ps->lifetime;
+}
+
+static void nextEvent(const struct particleSystem *ps, struct analyticState *state, int i)
+{
+    groundEvent(ps, state, i);
+    if (ps->lifetime > 0 && state->birth[i] + ps->lifetime < state->eventTime[i])
+        state->eventTime[i] = state->birth[i] + ps->lifetime;
+}
+
+// begin an arc at time t from height y with upward speed v; a bounce too
+// small to last two steps leaves the particle resting
+static void startArc(struct analyticState *state, int i, float t, float y, float v, int bounce)
+{
+    state->arcStart[i] = t;
+    state->arcY[i] = y;
+    if (bounce && v < state->gravity * TIME_DELTA)
+    {
+        state->arcVelocity[i] = 0;
+        state->arcGravity[i] = 0;
+    }
+    else
+    {
+        state->arcVelocity[i] = v;
+        state->arcGravity[i] = state->gravity;
+    }
+}
+
+// a particle emitted at time t; the emitter sends it downwards
+static void startLife(const struct particleSystem *ps, struct analyticState *state, int i, float t)
+{
+    state->birth[i] = t;
+    state->arcStart[i] = t;
+    state->arcY[i] = ps->positionY[i];
+    state->arcVelocity[i] = -ps->velocityY[i];
+    state->arcGravity[i] = state->gravity;
+    nextEvent(ps, state, i);
+}
+
+// what happens to particle i at its event time
+static void handleEvent(struct particleSystem *ps, struct analyticState *state, int i)
+{
+    float t = state->eventTime[i];
+    float distance = ps->velocityXZ[i] * (t - state->birth[i]);
+    float g = state->arcGravity[i];
+
+    if (expired(ps, state, i, t) || (g == 0 && state->arcY[i] == 0) ||
+        (g != 0 && distance > EDGE))
+    {
+        // lands or slides out past EDGE, or has lived long enough: a new
+        // particle takes its place, unless it is past the target
+        respawnParticleStep(ps, i, stepOf(state, t));
+        startLife(ps, state, i, t);
+        return;
+    }
+    if (g == 0)                                 // slides off the shelf
+        startArc(state, i, t, SHELF, 0, 0);
+    else                                        // bounce, losing a fifth of the speed
+    {
+        float impact = g * (t - state->arcStart[i]) - state->arcVelocity[i];
+        startArc(state, i, t, distance < SHELF_EDGE ? SHELF : 0, BOUNCE * impact, 1);
+    }
+    nextEvent(ps, state, i);
+}
+
+// the height and upward speed of particle i at time t
+static inline void arcAt(const struct analyticState *state, int i, float t, float *y, float *v)
+{
+    float tau = t - state->arcStart[i], g = state->arcGravity[i];
+    *y = state->arcY[i] + tau * (state->arcVelocity[i] - 0.5f * g * tau);
+    *v = state->arcVelocity[i] - g * tau;
+}
+
+struct analyticState *analyticCreate(struct particleSystem *ps)
+{
+    struct analyticState *state = calloc(1, sizeof(*state));
+    void **arrays[ANALYTIC_ARRAYS];
+    int array, i;
+
+    if (state == NULL)
+        return NULL;
+    listArrays(state, arrays);
+    for (array = 0; array < ANALYTIC_ARRAYS; array++)
+    {
+        if (ps->capacity > 0 && posix_memalign(arrays[array], CACHE_LINE, ps->capacity * sizeof(float)) != 0)
+        {
+            analyticDestroy(state);
+            return NULL;
+        }
+    }
+
+    state->epoch = ps->step * TIME_DELTA;
+    state->gravity = ps->gravity;
+    state->processed = stepOf(state, 0);
+
+    // the stepped positions are those of the age before the last step
+    for (i = 0; i < ps->numberParticles; i++)
+    {
+        float age = ps->particleTime[i] > 0 ? ps->particleTime[i] - TIME_DELTA : 0;
+        float distance = ps->velocityXZ[i] * age;
+        float ground = distance < SHELF_EDGE ? SHELF : 0;
+        float y = ps->positionY[i];
+        float v = particleDown(ps, i) ? -ps->velocityY[i] : ps->velocityY[i];
+
+        state->birth[i] = -age;
+        startArc(state, i, 0, y > ground ? y : ground, v, y <= ground);
+        nextEvent(ps, state, i);
+    }
+    scheduleAll(state, ps->numberParticles);
+    return state;
+}
+
+void analyticDestroy(struct analyticState *state)
+{
+    void **arrays[ANALYTIC_ARRAYS];
+    int array;
+
+    if (state == NULL)
+        return;
+    listArrays(state, arrays);
+    for (array = 0; array < ANALYTIC_ARRAYS; array++)
+        free(*arrays[array]);
+    free(state);
+}
+
+void analyticStore(struct particleSystem *ps, struct analyticState *state)
+{
+    float now = state->now;
+    int i;
+
+    for (i = 0; i < ps->numberParticles; i++)
+    {
+        float y, v;
+
+        arcAt(state, i, now, &y, &v);
+        ps->positionY[i] = ps->previousY[i] = y;
+        ps->velocityY[i] = fabsf(v);
+        setParticleDown(ps, i, v <= 0);
+        ps->particleTime[i] = now - state->birth[i] + TIME_DELTA;
+    }
+}
+
+// growing leaves the new particles out of the buckets until they are emitted
+void analyticResized(struct particleSystem *ps, int keep)
+{
+    if (keep < ps->analytic->scheduled)
+        scheduleAll(ps->analytic, keep);
+}
+
+void analyticReschedule(struct particleSystem *ps)
+{
+    scheduleAll(ps->analytic, ps->numberParticles);
+}
+
+void analyticEmit(struct particleSystem *ps, int first, int count)
+{
+    struct analyticState *state = ps->analytic;
+    int i;
+
+    for (i = first; i < first + count; i++)
+        startLife(ps, state, i, state->now);
+
+    // new particles right after the scheduled ones join the buckets; any
+    // others may be in a bucket already, so all of them are sorted again
+    if (first == state->scheduled)
+    {
+        for (i = first; i < first + count; i++)
+            schedule(state, i);
+        state->scheduled = first + count;
+    }
+    else
+        scheduleAll(state, ps->numberParticles);
+}
+
+// new gravity bends every arc from now on
+static void restartArcs(struct particleSystem *ps, struct analyticState *state)
+{
+    float now = state->now;
+    int i;
+
+    state->gravity = ps->gravity;
+    for (i = 0; i < ps->numberParticles; i++)
+    {
+        float y, v;
+
+        if (state->arcGravity[i] == 0)
+            continue;
+        arcAt(state, i, now, &y, &v);
+        startArc(state, i, now, y, v, 0);
+        nextEvent(ps, state, i);
+    }
+    scheduleAll(state, ps->numberParticles);
+}
+
+// keep the float times small enough to stay precise
+static void moveEpoch(struct particleSystem *ps, struct analyticState *state)
+{
+    const float shift = EPOCH_LENGTH;
+    int i;
+
+    for (i = 0; i < ps->numberParticles; i++)
+    {
+        state->birth[i] -= shift;
+        state->arcStart[i] -= shift;
+        state->eventTime[i] -= shift;
+    }
+    state->epoch += EPOCH_LENGTH;
+    state->now -= EPOCH_LENGTH;
+}
+
+// every particle of the bucket whose event is due has it handled, perhaps
+// several in a row, and goes to the bucket of its next one
+static void handleBucket(struct particleSystem *ps, struct analyticState *state, int64_t step)
+{
+    int bucket = step & (EVENT_BUCKETS - 1);
+    int i = state->head[bucket];
+    float now = state->now;
+
+    state->head[bucket] = -1;
+    while (i >= 0)
+    {
+        int next = state->next[i];
+        int events;
+
+        for (events = 0; state->eventTime[i] <= now && events < MAX_EVENTS; events++)
+            handleEvent(ps, state, i);
+        schedule(state, i);
+        i = next;
+    }
+}
+
+// two loops, each with few enough arrays that the compiler can check them
+// for overlap at run time and vectorise
+static void evaluateRange(struct particleSystem *ps, int begin, int end)
+{
+    const struct analyticState *state = ps->analytic;
+    const float now = state->now;
+    const float *birth = state->birth, *arcStart = state->arcStart;
+    const float *arcY = state->arcY, *arcVelocity = state->arcVelocity, *arcGravity = state->arcGravity;
+    const float *velocityXZ = ps->velocityXZ, *directionX = ps->directionX, *directionZ = ps->directionZ;
+    float *positionX = ps->positionX, *positionY = ps->positionY, *positionZ = ps->positionZ;
+    int i;
+
+    for (i = begin; i < end; i++)
+    {
+        float distance = velocityXZ[i] * (now - birth[i]);
+
+        positionX[i] = directionX[i] * distance;
+        positionZ[i] = directionZ[i] * distance;
+    }
+    for (i = begin; i < end; i++)
+    {
+        float tau = now - arcStart[i];
+
+        positionY[i] = arcY[i] + tau * (arcVelocity[i] - 0.5f * arcGravity[i] * tau);
+    }
+}
+
+static void evaluateChunk(void *context, int chunk)
+{
+    struct particleSystem *ps = context;
+    int begin = chunk * EVALUATE_CHUNK;
+    int end = begin + EVALUATE_CHUNK < ps->numberParticles ? begin + EVALUATE_CHUNK : ps->numberParticles;
+
+    evaluateRange(ps, begin, end);
+}
+
+void analyticAdvance(struct particleSystem *ps, double elapsed)
+{
+    struct analyticState *state = ps->analytic;
+    int chunks = (ps->numberParticles + EVALUATE_CHUNK - 1) / EVALUATE_CHUNK;
+    int64_t step, last;
+    float *current;
+
+    if (ps->gravity != state->gravity)
+        restartArcs(ps, state);
+
+    state->now += elapsed;
+    last = stepOf(state, state->now);
+    for (step = state->processed; step <= last; step++)
+        handleBucket(ps, state, step);
+    state->processed = last;                    // its bucket may still hold later events
+    ps->step = last;
+    if (state->now >= EPOCH_LENGTH)
+        moveEpoch(ps, state);
+
+    // the last positions stay in previous, as after a stepped update
+    current = ps->positionX; ps->positionX = ps->previousX; ps->previousX = current;
+    current = ps->positionY; ps->positionY = ps->previousY; ps->previousY = current;
+    current = ps->positionZ; ps->positionZ = ps->previousZ; ps->previousZ = current;
+    if (ps->pool != NULL && chunks > 1)
+        poolRun(ps->pool, chunks, evaluateChunk, ps);
+    else
+        evaluateRange(ps, 0, ps->numberParticles);
+}
+
+/* end of analytic.c */
@@ -0,0 +1,55 @@
+//
+//  analytic.h
+//
+//
+//  Created by BOWEN LI
+//
+//  Positions computed from time instead of stepped. Between two bounces a
+//  particle flies a parabola, so it keeps only the start of its current arc
+//  and the time of its next event: a bounce, falling off the shelf, or a
+//  landing past EDGE or the end of its lifetime that respawns it. Events wait in buckets of one step
+//  each, and only the particles whose event has come due are touched; every
+//  other particle costs one read-only evaluation per frame.
+//
+//  This is the motion the stepped kernels approximate, with the bounces at
+//  the exact crossing instead of the first step below the ground, and no
+//  step spent at the peak, so the two drift apart by a bounce or two.
+//
+
+#ifndef ANALYTIC_H
+#define ANALYTIC_H
+
+#include "particles.h"
+
+#define ANALYTIC_ARRAYS 7                       // arrays of one float or int per particle
+
+struct analyticState;
+
+// the arcs of the live particles, taken from their stepped state
+struct analyticState *analyticCreate(struct particleSystem *ps);
+void analyticDestroy(struct analyticState *state);
+
+// write the analytic state back into the stepped one
+void analyticStore(struct particleSystem *ps, struct analyticState *state);
+
+// the addresses of the per particle arrays, which particleSystemResize()
+// moves along with its own; returns how many, 0 for a NULL state
+int analyticArrays(struct analyticState *state, void **arrays[ANALYTIC_ARRAYS]);
+
+// after particleSystemResize(): only the first keep particles have events
+void analyticResized(struct particleSystem *ps, int keep);
+
+// after particles were moved to other indices: sort them all into the
+// buckets again
+void analyticReschedule(struct particleSystem *ps);
+
+// start the arcs of particles [first, first + count), just emitted
+void analyticEmit(struct particleSystem *ps, int first, int count);
+
+// advance the clock by elapsed seconds, handle the events that came due
+// and evaluate every position at the new time
+void analyticAdvance(struct particleSystem *ps, double elapsed);
+
+#endif
+
+/* end of analytic.h */
@@ -0,0 +1,1038 @@
+//
+//  bench.c
+//
+//
+//  Created by BOWEN LI
+//
+//  Headless throughput benchmark of the particle simulation: no window, no GL,
+//  so it can run on machines without a display or a GPU.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include "cull.h"
+#include "depthsort.h"
+#include "export.h"
+#include "particles.h"
+#include "scene.h"
+#include "snapshot.h"
+#include "grid.h"
+#include "pool.h"
+#include "rng.h"
+#include "vertices.h"
+
+#define DEFAULT_STEPS 100
+#define WARMUP_STEPS 10
+#define DIVERGED 1.0E-3                     // position error that counts as a different trajectory
+#define GRID_RADIUS 0.1f                    // interaction radius of the grid benchmark
+#define GRID_DENSITY 4000.0                 // points per unit cube there, some 17 within the radius
+#define LOD_DISTANCE 25.0f                  // the viewer's, beyond which particles are points
+#define SPREAD_STEPS 200                    // for the waterfall to reach the far end of the ground
+#define FRAME_BUDGET (1.0 / 60)             // seconds a step may take with its export, for 60 Hz
+#define GAP_EVERY 3                         // exported steps apart in the second check for gaps
+
+static int kernel = -1;                     // update kernel, -1 for the best one
+static int threads = 1;                     // update threads, the sweep goes up to it
+static uint64_t seed = 1;                   // the same particles on every run
+static int analytic = 0;                    // time the closed form instead of the kernel
+static int grid = 0;                        // time the spatial grid instead of the update
+static int depth = 0;                       // time the depth sort instead of the update
+static int view = 0;                        // time the view culling instead of the update
+static int snapshot = 0;                    // time saving and loading a snapshot instead
+static int trajectory = 0;                  // time exporting every step instead
+static int packing = 0;                     // time packing the drawn copy instead
+static int writing = 0;                     // time writing the drawn vertices instead
+static const char *scenePath;               // time this scene instead of the waterfall
+
+// monotonic wall clock in seconds
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1.0E9;
+}
+
+// peak resident set size of the process so far, in megabytes
+static double peakRSS(void)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return usage.ru_maxrss / (1024.0 * 1024.0);   // bytes on macOS
+#else
+    return usage.ru_maxrss / 1024.0;              // kilobytes elsewhere
+#endif
+}
+
+// a system of count freshly emitted particles, always from the same seed
+static struct particleSystem *makeSystem(int count, int withKernel, int withThreads)
+{
+    struct particleSystem *ps = particleSystemCreate();
+    if (ps == NULL || !particleSystemResize(ps, count))
+    {
+        fprintf(stderr, "cannot allocate %d particles\n", count);
+        particleSystemDestroy(ps);
+        return NULL;
+    }
+    if (withKernel >= 0)
+        particleSystemSetKernel(ps, withKernel);
+    if (!particleSystemSetThreads(ps, withThreads))
+    {
+        fprintf(stderr, "cannot start %d threads\n", withThreads);
+        particleSystemDestroy(ps);
+        return NULL;
+    }
+    ps->seed = seed;
+    if (scenePath != NULL)
+    {
+        struct scene *scene = sceneLoad(scenePath);
+        if (scene == NULL || !particleSystemSetScene(ps, scene, 0))
+        {
+            particleSystemDestroy(ps);
+            return NULL;
+        }
+        return ps;
+    }
+    makeParticleArray(ps);
+    if (analytic && !particleSystemSetAnalytic(ps, 1))
+    {
+        fprintf(stderr, "cannot allocate the analytic state of %d particles\n", count);
+        particleSystemDestroy(ps);
+        return NULL;
+    }
+    return ps;
+}
+
+// run steps updates on count particles and print one line of results
+static int runBenchmark(int count, int steps, int withThreads)
+{
+    struct particleSystem *ps;
+    double begin, elapsed;
+    int i;
+
+    ps = makeSystem(count, kernel, withThreads);
+    if (ps == NULL)
+        return 1;
+
+    // let the waterfall spread out so bounces and respawns are in the mix
+    for (i = 0; i < WARMUP_STEPS; i++)
+        updateParticleArray(ps);
+
+    begin = now();
+    for (i = 0; i < steps; i++)
+        updateParticleArray(ps);
+    elapsed = now() - begin;
+
+    count = ps->numberParticles;
+    printf("%10d %8d %10s %8d %10.3f %12.1f %14.3f %12.1f\n",
+           count, steps, scenePath != NULL ? "scene" : analytic ? "analytic" : kernelName(ps->kernel),
+           ps->threads, elapsed, steps / elapsed, elapsed * 1.0E9 / ((double) count * steps), peakRSS());
+    fflush(stdout);
+
+    particleSystemDestroy(ps);
+    return 0;
+}
+
+// time emitting count particles with every thread count, like the space key
+// or the "x 10 points" menu entry do in the viewer
+static int emitBenchmark(int count, int steps)
+{
+    struct particleSystem *ps;
+    double begin, elapsed;
+    int n, i;
+
+    for (n = 1; ; n = n * 2 < threads ? n * 2 : threads)
+    {
+        ps = makeSystem(count, kernel, n);
+        if (ps == NULL)
+            return 1;
+        begin = now();
+        for (i = 0; i < steps; i++)
+            makeParticleArray(ps);
+        elapsed = (now() - begin) / steps;
+        printf("%10d %8d %12.3f %14.3f\n", count, n, elapsed * 1.0E3, elapsed * 1.0E9 / count);
+        fflush(stdout);
+        particleSystemDestroy(ps);
+        if (n == threads)
+            return 0;
+    }
+}
+
+// grow from a tenth of count to count, once all at once as "x 10 points"
+// used to, and once at the emission rate, and compare the slowest step
+static int rampBenchmark(int count, float rate)
+{
+    struct particleSystem *ps;
+    double begin, elapsed, slowest = 0.0, total = 0.0;
+    int steps = 0;
+
+    ps = makeSystem(count / 10, kernel, threads);
+    if (ps == NULL)
+        return 1;
+    begin = now();
+    if (particleSystemResize(ps, count))
+        emitParticles(ps, count / 10, count - count / 10);
+    updateParticleArray(ps);
+    elapsed = now() - begin;
+    printf("%10s %10d %8d %12.3f %12.3f\n", "at once", count, 1, elapsed * 1.0E3, elapsed * 1.0E3);
+    particleSystemDestroy(ps);
+
+    ps = makeSystem(count / 10, kernel, threads);
+    if (ps == NULL)
+        return 1;
+    ps->emitRate = rate;
+    if (!particleSystemSetTarget(ps, count))
+    {
+        fprintf(stderr, "cannot allocate %d particles\n", count);
+        particleSystemDestroy(ps);
+        return 1;
+    }
+    while (ps->numberParticles < count)
+    {
+        begin = now();
+        updateParticleArray(ps);
+        elapsed = now() - begin;
+        slowest = elapsed > slowest ? elapsed : slowest;
+        total += elapsed;
+        steps++;
+    }
+    printf("%10.0f %10d %8d %12.3f %12.3f\n", rate, count, steps, total * 1.0E3 / steps, slowest * 1.0E3);
+    particleSystemDestroy(ps);
+    return 0;
+}
+
+// build the grid over count random points, then find every pair closer than
+// GRID_RADIUS for the repulsion, steps times each; the points fill a cube at
+// the same density whatever count is, so the cost per point should hold
+static int gridBenchmark(int count, int steps)
+{
+    struct particleGrid *particleGrid = gridCreate();
+    struct workerPool *pool = threads > 1 ? poolCreate(threads) : NULL;
+    float *x = malloc(count * sizeof(float)), *y = malloc(count * sizeof(float)), *z = malloc(count * sizeof(float));
+    float *velocity = calloc(count, sizeof(float));
+    const float side = (float) cbrt(count / GRID_DENSITY);
+    const uint32_t base = rngBase(seed, 0);
+    double begin, build = 0, query = 0;
+    long pairs = 0;
+    int i, status = 1;
+
+    if (particleGrid == NULL || (threads > 1 && pool == NULL) || x == NULL || y == NULL || z == NULL || velocity == NULL)
+        fprintf(stderr, "cannot allocate the grid of %d points\n", count);
+    else
+    {
+        for (i = 0; i < count; i++)
+        {
+            uint32_t key = rngKey(base, i);
+            x[i] = side * rngUniform(key, 0);
+            y[i] = side * rngUniform(key, 1);
+            z[i] = side * rngUniform(key, 2);
+        }
+        for (i = 0, status = 0; i < steps && status == 0; i++)
+        {
+            begin = now();
+            status = !gridBuild(particleGrid, pool, x, y, z, count, GRID_RADIUS);
+            build += now() - begin;
+            begin = now();
+            pairs = status ? 0 : gridRepel(particleGrid, pool, 0, 0, 0, velocity, velocity, velocity);
+            query += now() - begin;
+        }
+        if (status)
+            fprintf(stderr, "cannot allocate the grid of %d points\n", count);
+        else
+            printf("%10d %8d %10.3f %10.3f %14.3f %14.3f %11.1f\n", count, threads,
+                   build * 1.0E3 / steps, query * 1.0E3 / steps,
+                   build * 1.0E9 / ((double) count * steps), query * 1.0E9 / ((double) count * steps),
+                   (double) pairs / count);
+        fflush(stdout);
+    }
+
+    free(x);
+    free(y);
+    free(z);
+    free(velocity);
+    poolDestroy(pool);
+    gridDestroy(particleGrid);
+    return status;
+}
+
+// the viewer's modelview matrix at its original view, as gluLookAt() makes
+// it: the eye at (0, 12, 20) looking at (5, 3, 0), up along y
+static void originalView(float modelview[16])
+{
+    const float eye[3] = { 0, 12, 20 }, center[3] = { 5, 3, 0 };
+    float f[3], s[3], u[3], length;
+    int k;
+
+    for (k = 0; k < 3; k++)
+        f[k] = center[k] - eye[k];
+    length = sqrtf(f[0] * f[0] + f[1] * f[1] + f[2] * f[2]);
+    for (k = 0; k < 3; k++)
+        f[k] /= length;
+    s[0] = -f[2];                           // f x (0, 1, 0)
+    s[1] = 0;
+    s[2] = f[0];
+    length = sqrtf(s[0] * s[0] + s[2] * s[2]);
+    s[0] /= length;
+    s[2] /= length;
+    u[0] = s[1] * f[2] - s[2] * f[1];       // s x f
+    u[1] = s[2] * f[0] - s[0] * f[2];
+    u[2] = s[0] * f[1] - s[1] * f[0];
+    for (k = 0; k < 3; k++)
+    {
+        modelview[4 * k + 0] = s[k];
+        modelview[4 * k + 1] = u[k];
+        modelview[4 * k + 2] = -f[k];
+        modelview[4 * k + 3] = 0;
+    }
+    modelview[12] = -(s[0] * eye[0] + s[1] * eye[1] + s[2] * eye[2]);
+    modelview[13] = -(u[0] * eye[0] + u[1] * eye[1] + u[2] * eye[2]);
+    modelview[14] = f[0] * eye[0] + f[1] * eye[1] + f[2] * eye[2];
+    modelview[15] = 1;
+}
+
+// order count particles back to front after every one of steps updates,
+// or with the simulation paused steps times over, once sorting them all each
+// time, as when the camera moves, and once mending the last order, as when
+// it stands still
+static int sortSteps(struct particleSystem *ps, struct depthSort *full, struct depthSort *mended,
+                     const float modelview[16], int steps, int paused)
+{
+    double begin, fullTime = 0, mendedTime = 0;
+    int i, failures = depthSortFailures(mended), status = 0;
+
+    for (i = 0; i < steps && status == 0; i++)
+    {
+        if (!paused)
+            updateParticleArray(ps);
+        depthSortReset(full);
+        begin = now();
+        status = depthSortOrder(full, ps, modelview) == NULL;
+        fullTime += now() - begin;
+        begin = now();
+        status |= depthSortOrder(mended, ps, modelview) == NULL;
+        mendedTime += now() - begin;
+    }
+    if (status)
+        return 1;
+    printf("%10d %8d %10s %10.3f %10.3f %14.3f %14.3f %10d\n", ps->numberParticles, threads,
+           paused ? "paused" : "moving", fullTime * 1.0E3 / steps, mendedTime * 1.0E3 / steps,
+           fullTime * 1.0E9 / ((double) ps->numberParticles * steps),
+           mendedTime * 1.0E9 / ((double) ps->numberParticles * steps),
+           depthSortFailures(mended) - failures);
+    fflush(stdout);
+    return 0;
+}
+
+static int sortBenchmark(int count, int steps)
+{
+    struct particleSystem *ps = makeSystem(count, kernel, threads);
+    struct depthSort *full = depthSortCreate(), *mended = depthSortCreate();
+    float modelview[16];
+    int i, status = 0;
+
+    if (ps == NULL || full == NULL || mended == NULL)
+        status = 1;
+    originalView(modelview);
+    for (i = 0; i < WARMUP_STEPS && status == 0; i++)
+    {
+        updateParticleArray(ps);
+        status = depthSortOrder(mended, ps, modelview) == NULL;
+    }
+    if (status == 0)
+        status = sortSteps(ps, full, mended, modelview, steps, 0) || sortSteps(ps, full, mended, modelview, steps, 1);
+    if (status)
+        fprintf(stderr, "cannot sort %d particles\n", count);
+
+    depthSortDestroy(full);
+    depthSortDestroy(mended);
+    particleSystemDestroy(ps);
+    return status;
+}
+
+// find the particles in the viewer's original view, and in one closer to
+// the far end of the waterfall, after every one of steps updates
+static int cullBenchmark(int count, int steps)
+{
+    // gluPerspective(40, 1, 0.5, 40), then the view moved 8 closer and 6 to the right
+    const float f = 1.0f / tanf(20.0f * (float) M_PI / 180.0f), nearPlane = 0.5f, farPlane = 40.0f;
+    const float projection[16] = { f, 0, 0, 0,  0, f, 0, 0,
+                                   0, 0, (farPlane + nearPlane) / (nearPlane - farPlane), -1,
+                                   0, 0, 2 * farPlane * nearPlane / (nearPlane - farPlane), 0 };
+    struct particleSystem *ps = makeSystem(count, kernel, threads);
+    struct particleCull *particleCull = cullCreate();
+    float modelview[16], clip[2][16];
+    double begin, elapsed[2] = { 0, 0 };
+    int nearCount[2], farCount[2];
+    int i, v, row, column, k, status = 0;
+
+    if (ps == NULL || particleCull == NULL)
+        status = 1;
+    originalView(modelview);
+    for (v = 0; v < 2; v++)
+    {
+        for (column = 0; column < 4; column++)
+        {
+            for (row = 0; row < 4; row++)
+            {
+                clip[v][4 * column + row] = 0;
+                for (k = 0; k < 4; k++)
+                    clip[v][4 * column + row] += projection[4 * k + row] * modelview[4 * column + k];
+            }
+        }
+        modelview[12] -= 6;
+        modelview[14] += 8;
+    }
+    for (i = 0; i < SPREAD_STEPS + steps && status == 0; i++)
+    {
+        updateParticleArray(ps);
+        for (v = 0; v < 2 && status == 0 && i >= SPREAD_STEPS - WARMUP_STEPS; v++)
+        {
+            begin = now();
+            status = !cullParticles(particleCull, ps, NULL, clip[v], 0.05f, LOD_DISTANCE);
+            if (i >= SPREAD_STEPS)
+                elapsed[v] += now() - begin;
+            cullNear(particleCull, &nearCount[v]);
+            cullFar(particleCull, &farCount[v]);
+        }
+    }
+    if (status)
+        fprintf(stderr, "cannot cull %d particles\n", count);
+    else
+    {
+        for (v = 0; v < 2; v++)
+            printf("%10d %8d %10s %10.3f %14.3f %10d %10d\n", ps->numberParticles, threads, v == 0 ? "original" : "closer",
+                   elapsed[v] * 1.0E3 / steps, elapsed[v] * 1.0E9 / ((double) count * steps), nearCount[v], farCount[v]);
+    }
+    fflush(stdout);
+
+    cullDestroy(particleCull);
+    particleSystemDestroy(ps);
+    return status;
+}
+
+// warm the particles up, save them and load them into a second system:
+// the time to simulate the warm-up against the time to write and read it.
+// Both systems then take one more step, which must come out the same.
+static int snapshotBenchmark(int count)
+{
+    char path[] = "/tmp/particles.XXXXXX";
+    struct particleSystem *ps, *loaded;
+    struct snapshotWriter *writer;
+    struct snapshot *file = NULL;
+    double begin, warm, copy, write, open = 0, restore = 0;
+    struct stat status;
+    int descriptor, same = 0, failed, i;
+
+    ps = makeSystem(count, kernel, threads);
+    loaded = makeSystem(1, kernel, threads);
+    descriptor = mkstemp(path);
+    if (ps == NULL || loaded == NULL || descriptor < 0)
+    {
+        fprintf(stderr, "cannot set up the snapshot of %d particles\n", count);
+        particleSystemDestroy(ps);
+        particleSystemDestroy(loaded);
+        return 1;
+    }
+    close(descriptor);
+
+    begin = now();
+    for (i = 0; i < SPREAD_STEPS; i++)
+        updateParticleArray(ps);
+    warm = now() - begin;
+
+    begin = now();
+    writer = snapshotWriterCreate(path);
+    failed = writer == NULL || !snapshotWrite(writer, ps, SNAPSHOT_FULL);
+    copy = now() - begin;
+    failed = !snapshotWriterClose(writer) || failed;
+    write = now() - begin;
+
+    if (!failed)
+    {
+        begin = now();
+        file = snapshotOpen(path);
+        open = now() - begin;
+        begin = now();
+        failed = file == NULL || !snapshotRestore(file, 0, loaded);
+        restore = now() - begin;
+    }
+    if (!failed && stat(path, &status) == 0)
+    {
+        updateParticleArray(ps);
+        updateParticleArray(loaded);
+        same = ps->numberParticles == loaded->numberParticles && ps->step == loaded->step &&
+               memcmp(ps->positionX, loaded->positionX, ps->numberParticles * sizeof(float)) == 0 &&
+               memcmp(ps->positionY, loaded->positionY, ps->numberParticles * sizeof(float)) == 0 &&
+               memcmp(ps->positionZ, loaded->positionZ, ps->numberParticles * sizeof(float)) == 0;
+        printf("%10d %8d %12.1f %10.2f %10.2f %10.1f %10.3f %10.2f %6s\n",
+               ps->numberParticles, SPREAD_STEPS, warm * 1.0E3, copy * 1.0E3, write * 1.0E3,
+               status.st_size / (1024.0 * 1024.0), open * 1.0E3, restore * 1.0E3, same ? "yes" : "NO");
+    }
+    else
+        fprintf(stderr, "cannot save or load %d particles in %s\n", count, path);
+    fflush(stdout);
+
+    snapshotClose(file);
+    unlink(path);
+    particleSystemDestroy(ps);
+    particleSystemDestroy(loaded);
+    return failed || !same;
+}
+
+static struct exporter *stepExporter;       // what exportStep() writes to
+
+static void exportStep(struct particleSystem *ps)
+{
+    if (stepExporter != NULL && !exportFrame(stepExporter, ps))
+        stepExporter = NULL;
+}
+
+// advance by maxSteps at a time, as a frame loop that fell behind does,
+// exporting every every'th step; the steps read back must follow each other
+// with none missing
+static int exportGaps(const char *path, int count, int every, int advances)
+{
+    struct exportReader *reader;
+    struct exportedFrame frame;
+    struct particleSystem *ps = makeSystem(count, kernel, threads);
+    uint64_t first, expected, last = 0;
+    int failed, read = 0, gaps = 0, i;
+
+    if (ps == NULL)
+        return 1;
+    first = ps->step;
+    stepExporter = exporterCreate(path, EXPORT_DELTA, EXPORT_QUANTUM, every, 1);
+    failed = stepExporter == NULL;
+    ps->stepped = exportStep;
+    for (i = 0; i < advances && stepExporter != NULL; i++)
+        particleSystemAdvance(ps, ps->maxSteps * TIME_DELTA);
+    failed = failed || stepExporter == NULL || !exporterClose(stepExporter, NULL);
+    stepExporter = NULL;
+
+    reader = failed ? NULL : exportReaderOpen(path);
+    expected = (first / every + 1) * every;
+    for (; reader != NULL && exportRead(reader, &frame); read++, expected += every)
+    {
+        gaps += frame.step != expected;
+        last = frame.step;
+    }
+    exportReaderClose(reader);
+    gaps += expected != (ps->step / every + 1) * every;    // none missing at the end either
+
+    if (failed)
+        fprintf(stderr, "cannot export %d particles to %s\n", count, path);
+    else
+        printf("every %d step(s), %d advances of %d steps: %d frames, steps %llu to %llu, %s\n", every,
+               advances, ps->maxSteps, read, (unsigned long long) (first / every + 1) * every,
+               (unsigned long long) last, gaps == 0 ? "no gaps" : "GAPS");
+    particleSystemDestroy(ps);
+    return failed || gaps != 0;
+}
+
+// step the warmed-up particles with and without exporting every step, in
+// each encoding: the cost to the frame loop, how fast the file was written,
+// and how far the last frame read back is from the particles
+static int exportBenchmark(int count, int steps)
+{
+    static const char *names[] = {"raw", "delta"};
+    char path[] = "/tmp/particles.XXXXXX";
+    struct particleSystem *ps;
+    struct exporter *exporter;
+    struct exportReader *reader;
+    struct exportedFrame frame;
+    struct exportStats stats;
+    double begin, plain, exported, slowest, error;
+    int descriptor, encoding, failed = 0, read, i;
+
+    descriptor = mkstemp(path);
+    if (descriptor < 0)
+    {
+        fprintf(stderr, "cannot make a file to export to\n");
+        return 1;
+    }
+    close(descriptor);
+
+    for (encoding = EXPORT_RAW; encoding <= EXPORT_DELTA && !failed; encoding++)
+    {
+        ps = makeSystem(count, kernel, threads);
+        if (ps == NULL)
+            break;
+        for (i = 0; i < SPREAD_STEPS; i++)
+            updateParticleArray(ps);
+
+        begin = now();
+        for (i = 0; i < steps; i++)
+            updateParticleArray(ps);
+        plain = (now() - begin) / steps;
+
+        exporter = exporterCreate(path, encoding, EXPORT_QUANTUM, 1, 1);
+        failed = exporter == NULL;
+        slowest = 0;
+        begin = now();
+        for (i = 0; i < steps && !failed; i++)
+        {
+            double step = now();
+            updateParticleArray(ps);
+            failed = !exportFrame(exporter, ps);
+            slowest = fmax(slowest, now() - step);
+        }
+        exported = (now() - begin) / steps;
+        failed = !exporterClose(exporter, &stats) || failed;
+
+        // the last frame read back must be where the particles are, to half a quantum
+        reader = failed ? NULL : exportReaderOpen(path);
+        for (read = 0; reader != NULL && exportRead(reader, &frame); read++)
+            continue;
+        error = read == steps && frame.numberParticles == ps->numberParticles ? 0 : INFINITY;
+        for (i = 0; read == steps && i < frame.numberParticles; i++)
+        {
+            error = fmax(error, fabs(frame.x[i] - ps->positionX[i]));
+            error = fmax(error, fabs(frame.y[i] - ps->positionY[i]));
+            error = fmax(error, fabs(frame.z[i] - ps->positionZ[i]));
+        }
+        exportReaderClose(reader);
+
+        if (failed)
+            fprintf(stderr, "cannot export %d particles to %s\n", count, path);
+        else
+            printf("%10d %8s %10.2f %10.2f %10.2f %6s %10.1f %10.1f %10.1f %10.3g\n",
+                   ps->numberParticles, names[encoding], plain * 1.0E3, exported * 1.0E3, slowest * 1.0E3,
+                   slowest <= FRAME_BUDGET ? "yes" : "NO", stats.bytes / (1024.0 * 1024.0),
+                   stats.bytes / (1024.0 * 1024.0) / stats.seconds, stats.waited * 1.0E3, error);
+        fflush(stdout);
+        failed = failed || !(error <= EXPORT_QUANTUM / 2);
+        particleSystemDestroy(ps);
+    }
+    failed = failed || exportGaps(path, count, 1, steps);
+    failed = failed || exportGaps(path, count, GAP_EVERY, steps);
+    unlink(path);
+    return failed;
+}
+
+// the drawn copy of the warmed-up particles after every step, as floats and
+// packed, and the vertices written from each as the upload would, the packed
+// ones decoded and, as with shaders, undecoded: the time of both, the bytes
+// they move per particle, and how far the packed positions are from the floats
+static int compactBenchmark(int count, int steps)
+{
+    struct particleSystem *ps = makeSystem(count, kernel, threads);
+    struct compactParticles compact = { 0 };
+    float *copy[6], *vertex;
+    uint8_t (*colors)[4], *color;
+    uint16_t *units;
+    double begin, copied = 0, packed = 0, floatUpload = 0, compactUpload = 0, shaderUpload = 0, worst = 0, sum = 0;
+    const float blend = 0.5f;
+    int n, blocks, array, failed, i, k;
+
+    if (ps == NULL)
+        return 1;
+    for (i = 0; i < SPREAD_STEPS; i++)
+        updateParticleArray(ps);
+    n = ps->numberParticles;
+    blocks = (n + COMPACT_BLOCK - 1) / COMPACT_BLOCK;
+    for (array = 0; array < 6; array++)
+        copy[array] = malloc(n * sizeof(float));
+    colors = malloc(n * sizeof(*colors));
+    vertex = malloc(n * 3 * sizeof(float));
+    color = malloc(n * 4);
+    units = malloc(n * 6 * sizeof(uint16_t));
+    failed = colors == NULL || vertex == NULL || color == NULL || units == NULL || !compactReserve(&compact, n);
+    for (array = 0; array < 6; array++)
+        failed = failed || copy[array] == NULL;
+
+    for (i = 0; i < steps && !failed; i++)
+    {
+        const float *sources[6] = { ps->positionX, ps->positionY, ps->positionZ,
+                                    ps->previousX, ps->previousY, ps->previousZ };
+        int b;
+
+        updateParticleArray(ps);
+        begin = now();
+        for (array = 0; array < 6; array++)
+            memcpy(copy[array], sources[array], n * sizeof(float));
+        memcpy(colors, ps->colorList, n * sizeof(*colors));
+        copied += now() - begin;
+
+        begin = now();
+        for (b = 0; b < blocks; b++)
+            compactBlock(&compact, ps, b);
+        packed += now() - begin;
+
+        begin = now();
+        for (k = 0; k < n; k++)
+        {
+            vertex[3 * k + 0] = copy[3][k] + blend * (copy[0][k] - copy[3][k]);
+            vertex[3 * k + 1] = copy[4][k] + blend * (copy[1][k] - copy[4][k]);
+            vertex[3 * k + 2] = copy[5][k] + blend * (copy[2][k] - copy[5][k]);
+        }
+        memcpy(color, colors, n * sizeof(*colors));
+        floatUpload += now() - begin;
+
+        begin = now();
+        compactPositions(&compact, 0, n, blend, vertex);
+        memcpy(color, compact.color, n * sizeof(*compact.color));
+        compactUpload += now() - begin;
+
+        begin = now();
+        compactInterleave(&compact, NULL, n, units, color);
+        shaderUpload += now() - begin;
+    }
+
+    // the last step's vertices from the packed particles against the floats
+    for (k = 0; k < n && !failed; k++)
+    {
+        for (array = 0; array < 3; array++)
+        {
+            float expected = copy[3 + array][k] + blend * (copy[array][k] - copy[3 + array][k]);
+
+            worst = fmax(worst, fabs(vertex[3 * k + array] - expected));
+            sum += fabs(vertex[3 * k + array] - expected);
+        }
+        failed = memcmp(colors[k], color + 4 * k, 4) != 0;
+    }
+
+    if (failed)
+        fprintf(stderr, "cannot pack %d particles\n", count);
+    else
+    {
+        // copied: read and written; uploaded: read, and written as floats and bytes
+        printf("%10d %8s %8d %10.2f %10.2f %12d %12s %12s\n", n, "float", 28,
+               copied / steps * 1.0E3, floatUpload / steps * 1.0E3, 28 + 28 + 28 + 16, "-", "-");
+        printf("%10d %8s %8d %10.2f %10.2f %12d %12.3g %12.3g\n", n, "compact", 16,
+               packed / steps * 1.0E3, compactUpload / steps * 1.0E3, 28 + 16 + 16 + 16,
+               worst, sum / (3.0 * n));
+        printf("%10d %8s %8d %10.2f %10.2f %12d %12s %12s\n", n, "shader", 16,
+               packed / steps * 1.0E3, shaderUpload / steps * 1.0E3, 28 + 16 + 16 + 16, "-", "-");
+    }
+    fflush(stdout);
+
+    for (array = 0; array < 6; array++)
+        free(copy[array]);
+    free(colors);
+    free(vertex);
+    free(color);
+    free(units);
+    compactFree(&compact);
+    particleSystemDestroy(ps);
+    return failed;
+}
+
+// write the drawn vertices of the warmed-up particles steps times in each
+// case: by the loop the table picks for it, and by the one loop testing the
+// case particle by particle, which must write the same
+static int vertexBenchmark(int count, int steps)
+{
+    static const char *orders[] = {"stored", "sorted"}, *frames[] = {"float", "compact"};
+    static const char *shapes[] = {"points", "squares"};
+    struct particleSystem *ps = makeSystem(count, kernel, threads);
+    struct compactParticles compact = { 0 };
+    struct depthSort *sort = depthSortCreate();
+    const uint32_t *order = NULL;
+    float modelview[16], *vertex, *expectedVertex, size, worst;
+    uint8_t *color, *expectedColor;
+    double begin, specialised, checked;
+    int n, block, features, failed, i;
+
+    if (ps == NULL)
+        return 1;
+    for (i = 0; i < SPREAD_STEPS; i++)
+        updateParticleArray(ps);
+    ps->blend = 0.5f;
+    n = ps->numberParticles;
+    vertex = malloc(n * 12 * sizeof(float));
+    expectedVertex = malloc(n * 12 * sizeof(float));
+    color = malloc(n * 16);
+    expectedColor = malloc(n * 16);
+    failed = vertex == NULL || expectedVertex == NULL || color == NULL || expectedColor == NULL || sort == NULL ||
+             !compactReserve(&compact, n);
+    for (block = 0; !failed && block < (n + COMPACT_BLOCK - 1) / COMPACT_BLOCK; block++)
+        compactBlock(&compact, ps, block);
+    originalView(modelview);
+    if (!failed)
+        order = depthSortOrder(sort, ps, modelview);
+    failed = failed || order == NULL;
+
+    for (features = 0; features < VERTEX_KERNELS && !failed; features++)
+    {
+        vertexKernel write = vertexKernelFor(features);
+        const uint32_t *through = features & VERTEX_ORDERED ? order : NULL;
+        int corners = features & VERTEX_SQUARE ? 4 : 1;
+
+        ps->compact = features & VERTEX_COMPACT ? &compact : NULL;
+        size = features & VERTEX_SQUARE ? 0.1f : 0;
+        begin = now();
+        for (i = 0; i < steps; i++)
+            write(vertex, color, ps, through, 0, n, size);
+        specialised = (now() - begin) / steps;
+        begin = now();
+        for (i = 0; i < steps; i++)
+            vertexReference(expectedVertex, expectedColor, ps, through, 0, n, size);
+        checked = (now() - begin) / steps;
+
+        // a compact frame decoded a block at a time rounds apart from one decoded a particle at a time
+        worst = 0;
+        for (i = 0; i < 3 * corners * n; i++)
+            worst = fmaxf(worst, fabsf(vertex[i] - expectedVertex[i]));
+        failed = memcmp(color, expectedColor, 4 * corners * n) != 0 || !(worst <= 1.0E-5f);
+        printf("%10d %8s %8s %8s %10.2f %10.2f %8.2f %10.3g\n", n, orders[features & VERTEX_ORDERED ? 1 : 0],
+               frames[features & VERTEX_COMPACT ? 1 : 0], shapes[features & VERTEX_SQUARE ? 1 : 0],
+               specialised * 1.0E3, checked * 1.0E3, checked / specialised, worst);
+        fflush(stdout);
+    }
+    if (failed)
+        fprintf(stderr, "cannot write the vertices of %d particles, or they differ\n", count);
+
+    ps->compact = NULL;
+    free(vertex);
+    free(expectedVertex);
+    free(color);
+    free(expectedColor);
+    compactFree(&compact);
+    depthSortDestroy(sort);
+    particleSystemDestroy(ps);
+    return failed;
+}
+
+// one line per thread count: 1, 2, 4, ... and finally threads itself
+static int sweepThreads(int count, int steps)
+{
+    int n;
+    for (n = 1; n < threads; n *= 2)
+    {
+        if (runBenchmark(count, steps, n))
+            return 1;
+    }
+    return runBenchmark(count, steps, threads);
+}
+
+// run the same particles through the single threaded reference loop and the
+// chosen kernel and threads, and report how far apart they end up
+static int checkKernel(int count, int steps)
+{
+    struct particleSystem *expected, *actual;
+    double error, maxError = 0.0;
+    double heightExpected = 0.0, heightActual = 0.0;
+    int diverged = 0;
+    int i;
+
+    actual = makeSystem(count, kernel, threads);
+    analytic = 0;
+    expected = makeSystem(count, KERNEL_REFERENCE, 1);
+    if (expected == NULL || actual == NULL)
+        return 1;
+    count = actual->numberParticles;            // a scene's own count
+
+    for (i = 0; i < steps; i++)
+    {
+        updateParticleArray(expected);
+        updateParticleArray(actual);
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        error = fabs(expected->positionX[i] - actual->positionX[i]);
+        error = fmax(error, fabs(expected->positionY[i] - actual->positionY[i]));
+        error = fmax(error, fabs(expected->positionZ[i] - actual->positionZ[i]));
+        if (error > DIVERGED)
+            diverged++;
+        else if (error > maxError)
+            maxError = error;
+        heightExpected += expected->positionY[i];
+        heightActual += actual->positionY[i];
+    }
+    printf("%s on %d threads against reference after %d steps on %d particles:\n",
+           actual->analytic != NULL ? "analytic" : kernelName(actual->kernel), actual->threads, steps, count);
+    printf("  largest position error %.3g, %d particles (%.4f%%) bounced or respawned on a different step\n",
+           maxError, diverged, 100.0 * diverged / count);
+    printf("  mean height %.4f, reference %.4f\n", heightActual / count, heightExpected / count);
+
+    particleSystemDestroy(expected);
+    particleSystemDestroy(actual);
+    return 0;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-n particles] [-s steps] [-k kernel] [-t threads] [-S seed] [-c] [-e] [-a] [-r rate] [-f scene] [-g] [-d] [-v] [-m] [-x] [-q]\n", name);
+    fprintf(stderr, "  without -n the particle count sweeps from 1e3 to 1e7\n");
+    fprintf(stderr, "  -k reference|scalar|sse|avx2   update kernel, the fastest one by default\n");
+    fprintf(stderr, "  -t   time 1, 2, 4, ... up to this many update threads\n");
+    fprintf(stderr, "  -S   seed of the random values, 1 by default\n");
+    fprintf(stderr, "  -c   compare the kernel with the reference loop instead of timing it\n");
+    fprintf(stderr, "  -e   time emitting the particles instead of updating them\n");
+    fprintf(stderr, "  -a   compute the positions in closed form instead of stepping them\n");
+    fprintf(stderr, "  -r   time growing to the particle count at this many per second\n");
+    fprintf(stderr, "  -f   time the scene in this file, with its own particle count\n");
+    fprintf(stderr, "  -g   time building the spatial grid and querying it for neighbours\n");
+    fprintf(stderr, "  -d   time ordering the particles back to front, sorted afresh or mended\n");
+    fprintf(stderr, "  -v   time finding the particles in view, and those far enough to be points\n");
+    fprintf(stderr, "  -m   time saving a warmed-up system and loading it again, against warming it up\n");
+    fprintf(stderr, "  -x   time exporting every step, raw and as quantised deltas, against not exporting,\n");
+    fprintf(stderr, "       and check that catching up several steps at once exports each of them\n");
+    fprintf(stderr, "  -q   time copying and uploading the drawn particles as floats and packed, and the error\n");
+    fprintf(stderr, "  -w   time writing the drawn vertices by the loop for each case, against testing the case\n");
+    fprintf(stderr, "       for every particle\n");
+}
+
+int main(int argc, char **argv)
+{
+    int count = 0;
+    int steps = DEFAULT_STEPS;
+    int check = 0;
+    int emit = 0;
+    float rate = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:s:k:t:S:cear:f:gdvmxqwh")) != -1)
+    {
+        switch (opt)
+        {
+            case 'n':
+                count = atoi(optarg);
+                break;
+            case 's':
+                steps = atoi(optarg);
+                break;
+            case 'k':
+                kernel = kernelByName(optarg);
+                if (!kernelSupported(kernel))
+                {
+                    fprintf(stderr, "kernel %s is not available on this machine\n", optarg);
+                    return 1;
+                }
+                break;
+            case 't':
+                threads = atoi(optarg);
+                break;
+            case 'S':
+                seed = strtoull(optarg, NULL, 10);
+                break;
+            case 'c':
+                check = 1;
+                break;
+            case 'e':
+                emit = 1;
+                break;
+            case 'a':
+                analytic = 1;
+                break;
+            case 'r':
+                rate = atof(optarg);
+                break;
+            case 'g':
+                grid = 1;
+                break;
+            case 'd':
+                depth = 1;
+                break;
+            case 'v':
+                view = 1;
+                break;
+            case 'm':
+                snapshot = 1;
+                break;
+            case 'x':
+                trajectory = 1;
+                break;
+            case 'q':
+                packing = 1;
+                break;
+            case 'w':
+                writing = 1;
+                break;
+            case 'f':
+                scenePath = optarg;
+                count = 1;                  // one run, however many particles the scene has
+                break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (steps <= 0 || count < 0 || threads < 1 || rate < 0)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (check)
+        return checkKernel(count > 0 ? count : 1000000, steps);
+    if (rate > 0)
+    {
+        printf("%10s %10s %8s %12s %12s\n", "per second", "particles", "steps", "ms/step", "slowest ms");
+        return rampBenchmark(count > 0 ? count : 1000000, rate);
+    }
+    if (grid)
+    {
+        printf("%10s %8s %10s %10s %14s %14s %11s\n",
+               "particles", "threads", "build ms", "query ms", "build ns/pt", "query ns/pt", "neighbours");
+        if (count > 0)
+            return gridBenchmark(count, steps);
+        for (count = 1000; count <= 10000000; count *= 10)
+        {
+            if (gridBenchmark(count, steps))
+                return 1;
+        }
+        return 0;
+    }
+    if (depth)
+    {
+        printf("%10s %8s %10s %10s %10s %14s %14s %10s\n",
+               "particles", "threads", "simulation", "full ms", "mended ms", "full ns/pt", "mended ns/pt", "failed");
+        return sortBenchmark(count > 0 ? count : 1000000, steps);
+    }
+    if (view)
+    {
+        printf("%10s %8s %10s %10s %14s %10s %10s\n", "particles", "threads", "view", "ms", "ns/particle", "near", "far");
+        return cullBenchmark(count > 0 ? count : 1000000, steps);
+    }
+    if (snapshot)
+    {
+        printf("%10s %8s %12s %10s %10s %10s %10s %10s %6s\n", "particles", "steps", "warm-up ms",
+               "copy ms", "write ms", "MB", "open ms", "load ms", "same");
+        return snapshotBenchmark(count > 0 ? count : 1000000);
+    }
+    if (trajectory)
+    {
+        printf("%10s %8s %10s %10s %10s %6s %10s %10s %10s %10s\n", "particles", "encoding", "ms/step",
+               "export ms", "worst ms", "60 Hz", "MB", "MB/s", "waited ms", "error");
+        return exportBenchmark(count > 0 ? count : 1000000, steps);
+    }
+    if (packing)
+    {
+        printf("%10s %8s %8s %10s %10s %12s %12s %12s\n", "particles", "layout", "bytes", "copy ms",
+               "upload ms", "bytes moved", "max error", "mean error");
+        return compactBenchmark(count > 0 ? count : 1000000, steps);
+    }
+    if (writing)
+    {
+        printf("%10s %8s %8s %8s %10s %10s %8s %10s\n", "particles", "order", "frame", "shape", "table ms",
+               "tested ms", "speed-up", "max diff");
+        return vertexBenchmark(count > 0 ? count : 1000000, steps);
+    }
+    if (emit)
+    {
+        printf("%10s %8s %12s %14s\n", "particles", "threads", "ms/emission", "ns/particle");
+        return emitBenchmark(count > 0 ? count : 1000000, steps);
+    }
+
+    printf("%10s %8s %10s %8s %10s %12s %14s %12s\n",
+           "particles", "steps", "kernel", "threads", "seconds", "steps/s", "ns/particle", "peak RSS MB");
+    if (count > 0)
+        return sweepThreads(count, steps);
+
+    for (count = 1000; count <= 10000000; count *= 10)
+    {
+        if (sweepThreads(count, steps))
+            return 1;
+    }
+    return 0;
+}
+
+/* end of bench.c */
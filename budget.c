@@ -0,0 +1,160 @@
+//
+//  budget.c
+//
+//
+//  Created by BOWEN LI
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include "budget.h"
+
+#define PERCENTILE 0.9                          // of the window, judged against the budget
+#define AIM 0.85                                // of the budget, where a change of count aims
+#define LEAST_SCALE 0.5                         // of the count at one decision
+#define MOST_SCALE 1.5
+#define CLOSE_ENOUGH 0.1                        // of the count wanted, for the live one to be there
+#define LONGEST_WAIT 10                         // windows to wait for it at most
+#define OVERLOAD 2                              // of the budget, past which both give at once
+
+struct budget
+{
+    double seconds;                             // the budget
+    int particles;                              // wanted
+    int fewest, most;
+    float detail;
+    FILE *log;
+
+    double window[BUDGET_WINDOW];               // the work of the frames judged next
+    int count;
+    int waited;                                 // windows since the count changed
+    long frames;
+};
+
+struct budget *budgetCreate(double seconds, int particles, int fewest, int most, FILE *log)
+{
+    struct budget *budget = calloc(1, sizeof(struct budget));
+
+    if (budget == NULL)
+        return NULL;
+    budget->seconds = seconds;
+    budget->fewest = fewest;
+    budget->most = most;
+    budget->particles = particles < fewest ? fewest : particles > most ? most : particles;
+    budget->detail = 1;
+    budget->log = log;
+    return budget;
+}
+
+void budgetDestroy(struct budget *budget)
+{
+    free(budget);
+}
+
+static int compareSeconds(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+
+    return (x > y) - (x < y);
+}
+
+// the particles, scaled from live by how far load is from AIM, but at least
+// by LEAST_SCALE and at most by MOST_SCALE, and within fewest and most
+static int scaledParticles(const struct budget *budget, int live, double load)
+{
+    double scale = AIM / load;
+    double particles;
+
+    if (scale < LEAST_SCALE)
+        scale = LEAST_SCALE;
+    if (scale > MOST_SCALE)
+        scale = MOST_SCALE;
+    particles = live * scale;
+    if (particles < budget->fewest)
+        return budget->fewest;
+    if (particles > budget->most)
+        return budget->most;
+    return (int) particles;
+}
+
+// what changed from one value to the other, with digits after the point
+static void logDecision(const struct budget *budget, double work, int live, const char *what,
+                        double from, double to, int digits)
+{
+    if (budget->log == NULL)
+        return;
+    fprintf(budget->log, "budget: frame %ld, %.2f ms p90 against %.2f ms with %d particles, %s %.*f -> %.*f\n",
+            budget->frames, work * 1000, budget->seconds * 1000, live, what, digits, from, digits, to);
+    fflush(budget->log);
+}
+
+// the decision at the end of a window; returns 1 when something changed
+static int decide(struct budget *budget, double work, int live, int detailed)
+{
+    double load = work / budget->seconds;
+    float detail = budget->detail;
+    int before = budget->particles, particles;
+
+    // the count changed not long ago and the live particles are not there yet
+    if (abs(live - budget->particles) > CLOSE_ENOUGH * budget->particles && budget->waited++ < LONGEST_WAIT)
+        return 0;
+
+    if (load > 1)
+    {
+        particles = scaledParticles(budget, live, load);
+        if (detailed && detail > DETAIL_FLOOR && load < OVERLOAD)
+            budget->detail = detail - DETAIL_STEP > DETAIL_FLOOR ? detail - DETAIL_STEP : DETAIL_FLOOR;
+        else
+        {
+            // far past the budget the detail goes all the way down, and the count with it
+            if (detailed)
+                budget->detail = DETAIL_FLOOR;
+            if (particles < budget->particles)
+                budget->particles = particles;
+        }
+    }
+    else if (load < BUDGET_LOW)
+    {
+        particles = scaledParticles(budget, live, load);
+        if (particles > budget->particles)
+            budget->particles = particles;
+        else if (detailed && detail < 1 && budget->particles == budget->most)
+            budget->detail = detail + DETAIL_STEP < 1 ? detail + DETAIL_STEP : 1;
+    }
+
+    if (budget->detail != detail)
+        logDecision(budget, work, live, "detail", detail, budget->detail, 3);
+    if (budget->particles != before)
+    {
+        logDecision(budget, work, live, "particles", before, budget->particles, 0);
+        budget->waited = 0;
+    }
+    return budget->detail != detail || budget->particles != before;
+}
+
+int budgetFrame(struct budget *budget, double seconds, int numberParticles, int detailed)
+{
+    double sorted[BUDGET_WINDOW];
+
+    budget->frames++;
+    budget->window[budget->count++] = seconds;
+    if (budget->count < BUDGET_WINDOW)
+        return 0;
+
+    // a window is only judged once, so a change is judged by the frames after it
+    budget->count = 0;
+    qsort(memcpy(sorted, budget->window, sizeof(sorted)), BUDGET_WINDOW, sizeof(double), compareSeconds);
+    return decide(budget, sorted[(int) (PERCENTILE * BUDGET_WINDOW) - 1], numberParticles, detailed);
+}
+
+int budgetParticles(const struct budget *budget)
+{
+    return budget->particles;
+}
+
+float budgetDetail(const struct budget *budget)
+{
+    return budget->detail;
+}
+
+/* end of budget.c */
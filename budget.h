@@ -0,0 +1,53 @@
+//
+//  budget.h
+//
+//
+//  Created by BOWEN LI
+//
+//  A controller that holds the frames to a budget of time by changing how
+//  much there is to draw. It is told the work of every frame, the update and
+//  the drawing without the wait for the swap, and every BUDGET_WINDOW frames
+//  compares their 90th percentile with the budget. Past the budget it lowers
+//  the detail, the slices and stacks of the spheres, the size of the sprites
+//  and the distance to draw at full detail, then the particles, or both at
+//  once when the work is more than twice the budget. Well within it, below
+//  BUDGET_LOW of it, it raises the particles, then the detail, so the count
+//  is the last to give and the first to come back. Between the two it leaves
+//  things as they are, and after changing the count it waits for the live
+//  particles to get there before it judges again. The particles are scaled
+//  by how far the work is from the middle of the band, as the work grows
+//  about as the particles do.
+//
+
+#ifndef BUDGET_H
+#define BUDGET_H
+
+#include <stdio.h>
+
+#define BUDGET_WINDOW 30                        // frames judged together
+#define BUDGET_LOW 0.7                          // of the budget, below which there is room
+#define DETAIL_FLOOR 0.25                       // the least detail it goes down to
+#define DETAIL_STEP 0.125                       // changed at one decision
+
+struct budget;
+
+// a controller for frames of at most seconds, starting from particles, which
+// it keeps between fewest and most; pass the same for all three to leave the
+// count alone. The decisions are logged to log, which may be NULL.
+struct budget *budgetCreate(double seconds, int particles, int fewest, int most, FILE *log);
+void budgetDestroy(struct budget *budget);
+
+// a frame whose work took seconds with numberParticles live; detailed is 0
+// when the detail changes nothing drawn, e.g. for points. Returns 1 when the
+// particles or the detail are to change.
+int budgetFrame(struct budget *budget, double seconds, int numberParticles, int detailed);
+
+// the particles wanted
+int budgetParticles(const struct budget *budget);
+
+// the detail to draw at, from DETAIL_FLOOR to 1 for all the settings ask
+float budgetDetail(const struct budget *budget);
+
+#endif
+
+/* end of budget.h */
@@ -0,0 +1,189 @@
+//
+//  compact.c
+//
+//
+//  Created by BOWEN LI
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include "compact.h"
+#include "particles.h"
+
+int compactReserve(struct compactParticles *compact, int capacity)
+{
+    uint16_t **arrays[6] = { &compact->x, &compact->y, &compact->z,
+                             &compact->previousX, &compact->previousY, &compact->previousZ };
+    void *fresh[8];
+    int blocks = (capacity + COMPACT_BLOCK - 1) / COMPACT_BLOCK, array, found = 1;
+
+    if (capacity <= compact->capacity)
+        return 1;
+    for (array = 0; array < 8; array++)
+    {
+        size_t bytes = array < 6 ? capacity * sizeof(uint16_t) :
+                       array == 6 ? capacity * sizeof(*compact->color) : blocks * sizeof(*compact->box);
+
+        if (posix_memalign(&fresh[array], CACHE_LINE, bytes) != 0)
+        {
+            fresh[array] = NULL;
+            found = 0;
+        }
+    }
+    if (!found)
+    {
+        for (array = 0; array < 8; array++)
+            free(fresh[array]);
+        return 0;
+    }
+
+    // nothing is kept, as every frame packs all its particles again
+    compactFree(compact);
+    for (array = 0; array < 6; array++)
+        *arrays[array] = fresh[array];
+    compact->color = fresh[6];
+    compact->box = fresh[7];
+    compact->capacity = capacity;
+    return 1;
+}
+
+void compactFree(struct compactParticles *compact)
+{
+    free(compact->x);
+    free(compact->y);
+    free(compact->z);
+    free(compact->previousX);
+    free(compact->previousY);
+    free(compact->previousZ);
+    free(compact->color);
+    free(compact->box);
+    compact->capacity = 0;
+}
+
+// one axis of the block: the box around both positions, then both in its units
+static void packAxis(uint16_t *packed, uint16_t *previousPacked, const float *position, const float *previous,
+                     int begin, int end, float *low, float *unit)
+{
+    float lowest = position[begin], highest = lowest, inverse;
+    int i;
+
+    for (i = begin; i < end; i++)
+    {
+        lowest = position[i] < lowest ? position[i] : lowest;
+        highest = position[i] > highest ? position[i] : highest;
+        lowest = previous[i] < lowest ? previous[i] : lowest;
+        highest = previous[i] > highest ? previous[i] : highest;
+    }
+    *low = lowest;
+    *unit = (highest - lowest) / COMPACT_UNITS;
+    inverse = highest > lowest ? COMPACT_UNITS / (highest - lowest) : 0;
+
+    for (i = begin; i < end; i++)
+    {
+        float t = (position[i] - lowest) * inverse + 0.5f;
+        float u = (previous[i] - lowest) * inverse + 0.5f;
+
+        packed[i] = (uint16_t) (t < COMPACT_UNITS ? t : COMPACT_UNITS);
+        previousPacked[i] = (uint16_t) (u < COMPACT_UNITS ? u : COMPACT_UNITS);
+    }
+}
+
+void compactBlock(struct compactParticles *compact, const struct particleSystem *ps, int block)
+{
+    int begin = block * COMPACT_BLOCK, end = begin + COMPACT_BLOCK;
+    float *box = compact->box[block];
+
+    if (end > ps->numberParticles)
+        end = ps->numberParticles;
+    if (begin >= end)
+        return;
+    packAxis(compact->x, compact->previousX, ps->positionX, ps->previousX, begin, end, &box[0], &box[3]);
+    packAxis(compact->y, compact->previousY, ps->positionY, ps->previousY, begin, end, &box[1], &box[4]);
+    packAxis(compact->z, compact->previousZ, ps->positionZ, ps->previousZ, begin, end, &box[2], &box[5]);
+
+    // the colours are kept as the bytes drawn
+    memcpy(compact->color + begin, ps->colorList + begin, (end - begin) * sizeof(*compact->color));
+}
+
+// n particles of one block, unit and rest the parts of its box's units that
+// the current and the previous positions get
+static void decodeBlock(float *restrict vertex, const uint16_t *restrict x, const uint16_t *restrict y,
+                        const uint16_t *restrict z, const uint16_t *restrict previousX,
+                        const uint16_t *restrict previousY, const uint16_t *restrict previousZ, int n,
+                        const float low[3], const float unit[3], const float rest[3])
+{
+    const float lowX = low[0], lowY = low[1], lowZ = low[2];
+    const float unitX = unit[0], unitY = unit[1], unitZ = unit[2];
+    const float restX = rest[0], restY = rest[1], restZ = rest[2];
+    int i;
+
+    for (i = 0; i < n; i++)
+    {
+        vertex[3 * i + 0] = lowX + restX * previousX[i] + unitX * x[i];
+        vertex[3 * i + 1] = lowY + restY * previousY[i] + unitY * y[i];
+        vertex[3 * i + 2] = lowZ + restZ * previousZ[i] + unitZ * z[i];
+    }
+}
+
+void compactPositions(const struct compactParticles *compact, int first, int n, float blend, float *vertex)
+{
+    int end = first + n, k;
+
+    while (first < end)
+    {
+        // a block at a time, so its box stays put through the loop
+        int last = ((first >> COMPACT_SHIFT) + 1) << COMPACT_SHIFT;
+        const float *box = compact->box[first >> COMPACT_SHIFT];
+        float unit[3], rest[3];
+
+        if (last > end)
+            last = end;
+        for (k = 0; k < 3; k++)
+        {
+            unit[k] = box[3 + k] * blend;
+            rest[k] = box[3 + k] - unit[k];
+        }
+        decodeBlock(vertex, compact->x + first, compact->y + first, compact->z + first, compact->previousX + first,
+                    compact->previousY + first, compact->previousZ + first, last - first, box, unit, rest);
+        vertex += 3 * (last - first);
+        first = last;
+    }
+}
+
+void compactInterleave(const struct compactParticles *compact, const uint32_t *order, int n,
+                       uint16_t *restrict units, uint8_t *restrict color)
+{
+    const uint16_t *restrict x = compact->x, *restrict y = compact->y, *restrict z = compact->z;
+    const uint16_t *restrict previousX = compact->previousX, *restrict previousY = compact->previousY;
+    const uint16_t *restrict previousZ = compact->previousZ;
+    int i;
+
+    if (order == NULL)
+    {
+        for (i = 0; i < n; i++)
+        {
+            units[6 * i + 0] = x[i];
+            units[6 * i + 1] = y[i];
+            units[6 * i + 2] = z[i];
+            units[6 * i + 3] = previousX[i];
+            units[6 * i + 4] = previousY[i];
+            units[6 * i + 5] = previousZ[i];
+        }
+        memcpy(color, compact->color, n * sizeof(*compact->color));
+        return;
+    }
+    for (i = 0; i < n; i++)
+    {
+        uint32_t k = order[i];
+
+        units[6 * i + 0] = x[k];
+        units[6 * i + 1] = y[k];
+        units[6 * i + 2] = z[k];
+        units[6 * i + 3] = previousX[k];
+        units[6 * i + 4] = previousY[k];
+        units[6 * i + 5] = previousZ[k];
+        memcpy(color + 4 * i, compact->color[k], 4);
+    }
+}
+
+/* end of compact.c */
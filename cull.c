@@ -0,0 +1,420 @@
+//
+//  cull.c
+//
+//
+//  Created by BOWEN LI
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "cull.h"
+#include "pool.h"
+
+#define CULL_CHUNK 65536                        // fewest particles worth a task of their own
+#define NUMBER_TILES (TILES * TILES * TILES)
+
+#define CULLED 0
+#define FAR 1
+#define NEAR 2
+
+struct particleCull
+{
+    int capacity;                               // particles the arrays have room for
+    int taskCapacity;                           // tasks the per task arrays have room for
+    int tasks;
+    int count;
+    const struct particleSystem *ps;
+    const uint32_t *order;
+    int firstNear;                              // in order, the first particle drawn near
+    float depth[4];                             // the last row of clip, the depth along the view
+    float lodDistance;
+    struct workerPool *pool;
+
+    float low[3];                               // the corner of tile (0, 0, 0), from the last frame
+    float size[3];                              // of a tile along each axis
+    float inverse[3];                           // tiles per unit along each axis
+    float *taskBounds;                          // per task: low x, y, z, then high x, y, z
+    uint8_t tileClass[NUMBER_TILES];            // CULLED, FAR or NEAR
+    uint8_t *classOf;                           // per particle in order
+    int *taskNear, *taskFar;                    // per task: counts, then write offsets
+
+    uint32_t *near, *far;
+    int nearCount, farCount;
+};
+
+struct particleCull *cullCreate(void)
+{
+    struct particleCull *cull = calloc(1, sizeof(struct particleCull));
+    int k;
+
+    if (cull == NULL)
+        return NULL;
+    for (k = 0; k < 3; k++)                     // no box yet: every particle is outside it
+    {
+        cull->low[k] = INFINITY;
+        cull->size[k] = cull->inverse[k] = 1;
+    }
+    return cull;
+}
+
+static void freeArrays(struct particleCull *cull)
+{
+    free(cull->taskBounds);
+    free(cull->classOf);
+    free(cull->taskNear);
+    free(cull->taskFar);
+    free(cull->near);
+    free(cull->far);
+    cull->taskBounds = NULL;
+    cull->classOf = NULL;
+    cull->taskNear = cull->taskFar = NULL;
+    cull->near = cull->far = NULL;
+    cull->capacity = cull->taskCapacity = 0;
+    cull->nearCount = cull->farCount = 0;
+}
+
+void cullDestroy(struct particleCull *cull)
+{
+    if (cull == NULL)
+        return;
+    freeArrays(cull);
+    free(cull);
+}
+
+const uint32_t *cullNear(const struct particleCull *cull, int *count)
+{
+    *count = cull->nearCount;
+    return cull->near;
+}
+
+const uint32_t *cullFar(const struct particleCull *cull, int *count)
+{
+    *count = cull->farCount;
+    return cull->far;
+}
+
+// room for count particles split among tasks tasks; the arrays only ever grow
+static int reserve(struct particleCull *cull, int count, int tasks)
+{
+    if (count <= cull->capacity && tasks <= cull->taskCapacity)
+        return 1;
+    if (count < cull->capacity)
+        count = cull->capacity;
+    if (tasks < cull->taskCapacity)
+        tasks = cull->taskCapacity;
+
+    freeArrays(cull);
+    cull->taskBounds = malloc(tasks * 6 * sizeof(float));
+    cull->classOf = malloc(count);
+    cull->taskNear = malloc(tasks * sizeof(int));
+    cull->taskFar = malloc(tasks * sizeof(int));
+    cull->near = malloc(count * sizeof(uint32_t));
+    cull->far = malloc(count * sizeof(uint32_t));
+    if (cull->taskBounds == NULL || cull->classOf == NULL || cull->taskNear == NULL || cull->taskFar == NULL ||
+        cull->near == NULL || cull->far == NULL)
+    {
+        freeArrays(cull);
+        return 0;
+    }
+    cull->capacity = count;
+    cull->taskCapacity = tasks;
+    return 1;
+}
+
+static void run(struct particleCull *cull, int chunks, poolTask task)
+{
+    int chunk;
+
+    if (cull->pool != NULL && chunks > 1)
+        poolRun(cull->pool, chunks, task, cull);
+    else
+    {
+        for (chunk = 0; chunk < chunks; chunk++)
+            task(cull, chunk);
+    }
+}
+
+// [first, end) of the particles task t of tasks takes
+static void split(int total, int tasks, int t, int *first, int *end)
+{
+    *first = (int) ((long) total * t / tasks);
+    *end = (int) ((long) total * (t + 1) / tasks);
+}
+
+// TILES tiles along each axis of the box around all the particles, for the
+// next frame
+static void layTiles(struct particleCull *cull)
+{
+    float low[3] = { INFINITY, INFINITY, INFINITY }, high[3] = { -INFINITY, -INFINITY, -INFINITY };
+    int t, k;
+
+    for (t = 0; t < cull->tasks; t++)
+    {
+        for (k = 0; k < 3; k++)
+        {
+            low[k] = fminf(low[k], cull->taskBounds[6 * t + k]);
+            high[k] = fmaxf(high[k], cull->taskBounds[6 * t + 3 + k]);
+        }
+    }
+    for (k = 0; k < 3; k++)
+    {
+        if (!(low[k] <= high[k]))               // no particles, or none finite
+            low[k] = high[k] = 0;
+        cull->low[k] = low[k];
+        cull->size[k] = (high[k] - low[k]) / TILES;
+        if (!(cull->size[k] > 0))               // flat, or too wide to measure
+            cull->size[k] = 1;
+        cull->inverse[k] = 1.0f / cull->size[k];
+    }
+}
+
+// a row of the column-major matrix m
+static void matrixRow(const float m[16], int row, float r[4])
+{
+    int k;
+    for (k = 0; k < 4; k++)
+        r[k] = m[4 * k + row];
+}
+
+// whether the box [low, high] is wholly on the negative side of the plane
+static int outside(const float plane[4], const float low[3], const float high[3])
+{
+    float x = plane[0] > 0 ? high[0] : low[0];
+    float y = plane[1] > 0 ? high[1] : low[1];
+    float z = plane[2] > 0 ? high[2] : low[2];
+    return plane[0] * x + plane[1] * y + plane[2] * z + plane[3] < 0;
+}
+
+// every tile culled, far or near: the frustum planes are the last row of
+// clip plus or minus each of the others, and the last row alone gives the
+// depth along the view, here of the tile's nearest corner
+static void classifyTiles(struct particleCull *cull, const float clip[16], float margin, float lodDistance)
+{
+    float planes[6][4], w[4], r[4];
+    int p, k, cx, cy, cz;
+
+    matrixRow(clip, 3, w);
+    memcpy(cull->depth, w, sizeof cull->depth);
+    cull->lodDistance = lodDistance;
+    for (p = 0; p < 6; p++)
+    {
+        matrixRow(clip, p / 2, r);
+        for (k = 0; k < 4; k++)
+            planes[p][k] = p % 2 == 0 ? w[k] + r[k] : w[k] - r[k];
+    }
+
+    for (cz = 0; cz < TILES; cz++)
+    {
+        for (cy = 0; cy < TILES; cy++)
+        {
+            for (cx = 0; cx < TILES; cx++)
+            {
+                const int cell[3] = { cx, cy, cz };
+                float low[3], high[3], nearest;
+                int tile = (cz * TILES + cy) * TILES + cx;
+                int culled = 0;
+
+                for (k = 0; k < 3; k++)
+                {
+                    low[k] = cull->low[k] + cell[k] * cull->size[k] - margin;
+                    high[k] = cull->low[k] + (cell[k] + 1) * cull->size[k] + margin;
+                }
+                for (p = 0; p < 6 && !culled; p++)
+                    culled = outside(planes[p], low, high);
+
+                nearest = w[3];
+                for (k = 0; k < 3; k++)
+                    nearest += w[k] * (w[k] > 0 ? low[k] : high[k]);
+                cull->tileClass[tile] = culled ? CULLED : nearest > lodDistance ? FAR : NEAR;
+            }
+        }
+    }
+}
+
+// a coordinate's tile, -1 past the ends or when it is not a number
+static inline int tileAlong(float p, float low, float inverse)
+{
+    float t = (p - low) * inverse;
+    return t >= 0 && t < TILES ? (int) t : -1;
+}
+
+// the class of every particle of the task from its tile, counted, and the
+// box around them; a particle that left the last frame's box is near, or in
+// an order far by its own depth, so that one far respawn does not make all
+// the rest near (see promoteTask()). The byte stores may alias anything, so
+// everything read is in locals first. ordered and compact are constants in
+// each task below, so the loop tests neither.
+static inline __attribute__((always_inline))
+void classParticles(struct particleCull *cull, int task, const int ordered, const int compact)
+{
+    const struct particleSystem *ps = cull->ps;
+    const float *positionX = ps->positionX, *positionY = ps->positionY, *positionZ = ps->positionZ;
+    const float *previousX = ps->previousX, *previousY = ps->previousY, *previousZ = ps->previousZ;
+    const struct compactParticles *packed = ps->compact;
+    const float blend = ps->blend;
+    const float lowX = cull->low[0], lowY = cull->low[1], lowZ = cull->low[2];
+    const float inverseX = cull->inverse[0], inverseY = cull->inverse[1], inverseZ = cull->inverse[2];
+    const uint32_t *order = cull->order;
+    const uint8_t *tileClass = cull->tileClass;
+    const float *depth = cull->depth, lodDistance = cull->lodDistance;
+    uint8_t *classOf = cull->classOf;
+    float *bounds = cull->taskBounds + 6 * task;
+    float low[3] = { INFINITY, INFINITY, INFINITY }, high[3] = { -INFINITY, -INFINITY, -INFINITY };
+    int near = 0, far = 0, s, k, first, end;
+
+    split(cull->count, cull->tasks, task, &first, &end);
+    for (s = first; s < end; s++)
+    {
+        int i = ordered ? (int) order[s] : s;
+        float position[3];
+        int cx, cy, cz;
+        uint8_t class;
+
+        if (compact)
+            compactPosition(packed, i, blend, position);
+        else
+        {
+            position[0] = previousX[i] + blend * (positionX[i] - previousX[i]);
+            position[1] = previousY[i] + blend * (positionY[i] - previousY[i]);
+            position[2] = previousZ[i] + blend * (positionZ[i] - previousZ[i]);
+        }
+        for (k = 0; k < 3; k++)
+        {
+            low[k] = position[k] < low[k] ? position[k] : low[k];
+            high[k] = position[k] > high[k] ? position[k] : high[k];
+        }
+        cx = tileAlong(position[0], lowX, inverseX);
+        cy = tileAlong(position[1], lowY, inverseY);
+        cz = tileAlong(position[2], lowZ, inverseZ);
+        if ((cx | cy | cz) >= 0)
+            class = tileClass[(cz * TILES + cy) * TILES + cx];
+        else if (ordered &&
+                 depth[0] * position[0] + depth[1] * position[1] + depth[2] * position[2] + depth[3] > lodDistance)
+            class = FAR;
+        else
+            class = NEAR;
+        classOf[s] = class;
+        near += class == NEAR;
+        far += class == FAR;
+    }
+    cull->taskNear[task] = near;
+    cull->taskFar[task] = far;
+    for (k = 0; k < 3; k++)
+    {
+        bounds[k] = low[k];
+        bounds[3 + k] = high[k];
+    }
+}
+
+static void classTask(void *context, int task)
+{
+    classParticles(context, task, 0, 0);
+}
+
+static void orderedClassTask(void *context, int task)
+{
+    classParticles(context, task, 1, 0);
+}
+
+static void compactClassTask(void *context, int task)
+{
+    classParticles(context, task, 0, 1);
+}
+
+static void orderedCompactClassTask(void *context, int task)
+{
+    classParticles(context, task, 1, 1);
+}
+
+// the far particles of the task that come after the first near one in order
+// drawn near too, recounted, so that drawing the far list and then the near
+// one goes back to front; they are few, as only a tile across the level of
+// detail distance holds both
+static void promoteTask(void *context, int task)
+{
+    struct particleCull *cull = context;
+    uint8_t *classOf = cull->classOf;
+    int promoted = 0, s, first, end;
+
+    split(cull->count, cull->tasks, task, &first, &end);
+    for (s = first > cull->firstNear ? first : cull->firstNear; s < end; s++)
+    {
+        if (classOf[s] == FAR)
+        {
+            classOf[s] = NEAR;
+            promoted++;
+        }
+    }
+    cull->taskNear[task] += promoted;
+    cull->taskFar[task] -= promoted;
+}
+
+// every particle of the task to its list, from the task's offsets
+static void writeTask(void *context, int task)
+{
+    struct particleCull *cull = context;
+    uint32_t *near = cull->near + cull->taskNear[task], *far = cull->far + cull->taskFar[task];
+    const uint32_t *order = cull->order;
+    const uint8_t *classOf = cull->classOf;
+    int s, first, end;
+
+    split(cull->count, cull->tasks, task, &first, &end);
+    for (s = first; s < end; s++)
+    {
+        uint32_t index = order != NULL ? order[s] : (uint32_t) s;
+        if (classOf[s] == NEAR)
+            *near++ = index;
+        else if (classOf[s] == FAR)
+            *far++ = index;
+    }
+}
+
+int cullParticles(struct particleCull *cull, const struct particleSystem *ps, const uint32_t *order,
+                  const float clip[16], float margin, float lodDistance)
+{
+    int count = ps->numberParticles;
+    int tasks = ps->pool != NULL ? poolThreads(ps->pool) : 1;
+    int near = 0, far = 0, t, n;
+
+    if (tasks > (count + CULL_CHUNK - 1) / CULL_CHUNK)
+        tasks = (count + CULL_CHUNK - 1) / CULL_CHUNK;
+    if (tasks < 1)
+        tasks = 1;
+    if (!reserve(cull, count > 0 ? count : 1, tasks))
+        return 0;
+
+    cull->pool = ps->pool;
+    cull->tasks = tasks;
+    cull->count = count;
+    cull->ps = ps;
+    cull->order = order;
+
+    classifyTiles(cull, clip, margin, lodDistance);
+    if (ps->compact != NULL)
+        run(cull, tasks, order != NULL ? orderedCompactClassTask : compactClassTask);
+    else
+        run(cull, tasks, order != NULL ? orderedClassTask : classTask);
+    if (order != NULL)
+    {
+        const uint8_t *firstNear = memchr(cull->classOf, NEAR, count);
+        cull->firstNear = firstNear != NULL ? (int) (firstNear - cull->classOf) : count;
+        run(cull, tasks, promoteTask);
+    }
+    layTiles(cull);
+    for (t = 0; t < tasks; t++)
+    {
+        n = cull->taskNear[t];
+        cull->taskNear[t] = near;
+        near += n;
+        n = cull->taskFar[t];
+        cull->taskFar[t] = far;
+        far += n;
+    }
+    run(cull, tasks, writeTask);
+    cull->nearCount = near;
+    cull->farCount = far;
+    return 1;
+}
+
+/* end of cull.c */
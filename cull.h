@@ -0,0 +1,47 @@
+//
+//  cull.h
+//
+//
+//  Created by BOWEN LI
+//
+//  Which particles are worth drawing, and how. The box around the particles
+//  is cut into TILES tiles along each axis; each tile is tested whole against
+//  the six planes of the view frustum, so a particle costs a table lookup
+//  rather than a test of its own. The box is the one around the last frame's
+//  particles, which keeps it all to one pass over the positions; those that
+//  have left it since are drawn in full. Tiles nearer than the level of detail
+//  distance draw their particles in full, as squares or spheres, and those
+//  beyond it only as points; tiles outside the frustum are not drawn at all.
+//
+
+#ifndef CULL_H
+#define CULL_H
+
+#include <stdint.h>
+#include "particles.h"
+
+#define TILES 16                                // along each axis of the box
+
+struct particleCull;
+
+struct particleCull *cullCreate(void);
+void cullDestroy(struct particleCull *cull);
+
+// split the particles of ps, taken in order (see depthSortOrder()) or as they
+// are stored when order is NULL, into the near and the far ones that can be
+// seen through clip, the projection times the modelview matrix in column-major
+// order. margin is how far a particle reaches past its position; lodDistance
+// is the depth along the view beyond which a whole tile is far. Both lists
+// keep the order; with an order, the far particles that come after the first
+// near one go to the near list, so that the far list drawn before the near
+// one keeps it too. Returns 0 when the memory cannot be found.
+int cullParticles(struct particleCull *cull, const struct particleSystem *ps, const uint32_t *order,
+                  const float clip[16], float margin, float lodDistance);
+
+// the lists of the last cullParticles(), valid until the next one
+const uint32_t *cullNear(const struct particleCull *cull, int *count);
+const uint32_t *cullFar(const struct particleCull *cull, int *count);
+
+#endif
+
+/* end of cull.h */
@@ -0,0 +1,440 @@
+//
+//  depthsort.c
+//
+//
+//  Created by BOWEN LI
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include "depthsort.h"
+#include "pool.h"
+
+#define KEY_BITS 16                             // of the depths, over the range they span
+#define DIGIT_BITS 8                            // two radix passes cover the key
+#define RADIX (1 << DIGIT_BITS)
+#define SORT_CHUNK 65536                        // fewest particles worth a task of their own
+#define WINDOW 32                               // places a particle may move and still be inserted
+#define OUTLIER_SHARE 4                         // more than 1 in this many moved further: sort it all
+#define MAX_BACKOFF 64                          // frames sorted afresh at most before mending again
+
+struct depthSort
+{
+    int capacity;                               // particles the arrays have room for
+    int taskCapacity;                           // tasks the histograms have room for
+    int tasks;
+    int count;                                  // particles in order
+    int valid;                                  // whether order can be mended next frame
+    int full;                                   // whether the last order was sorted from scratch
+    int backoff;                                // frames to sort afresh after the next failed mend
+    int skip;                                   // frames still to sort afresh before trying to mend
+    int failures;                               // mends that fell back to sorting it all
+    uint64_t step;                              // of the particles in order
+    float modelview[16];                        // the camera of order
+    const struct particleSystem *ps;
+    struct workerPool *pool;
+
+    uint32_t *keyOf;                            // per particle, in the order of the arrays
+    uint32_t *taskRange;                        // per task: the lowest and the highest key
+    uint32_t low;                               // the lowest key, which becomes 0
+    int keyShift;                               // and what is cut off the keys after that
+    uint32_t *order, *keys;                     // the particles back to front, and their keys
+    uint32_t *spare, *spareKeys;                // the same for a radix pass to write to
+    uint32_t *histogram;                        // tasks * RADIX: counts, then write offsets
+
+    // the radix pass under way: inIndex NULL for particles in array order
+    const uint32_t *inKeys, *inIndex;
+    uint32_t *outKeys, *outIndex;
+    int passCount;
+    int digitShift;
+};
+
+struct depthSort *depthSortCreate(void)
+{
+    return calloc(1, sizeof(struct depthSort));
+}
+
+static void freeArrays(struct depthSort *sort)
+{
+    free(sort->keyOf);
+    free(sort->order);
+    free(sort->keys);
+    free(sort->spare);
+    free(sort->spareKeys);
+    free(sort->histogram);
+    free(sort->taskRange);
+    sort->keyOf = sort->order = sort->keys = sort->spare = sort->spareKeys = sort->histogram = NULL;
+    sort->taskRange = NULL;
+    sort->capacity = sort->taskCapacity = 0;
+    sort->valid = 0;
+}
+
+void depthSortDestroy(struct depthSort *sort)
+{
+    if (sort == NULL)
+        return;
+    freeArrays(sort);
+    free(sort);
+}
+
+int depthSortWasFull(const struct depthSort *sort)
+{
+    return sort->full;
+}
+
+int depthSortFailures(const struct depthSort *sort)
+{
+    return sort->failures;
+}
+
+void depthSortReset(struct depthSort *sort)
+{
+    sort->valid = 0;
+}
+
+// room for count particles sorted by tasks tasks; the arrays only ever grow
+static int reserve(struct depthSort *sort, int count, int tasks)
+{
+    if (count <= sort->capacity && tasks <= sort->taskCapacity)
+        return 1;
+    if (count < sort->capacity)
+        count = sort->capacity;
+    if (tasks < sort->taskCapacity)
+        tasks = sort->taskCapacity;
+
+    freeArrays(sort);
+    sort->keyOf = malloc(count * sizeof(uint32_t));
+    sort->order = malloc(count * sizeof(uint32_t));
+    sort->keys = malloc(count * sizeof(uint32_t));
+    sort->spare = malloc(count * sizeof(uint32_t));
+    sort->spareKeys = malloc(count * sizeof(uint32_t));
+    sort->histogram = malloc((size_t) tasks * RADIX * sizeof(uint32_t));
+    sort->taskRange = malloc(tasks * 2 * sizeof(uint32_t));
+    if (sort->keyOf == NULL || sort->order == NULL || sort->keys == NULL || sort->spare == NULL ||
+        sort->spareKeys == NULL || sort->histogram == NULL || sort->taskRange == NULL)
+    {
+        freeArrays(sort);
+        return 0;
+    }
+    sort->capacity = count;
+    sort->taskCapacity = tasks;
+    return 1;
+}
+
+// tasks worth sharing count particles among
+static int tasksFor(const struct depthSort *sort, int count)
+{
+    int tasks = sort->pool != NULL ? poolThreads(sort->pool) : 1;
+
+    if (tasks > (count + SORT_CHUNK - 1) / SORT_CHUNK)
+        tasks = (count + SORT_CHUNK - 1) / SORT_CHUNK;
+    return tasks > 1 ? tasks : 1;
+}
+
+static void run(struct depthSort *sort, int chunks, poolTask task)
+{
+    int chunk;
+
+    if (sort->pool != NULL && chunks > 1)
+        poolRun(sort->pool, chunks, task, sort);
+    else
+    {
+        for (chunk = 0; chunk < chunks; chunk++)
+            task(sort, chunk);
+    }
+}
+
+// [first, end) of the particles task t of tasks takes
+static void split(int total, int tasks, int t, int *first, int *end)
+{
+    *first = (int) ((long) total * t / tasks);
+    *end = (int) ((long) total * (t + 1) / tasks);
+}
+
+// the bits of a float turned so that they order as the float does: a
+// positive float flips its sign bit, a negative one every bit. Equal steps of
+// the key are then equal fractions of the depth, so that a far particle
+// costs the near ones little of their resolution.
+static uint32_t depthKey(float depth)
+{
+    uint32_t bits;
+
+    memcpy(&bits, &depth, sizeof bits);
+    return bits ^ ((uint32_t) -(int32_t) (bits >> 31) | 0x80000000U);
+}
+
+// the key of every particle of the task: its z in eye space, which is more
+// negative the farther away it is, so that ascending keys are back to front.
+// compact is a constant in each task below, so the loop does not test it.
+static inline __attribute__((always_inline))
+void keyParticles(struct depthSort *sort, int task, const int compact)
+{
+    const struct particleSystem *ps = sort->ps;
+    const float *positionX = ps->positionX, *positionY = ps->positionY, *positionZ = ps->positionZ;
+    const float *previousX = ps->previousX, *previousY = ps->previousY, *previousZ = ps->previousZ;
+    const float blend = ps->blend;
+    const float *m = sort->modelview;
+    uint32_t *keyOf = sort->keyOf;
+    uint32_t low = UINT32_MAX, high = 0;
+    int i, first, end;
+
+    split(ps->numberParticles, sort->tasks, task, &first, &end);
+    for (i = first; i < end; i++)
+    {
+        float position[3];
+        uint32_t key;
+
+        if (compact)
+            compactPosition(ps->compact, i, blend, position);
+        else
+        {
+            position[0] = previousX[i] + blend * (positionX[i] - previousX[i]);
+            position[1] = previousY[i] + blend * (positionY[i] - previousY[i]);
+            position[2] = previousZ[i] + blend * (positionZ[i] - previousZ[i]);
+        }
+        key = depthKey(m[2] * position[0] + m[6] * position[1] + m[10] * position[2] + m[14]);
+        keyOf[i] = key;
+        low = key < low ? key : low;
+        high = key > high ? key : high;
+    }
+    sort->taskRange[2 * task] = low;
+    sort->taskRange[2 * task + 1] = high;
+}
+
+static void keyTask(void *context, int task)
+{
+    keyParticles(context, task, 0);
+}
+
+static void compactKeyTask(void *context, int task)
+{
+    keyParticles(context, task, 1);
+}
+
+// the keys of the task cut to KEY_BITS over the range they span
+static void quantizeTask(void *context, int task)
+{
+    struct depthSort *sort = context;
+    uint32_t *keyOf = sort->keyOf;
+    const uint32_t low = sort->low;
+    const int keyShift = sort->keyShift;
+    int i, first, end;
+
+    split(sort->count, sort->tasks, task, &first, &end);
+    for (i = first; i < end; i++)
+        keyOf[i] = (keyOf[i] - low) >> keyShift;
+}
+
+// the keys of every particle, KEY_BITS each
+static void makeKeys(struct depthSort *sort)
+{
+    uint32_t low = UINT32_MAX, high = 0;
+    int t;
+
+    run(sort, sort->tasks, sort->ps->compact != NULL ? compactKeyTask : keyTask);
+    for (t = 0; t < sort->tasks; t++)
+    {
+        low = sort->taskRange[2 * t] < low ? sort->taskRange[2 * t] : low;
+        high = sort->taskRange[2 * t + 1] > high ? sort->taskRange[2 * t + 1] : high;
+    }
+    sort->low = low;
+    for (sort->keyShift = 0; low < high && (high - low) >> sort->keyShift >= 1U << KEY_BITS; sort->keyShift++)
+        ;
+    run(sort, sort->tasks, quantizeTask);
+}
+
+// the keys of the last order, particle by particle
+static void gatherTask(void *context, int task)
+{
+    struct depthSort *sort = context;
+    int s, first, end;
+
+    split(sort->count, sort->tasks, task, &first, &end);
+    for (s = first; s < end; s++)
+        sort->keys[s] = sort->keyOf[sort->order[s]];
+}
+
+// the digit of every key of the task, counted in the task's histogram
+static void countTask(void *context, int task)
+{
+    struct depthSort *sort = context;
+    uint32_t *histogram = sort->histogram + (size_t) task * RADIX;
+    int d, i, first, end;
+
+    for (d = 0; d < RADIX; d++)
+        histogram[d] = 0;
+    split(sort->passCount, sort->tasks, task, &first, &end);
+    for (i = first; i < end; i++)
+        histogram[(sort->inKeys[i] >> sort->digitShift) & (RADIX - 1)]++;
+}
+
+// every key of the task to its place, in the order it had within a digit
+static void scatterTask(void *context, int task)
+{
+    struct depthSort *sort = context;
+    uint32_t *offset = sort->histogram + (size_t) task * RADIX;
+    const uint32_t *inKeys = sort->inKeys, *inIndex = sort->inIndex;
+    uint32_t *outKeys = sort->outKeys, *outIndex = sort->outIndex;
+    const int digitShift = sort->digitShift;
+    int i, first, end;
+
+    split(sort->passCount, sort->tasks, task, &first, &end);
+    for (i = first; i < end; i++)
+    {
+        uint32_t key = inKeys[i];
+        uint32_t s = offset[(key >> digitShift) & (RADIX - 1)]++;
+        outKeys[s] = key;
+        outIndex[s] = inIndex != NULL ? inIndex[i] : (uint32_t) i;
+    }
+}
+
+// one stable counting sort of count keys by the digit at digitShift
+static void radixPass(struct depthSort *sort, const uint32_t *inKeys, const uint32_t *inIndex,
+                      uint32_t *outKeys, uint32_t *outIndex, int count, int digitShift)
+{
+    uint32_t offset = 0;
+    int d, t;
+
+    sort->tasks = tasksFor(sort, count);
+    sort->inKeys = inKeys;
+    sort->inIndex = inIndex;
+    sort->outKeys = outKeys;
+    sort->outIndex = outIndex;
+    sort->passCount = count;
+    sort->digitShift = digitShift;
+
+    run(sort, sort->tasks, countTask);
+    for (d = 0; d < RADIX; d++)
+    {
+        for (t = 0; t < sort->tasks; t++)
+        {
+            uint32_t *counted = &sort->histogram[(size_t) t * RADIX + d];
+            uint32_t n = *counted;
+            *counted = offset;
+            offset += n;
+        }
+    }
+    run(sort, sort->tasks, scatterTask);
+}
+
+// sort every particle from its key alone
+static void sortAll(struct depthSort *sort, int count)
+{
+    radixPass(sort, sort->keyOf, NULL, sort->spareKeys, sort->spare, count, 0);
+    radixPass(sort, sort->spareKeys, sort->spare, sort->keys, sort->order, count, DIGIT_BITS);
+}
+
+// mend the last order under its new keys: particles in order stay, those a
+// few places out are inserted where they belong, and those further out are
+// set aside in spare, in order, and sorted and merged back in after. Returns
+// 0, leaving order broken, as soon as too many are set aside for that to pay.
+static int mend(struct depthSort *sort)
+{
+    uint32_t *keys = sort->keys, *order = sort->order;
+    int count = sort->count, limit = count / OUTLIER_SHARE;
+    int kept = 0, aside = 0, s, j;
+
+    for (s = 0; s < count; s++)
+    {
+        uint32_t key = keys[s], index = order[s];
+        int ahead = s + WINDOW < count ? s + WINDOW : count - 1;
+
+        // ahead of the particles after it by more than the window, which
+        // are themselves in order after the kept ones: it jumped back, as a
+        // respawn does, and would push them all out of place
+        if (key > keys[ahead] && (kept == 0 || keys[kept - 1] <= keys[s + 1]))
+            j = -1;
+        else
+        {
+            for (j = kept; j > 0 && keys[j - 1] > key && kept - j < WINDOW; j--)
+                ;
+            if (j > 0 && keys[j - 1] > key)
+                j = -1;
+        }
+
+        if (j < 0)
+        {
+            if (aside == limit || aside > s / OUTLIER_SHARE + WINDOW)
+                return 0;
+            sort->spareKeys[aside] = key;
+            sort->spare[aside++] = index;
+        }
+        else
+        {
+            if (j < kept)
+            {
+                memmove(keys + j + 1, keys + j, (kept - j) * sizeof(uint32_t));
+                memmove(order + j + 1, order + j, (kept - j) * sizeof(uint32_t));
+            }
+            keys[j] = key;
+            order[j] = index;
+            kept++;
+        }
+    }
+    if (aside == 0)
+        return 1;
+
+    // sort the ones set aside through the room they left at the end of
+    // order, then merge from the back, the kept ones first among equals
+    radixPass(sort, sort->spareKeys, sort->spare, keys + kept, order + kept, aside, 0);
+    radixPass(sort, keys + kept, order + kept, sort->spareKeys, sort->spare, aside, DIGIT_BITS);
+    for (s = count - 1, j = aside - 1; j >= 0; s--)
+    {
+        if (kept > 0 && keys[kept - 1] > sort->spareKeys[j])
+        {
+            kept--;
+            keys[s] = keys[kept];
+            order[s] = order[kept];
+        }
+        else
+        {
+            keys[s] = sort->spareKeys[j];
+            order[s] = sort->spare[j--];
+        }
+    }
+    return 1;
+}
+
+const uint32_t *depthSortOrder(struct depthSort *sort, const struct particleSystem *ps, const float modelview[16])
+{
+    int count = ps->numberParticles;
+    int moved = memcmp(sort->modelview, modelview, sizeof sort->modelview) != 0;
+
+    sort->pool = ps->pool;
+    if (!reserve(sort, count > 0 ? count : 1, tasksFor(sort, count)))
+        return NULL;
+    sort->ps = ps;
+    memcpy(sort->modelview, modelview, sizeof sort->modelview);
+
+    // the particles of a paused simulation hardly move, so they are always
+    // worth mending
+    sort->full = !sort->valid || moved || count != sort->count || (sort->skip > 0 && ps->step != sort->step);
+    if (sort->skip > 0)
+        sort->skip--;
+    sort->step = ps->step;
+    sort->count = count;
+    sort->tasks = tasksFor(sort, count);
+    makeKeys(sort);
+    if (!sort->full)
+    {
+        // a failed mend costs a pass for nothing, so after one the particles
+        // are sorted afresh for twice as many frames as after the last
+        run(sort, sort->tasks, gatherTask);
+        sort->full = !mend(sort);
+        if (sort->full)
+        {
+            sort->failures++;
+            sort->backoff = sort->backoff > 0 ? sort->backoff * 2 : 1;
+            sort->backoff = sort->backoff < MAX_BACKOFF ? sort->backoff : MAX_BACKOFF;
+            sort->skip = sort->backoff;
+        }
+        else
+            sort->backoff = 0;
+    }
+    if (sort->full)
+        sortAll(sort, count);
+    sort->valid = 1;
+    return sort->order;
+}
+
+/* end of depthsort.c */
@@ -0,0 +1,49 @@
+//
+//  depthsort.h
+//
+//
+//  Created by BOWEN LI
+//
+//  The order to draw the particles in from the farthest to the nearest, so
+//  that blending them over one another is right. Depths are cut to 16 bit
+//  keys over the range they span and sorted by two passes of a radix sort
+//  shared among the update threads. From one frame to the next under the same camera the order
+//  hardly changes, so the last order is kept and only mended: a particle
+//  that moved a few places is inserted again, and the few that moved far,
+//  such as respawns, are sorted on their own and merged back in. When the
+//  camera or the particle count changes, or too many particles moved far,
+//  the whole order is sorted again. A mend that fails costs a pass for
+//  nothing, as it does every frame in a fast waterfall, so after each one
+//  the next is put off twice as long as the last, up to 64 frames, unless
+//  the simulation is paused.
+//
+
+#ifndef DEPTHSORT_H
+#define DEPTHSORT_H
+
+#include <stdint.h>
+#include "particles.h"
+
+struct depthSort;
+
+struct depthSort *depthSortCreate(void);
+void depthSortDestroy(struct depthSort *sort);
+
+// the indices of the particles of ps back to front, where they are drawn
+// (see drawPosition()) seen through modelview, a column-major matrix as
+// glGetFloatv(GL_MODELVIEW_MATRIX) gives; NULL when the memory cannot be
+// found. The order stays valid until the next call.
+const uint32_t *depthSortOrder(struct depthSort *sort, const struct particleSystem *ps, const float modelview[16]);
+
+// whether the last depthSortOrder() sorted everything again
+int depthSortWasFull(const struct depthSort *sort);
+
+// the mends tried so far that fell back to sorting everything again
+int depthSortFailures(const struct depthSort *sort);
+
+// forget the last order, so that the next depthSortOrder() sorts everything
+void depthSortReset(struct depthSort *sort);
+
+#endif
+
+/* end of depthsort.h */
@@ -0,0 +1,379 @@
+//
+//  draw.c
+//
+//
+//  Created by BOWEN LI
+//
+
+#ifdef MACOSX
+#include <OpenGL/glu.h>
+#else
+#include <GL/glu.h>
+#endif
+
+#include <stdlib.h>
+#include <math.h>
+#include "draw.h"
+#include "cull.h"
+#include "depthsort.h"
+#include "gpusim.h"
+#include "render.h"
+#include "scene.h"
+#include "vertices.h"
+
+#define IMMEDIATE_CHUNK 256                     // particles written at a time for immediate mode
+
+struct worldDraw
+{
+    struct profile *profile;                    // times the sort and the cull, may be NULL
+    struct particleBuffers *buffers;            // NULL in immediate mode only
+    struct depthSort *depthSort;                // made the first time it is needed
+    struct particleCull *particleCull;
+    GLUquadric *quadric;                        // immediate mode spheres
+};
+
+// hardcode the texture, just use the red color as texture
+static void glInitTexture(void)
+{
+    GLuint texture;
+
+    glGenTextures(1, &texture);                   // generate texture names
+    glBindTexture(GL_TEXTURE_2D, texture);        // bind a named texture to a texturing target
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);  // sets the texture magnification function
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);  // sets the texture minifying function
+    unsigned char data[] = { 255, 0, 0, 255 };
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, data); // specify a two-dimensional texture image
+}
+
+struct worldDraw *worldDrawCreate(struct profile *profile)
+{
+    struct worldDraw *draw = calloc(1, sizeof(struct worldDraw));
+
+    if (draw == NULL)
+        return NULL;
+    draw->profile = profile;
+    draw->quadric = gluNewQuadric();
+    if (draw->quadric == NULL)
+    {
+        free(draw);
+        return NULL;
+    }
+    gluQuadricDrawStyle(draw->quadric, GLU_LINE);
+
+    // flat shading selects the computed color of just one vertex
+    // and assigns it to all the pixel fragments
+    glShadeModel(GL_FLAT);
+
+    // do depth comparisons and update the depth buffer
+    glEnable(GL_DEPTH_TEST);
+
+    // if enabled, draw points with proper filtering. Otherwise, draw aliased points
+    glEnable(GL_POINT_SMOOTH);
+
+    // enable the alpha
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+    // initialise the texture
+    glInitTexture();
+
+    // the vertex buffers and the sphere mesh
+    draw->buffers = createParticleBuffers(profile);
+    return draw;
+}
+
+void worldDrawDestroy(struct worldDraw *draw)
+{
+    if (draw == NULL)
+        return;
+    destroyParticleBuffers(draw->buffers);
+    depthSortDestroy(draw->depthSort);
+    cullDestroy(draw->particleCull);
+    gluDeleteQuadric(draw->quadric);
+    free(draw);
+}
+
+// the two grounds of the waterfall
+static void drawGrounds(void)
+{
+    // Draw the smaller ground
+    glColor3f(0.3, 0.0, 0.5);
+    glBegin(GL_QUADS);
+    glVertex3f(-3, 4.80, -3);
+    glVertex3f(3, 4.80, -3);
+    glVertex3f(3, 4.80, 3);
+    glVertex3f(-3, 4.80, 3);
+    glEnd();
+
+    // Draw the bigger ground
+    glColor3f(0.5, 0.0, 0.5);
+    glBegin(GL_QUADS);
+    glVertex3f(-5, -0.1, -5);
+    glVertex3f(EDGE, -0.1, -5);
+    glVertex3f(EDGE, -0.1, 5);
+    glVertex3f(-5, -0.1, 5);
+    glEnd();
+}
+
+// the twelve edges of the box [low, high]
+static void drawWireBox(const float low[3], const float high[3])
+{
+    int edge, k;
+
+    glBegin(GL_LINES);
+    for (edge = 0; edge < 12; edge++)
+    {
+        int along = edge / 4;                   // the axis the edge runs along
+        int a = (along + 1) % 3, b = (along + 2) % 3;
+        float from[3], to[3];
+
+        for (k = 0; k < 3; k++)
+            from[k] = to[k] = low[k];
+        from[a] = to[a] = edge & 1 ? high[a] : low[a];
+        from[b] = to[b] = edge & 2 ? high[b] : low[b];
+        to[along] = high[along];
+        glVertex3fv(from);
+        glVertex3fv(to);
+    }
+    glEnd();
+}
+
+// the colliders of a scene in place of the waterfall's two grounds: boxes
+// as wire cubes, planes facing up as a square of EDGE either side
+static void drawColliders(const struct scene *scene)
+{
+    int c;
+
+    for (c = 0; c < scene->numberColliders; c++)
+    {
+        const struct collider *collider = &scene->colliders[c];
+        if (collider->type == COLLIDER_BOX)
+        {
+            glColor3f(0.3, 0.0, 0.5);
+            drawWireBox(collider->low, collider->high);
+        }
+        else if (collider->normal[1] > 0.99)
+        {
+            GLfloat y = collider->offset / collider->normal[1] - 0.1;
+            glColor3f(0.5, 0.0, 0.5);
+            glBegin(GL_QUADS);
+            glVertex3f(-EDGE, y, -EDGE);
+            glVertex3f(EDGE, y, -EDGE);
+            glVertex3f(EDGE, y, EDGE);
+            glVertex3f(-EDGE, y, EDGE);
+            glEnd();
+        }
+    }
+}
+
+// the particles back to front under the modelview matrix about to draw
+// them, or NULL to draw them as they are stored
+static const uint32_t *drawOrder(struct worldDraw *draw, const struct particleSystem *ps)
+{
+    GLfloat modelview[16];
+    const uint32_t *order;
+
+    if (draw->depthSort == NULL)
+        draw->depthSort = depthSortCreate();
+    if (draw->depthSort == NULL)
+        return NULL;
+    glGetFloatv(GL_MODELVIEW_MATRIX, modelview);
+    profileBegin(draw->profile, PROFILE_SORT);
+    order = depthSortOrder(draw->depthSort, ps, modelview);
+    profileEnd(draw->profile, PROFILE_SORT);
+    return order;
+}
+
+// c = a b for column-major 4 x 4 matrices
+static void multiplyMatrices(GLfloat c[16], const GLfloat a[16], const GLfloat b[16])
+{
+    int row, column, k;
+
+    for (column = 0; column < 4; column++)
+    {
+        for (row = 0; row < 4; row++)
+        {
+            c[4 * column + row] = 0;
+            for (k = 0; k < 4; k++)
+                c[4 * column + row] += a[4 * k + row] * b[4 * column + k];
+        }
+    }
+}
+
+// split the particles, in order, into the near and the far ones in view;
+// returns 0 to draw them all instead
+static int cullView(struct worldDraw *draw, const struct particleSystem *ps, const uint32_t *order,
+                    const struct drawSettings *settings)
+{
+    GLfloat projection[16], modelview[16], clip[16];
+    GLfloat margin = settings->square ? settings->squareSize : settings->sphere ? SPHERE_RADIUS : 0;   // points clip at their centre
+    int done;
+
+    if (draw->particleCull == NULL)
+        draw->particleCull = cullCreate();
+    if (draw->particleCull == NULL)
+        return 0;
+    glGetFloatv(GL_PROJECTION_MATRIX, projection);
+    glGetFloatv(GL_MODELVIEW_MATRIX, modelview);
+    multiplyMatrices(clip, projection, modelview);
+    profileBegin(draw->profile, PROFILE_CULL);
+    done = cullParticles(draw->particleCull, ps, order, clip, margin,
+                         settings->point ? INFINITY : settings->lodDistance);
+    profileEnd(draw->profile, PROFILE_CULL);
+    return done;
+}
+
+// count particles in order, or all of them as stored when order is NULL,
+// drawn as points, squares or spheres
+static void drawParticles(struct worldDraw *draw, const struct particleSystem *ps, const uint32_t *order, int count,
+                          int asPoint, int asSquare, int asSphere, const struct drawSettings *settings)
+{
+    struct particleBuffers *buffers = draw->buffers;
+    int buffered = settings->buffered && buffers != NULL;
+    GLfloat squareSize = settings->squareSize;
+    GLfloat vertex[4 * 3 * IMMEDIATE_CHUNK];
+    GLubyte color[4 * 4 * IMMEDIATE_CHUNK];
+    vertexKernel kernel;
+    int first, n, i;
+
+    if (buffers != NULL)
+        setDrawOrder(buffers, order, count);
+
+    // check the rendering shape: point or square or sphere
+    if (asPoint && buffered && drawPointsBuffered(buffers, ps))
+        ;               // one draw call from the vertex buffer
+    else if (asSquare && buffered && drawSprites(buffers, ps, squareSize, settings->textured))
+        ;               // one vertex per particle, expanded to a square facing the camera
+    else if (asSquare && buffered && drawSquaresBuffered(buffers, ps, squareSize))
+        ;
+    else if (asPoint)     // rendering as point
+    {
+        kernel = vertexKernelFor(vertexFeatures(ps, order, 0));
+        glBegin(GL_POINTS);
+        for (first = 0; first < count; first += IMMEDIATE_CHUNK)
+        {
+            // draw particles, a chunk at a time from the loop for the case
+            n = count - first < IMMEDIATE_CHUNK ? count - first : IMMEDIATE_CHUNK;
+            kernel(vertex, color, ps, order, first, n, 0);
+            for (i = 0; i < n; i++)
+            {
+                glColor4ubv(color + 4 * i);
+                glVertex3fv(vertex + 3 * i);
+            }
+        }
+        glEnd();
+    }
+    else if (asSquare)    // rendering as billboarded sprite
+    {
+        kernel = vertexKernelFor(vertexFeatures(ps, order, 1));
+        glBegin(GL_QUADS);
+        for (first = 0; first < count; first += IMMEDIATE_CHUNK)
+        {
+            // draw particles, their corners left top, left bottom, right bottom, right top
+            n = count - first < IMMEDIATE_CHUNK ? count - first : IMMEDIATE_CHUNK;
+            kernel(vertex, color, ps, order, first, n, squareSize);
+            for (i = 0; i < 4 * n; i++)
+            {
+                glColor4ubv(color + 4 * i);
+                glVertex3fv(vertex + 3 * i);
+            }
+        }
+        glEnd();
+    }
+
+    else if (asSphere && buffered &&
+             drawSpheresInstanced(buffers, ps, SPHERE_RADIUS, settings->slicesStacks, settings->textured))
+        ;               // one instanced draw call for all the spheres
+    else if (asSphere)    // rendering as sphere
+    {
+        if (settings->textured)     // enable or disable the texture function
+        {
+            // set texture environment parameters specifies how texture values are interpreted when a fragment is textured
+            glTexEnvf(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_DECAL);
+            glEnable(GL_TEXTURE_2D);
+        }
+        kernel = vertexKernelFor(vertexFeatures(ps, order, 0));
+        for (first = 0; first < count; first += IMMEDIATE_CHUNK)
+        {
+            n = count - first < IMMEDIATE_CHUNK ? count - first : IMMEDIATE_CHUNK;
+            kernel(vertex, color, ps, order, first, n, 0);
+            for (i = 0; i < n; i++)
+            {
+                glPushMatrix();
+                // put the drawn particles in correct position
+                glTranslatef (vertex[3 * i], vertex[3 * i + 1], vertex[3 * i + 2]);
+                glColor4ubv(color + 4 * i);
+
+                // draw particles, a wire sphere as glutWireSphere drew it
+                gluSphere(draw->quadric, SPHERE_RADIUS, settings->slicesStacks, settings->slicesStacks);
+                glPopMatrix();
+            }
+        }
+        glDisable(GL_TEXTURE_2D);
+    }
+}
+
+// the particles the GPU simulates, straight from its buffer: unsorted and
+// all of them, as only the GPU knows where they are, and spheres as sprites
+// without instancing
+static void drawResident(struct worldDraw *draw, const struct particleSystem *ps, const struct drawSettings *settings)
+{
+    struct particleBuffers *buffers = draw->buffers;
+
+    if (buffers == NULL)
+        return;
+    setDrawOrder(buffers, NULL, ps->numberParticles);
+    setResident(buffers, gpuSimulationBuffer(ps->device), ps->blend);
+    if (settings->point)
+        drawPointsBuffered(buffers, ps);
+    else if (settings->square)
+        drawSprites(buffers, ps, settings->squareSize, settings->textured);
+    else if (!drawSpheresInstanced(buffers, ps, SPHERE_RADIUS, settings->slicesStacks, settings->textured))
+        drawSprites(buffers, ps, SPHERE_RADIUS, settings->textured);
+    setResident(buffers, 0, 1);
+}
+
+void drawWorld(struct worldDraw *draw, const struct particleSystem *ps, const struct drawSettings *settings)
+{
+    const uint32_t *order, *near, *far;
+    int nearCount, farCount;
+
+    // Enable the z buffer
+    glDepthMask(GL_TRUE);
+
+    if (ps->scene != NULL)
+        drawColliders(ps->scene);
+    else
+        drawGrounds();
+
+    if (ps->device != NULL)
+    {
+        drawResident(draw, ps, settings);
+        return;
+    }
+
+    // blending is only right when the nearer particles are drawn later
+    order = settings->sorted ? drawOrder(draw, ps) : NULL;
+
+    // only what can be seen, the far part as points: those are drawn first,
+    // all of them being behind the near ones when sorted (see cullParticles())
+    if (settings->culled && cullView(draw, ps, order, settings))
+    {
+        far = cullFar(draw->particleCull, &farCount);
+        near = cullNear(draw->particleCull, &nearCount);
+        drawParticles(draw, ps, far, farCount, 1, 0, 0, settings);
+        drawParticles(draw, ps, near, nearCount, settings->point, settings->square, settings->sphere, settings);
+    }
+    else
+        drawParticles(draw, ps, order, ps->numberParticles, settings->point, settings->square, settings->sphere,
+                      settings);
+}
+
+void scaleDetail(struct drawSettings *settings, float detail)
+{
+    settings->slicesStacks = 2 + (int) ((settings->slicesStacks - 2) * detail + 0.5f);
+    settings->squareSize *= detail;
+    settings->lodDistance *= detail;
+}
+
+/* end of draw.c */
@@ -0,0 +1,59 @@
+//
+//  draw.h
+//
+//
+//  Created by BOWEN LI
+//
+//  One frame of the world: the grounds of the waterfall or the colliders of a
+//  scene, then the particles, sorted and culled as the settings ask. The
+//  viewer and the headless renderer both draw through it, so it needs OpenGL
+//  and GLU but not GLUT or a window.
+//
+
+#ifndef DRAW_H
+#define DRAW_H
+
+#ifdef MACOSX
+#include <OpenGL/gl.h>
+#else
+#include <GL/gl.h>
+#endif
+
+#include "particles.h"
+#include "profile.h"
+
+#define SPHERE_RADIUS 0.05                      // radius of the particles rendered as sphere
+#define LOD_DISTANCE 25.0                       // depth beyond which particles are only points
+
+struct drawSettings
+{
+    int point, square, sphere;                  // the shape, one of them set
+    GLfloat squareSize;                         // half the side of a square
+    int slicesStacks;                           // of a sphere
+    int textured;                               // the texture on squares and spheres
+    int buffered;                               // from vertex buffers, spheres instanced
+    int sorted;                                 // back to front
+    int culled;                                 // only what can be seen, far ones as points
+    float lodDistance;
+};
+
+struct worldDraw;
+
+// needs the GL context current; binds the texture and creates the vertex
+// buffers, falling back to immediate mode when they cannot be. The sort,
+// cull and upload times go to profile, which may be NULL.
+struct worldDraw *worldDrawCreate(struct profile *profile);
+void worldDrawDestroy(struct worldDraw *draw);
+
+// draw ps under the current projection and modelview matrices; the depth
+// buffer is written, nothing is cleared. Particles on the GPU (see gpusim.h)
+// are drawn from its buffer, neither sorted nor culled.
+void drawWorld(struct worldDraw *draw, const struct particleSystem *ps, const struct drawSettings *settings);
+
+// less detail than the settings ask, a fraction of it: the spheres' slices
+// and stacks down towards 2, the squares smaller and the far ones nearer
+void scaleDetail(struct drawSettings *settings, float detail);
+
+#endif
+
+/* end of draw.h */
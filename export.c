@@ -0,0 +1,542 @@
+//
+//  export.c
+//
+//
+//  Created by BOWEN LI
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "export.h"
+#include "pool.h"
+#include "profile.h"
+#include "stream.h"
+
+#define FILE_MAGIC "PTRAJECT"
+#define FRAME_MAGIC 0x52465450u                 // "PTFR" in the file
+#define BUFFERS 2                               // one to gather into while the other is written
+#define MAX_QUANTISED 1073741824.0f             // 2^30, so differences stay in 32 bits
+#define MAX_VARINT 5                            // bytes of a 32 bit varint
+#define GATHER_CHUNK 65536                      // fewest particles worth a task of their own
+
+struct fileHeader
+{
+    char magic[8];                              // FILE_MAGIC, without its '\0'
+    uint32_t version;                           // EXPORT_VERSION
+    uint32_t encoding;                          // EXPORT_RAW or EXPORT_DELTA
+    float quantum;
+    uint32_t every;                             // steps from one frame to the next
+    uint32_t stride;                            // particles from one exported to the next
+    uint32_t frames;                            // 0 until the exporter closed the file
+    uint8_t reserved[32];
+};
+
+struct frameHeader
+{
+    uint32_t magic;                             // FRAME_MAGIC
+    uint32_t flags;                             // EXPORT_KEY_FRAME
+    uint64_t step;
+    uint32_t numberParticles;
+    uint32_t payload;                           // bytes after this header
+    uint8_t reserved[8];
+};
+
+typedef char fileHeaderSize[sizeof(struct fileHeader) == 64 ? 1 : -1];
+typedef char frameHeaderSize[sizeof(struct frameHeader) == 32 ? 1 : -1];
+
+// what the frame loop hands the thread: this, then x, y, z and the colours
+struct gathered
+{
+    uint64_t step;
+    uint32_t numberParticles;
+    uint32_t unused;
+};
+
+// the particles being gathered, in chunks of GATHER_CHUNK
+struct gatherTask
+{
+    const struct particleSystem *ps;
+    int numberParticles, stride;
+    float *x, *y, *z;
+    uint8_t (*color)[4];
+};
+
+// the frame before, which a delta encoding is the difference from
+struct trajectory
+{
+    int32_t *quantised[3];                      // x, y and z in quanta
+    uint8_t (*color)[4];
+    int numberParticles;
+    int capacity;
+};
+
+struct exporter
+{
+    struct fileStream *stream;
+    struct fileHeader header;
+    uint64_t frames, particles;
+    double opened;
+
+    // the thread's alone until the stream is closed
+    struct trajectory before;
+    uint8_t *encoded;
+    size_t encodedCapacity;
+    uint64_t written;                           // frames
+    uint64_t bytes;
+    double busy;
+};
+
+struct exportReader
+{
+    FILE *file;
+    struct fileHeader header;
+    struct trajectory before;
+    uint8_t *payload;
+    size_t payloadCapacity;
+    float *x, *y, *z;
+    uint8_t (*color)[4];
+    int capacity;
+};
+
+static int littleEndian(void)
+{
+    const uint32_t one = 1;
+    return *(const uint8_t *) &one == 1;
+}
+
+// room for n particles; what is new is 0 and black
+static int reserveTrajectory(struct trajectory *t, int n)
+{
+    int axis;
+
+    if (n <= t->capacity)
+        return 1;
+    for (axis = 0; axis < 3; axis++)
+    {
+        int32_t *grown = realloc(t->quantised[axis], n * sizeof(int32_t));
+        if (grown == NULL)
+            return 0;
+        t->quantised[axis] = grown;
+    }
+    {
+        uint8_t (*grown)[4] = realloc(t->color, n * sizeof(*t->color));
+        if (grown == NULL)
+            return 0;
+        t->color = grown;
+    }
+    t->capacity = n;
+    return 1;
+}
+
+// the frame after t has n particles; those t lacks start at 0 and black
+static int beginFrame(struct trajectory *t, int n, int keyFrame)
+{
+    int axis;
+
+    if (!reserveTrajectory(t, n))
+        return 0;
+    if (keyFrame)
+        t->numberParticles = 0;
+    if (n > t->numberParticles)
+    {
+        for (axis = 0; axis < 3; axis++)
+            memset(t->quantised[axis] + t->numberParticles, 0, (n - t->numberParticles) * sizeof(int32_t));
+        memset(t->color + t->numberParticles, 0, (n - t->numberParticles) * sizeof(*t->color));
+    }
+    t->numberParticles = n;
+    return 1;
+}
+
+static void freeTrajectory(struct trajectory *t)
+{
+    int axis;
+
+    for (axis = 0; axis < 3; axis++)
+        free(t->quantised[axis]);
+    free(t->color);
+}
+
+static uint8_t *putVarint(uint8_t *at, uint32_t value)
+{
+    while (value >= 0x80)
+    {
+        *at++ = (uint8_t) (value | 0x80);
+        value >>= 7;
+    }
+    *at++ = (uint8_t) value;
+    return at;
+}
+
+// the varint at *at, before end, moving *at past it; 0 when it runs off
+static int getVarint(const uint8_t **at, const uint8_t *end, uint32_t *value)
+{
+    uint32_t result = 0;
+    int shift;
+
+    for (shift = 0; shift < 7 * MAX_VARINT && *at < end; shift += 7)
+    {
+        uint8_t byte = *(*at)++;
+        result |= (uint32_t) (byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+        {
+            *value = result;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int32_t quantise(float p, float quantum)
+{
+    float q = p / quantum;
+
+    if (!(q > -MAX_QUANTISED))                  // NaN too
+        q = -MAX_QUANTISED;
+    if (q > MAX_QUANTISED)
+        q = MAX_QUANTISED;
+    return (int32_t) lrintf(q);
+}
+
+// a gathered frame as differences from exporter->before, which it becomes;
+// returns the bytes encoded
+static size_t encodeDelta(struct exporter *exporter, const struct gathered *frame)
+{
+    int n = frame->numberParticles, axis, i, same;
+    const float *p = (const float *) (frame + 1);
+    const uint8_t (*color)[4] = (const uint8_t (*)[4]) (p + 3 * (size_t) n);
+    float quantum = exporter->header.quantum;
+    uint8_t *at = exporter->encoded;
+    struct trajectory *before = &exporter->before;
+
+    for (axis = 0; axis < 3; axis++, p += n)
+    {
+        int32_t *q = before->quantised[axis];
+
+        for (i = 0; i < n; i++)
+        {
+            int32_t now = quantise(p[i], quantum);
+            int32_t d = (int32_t) ((uint32_t) now - (uint32_t) q[i]);
+
+            at = putVarint(at, ((uint32_t) d << 1) ^ (uint32_t) (d >> 31));
+            q[i] = now;
+        }
+    }
+    for (i = 0, same = 0; i < n; i++)
+    {
+        if (memcmp(color[i], before->color[i], 4) == 0)
+        {
+            same++;
+            continue;
+        }
+        at = putVarint(at, same);
+        memcpy(at, color[i], 4);
+        memcpy(before->color[i], color[i], 4);
+        at += 4;
+        same = 0;
+    }
+    at = putVarint(at, same);
+    return at - exporter->encoded;
+}
+
+// the stream's writer: encode a gathered frame and write it
+static int writeFrame(void *context, FILE *file, const char *data, size_t bytes)
+{
+    struct exporter *exporter = context;
+    const struct gathered *frame = (const struct gathered *) data;
+    struct frameHeader header;
+    const void *payload = frame + 1;
+    double begin = profileNow();
+    int done;
+
+    memset(&header, 0, sizeof(header));
+    header.magic = FRAME_MAGIC;
+    header.flags = exporter->written % EXPORT_KEY_FRAMES == 0 ? EXPORT_KEY_FRAME : 0;
+    header.step = frame->step;
+    header.numberParticles = frame->numberParticles;
+    header.payload = bytes - sizeof(struct gathered);
+
+    if (exporter->header.encoding == EXPORT_DELTA)
+    {
+        size_t worst = (size_t) frame->numberParticles * (4 * MAX_VARINT + 4) + MAX_VARINT;
+
+        if (worst > exporter->encodedCapacity)
+        {
+            free(exporter->encoded);
+            exporter->encodedCapacity = 0;
+            exporter->encoded = malloc(worst);
+            if (exporter->encoded == NULL)
+                return 0;
+            exporter->encodedCapacity = worst;
+        }
+        if (!beginFrame(&exporter->before, frame->numberParticles, header.flags & EXPORT_KEY_FRAME))
+            return 0;
+        header.payload = encodeDelta(exporter, frame);
+        payload = exporter->encoded;
+    }
+
+    done = fwrite(&header, sizeof(header), 1, file) == 1 && fwrite(payload, 1, header.payload, file) == header.payload;
+    exporter->written++;
+    exporter->bytes += sizeof(header) + header.payload;
+    exporter->busy += profileNow() - begin;
+    return done;
+}
+
+struct exporter *exporterCreate(const char *path, int encoding, float quantum, int every, int stride)
+{
+    struct exporter *exporter;
+
+    if (!littleEndian() || (encoding != EXPORT_RAW && encoding != EXPORT_DELTA) || !(quantum > 0))
+        return NULL;
+    exporter = calloc(1, sizeof(struct exporter));
+    if (exporter == NULL)
+        return NULL;
+    memcpy(exporter->header.magic, FILE_MAGIC, sizeof(exporter->header.magic));
+    exporter->header.version = EXPORT_VERSION;
+    exporter->header.encoding = encoding;
+    exporter->header.quantum = quantum;
+    exporter->header.every = every < 1 ? 1 : every;
+    exporter->header.stride = stride < 1 ? 1 : stride;
+    exporter->bytes = sizeof(struct fileHeader);
+    exporter->opened = profileNow();
+
+    exporter->stream = streamOpen(path, &exporter->header, sizeof(exporter->header), BUFFERS, writeFrame, exporter);
+    if (exporter->stream == NULL)
+    {
+        free(exporter);
+        return NULL;
+    }
+    return exporter;
+}
+
+// every stride'th particle of a chunk of them, its colour in bytes
+static void gatherChunk(void *context, int chunk)
+{
+    const struct gatherTask *task = context;
+    const struct particleSystem *ps = task->ps;
+    int begin = chunk * GATHER_CHUNK, end = begin + GATHER_CHUNK, stride = task->stride, i, j;
+
+    if (end > task->numberParticles)
+        end = task->numberParticles;
+    for (i = begin, j = begin * stride; i < end; i++, j += stride)
+    {
+        task->x[i] = ps->positionX[j];
+        task->y[i] = ps->positionY[j];
+        task->z[i] = ps->positionZ[j];
+        memcpy(task->color[i], ps->colorList[j], sizeof(task->color[i]));
+    }
+}
+
+int exportFrame(struct exporter *exporter, const struct particleSystem *ps)
+{
+    int stride = exporter->header.stride;
+    int n = (ps->numberParticles + stride - 1) / stride, chunks, chunk;
+    size_t bytes = sizeof(struct gathered) + (size_t) n * (3 * sizeof(float) + 4);
+    struct gathered *frame;
+    struct gatherTask task;
+
+    if (ps->step % exporter->header.every != 0)
+        return 1;
+
+    frame = (struct gathered *) streamBuffer(exporter->stream, bytes);
+    if (frame == NULL)
+        return 0;
+    frame->step = ps->step;
+    frame->numberParticles = n;
+    frame->unused = 0;
+    task.ps = ps;
+    task.numberParticles = n;
+    task.stride = stride;
+    task.x = (float *) (frame + 1);
+    task.y = task.x + n;
+    task.z = task.y + n;
+    task.color = (uint8_t (*)[4]) (task.z + n);
+    chunks = (n + GATHER_CHUNK - 1) / GATHER_CHUNK;
+    if (ps->pool != NULL && chunks > 1)
+        poolRun(ps->pool, chunks, gatherChunk, &task);
+    else
+    {
+        for (chunk = 0; chunk < chunks; chunk++)
+            gatherChunk(&task, chunk);
+    }
+    streamQueue(exporter->stream, bytes);
+
+    exporter->frames++;
+    exporter->particles += n;
+    return 1;
+}
+
+int exporterClose(struct exporter *exporter, struct exportStats *stats)
+{
+    double waited;
+    int done;
+
+    if (exporter == NULL)
+        return 1;
+
+    // the frame count tells a whole file from one whose exporter never finished
+    waited = streamWaited(exporter->stream);
+    exporter->header.frames = exporter->frames;
+    done = streamClose(exporter->stream, &exporter->header, sizeof(exporter->header));
+    if (stats != NULL)
+    {
+        stats->frames = exporter->frames;
+        stats->particles = exporter->particles;
+        stats->bytes = exporter->bytes;
+        stats->seconds = profileNow() - exporter->opened;
+        stats->busy = exporter->busy;
+        stats->waited = waited;
+    }
+    freeTrajectory(&exporter->before);
+    free(exporter->encoded);
+    free(exporter);
+    return done;
+}
+
+struct exportReader *exportReaderOpen(const char *path)
+{
+    struct exportReader *reader;
+
+    if (!littleEndian())
+        return NULL;
+    reader = calloc(1, sizeof(struct exportReader));
+    if (reader == NULL)
+        return NULL;
+    reader->file = fopen(path, "rb");
+    if (reader->file == NULL || fread(&reader->header, sizeof(reader->header), 1, reader->file) != 1 ||
+        memcmp(reader->header.magic, FILE_MAGIC, sizeof(reader->header.magic)) != 0 ||
+        reader->header.version != EXPORT_VERSION ||
+        (reader->header.encoding != EXPORT_RAW && reader->header.encoding != EXPORT_DELTA) ||
+        !(reader->header.quantum > 0))
+    {
+        exportReaderClose(reader);
+        return NULL;
+    }
+    return reader;
+}
+
+void exportReaderClose(struct exportReader *reader)
+{
+    if (reader == NULL)
+        return;
+    if (reader->file != NULL)
+        fclose(reader->file);
+    freeTrajectory(&reader->before);
+    free(reader->payload);
+    free(reader->x);
+    free(reader->y);
+    free(reader->z);
+    free(reader->color);
+    free(reader);
+}
+
+// the reader's arrays with room for n particles
+static int reserveFrame(struct exportReader *reader, int n)
+{
+    float **axes[3] = {&reader->x, &reader->y, &reader->z};
+    int axis;
+
+    if (n <= reader->capacity)
+        return 1;
+    for (axis = 0; axis < 3; axis++)
+    {
+        float *grown = realloc(*axes[axis], n * sizeof(float));
+        if (grown == NULL)
+            return 0;
+        *axes[axis] = grown;
+    }
+    {
+        uint8_t (*grown)[4] = realloc(reader->color, n * sizeof(*reader->color));
+        if (grown == NULL)
+            return 0;
+        reader->color = grown;
+    }
+    reader->capacity = n;
+    return 1;
+}
+
+// undo encodeDelta() into the reader's arrays
+static int decodeDelta(struct exportReader *reader, int n, size_t bytes)
+{
+    const uint8_t *at = reader->payload, *end = at + bytes;
+    float *axes[3] = {reader->x, reader->y, reader->z};
+    float quantum = reader->header.quantum;
+    struct trajectory *before = &reader->before;
+    uint32_t zigzag, same;
+    int axis, i;
+
+    for (axis = 0; axis < 3; axis++)
+    {
+        int32_t *q = before->quantised[axis];
+
+        for (i = 0; i < n; i++)
+        {
+            if (!getVarint(&at, end, &zigzag))
+                return 0;
+            q[i] = (int32_t) ((uint32_t) q[i] + ((zigzag >> 1) ^ (0u - (zigzag & 1))));
+            axes[axis][i] = q[i] * quantum;
+        }
+    }
+    for (i = 0;; i++)
+    {
+        if (!getVarint(&at, end, &same) || same > (uint32_t) (n - i))
+            return 0;
+        i += same;
+        if (i == n)
+            break;
+        if (end - at < 4)
+            return 0;
+        memcpy(before->color[i], at, 4);
+        at += 4;
+    }
+    memcpy(reader->color, before->color, n * sizeof(*reader->color));
+    return at == end;
+}
+
+int exportRead(struct exportReader *reader, struct exportedFrame *frame)
+{
+    struct frameHeader header;
+    int n;
+
+    if (fread(&header, sizeof(header), 1, reader->file) != 1 || header.magic != FRAME_MAGIC ||
+        header.numberParticles > (uint32_t) (INT32_MAX / (4 * MAX_VARINT + 4)))
+        return 0;
+    n = header.numberParticles;
+    if (reader->header.encoding == EXPORT_RAW ? header.payload != (size_t) n * (3 * sizeof(float) + 4)
+                                              : header.payload > (size_t) n * (4 * MAX_VARINT + 4) + MAX_VARINT)
+        return 0;
+    if (header.payload > reader->payloadCapacity)
+    {
+        free(reader->payload);
+        reader->payloadCapacity = 0;
+        reader->payload = malloc(header.payload);
+        if (reader->payload == NULL)
+            return 0;
+        reader->payloadCapacity = header.payload;
+    }
+    if (fread(reader->payload, 1, header.payload, reader->file) != header.payload || !reserveFrame(reader, n))
+        return 0;
+
+    if (reader->header.encoding == EXPORT_RAW)
+    {
+        memcpy(reader->x, reader->payload, n * sizeof(float));
+        memcpy(reader->y, reader->payload + n * sizeof(float), n * sizeof(float));
+        memcpy(reader->z, reader->payload + 2 * n * sizeof(float), n * sizeof(float));
+        memcpy(reader->color, reader->payload + 3 * n * sizeof(float), n * sizeof(*reader->color));
+    }
+    else if (!beginFrame(&reader->before, n, header.flags & EXPORT_KEY_FRAME) ||
+             !decodeDelta(reader, n, header.payload))
+        return 0;
+
+    frame->step = header.step;
+    frame->numberParticles = n;
+    frame->flags = header.flags;
+    frame->x = reader->x;
+    frame->y = reader->y;
+    frame->z = reader->z;
+    frame->color = reader->color;
+    return 1;
+}
+
+/* end of export.c */
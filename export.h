@@ -0,0 +1,98 @@
+//
+//  export.h
+//
+//
+//  Created by BOWEN LI
+//
+//  The particles' trajectories streamed to a file for tools outside the
+//  viewer: where every particle is and its colour, frame after frame. Every
+//  k-th step can be exported, and every s-th particle of it. The frame loop
+//  only gathers the particles into one of two buffers; the stream's thread
+//  encodes and writes them, so the simulation waits only when the disk falls
+//  two frames behind.
+//
+//  The format is little endian throughout:
+//
+//      file header     64 bytes: "PTRAJECT", version, encoding, quantum,
+//                      every, stride, frames
+//      frame header    32 bytes: "PTFR", flags, step, particles, payload bytes
+//      payload
+//      frame header    ...
+//
+//  A raw payload is x, y and z of the particles as floats, then their colours
+//  as RGBA bytes. A delta payload quantises every coordinate to a multiple of
+//  quantum and keeps, for x, then y, then z, each particle's difference from
+//  the same particle in the frame before as a zigzag varint. The colours
+//  follow as runs: a varint count of particles whose colour is the same as
+//  before, then one RGBA colour that is not, ..., closed by the count of the
+//  last unchanged ones. Particles the frame before did not have were at 0
+//  and black, and so is everything in a key frame, one every EXPORT_KEY_FRAMES
+//  frames, which is where a reader can start.
+//
+
+#ifndef EXPORT_H
+#define EXPORT_H
+
+#include <stdint.h>
+#include "particles.h"
+
+#define EXPORT_VERSION 1
+
+#define EXPORT_RAW 0                            // floats and bytes as they are
+#define EXPORT_DELTA 1                          // quantised differences from the frame before
+
+#define EXPORT_QUANTUM (1.0f / 1024)            // of a delta encoding, in world units
+#define EXPORT_KEY_FRAMES 64                    // frames from one key frame to the next
+#define EXPORT_KEY_FRAME 1                      // flag of a frame that stands alone
+
+struct exporter;
+struct exportReader;
+
+// how an export went, from opening to closing
+struct exportStats
+{
+    uint64_t frames;
+    uint64_t particles;                         // summed over the frames
+    uint64_t bytes;                             // in the file
+    double seconds;                             // from opening to closing
+    double busy;                                // seconds the thread encoded and wrote
+    double waited;                              // seconds the frame loop waited for a buffer
+};
+
+// a frame read back, its arrays the reader's until the next frame
+struct exportedFrame
+{
+    uint64_t step;
+    int numberParticles;
+    uint32_t flags;
+    float *x, *y, *z;
+    uint8_t (*color)[4];
+};
+
+// start a file at path, truncating it, to export every step'th step and every
+// stride'th particle in the encoding; quantum is that of EXPORT_DELTA. NULL
+// when it cannot be written or the thread cannot start.
+struct exporter *exporterCreate(const char *path, int encoding, float quantum, int every, int stride);
+
+// export ps when its step is a multiple of every; called after each step,
+// that is every every'th of them. The particles are gathered before it returns; where they are, not
+// where they are drawn between two steps. Returns 0 when the frame cannot be
+// written, or an earlier one failed.
+int exportFrame(struct exporter *exporter, const struct particleSystem *ps);
+
+// wait for the queued frames and close the file, filling in stats when it is
+// not NULL; returns 0 when any write failed
+int exporterClose(struct exporter *exporter, struct exportStats *stats);
+
+// open an export to read back from the start; NULL when it is not one of
+// this version
+struct exportReader *exportReaderOpen(const char *path);
+void exportReaderClose(struct exportReader *reader);
+
+// the next frame into frame; returns 0 at the end of the file, or when the
+// frame is cut short or damaged
+int exportRead(struct exportReader *reader, struct exportedFrame *frame);
+
+#endif
+
+/* end of export.h */
@@ -5,33 +5,37 @@
 //  Created by BOWEN LI on 04/12/2017.
 //
 
-#include <sys/time.h>
 #include <stdio.h>
+#include "profile.h"
 
-struct timeval frameStartTime, frameEndTime;
+#define LINE_PIXELS 14                          // from one line of the overlay to the next
 
-void frameStart(void) {
-    gettimeofday(&frameStartTime, NULL);
-}
-
-void frameEnd(void *font, GLclampf r, GLclampf g, GLclampf b,
-              GLfloat x, GLfloat y) {
-    /* font: font to use, e.g., GLUT_BITMAP_HELVETICA_10
+// the stages of the frame, each with the times (ms) 50, 95 and 99 percent of
+// the recent frames stay within
+void drawFrameTimes(const struct profile *profile, int numberParticles, void *font,
+                    GLclampf r, GLclampf g, GLclampf b, GLfloat x, GLfloat y) {
+    /* font: font to use, fixed width to keep the columns, e.g., GLUT_BITMAP_8_BY_13
      r, g, b: text colour
-     x, y: text position in window: range [0,0] (bottom left of window)
+     x, y: position of the first line in window: range [0,0] (bottom left of window)
      to [1,1] (top right of window). */
     
-    float elapsedTime;
-    char str[30];
+    char str[NUMBER_STAGES + 2][64];
     char *ch;
     GLint matrixMode;
     GLboolean lightingOn;
+    GLfloat line = (GLfloat) LINE_PIXELS / glutGet(GLUT_WINDOW_HEIGHT);
+    double frame = profilePercentile(profile, PROFILE_FRAME, 0.5);
+    int stage, i;
     
-    gettimeofday(&frameEndTime, NULL);
-    
-    elapsedTime= frameEndTime.tv_sec - frameStartTime.tv_sec +
-    ((frameEndTime.tv_usec - frameStartTime.tv_usec)/1.0E6);
-    sprintf(str, "Frames per second: %2.0f", 1.0/elapsedTime);
+    sprintf(str[0], "%4.0f fps  %d particles", frame > 0 ? 1.0 / frame : 0.0, numberParticles);
+    sprintf(str[1], "%-8s%8s%8s%8s", "ms", "p50", "p95", "p99");
+    for (stage = 0; stage < NUMBER_STAGES; stage++)
+    {
+        sprintf(str[stage + 2], "%-8s%8.2f%8.2f%8.2f", stageName(stage),
+                profilePercentile(profile, stage, 0.50) * 1.0E3,
+                profilePercentile(profile, stage, 0.95) * 1.0E3,
+                profilePercentile(profile, stage, 0.99) * 1.0E3);
+    }
     
     lightingOn= glIsEnabled(GL_LIGHTING);        /* lighting on? */
     if (lightingOn) glDisable(GL_LIGHTING);
@@ -47,9 +51,11 @@ void frameEnd(void *font, GLclampf r, GLclampf g, GLclampf b,
     glLoadIdentity();
     glPushAttrib(GL_COLOR_BUFFER_BIT);       /* save current colour */
     glColor3f(r, g, b);
-    glRasterPos3f(x, y, 0.0);
-    for(ch= str; *ch; ch++) {
-        glutBitmapCharacter(font, (int)*ch);
+    for (i = 0; i < NUMBER_STAGES + 2; i++) {
+        glRasterPos3f(x, y - i * line, 0.0);
+        for(ch= str[i]; *ch; ch++) {
+            glutBitmapCharacter(font, (int)*ch);
+        }
     }
     glPopAttrib();
     glPopMatrix();
@@ -0,0 +1,415 @@
+//
+//  gpusim.c
+//
+//
+//  Created by BOWEN LI
+//
+
+#define GL_GLEXT_PROTOTYPES
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "gpusim.h"
+#include "rng.h"
+
+#ifndef MACOSX
+#include <GL/glext.h>
+#endif
+
+#define STAGING 16384                           // particles interleaved or read back at once
+
+#ifdef GL_VERSION_3_1
+#define HAVE_TRANSFORM_FEEDBACK 1
+
+// the inputs in the order of their attribute indices, and the outputs in the
+// order of the layout in gpusim.h
+static const char *const inputs[] = { "position", "time", "velocityXZ", "velocityY", "direction", "down", "color" };
+static const char *const outputs[] = { "nextPosition", "nextPrevious", "nextTime", "nextVelocityXZ",
+                                       "nextVelocityY", "nextDirection", "nextDown", "nextColor" };
+#define NUMBER_INPUTS 7
+#define NUMBER_OUTPUTS 8
+
+// updateScalar() and, for a particle leaving EDGE or outliving the lifetime,
+// emitRange() with the stream of the particle's index
+static const char *updateShader =
+    "#version 130\n"
+    "uniform float gravity;\n"
+    "uniform float meanVelocity;\n"
+    "uniform float lifetime;\n"
+    "uniform uint respawnBase;\n"               // rngBase() of this step's respawns
+    "uniform vec2 tilt;\n"                      // sine and cosine of 65 degrees, as the CPU has them
+    "in vec3 position;\n"
+    "in float time;\n"
+    "in float velocityXZ;\n"
+    "in float velocityY;\n"
+    "in vec2 direction;\n"
+    "in float down;\n"
+    "in uint color;\n"
+    "out vec3 nextPosition;\n"
+    "out vec3 nextPrevious;\n"
+    "out float nextTime;\n"
+    "out float nextVelocityXZ;\n"
+    "out float nextVelocityY;\n"
+    "out vec2 nextDirection;\n"
+    "out float nextDown;\n"
+    "flat out uint nextColor;\n"
+    "const float dt = 0.025;\n"
+    "const float degree = 0.0174532922;\n"
+    "uint rngHash(uint x)\n"
+    "{\n"
+    "    x ^= x >> 16;\n"
+    "    x *= 0x7feb352du;\n"
+    "    x ^= x >> 15;\n"
+    "    x *= 0x846ca68bu;\n"
+    "    x ^= x >> 16;\n"
+    "    return x;\n"
+    "}\n"
+    "float rngUniform(uint key, uint draw)\n"
+    "{\n"
+    "    return float(int(rngHash(key + draw * 0x9e3779b9u) >> 8)) * (1.0 / 16777216.0);\n"
+    "}\n"
+    "float smallSin(float x)\n"
+    "{\n"
+    "    float x2 = x * x;\n"
+    "    return x * (1.0 - x2 * (1.0 / 6.0) * (1.0 - x2 * (1.0 / 20.0) * (1.0 - x2 * (1.0 / 42.0))));\n"
+    "}\n"
+    "float smallCos(float x)\n"
+    "{\n"
+    "    float x2 = x * x;\n"
+    "    return 1.0 - x2 * 0.5 * (1.0 - x2 * (1.0 / 12.0) * (1.0 - x2 * (1.0 / 30.0) * (1.0 - x2 * (1.0 / 56.0))));\n"
+    "}\n"
+    "float range(float low, float high, uint key, uint draw)\n"
+    "{\n"
+    "    return low + (high - low) * rngUniform(key, draw);\n"
+    "}\n"
+    "uint channel(float low, float high, uint key, uint draw)\n"
+    "{\n"
+    "    return uint(range(low, high, key, draw) * 255.0 + 0.5);\n"
+    "}\n"
+    "void respawn()\n"
+    "{\n"
+    "    uint key = rngHash(respawnBase ^ uint(gl_VertexID));\n"
+    "    float angle = range(-5.0, 5.0, key, 1u) * degree;\n"
+    "    float turn = range(-15.0, 15.0, key, 2u) * degree;\n"
+    "    float velocity = meanVelocity + range(-1.0, 1.0, key, 3u);\n"
+    "    float sinAngle = smallSin(angle), cosAngle = smallCos(angle);\n"
+    "    nextPosition = vec3(0.0, range(8.0, 10.0, key, 0u), 0.0);\n"
+    "    nextPrevious = nextPosition;\n"
+    "    nextTime = 0.0;\n"
+    "    nextDirection = vec2(smallCos(turn), smallSin(turn));\n"
+    "    nextVelocityXZ = velocity * (tilt.y * cosAngle - tilt.x * sinAngle);\n"
+    "    nextVelocityY = velocity * (tilt.x * cosAngle + tilt.y * sinAngle);\n"
+    "    nextDown = 1.0;\n"
+    "    nextColor = channel(0.1, 1.0, key, 4u) | channel(0.1, 1.0, key, 5u) << 8 |\n"
+    "                channel(0.1, 1.0, key, 6u) << 16 | channel(0.7, 1.0, key, 7u) << 24;\n"
+    "}\n"
+    "void main()\n"
+    "{\n"
+    "    float gdt = gravity * dt;\n"
+    "    float hgdt = 0.5 * gdt;\n"
+    "    float hgdt2 = hgdt * dt;\n"
+    "    float distance = velocityXZ * time;\n"
+    "    float y = position.y;\n"
+    "    float vy = velocityY;\n"
+    "    bool isDown = down != 0.0;\n"
+    "    bool rising = !isDown && vy > 0.0;\n"
+    "    bool hit;\n"
+    "    y = isDown ? y - (vy + hgdt) * dt : (rising ? y + (vy * dt - hgdt2) : y);\n"
+    "    vy = isDown ? vy + gdt : (rising ? vy - gdt : vy);\n"
+    "    hit = (y <= 5.0 && distance < 3.0) || (y <= 0.0 && distance > 3.0);\n"
+    "    nextPosition = vec3(direction.x * distance, y, direction.y * distance);\n"
+    "    nextPrevious = position;\n"
+    "    nextTime = time + dt;\n"
+    "    nextVelocityXZ = velocityXZ;\n"
+    "    nextVelocityY = hit ? vy * 0.8 : vy;\n"
+    "    nextDirection = direction;\n"
+    "    nextDown = !hit && !rising ? 1.0 : 0.0;\n"
+    "    nextColor = color;\n"
+    "    if ((hit && distance > 10.0) || (lifetime > 0.0 && nextTime > lifetime))\n"
+    "        respawn();\n"
+    "    gl_Position = vec4(0.0);\n"             // nothing is rasterised, but some linkers want it
+    "}\n";
+#endif
+
+struct gpuSimulation
+{
+    struct particleDevice device;               // first, so the device is the simulation
+    GLuint program;
+    GLint gravity, meanVelocity, lifetime, respawnBase, tilt;
+    GLuint state[2];                            // the particles, stepped from one into the other
+    int current;                                // the one the last step wrote
+    int capacity;                               // particles the buffers have room for
+    unsigned char *staging;                     // STAGING particles in the buffers' layout
+};
+
+#ifdef HAVE_TRANSFORM_FEEDBACK
+// whether the context is at least OpenGL major.minor
+static int versionSupported(int major, int minor)
+{
+    const char *version = (const char *) glGetString(GL_VERSION);
+    int contextMajor = 0, contextMinor = 0;
+
+    if (version == NULL || sscanf(version, "%d.%d", &contextMajor, &contextMinor) != 2)
+        return 0;
+    return contextMajor > major || (contextMajor == major && contextMinor >= minor);
+}
+
+// the update program, its outputs captured one after another; 0 when it does
+// not build
+static GLuint linkUpdate(void)
+{
+    GLuint shader = glCreateShader(GL_VERTEX_SHADER), program;
+    GLint status;
+    char log[512];
+    int i;
+
+    glShaderSource(shader, 1, &updateShader, NULL);
+    glCompileShader(shader);
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+    if (!status)
+    {
+        glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+        fprintf(stderr, "cannot compile the update shader: %s\n", log);
+        glDeleteShader(shader);
+        return 0;
+    }
+    program = glCreateProgram();
+    glAttachShader(program, shader);
+    for (i = 0; i < NUMBER_INPUTS; i++)
+        glBindAttribLocation(program, i, inputs[i]);
+    glTransformFeedbackVaryings(program, NUMBER_OUTPUTS, outputs, GL_INTERLEAVED_ATTRIBS);
+    glLinkProgram(program);
+    glDeleteShader(shader);                     // it goes with the program
+    glGetProgramiv(program, GL_LINK_STATUS, &status);
+    if (!status)
+    {
+        glGetProgramInfoLog(program, sizeof(log), NULL, log);
+        fprintf(stderr, "cannot link the update program: %s\n", log);
+        glDeleteProgram(program);
+        return 0;
+    }
+    return program;
+}
+
+// room for capacity particles, the first keep of them kept
+static void reserve(struct gpuSimulation *gpu, int capacity, int keep)
+{
+    GLuint fresh[2];
+    int k;
+
+    if (capacity <= gpu->capacity)
+        return;
+    glGenBuffers(2, fresh);
+    for (k = 0; k < 2; k++)
+    {
+        glBindBuffer(GL_ARRAY_BUFFER, fresh[k]);
+        glBufferData(GL_ARRAY_BUFFER, (GLsizeiptr) capacity * GPU_STRIDE, NULL, GL_DYNAMIC_COPY);
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    if (keep > 0 && gpu->capacity > 0)
+    {
+        glBindBuffer(GL_COPY_READ_BUFFER, gpu->state[gpu->current]);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, fresh[0]);
+        glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, (GLsizeiptr) keep * GPU_STRIDE);
+        glBindBuffer(GL_COPY_READ_BUFFER, 0);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    }
+    if (gpu->capacity > 0)
+        glDeleteBuffers(2, gpu->state);
+    gpu->state[0] = fresh[0];
+    gpu->state[1] = fresh[1];
+    gpu->current = 0;
+    gpu->capacity = capacity;
+}
+
+static void putFloat(unsigned char *to, float value)
+{
+    memcpy(to, &value, sizeof(float));
+}
+
+static float getFloat(const unsigned char *from)
+{
+    float value;
+
+    memcpy(&value, from, sizeof(float));
+    return value;
+}
+
+// the new particles interleaved into the current buffer, a staging block at a time
+static void emitted(struct particleDevice *device, const struct particleSystem *ps, int first, int count)
+{
+    struct gpuSimulation *gpu = (struct gpuSimulation *) device;
+    int begin, i;
+
+    reserve(gpu, ps->capacity, first);
+    glBindBuffer(GL_ARRAY_BUFFER, gpu->state[gpu->current]);
+    for (begin = first; begin < first + count; begin += STAGING)
+    {
+        int end = begin + STAGING < first + count ? begin + STAGING : first + count;
+
+        for (i = begin; i < end; i++)
+        {
+            unsigned char *particle = gpu->staging + (size_t) (i - begin) * GPU_STRIDE;
+
+            putFloat(particle + GPU_POSITION, ps->positionX[i]);
+            putFloat(particle + GPU_POSITION + 4, ps->positionY[i]);
+            putFloat(particle + GPU_POSITION + 8, ps->positionZ[i]);
+            putFloat(particle + GPU_PREVIOUS, ps->previousX[i]);
+            putFloat(particle + GPU_PREVIOUS + 4, ps->previousY[i]);
+            putFloat(particle + GPU_PREVIOUS + 8, ps->previousZ[i]);
+            putFloat(particle + GPU_TIME, ps->particleTime[i]);
+            putFloat(particle + GPU_VELOCITY_XZ, ps->velocityXZ[i]);
+            putFloat(particle + GPU_VELOCITY_Y, ps->velocityY[i]);
+            putFloat(particle + GPU_DIRECTION, ps->directionX[i]);
+            putFloat(particle + GPU_DIRECTION + 4, ps->directionZ[i]);
+            putFloat(particle + GPU_DOWN, particleDown(ps, i));
+            memcpy(particle + GPU_COLOR, ps->colorList[i], sizeof(*ps->colorList));
+        }
+        glBufferSubData(GL_ARRAY_BUFFER, (GLintptr) begin * GPU_STRIDE, (GLsizeiptr) (end - begin) * GPU_STRIDE,
+                        gpu->staging);
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+// one step, from the current buffer into the other
+static void update(struct particleDevice *device, const struct particleSystem *ps)
+{
+    static const GLint sizes[NUMBER_INPUTS] = { 3, 1, 1, 1, 2, 1, 1 };
+    static const size_t offsets[NUMBER_INPUTS] = { GPU_POSITION, GPU_TIME, GPU_VELOCITY_XZ, GPU_VELOCITY_Y,
+                                                   GPU_DIRECTION, GPU_DOWN, GPU_COLOR };
+    struct gpuSimulation *gpu = (struct gpuSimulation *) device;
+    int n = ps->numberParticles, k;
+
+    if (n == 0)
+        return;
+    glUseProgram(gpu->program);
+    glUniform1f(gpu->gravity, ps->gravity);
+    glUniform1f(gpu->meanVelocity, ps->meanVelocity);
+    glUniform1f(gpu->lifetime, ps->lifetime);
+    glUniform1ui(gpu->respawnBase, rngBase(ps->seed, 2 * ps->step + 1));
+    glUniform2f(gpu->tilt, sin(65.0 * (float) (PI / 180.0)), cos(65.0 * (float) (PI / 180.0)));
+
+    glBindBuffer(GL_ARRAY_BUFFER, gpu->state[gpu->current]);
+    for (k = 0; k < NUMBER_INPUTS; k++)
+    {
+        glEnableVertexAttribArray(k);
+        if (offsets[k] == GPU_COLOR)
+            glVertexAttribIPointer(k, 1, GL_UNSIGNED_INT, GPU_STRIDE, (const GLvoid *) offsets[k]);
+        else
+            glVertexAttribPointer(k, sizes[k], GL_FLOAT, GL_FALSE, GPU_STRIDE, (const GLvoid *) offsets[k]);
+    }
+    glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, gpu->state[1 - gpu->current]);
+
+    glEnable(GL_RASTERIZER_DISCARD);
+    glBeginTransformFeedback(GL_POINTS);
+    glDrawArrays(GL_POINTS, 0, n);
+    glEndTransformFeedback();
+    glDisable(GL_RASTERIZER_DISCARD);
+
+    glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, 0);
+    for (k = 0; k < NUMBER_INPUTS; k++)
+        glDisableVertexAttribArray(k);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glUseProgram(0);
+    gpu->current = 1 - gpu->current;
+}
+
+// the current buffer back into the arrays
+static void fetch(struct particleDevice *device, struct particleSystem *ps)
+{
+    struct gpuSimulation *gpu = (struct gpuSimulation *) device;
+    int begin, i;
+
+    if (ps->numberParticles == 0)
+        return;
+    glBindBuffer(GL_ARRAY_BUFFER, gpu->state[gpu->current]);
+    for (begin = 0; begin < ps->numberParticles; begin += STAGING)
+    {
+        int end = begin + STAGING < ps->numberParticles ? begin + STAGING : ps->numberParticles;
+
+        glGetBufferSubData(GL_ARRAY_BUFFER, (GLintptr) begin * GPU_STRIDE, (GLsizeiptr) (end - begin) * GPU_STRIDE,
+                           gpu->staging);
+        for (i = begin; i < end; i++)
+        {
+            const unsigned char *particle = gpu->staging + (size_t) (i - begin) * GPU_STRIDE;
+
+            ps->positionX[i] = getFloat(particle + GPU_POSITION);
+            ps->positionY[i] = getFloat(particle + GPU_POSITION + 4);
+            ps->positionZ[i] = getFloat(particle + GPU_POSITION + 8);
+            ps->previousX[i] = getFloat(particle + GPU_PREVIOUS);
+            ps->previousY[i] = getFloat(particle + GPU_PREVIOUS + 4);
+            ps->previousZ[i] = getFloat(particle + GPU_PREVIOUS + 8);
+            ps->particleTime[i] = getFloat(particle + GPU_TIME);
+            ps->velocityXZ[i] = getFloat(particle + GPU_VELOCITY_XZ);
+            ps->velocityY[i] = getFloat(particle + GPU_VELOCITY_Y);
+            ps->directionX[i] = getFloat(particle + GPU_DIRECTION);
+            ps->directionZ[i] = getFloat(particle + GPU_DIRECTION + 4);
+            setParticleDown(ps, i, getFloat(particle + GPU_DOWN) != 0);
+            memcpy(ps->colorList[i], particle + GPU_COLOR, sizeof(*ps->colorList));
+        }
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+#endif
+
+struct particleDevice *gpuSimulationCreate(void)
+{
+#ifdef HAVE_TRANSFORM_FEEDBACK
+    struct gpuSimulation *gpu;
+
+    if (!versionSupported(3, 1))
+    {
+        fprintf(stderr, "simulating on the GPU needs OpenGL 3.1, this is %s\n", (const char *) glGetString(GL_VERSION));
+        return NULL;
+    }
+    gpu = calloc(1, sizeof(struct gpuSimulation));
+    if (gpu == NULL)
+        return NULL;
+    gpu->staging = malloc((size_t) STAGING * GPU_STRIDE);
+    gpu->program = linkUpdate();
+    if (gpu->staging == NULL || gpu->program == 0)
+    {
+        gpuSimulationDestroy(&gpu->device);
+        return NULL;
+    }
+    gpu->gravity = glGetUniformLocation(gpu->program, "gravity");
+    gpu->meanVelocity = glGetUniformLocation(gpu->program, "meanVelocity");
+    gpu->lifetime = glGetUniformLocation(gpu->program, "lifetime");
+    gpu->respawnBase = glGetUniformLocation(gpu->program, "respawnBase");
+    gpu->tilt = glGetUniformLocation(gpu->program, "tilt");
+    gpu->device.emitted = emitted;
+    gpu->device.update = update;
+    gpu->device.fetch = fetch;
+    return &gpu->device;
+#else
+    fprintf(stderr, "simulating on the GPU needs OpenGL 3.1 headers\n");
+    return NULL;
+#endif
+}
+
+void gpuSimulationDestroy(struct particleDevice *device)
+{
+    struct gpuSimulation *gpu = (struct gpuSimulation *) device;
+
+    if (gpu == NULL)
+        return;
+#ifdef HAVE_TRANSFORM_FEEDBACK
+    if (gpu->capacity > 0)
+        glDeleteBuffers(2, gpu->state);
+    if (gpu->program != 0)
+        glDeleteProgram(gpu->program);
+#endif
+    free(gpu->staging);
+    free(gpu);
+}
+
+GLuint gpuSimulationBuffer(const struct particleDevice *device)
+{
+    const struct gpuSimulation *gpu = (const struct gpuSimulation *) device;
+
+    return gpu->capacity > 0 ? gpu->state[gpu->current] : 0;
+}
+
+/* end of gpusim.c */
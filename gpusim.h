@@ -0,0 +1,56 @@
+//
+//  gpusim.h
+//
+//
+//  Created by BOWEN LI
+//
+//  The waterfall stepped on the GPU. The particles live in two GL buffers,
+//  one particle after another in the layout below; a vertex shader runs the
+//  rule of updateScalar() on every particle of one buffer and transform
+//  feedback writes the result into the other, with the rasteriser off. A
+//  particle that respawns draws its numbers from the same counter-based
+//  hashes as emitRange() (see rng.h), so it takes the same values a CPU
+//  respawn would, but for the roundings the shader compiler may fuse. Only
+//  the parameters go up every step, and new particles when they are emitted;
+//  the drawing reads the buffer where it is (see render.h), so nothing is
+//  uploaded per frame.
+//
+//  It needs OpenGL 3.1, which Mesa's llvmpipe has, and the GL context of the
+//  thread stepping the system.
+//
+
+#ifndef GPUSIM_H
+#define GPUSIM_H
+
+#ifdef MACOSX
+#include <OpenGL/gl.h>
+#else
+#include <GL/gl.h>
+#endif
+
+#include "particles.h"
+
+// one particle in the buffers, in bytes
+#define GPU_POSITION 0                          // x, y, z
+#define GPU_PREVIOUS 12                         // x, y, z one step earlier
+#define GPU_TIME 24
+#define GPU_VELOCITY_XZ 28
+#define GPU_VELOCITY_Y 32
+#define GPU_DIRECTION 36                        // x, z
+#define GPU_DOWN 44                             // 1 in down direction, 0 otherwise
+#define GPU_COLOR 48                            // RGBA bytes
+#define GPU_STRIDE 52
+
+// the GPU's particles, to give to particleSystemSetDevice(); NULL without
+// OpenGL 3.1 or when the shader does not build, which is reported
+struct particleDevice *gpuSimulationCreate(void);
+
+// also frees the buffers; take the device from its system first
+void gpuSimulationDestroy(struct particleDevice *device);
+
+// the buffer holding the particles as the last step left them
+GLuint gpuSimulationBuffer(const struct particleDevice *device);
+
+#endif
+
+/* end of gpusim.h */
@@ -0,0 +1,520 @@
+//
+//  grid.c
+//
+//
+//  Created by BOWEN LI
+//
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+#include "grid.h"
+#include "pool.h"
+
+#define MIN_BUCKETS 1024
+#define BUCKETS_PER_POINT 2                     // beyond that cubes share buckets, rarely
+#define MAX_CUBES (1 << 20)                     // along one axis; points further out join the last
+#define SORT_CHUNK 65536                        // fewest points worth a sort task of their own
+#define QUERY_CHUNK 4096                        // sorted points per repulsion task
+#define ROWS 9                                  // rows of three cubes around a cube
+#define RUNS (2 * ROWS)                         // a row may wrap around the end of the table
+#define CLOSEST 1.0E-12f                        // squared distance that keeps 1 / d finite
+
+struct particleGrid
+{
+    int capacity;                               // points the arrays have room for
+    int bucketCapacity;                         // buckets the histograms and start have room for
+    int taskCapacity;                           // sort tasks they have room for
+    int tasks;                                  // sort tasks, each with its own histogram
+    int count;
+    int buckets;                                // a power of two
+    float radius;                               // also the side of a cube
+    float low[3];                               // the corner of cube (0, 0, 0)
+    int cubes[3];                               // along x, y and z
+    struct workerPool *pool;
+
+    const float *inX, *inY, *inZ;               // the positions being sorted
+    float *taskBounds;                          // per task: low x, y, z, then high x, y, z
+    uint32_t *bucketOf;                         // per point, in the order given
+    uint32_t *histogram;                        // tasks * buckets: counts, then write offsets
+    uint32_t *rangeTotal;                       // points in each task's run of buckets
+    uint32_t *start;                            // buckets + 1: bucket b is [start[b], start[b + 1])
+    uint32_t *order;                            // per sorted point, its index as given
+    float *x, *y, *z;                           // the positions in sorted order
+    float *vx, *vy, *vz;                        // and the velocities, during gridRepel()
+    long *pairs;                                // per repulsion task
+
+    float stiffness, damping, seconds;          // during gridRepel()
+    float *velocityX, *velocityY, *velocityZ;
+};
+
+// buckets [first, end) holding a row of cubes or more, then the sorted
+// points in them
+struct bucketRun
+{
+    uint32_t first, end;
+};
+
+struct particleGrid *gridCreate(void)
+{
+    return calloc(1, sizeof(struct particleGrid));
+}
+
+static void freeArrays(struct particleGrid *grid)
+{
+    free(grid->taskBounds);
+    free(grid->bucketOf);
+    free(grid->histogram);
+    free(grid->rangeTotal);
+    free(grid->start);
+    free(grid->order);
+    free(grid->x);
+    free(grid->y);
+    free(grid->z);
+    free(grid->vx);
+    free(grid->vy);
+    free(grid->vz);
+    free(grid->pairs);
+    grid->taskBounds = grid->x = grid->y = grid->z = grid->vx = grid->vy = grid->vz = NULL;
+    grid->bucketOf = grid->histogram = grid->rangeTotal = grid->start = grid->order = NULL;
+    grid->pairs = NULL;
+    grid->capacity = grid->bucketCapacity = grid->taskCapacity = 0;
+}
+
+void gridDestroy(struct particleGrid *grid)
+{
+    if (grid == NULL)
+        return;
+    freeArrays(grid);
+    free(grid);
+}
+
+// room for count points in buckets buckets, sorted by tasks tasks; the
+// arrays only ever grow
+static int reserve(struct particleGrid *grid, int count, int buckets, int tasks)
+{
+    if (count <= grid->capacity && buckets <= grid->bucketCapacity && tasks <= grid->taskCapacity)
+        return 1;
+    if (count < grid->capacity)
+        count = grid->capacity;
+    if (buckets < grid->bucketCapacity)
+        buckets = grid->bucketCapacity;
+    if (tasks < grid->taskCapacity)
+        tasks = grid->taskCapacity;
+
+    freeArrays(grid);
+    grid->taskBounds = malloc(tasks * 6 * sizeof(float));
+    grid->bucketOf = malloc(count * sizeof(uint32_t));
+    grid->histogram = malloc((size_t) tasks * buckets * sizeof(uint32_t));
+    grid->rangeTotal = malloc(tasks * sizeof(uint32_t));
+    grid->start = malloc((buckets + 1) * sizeof(uint32_t));
+    grid->order = malloc(count * sizeof(uint32_t));
+    grid->x = malloc(count * sizeof(float));
+    grid->y = malloc(count * sizeof(float));
+    grid->z = malloc(count * sizeof(float));
+    grid->vx = malloc(count * sizeof(float));
+    grid->vy = malloc(count * sizeof(float));
+    grid->vz = malloc(count * sizeof(float));
+    grid->pairs = malloc((count / QUERY_CHUNK + 1) * sizeof(long));
+    if (grid->taskBounds == NULL || grid->bucketOf == NULL || grid->histogram == NULL || grid->rangeTotal == NULL ||
+        grid->start == NULL || grid->order == NULL || grid->x == NULL || grid->y == NULL || grid->z == NULL ||
+        grid->vx == NULL || grid->vy == NULL || grid->vz == NULL || grid->pairs == NULL)
+    {
+        freeArrays(grid);
+        return 0;
+    }
+    grid->capacity = count;
+    grid->bucketCapacity = buckets;
+    grid->taskCapacity = tasks;
+    return 1;
+}
+
+static void run(struct particleGrid *grid, int chunks, poolTask task)
+{
+    int chunk;
+
+    if (grid->pool != NULL && chunks > 1)
+        poolRun(grid->pool, chunks, task, grid);
+    else
+    {
+        for (chunk = 0; chunk < chunks; chunk++)
+            task(grid, chunk);
+    }
+}
+
+// [first, end) of the points or buckets task t of tasks takes
+static void split(int total, int tasks, int t, int *first, int *end)
+{
+    *first = (int) ((long) total * t / tasks);
+    *end = (int) ((long) total * (t + 1) / tasks);
+}
+
+// the box around the task's run of points
+static void boundsTask(void *context, int task)
+{
+    struct particleGrid *grid = context;
+    float *bounds = grid->taskBounds + 6 * task;
+    float lowX = INFINITY, lowY = INFINITY, lowZ = INFINITY;
+    float highX = -INFINITY, highY = -INFINITY, highZ = -INFINITY;
+    int i, first, end;
+
+    split(grid->count, grid->tasks, task, &first, &end);
+    for (i = first; i < end; i++)
+    {
+        lowX = fminf(lowX, grid->inX[i]);
+        lowY = fminf(lowY, grid->inY[i]);
+        lowZ = fminf(lowZ, grid->inZ[i]);
+        highX = fmaxf(highX, grid->inX[i]);
+        highY = fmaxf(highY, grid->inY[i]);
+        highZ = fmaxf(highZ, grid->inZ[i]);
+    }
+    bounds[0] = lowX;
+    bounds[1] = lowY;
+    bounds[2] = lowZ;
+    bounds[3] = highX;
+    bounds[4] = highY;
+    bounds[5] = highZ;
+}
+
+// cubes of one radius over the box around all the points
+static void layCubes(struct particleGrid *grid)
+{
+    float low[3] = { INFINITY, INFINITY, INFINITY }, high[3] = { -INFINITY, -INFINITY, -INFINITY };
+    int t, k;
+
+    for (t = 0; t < grid->tasks; t++)
+    {
+        for (k = 0; k < 3; k++)
+        {
+            low[k] = fminf(low[k], grid->taskBounds[6 * t + k]);
+            high[k] = fmaxf(high[k], grid->taskBounds[6 * t + 3 + k]);
+        }
+    }
+    for (k = 0; k < 3; k++)
+    {
+        if (!(low[k] <= high[k]))               // no points, or none finite
+            low[k] = high[k] = 0;
+        grid->low[k] = low[k];
+        grid->cubes[k] = (int) fminf((high[k] - low[k]) / grid->radius, (float) (MAX_CUBES - 1)) + 1;
+    }
+}
+
+// a coordinate's cube along axis k; past the last cube, or not a number, the
+// nearest one, which still leaves every neighbour within one cube
+static int cubeAlong(const struct particleGrid *grid, int k, float p, float inverse)
+{
+    return (int) fminf(fmaxf((p - grid->low[k]) * inverse, 0.0f), (float) (grid->cubes[k] - 1));
+}
+
+// the cubes numbered along x, then y, then z, wrapped around the table: far
+// apart cubes may share a bucket, but a row of cubes is a run of buckets
+static uint32_t bucketOf(const struct particleGrid *grid, int cx, int cy, int cz)
+{
+    return (uint32_t) (((uint64_t) cz * grid->cubes[1] + cy) * grid->cubes[0] + cx) & (grid->buckets - 1);
+}
+
+// the bucket of every point of the run, counted in the run's histogram
+static void countTask(void *context, int task)
+{
+    struct particleGrid *grid = context;
+    uint32_t *histogram = grid->histogram + (size_t) task * grid->buckets;
+    const float inverse = 1.0f / grid->radius;
+    int b, i, first, end;
+
+    for (b = 0; b < grid->buckets; b++)
+        histogram[b] = 0;
+    split(grid->count, grid->tasks, task, &first, &end);
+    for (i = first; i < end; i++)
+    {
+        uint32_t bucket = bucketOf(grid, cubeAlong(grid, 0, grid->inX[i], inverse),
+                                   cubeAlong(grid, 1, grid->inY[i], inverse),
+                                   cubeAlong(grid, 2, grid->inZ[i], inverse));
+        grid->bucketOf[i] = bucket;
+        histogram[bucket]++;
+    }
+}
+
+// the points that every run has in the task's run of buckets
+static void totalTask(void *context, int task)
+{
+    struct particleGrid *grid = context;
+    uint32_t total = 0;
+    int b, t, first, end;
+
+    split(grid->buckets, grid->tasks, task, &first, &end);
+    for (t = 0; t < grid->tasks; t++)
+    {
+        const uint32_t *histogram = grid->histogram + (size_t) t * grid->buckets;
+        for (b = first; b < end; b++)
+            total += histogram[b];
+    }
+    grid->rangeTotal[task] = total;
+}
+
+// the counts of the task's buckets become offsets, which rangeTotal already
+// holds the first of: bucket by bucket, each run after the one before it
+static void offsetTask(void *context, int task)
+{
+    struct particleGrid *grid = context;
+    uint32_t offset = grid->rangeTotal[task];
+    int b, t, first, end;
+
+    split(grid->buckets, grid->tasks, task, &first, &end);
+    for (b = first; b < end; b++)
+    {
+        grid->start[b] = offset;
+        for (t = 0; t < grid->tasks; t++)
+        {
+            uint32_t *count = &grid->histogram[(size_t) t * grid->buckets + b];
+            uint32_t n = *count;
+            *count = offset;
+            offset += n;
+        }
+    }
+}
+
+// every point of the run to its place, in the order given within a bucket
+static void scatterTask(void *context, int task)
+{
+    struct particleGrid *grid = context;
+    uint32_t *offset = grid->histogram + (size_t) task * grid->buckets;
+    int i, first, end;
+
+    split(grid->count, grid->tasks, task, &first, &end);
+    for (i = first; i < end; i++)
+    {
+        uint32_t s = offset[grid->bucketOf[i]]++;
+        grid->order[s] = i;
+        grid->x[s] = grid->inX[i];
+        grid->y[s] = grid->inY[i];
+        grid->z[s] = grid->inZ[i];
+    }
+}
+
+int gridBuild(struct particleGrid *grid, struct workerPool *pool,
+              const float *x, const float *y, const float *z, int count, float radius)
+{
+    int tasks = pool != NULL ? poolThreads(pool) : 1;
+    int buckets = MIN_BUCKETS;
+    double cubes;
+    uint32_t total = 0, n;
+    int t;
+
+    if (tasks > (count + SORT_CHUNK - 1) / SORT_CHUNK)
+        tasks = (count + SORT_CHUNK - 1) / SORT_CHUNK;
+    if (tasks < 1)
+        tasks = 1;
+    if (!reserve(grid, count > 0 ? count : 1, MIN_BUCKETS, tasks))
+        return 0;
+
+    grid->pool = pool;
+    grid->tasks = tasks;
+    grid->count = count;
+    grid->radius = radius;
+    grid->inX = x;
+    grid->inY = y;
+    grid->inZ = z;
+
+    run(grid, tasks, boundsTask);
+    layCubes(grid);
+
+    // a bucket for every cube while there are few enough, so none share
+    cubes = (double) grid->cubes[0] * grid->cubes[1] * grid->cubes[2];
+    while (buckets < cubes && buckets < BUCKETS_PER_POINT * count)
+        buckets *= 2;
+    if (!reserve(grid, count > 0 ? count : 1, buckets, tasks))
+        return 0;
+    grid->buckets = buckets;
+
+    run(grid, tasks, countTask);
+    run(grid, tasks, totalTask);
+    for (t = 0; t < tasks; t++)
+    {
+        n = grid->rangeTotal[t];
+        grid->rangeTotal[t] = total;
+        total += n;
+    }
+    run(grid, tasks, offsetTask);
+    grid->start[buckets] = total;
+    run(grid, tasks, scatterTask);
+    return 1;
+}
+
+// the runs of sorted points in the cubes around (cx, cy, cz), each bucket in
+// one run only however the rows wrap or overlap; returns how many
+static int neighbourRuns(const struct particleGrid *grid, int cx, int cy, int cz, struct bucketRun runs[RUNS])
+{
+    const int x0 = cx > 0 ? cx - 1 : 0, x1 = cx + 1 < grid->cubes[0] ? cx + 1 : cx;
+    int y, z, r, n = 0, merged = 0;
+
+    for (z = cz - 1; z <= cz + 1; z++)
+    {
+        for (y = cy - 1; y <= cy + 1; y++)
+        {
+            struct bucketRun row;
+
+            if (z < 0 || z >= grid->cubes[2] || y < 0 || y >= grid->cubes[1])
+                continue;
+            row.first = bucketOf(grid, x0, y, z);
+            row.end = row.first + (x1 - x0 + 1);
+            if (row.end > (uint32_t) grid->buckets)
+            {
+                // the wrapped part starts at bucket 0, so it goes first
+                for (r = n; r > 0; r--)
+                    runs[r] = runs[r - 1];
+                runs[0].first = 0;
+                runs[0].end = row.end - grid->buckets;
+                row.end = grid->buckets;
+                n++;
+            }
+            for (r = n; r > 0 && runs[r - 1].first > row.first; r--)
+                runs[r] = runs[r - 1];
+            runs[r] = row;
+            n++;
+        }
+    }
+    for (r = 0; r < n; r++)
+    {
+        if (merged > 0 && runs[r].first <= runs[merged - 1].end)
+            runs[merged - 1].end = runs[r].end > runs[merged - 1].end ? runs[r].end : runs[merged - 1].end;
+        else
+            runs[merged++] = runs[r];
+    }
+
+    // from buckets to the sorted points in them, leaving out the empty runs
+    for (r = 0, n = 0; r < merged; r++)
+    {
+        uint32_t first = grid->start[runs[r].first], end = grid->start[runs[r].end];
+        if (first < end)
+        {
+            runs[n].first = first;
+            runs[n++].end = end;
+        }
+    }
+    return n;
+}
+
+// the forces of the sorted points [first, end) on the point with position
+// and velocity p, added to force; every point is weighed, the ones out of
+// reach with 0, and nothing is left to a branch, so the loop vectorises
+static int gather(const float *restrict x, const float *restrict y, const float *restrict z,
+                  const float *restrict vx, const float *restrict vy, const float *restrict vz,
+                  uint32_t first, uint32_t end, const float p[6], const struct particleGrid *grid,
+                  float *restrict force)
+{
+    const float reach = grid->radius * grid->radius, inverse = 1.0f / grid->radius;
+    const float stiffness = grid->stiffness, damping = grid->damping;
+    const float px = p[0], py = p[1], pz = p[2], pvx = p[3], pvy = p[4], pvz = p[5];
+    float fx = 0, fy = 0, fz = 0;
+    int pairs = 0;
+    uint32_t j;
+
+    for (j = first; j < end; j++)
+    {
+        float dx = px - x[j], dy = py - y[j], dz = pz - z[j];
+        float d2 = dx * dx + dy * dy + dz * dz;
+        int near = (d2 < reach) & (d2 > 0);
+        float inverseD = 1.0f / sqrtf(d2 > CLOSEST ? d2 : CLOSEST);
+        float apart = (dx * (pvx - vx[j]) + dy * (pvy - vy[j]) + dz * (pvz - vz[j])) * inverseD;
+        float push = stiffness * (1.0f - d2 * inverseD * inverse) - damping * apart;
+        float w = push * inverseD * (float) near;   // over d for the unit vector
+        fx += dx * w;
+        fy += dy * w;
+        fz += dz * w;
+        pairs += near;
+    }
+    force[0] += fx;
+    force[1] += fy;
+    force[2] += fz;
+    return pairs;
+}
+
+// the velocities in sorted order, so the forces read them from there while
+// they are added to the ones given
+static void copyTask(void *context, int task)
+{
+    struct particleGrid *grid = context;
+    int s, last;
+
+    s = task * QUERY_CHUNK;
+    last = s + QUERY_CHUNK < grid->count ? s + QUERY_CHUNK : grid->count;
+    for (; s < last; s++)
+    {
+        uint32_t i = grid->order[s];
+        grid->vx[s] = grid->velocityX[i];
+        grid->vy[s] = grid->velocityY[i];
+        grid->vz[s] = grid->velocityZ[i];
+    }
+}
+
+// the sorted points of one chunk gather the forces of their neighbours; each
+// writes only its own velocity, so no two tasks touch the same particle
+static void repelTask(void *context, int task)
+{
+    struct particleGrid *grid = context;
+    const float inverse = 1.0f / grid->radius;
+    struct bucketRun runs[RUNS];
+    int s, last, r, n = 0;
+    int cx = -1, cy = -1, cz = -1;
+    long pairs = 0;
+
+    s = task * QUERY_CHUNK;
+    last = s + QUERY_CHUNK < grid->count ? s + QUERY_CHUNK : grid->count;
+    for (; s < last; s++)
+    {
+        const float p[6] = { grid->x[s], grid->y[s], grid->z[s], grid->vx[s], grid->vy[s], grid->vz[s] };
+        float force[3] = { 0, 0, 0 };
+        int x = cubeAlong(grid, 0, p[0], inverse);
+        int y = cubeAlong(grid, 1, p[1], inverse);
+        int z = cubeAlong(grid, 2, p[2], inverse);
+        float scale, size;
+        uint32_t i;
+
+        // points come a cube at a time, so its runs mostly carry over
+        if (x != cx || y != cy || z != cz)
+        {
+            cx = x;
+            cy = y;
+            cz = z;
+            n = neighbourRuns(grid, cx, cy, cz, runs);
+        }
+        for (r = 0; r < n; r++)
+            pairs += gather(grid->x, grid->y, grid->z, grid->vx, grid->vy, grid->vz,
+                            runs[r].first, runs[r].end, p, grid, force);
+
+        // a step of explicit forces overshoots when many neighbours push
+        // at once, so no push moves a point more than a radius in a step
+        scale = grid->seconds;
+        size = sqrtf(force[0] * force[0] + force[1] * force[1] + force[2] * force[2]) * scale * grid->seconds;
+        if (size > grid->radius)
+            scale *= grid->radius / size;
+        i = grid->order[s];
+        grid->velocityX[i] += scale * force[0];
+        grid->velocityY[i] += scale * force[1];
+        grid->velocityZ[i] += scale * force[2];
+    }
+    grid->pairs[task] = pairs;
+}
+
+long gridRepel(struct particleGrid *grid, struct workerPool *pool, float stiffness, float damping, float seconds,
+               float *velocityX, float *velocityY, float *velocityZ)
+{
+    int chunks = (grid->count + QUERY_CHUNK - 1) / QUERY_CHUNK;
+    long pairs = 0;
+    int chunk;
+
+    grid->pool = pool;
+    grid->stiffness = stiffness;
+    grid->damping = damping;
+    grid->seconds = seconds;
+    grid->velocityX = velocityX;
+    grid->velocityY = velocityY;
+    grid->velocityZ = velocityZ;
+    run(grid, chunks, copyTask);
+    run(grid, chunks, repelTask);
+    for (chunk = 0; chunk < chunks; chunk++)
+        pairs += grid->pairs[chunk];
+    return pairs;
+}
+
+/* end of grid.c */
@@ -0,0 +1,42 @@
+//
+//  grid.h
+//
+//
+//  Created by BOWEN LI
+//
+//  A uniform grid for finding the particles near a particle without looking
+//  at all of them. Space is cut into cubes one interaction radius wide and
+//  numbered along x, then y, then z; the numbers wrap around a table of
+//  buckets at most about twice the point count, so the table costs memory
+//  by the point count only and three cubes in a row are still three buckets
+//  in a row. Every step sorts the points into their buckets again with a
+//  counting sort: each task counts its own run of points, a prefix sum turns
+//  the counts into offsets, and each task writes its run to the offsets. A
+//  point's neighbours are then in nine runs of buckets around its own.
+//
+
+#ifndef GRID_H
+#define GRID_H
+
+struct particleGrid;
+struct workerPool;
+
+struct particleGrid *gridCreate(void);
+void gridDestroy(struct particleGrid *grid);
+
+// sort count positions into cubes for neighbours within radius; pool may be
+// NULL. Returns 0 when the memory cannot be found.
+int gridBuild(struct particleGrid *grid, struct workerPool *pool,
+              const float *x, const float *y, const float *z, int count, float radius);
+
+// soft-sphere repulsion between the points of the last gridBuild(): every
+// pair closer than the radius pushes apart with stiffness * (1 - d / radius),
+// less damping times the speed they move apart at, for seconds. The
+// velocities are in the order the points were given in. Returns the number
+// of such pairs, each counted from both ends.
+long gridRepel(struct particleGrid *grid, struct workerPool *pool, float stiffness, float damping, float seconds,
+               float *velocityX, float *velocityY, float *velocityZ);
+
+#endif
+
+/* end of grid.h */
@@ -0,0 +1,1061 @@
+//
+//  headless.c
+//
+//
+//  Created by BOWEN LI
+//
+//  The viewer's drawing without a window: an EGL pbuffer stands in for the
+//  GLUT window, so frames can be drawn on machines without a display, and
+//  with Mesa's software rasteriser without a GPU. A script moves the camera
+//  and changes the settings as the menu would; every frame is read back and
+//  may be written out as PPM or PNG, compared with reference images, and its
+//  stage times traced as the viewer's --trace does. With a frame budget the
+//  viewer's controller changes the particles and the detail as it would, and
+//  the particles can be drawn packed as the viewer's --compact draws them.
+//  Given a scenario instead of a script, it runs the benchmark sweep.h
+//  describes, and checks the results against a baseline. The particles can
+//  be stepped on the GPU (see gpusim.h), and that simulation checked against
+//  the CPU's.
+//
+//  A script has one command per line, '#' starting a comment:
+//
+//      frames    n                         draw n frames, one step apart
+//      still     n                         draw n frames without a step
+//      camera    ex ey ez  cx cy cz        look from e at c, up along y
+//      turn      degrees                   turn the world about y every frame
+//      mode      point|square|sphere
+//      square    size                      half the side of a square
+//      pointsize pixels
+//      slices    n                         slices and stacks of a sphere
+//      texture   0|1
+//      buffered  0|1
+//      sorted    0|1
+//      culled    0|1
+//      lod       distance
+//      particles n                         the target count, emitted over the next steps
+//      gravity   g
+//      velocity  v
+//      gpu       0|1                       step the particles on the GPU
+//
+//  While a recording plays, particles, gravity and velocity change nothing.
+//
+
+#define GL_GLEXT_PROTOTYPES
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <unistd.h>
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <GL/gl.h>
+#include <GL/glu.h>
+#include <GL/glext.h>
+#include "budget.h"
+#include "draw.h"
+#include "gpusim.h"
+#include "particles.h"
+#include "profile.h"
+#include "scene.h"
+#include "snapshot.h"
+#include "sweep.h"
+
+#define DEFAULT_SIZE 512                        // pixels along each side
+#define DEFAULT_FRAMES 100                      // without a script
+#define READBACKS 2                             // pixel buffers the asynchronous readback rotates through
+#define STORED_BLOCK 65535                      // the most a stored deflate block holds
+#define MAX_PARTICLES 1000000                   // the viewer's limit, for the budget controller
+
+static int width = DEFAULT_SIZE, height = DEFAULT_SIZE;
+static int async = 0;                           // read back through pixel buffers, a frame late
+static int png = 0;                             // write PNG rather than PPM
+static const char *outputPrefix;                // where the frames go, if anywhere
+static const char *referencePrefix;             // the frames to compare with, if any
+static double tolerance = 0.5;                  // mean difference per channel a frame may have
+static int threads = 1;
+static uint64_t seed = 1;                       // the same particles on every run
+static const char *scenePath;
+static const char *tracePath;
+static const char *loadPath;                    // the snapshot to start from, if any
+static const char *recordPath;                  // where to record every frame, if anywhere
+static const char *playPath;                    // the recording to draw instead of simulating
+static double frameBudget;                      // seconds of work a frame may take, 0 for no controller
+static int packing = 0;                         // draw from a packed copy, as the viewer's --compact
+static struct compactParticles packed;
+static struct particleSystem packedView;
+static const char *scenarioPath;                // the sweep to run, if any
+static const char *resultsPath;                 // where its results go, if anywhere
+static const char *baselinePath;                // the results to hold them to, if any
+static double threshold = SWEEP_THRESHOLD;
+static int onGPU = 0;                           // step the particles on the GPU from the start
+static int checkSteps;                          // steps to check the GPU against the CPU over, 0 for none
+static struct particleDevice *device;           // the GPU's, made the first time it is asked for
+
+static struct particleSystem *ps;
+static struct worldDraw *worldDraw;
+static struct profile *profile;
+static struct drawSettings settings;
+static struct snapshotWriter *recording;
+static struct snapshot *playback;
+static struct budget *budget;
+static GLfloat eye[3], center[3];              // the view, from startSettings() on
+static GLfloat angle = 0, turn = 0;             // in degree
+
+static GLuint readback[READBACKS];              // pixel buffers, 0 when reading straight back
+static int frame;                               // frames drawn so far
+static unsigned char *pixels;                   // width * height RGB, bottom row first
+static unsigned char *image;                    // the same top row first, and a reference
+static unsigned char *reference;
+static int differing;                           // frames further from their reference than tolerance
+static double worstDifference;
+
+// an EGL context on a pbuffer of width x height, on Mesa's surfaceless
+// platform when there is one so that no display is needed
+static int startContext(void)
+{
+    static const EGLint configAttributes[] = {
+        EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+        EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8, EGL_BLUE_SIZE, 8,
+        EGL_DEPTH_SIZE, 24,
+        EGL_NONE
+    };
+    const EGLint surfaceAttributes[] = { EGL_WIDTH, width, EGL_HEIGHT, height, EGL_NONE };
+    PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay;
+    EGLDisplay display = EGL_NO_DISPLAY;
+    EGLConfig config;
+    EGLSurface surface;
+    EGLContext context;
+    EGLint configs;
+
+    getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC) eglGetProcAddress("eglGetPlatformDisplayEXT");
+#ifdef EGL_PLATFORM_SURFACELESS_MESA
+    if (getPlatformDisplay != NULL)
+        display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+#endif
+    if (display == EGL_NO_DISPLAY)
+        display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    if (display == EGL_NO_DISPLAY || !eglInitialize(display, NULL, NULL))
+    {
+        fprintf(stderr, "cannot open an EGL display\n");
+        return 0;
+    }
+    if (!eglChooseConfig(display, configAttributes, &config, 1, &configs) || configs < 1 ||
+        !eglBindAPI(EGL_OPENGL_API))
+    {
+        fprintf(stderr, "no EGL configuration draws OpenGL into a pbuffer\n");
+        return 0;
+    }
+    surface = eglCreatePbufferSurface(display, config, surfaceAttributes);
+    context = eglCreateContext(display, config, EGL_NO_CONTEXT, NULL);
+    if (surface == EGL_NO_SURFACE || context == EGL_NO_CONTEXT ||
+        !eglMakeCurrent(display, surface, surface, context))
+    {
+        fprintf(stderr, "cannot draw into a %d x %d pbuffer\n", width, height);
+        return 0;
+    }
+    return 1;
+}
+
+// the pixel buffers the frames are read into, when reading back a frame late
+static int startReadback(void)
+{
+    int k;
+
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    if (!async)
+        return 1;
+    glGenBuffers(READBACKS, readback);
+    for (k = 0; k < READBACKS; k++)
+    {
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, readback[k]);
+        glBufferData(GL_PIXEL_PACK_BUFFER, (GLsizeiptr) width * height * 3, NULL, GL_STREAM_READ);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    return glGetError() == GL_NO_ERROR;
+}
+
+static uint32_t crc32Of(uint32_t crc, const unsigned char *data, size_t length)
+{
+    size_t i;
+    int bit;
+
+    crc = ~crc;
+    for (i = 0; i < length; i++)
+    {
+        crc ^= data[i];
+        for (bit = 0; bit < 8; bit++)
+            crc = crc >> 1 ^ (0xEDB88320u & -(crc & 1));
+    }
+    return ~crc;
+}
+
+static void putBigEndian(unsigned char *to, uint32_t value)
+{
+    to[0] = value >> 24;
+    to[1] = value >> 16;
+    to[2] = value >> 8;
+    to[3] = value;
+}
+
+// one PNG chunk: its length, type, data and the CRC of the last two
+static void writeChunk(FILE *file, const char *type, const unsigned char *data, size_t length)
+{
+    unsigned char word[4];
+    uint32_t crc;
+
+    putBigEndian(word, length);
+    fwrite(word, 1, 4, file);
+    fwrite(type, 1, 4, file);
+    if (length > 0)
+        fwrite(data, 1, length, file);
+    crc = crc32Of(crc32Of(0, (const unsigned char *) type, 4), data, length);
+    putBigEndian(word, crc);
+    fwrite(word, 1, 4, file);
+}
+
+// the image as an RGB PNG. The rows are stored in deflate blocks that are
+// not compressed: larger files, but no zlib, and writing stays cheap next to
+// the frame.
+static int writePNG(FILE *file, const unsigned char *rgb)
+{
+    static const unsigned char signature[8] = { 137, 'P', 'N', 'G', '\r', '\n', 26, '\n' };
+    size_t row = (size_t) width * 3 + 1;        // a filter byte leads each row
+    size_t raw = row * height;
+    size_t blocks = (raw + STORED_BLOCK - 1) / STORED_BLOCK;
+    size_t length = 2 + raw + 5 * blocks + 4, at, done, i;
+    unsigned char header[13], *data = malloc(length);
+    uint32_t a = 1, b = 0;
+    int y;
+
+    if (data == NULL)
+        return 0;
+    putBigEndian(header, width);
+    putBigEndian(header + 4, height);
+    header[8] = 8;                              // bits per channel
+    header[9] = 2;                              // RGB
+    header[10] = header[11] = header[12] = 0;   // deflate, no filters beyond none, not interlaced
+
+    data[0] = 0x78;                             // deflate with a 32K window, no dictionary
+    data[1] = 0x01;
+    at = 2;
+    for (done = 0; done < raw; )
+    {
+        size_t size = raw - done < STORED_BLOCK ? raw - done : STORED_BLOCK;
+        data[at++] = done + size == raw;        // the last block, stored
+        data[at++] = size;
+        data[at++] = size >> 8;
+        data[at++] = ~size;
+        data[at++] = ~size >> 8;
+        for (i = 0; i < size; i++, done++)
+        {
+            size_t x = done % row;
+            y = done / row;
+            data[at + i] = x == 0 ? 0 : rgb[(size_t) y * (row - 1) + x - 1];
+            a = (a + data[at + i]) % 65521;
+            b = (b + a) % 65521;
+        }
+        at += size;
+    }
+    putBigEndian(data + at, b << 16 | a);
+
+    fwrite(signature, 1, sizeof(signature), file);
+    writeChunk(file, "IHDR", header, sizeof(header));
+    writeChunk(file, "IDAT", data, length);
+    writeChunk(file, "IEND", NULL, 0);
+    free(data);
+    return 1;
+}
+
+// the frame with this number under prefix
+static void framePath(char *path, size_t size, const char *prefix, int number, const char *extension)
+{
+    snprintf(path, size, "%s%05d.%s", prefix, number, extension);
+}
+
+static int writeImage(int number, const unsigned char *rgb)
+{
+    char path[1024];
+    FILE *file;
+    int written;
+
+    framePath(path, sizeof(path), outputPrefix, number, png ? "png" : "ppm");
+    file = fopen(path, "wb");
+    if (file == NULL)
+    {
+        fprintf(stderr, "cannot write %s\n", path);
+        return 0;
+    }
+    if (png)
+        written = writePNG(file, rgb);
+    else
+    {
+        fprintf(file, "P6\n%d %d\n255\n", width, height);
+        written = fwrite(rgb, 3, (size_t) width * height, file) == (size_t) width * height;
+    }
+    written = fclose(file) == 0 && written;
+    if (!written)
+        fprintf(stderr, "cannot write %s\n", path);
+    return written;
+}
+
+// the reference frame with this number, which must be a PPM of the same size
+static int readReference(int number)
+{
+    char path[1024];
+    FILE *file;
+    int w, h, maximum, ok;
+
+    framePath(path, sizeof(path), referencePrefix, number, "ppm");
+    file = fopen(path, "rb");
+    if (file == NULL)
+    {
+        fprintf(stderr, "cannot open the reference %s\n", path);
+        return 0;
+    }
+    ok = fscanf(file, "P6 %d %d %d", &w, &h, &maximum) == 3 && fgetc(file) != EOF &&
+         w == width && h == height && maximum == 255 &&
+         fread(reference, 3, (size_t) width * height, file) == (size_t) width * height;
+    fclose(file);
+    if (!ok)
+        fprintf(stderr, "%s is not a %d x %d PPM\n", path, width, height);
+    return ok;
+}
+
+// compare the frame with its reference, and remember how far it is off
+static int compareImage(int number, const unsigned char *rgb)
+{
+    size_t bytes = (size_t) width * height * 3, i;
+    double difference = 0;
+
+    if (!readReference(number))
+        return 0;
+    for (i = 0; i < bytes; i++)
+        difference += abs(rgb[i] - reference[i]);
+    difference /= bytes;
+    if (difference > tolerance)
+    {
+        printf("frame %d differs from its reference by %.3f per channel\n", number, difference);
+        differing++;
+    }
+    if (difference > worstDifference)
+        worstDifference = difference;
+    return 1;
+}
+
+// a frame read back, bottom row first: written out and compared as asked
+static int finishFrame(int number, const unsigned char *bottomUp)
+{
+    size_t stride = (size_t) width * 3;
+    int y;
+
+    if (outputPrefix == NULL && referencePrefix == NULL)
+        return 1;
+    for (y = 0; y < height; y++)
+        memcpy(image + y * stride, bottomUp + (size_t) (height - 1 - y) * stride, stride);
+    if (outputPrefix != NULL && !writeImage(number, image))
+        return 0;
+    return referencePrefix == NULL || compareImage(number, image);
+}
+
+// read the frame just drawn back; through a pixel buffer it is only copied
+// out a frame later, when the copy has long finished, so that the wait for
+// it overlaps drawing the next one
+static int readFrame(void)
+{
+    const unsigned char *mapped;
+    int ok = 1;
+
+    if (!async)
+    {
+        glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, pixels);
+        return finishFrame(frame, pixels);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, readback[frame % READBACKS]);
+    glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, NULL);
+    if (frame > 0)
+    {
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, readback[(frame - 1) % READBACKS]);
+        mapped = glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+        ok = mapped != NULL && finishFrame(frame - 1, mapped);
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    return ok;
+}
+
+// the last frame still in a pixel buffer
+static int flushReadback(void)
+{
+    const unsigned char *mapped;
+    int ok;
+
+    if (!async || frame == 0)
+        return 1;
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, readback[(frame - 1) % READBACKS]);
+    mapped = glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+    ok = mapped != NULL && finishFrame(frame - 1, mapped);
+    glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    return ok;
+}
+
+// one frame, timed in the viewer's stages; reading it back stands for the
+// swap
+static int drawFrame(int step)
+{
+    const struct particleSystem *drawn = ps;
+    struct drawSettings scaled = settings;
+    int numberParticles;
+    int ok;
+
+    if (playback != NULL)                       // a recording plays without the simulation
+        drawn = snapshotView(playback, frame % snapshotFrames(playback), ps->pool);
+    else if (step)
+    {
+        profileBegin(profile, PROFILE_UPDATE);
+        particleSystemAdvance(ps, TIME_DELTA);
+        profileEnd(profile, PROFILE_UPDATE);
+    }
+    if (packing && playback == NULL && ps->device == NULL && compactReserve(&packed, ps->capacity))
+    {
+        int block;
+
+        for (block = 0; block * COMPACT_BLOCK < ps->numberParticles; block++)
+            compactBlock(&packed, ps, block);
+        packedView = *ps;
+        packedView.compact = &packed;
+        drawn = &packedView;
+    }
+    numberParticles = drawn->numberParticles;
+    angle += turn;
+
+    profileBegin(profile, PROFILE_DRAW);        // less the uploads, timed inside
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    glMatrixMode(GL_MODELVIEW);
+    glLoadIdentity();
+    gluLookAt(eye[0], eye[1], eye[2], center[0], center[1], center[2], 0.0, 1.0, 0.0);
+    glRotatef(angle, 0.0, 1.0, 0.0);
+    if (budget != NULL)
+        scaleDetail(&scaled, budgetDetail(budget));
+    drawWorld(worldDraw, drawn, &scaled);
+    profileEnd(profile, PROFILE_DRAW);
+
+    profileBegin(profile, PROFILE_SWAP);
+    ok = readFrame();
+    profileEnd(profile, PROFILE_SWAP);
+    profileFrame(profile, numberParticles);
+    frame++;
+
+    // the work is what the viewer's is, the readback left out as the swap is,
+    // and the count changes as the viewer changes it
+    if (budget != NULL && playback == NULL &&
+        budgetFrame(budget, profileLast(profile, PROFILE_FRAME) - profileLast(profile, PROFILE_SWAP),
+                    numberParticles, !settings.point) && ps->scene == NULL)
+    {
+        if (budgetParticles(budget) < ps->numberParticles)
+            particleSystemResize(ps, budgetParticles(budget));
+        else
+            particleSystemSetTarget(ps, budgetParticles(budget));
+    }
+    if (recording != NULL && ps->device != NULL)
+        particleSystemFetch(ps);                // the recording reads the arrays
+    if (recording != NULL && !snapshotWrite(recording, drawn, SNAPSHOT_DRAWN))
+    {
+        fprintf(stderr, "cannot record to %s\n", recordPath);
+        return 0;
+    }
+    return ok;
+}
+
+// step ps on the GPU, or on the CPU again; returns 0 when the GPU cannot
+static int useGPU(int on)
+{
+    if (on && device == NULL && (device = gpuSimulationCreate()) == NULL)
+        return 0;
+    return particleSystemSetDevice(ps, on ? device : NULL);
+}
+
+// one line of the script; returns 0 when it cannot be read or a frame fails
+static int runCommand(const char *line)
+{
+    char keyword[32], word[32];
+    float f[6];
+    int n, i;
+
+    if (sscanf(line, "%31s", keyword) != 1)
+        return 1;                               // blank
+    if (strcmp(keyword, "frames") == 0 || strcmp(keyword, "still") == 0)
+    {
+        if (sscanf(line, "%*s %d", &n) != 1 || n < 0)
+            return 0;
+        for (i = 0; i < n; i++)
+        {
+            if (!drawFrame(keyword[0] == 'f'))
+                return 0;
+        }
+    }
+    else if (strcmp(keyword, "camera") == 0)
+    {
+        if (sscanf(line, "%*s %f %f %f %f %f %f", &f[0], &f[1], &f[2], &f[3], &f[4], &f[5]) != 6)
+            return 0;
+        memcpy(eye, f, sizeof(eye));
+        memcpy(center, f + 3, sizeof(center));
+    }
+    else if (strcmp(keyword, "mode") == 0)
+    {
+        if (sscanf(line, "%*s %31s", word) != 1)
+            return 0;
+        settings.point = strcmp(word, "point") == 0;
+        settings.square = strcmp(word, "square") == 0;
+        settings.sphere = strcmp(word, "sphere") == 0;
+        return settings.point || settings.square || settings.sphere;
+    }
+    else
+    {
+        if (sscanf(line, "%*s %f", &f[0]) != 1)
+            return 0;
+        if (strcmp(keyword, "turn") == 0)
+            turn = f[0];
+        else if (strcmp(keyword, "square") == 0 && f[0] > 0)
+            settings.squareSize = f[0];
+        else if (strcmp(keyword, "pointsize") == 0 && f[0] > 0)
+            glPointSize(f[0]);
+        else if (strcmp(keyword, "slices") == 0 && f[0] >= 1)
+            settings.slicesStacks = f[0];
+        else if (strcmp(keyword, "texture") == 0)
+            settings.textured = f[0] != 0;
+        else if (strcmp(keyword, "buffered") == 0)
+            settings.buffered = f[0] != 0;
+        else if (strcmp(keyword, "sorted") == 0)
+            settings.sorted = f[0] != 0;
+        else if (strcmp(keyword, "culled") == 0)
+            settings.culled = f[0] != 0;
+        else if (strcmp(keyword, "lod") == 0)
+            settings.lodDistance = f[0];
+        else if (strcmp(keyword, "particles") == 0 && f[0] >= 1 && ps->scene == NULL)
+            return particleSystemSetTarget(ps, f[0]);
+        else if (strcmp(keyword, "gravity") == 0)
+            ps->gravity = f[0];
+        else if (strcmp(keyword, "velocity") == 0)
+            ps->meanVelocity = f[0];
+        else if (strcmp(keyword, "gpu") == 0)
+            return playback == NULL && useGPU(f[0] != 0);
+        else
+            return 0;
+    }
+    return 1;
+}
+
+static int runScript(const char *path)
+{
+    FILE *file = fopen(path, "r");
+    char line[256];
+    int number = 0;
+
+    if (file == NULL)
+    {
+        fprintf(stderr, "cannot open the script %s\n", path);
+        return 0;
+    }
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        number++;
+        line[strcspn(line, "#\n")] = '\0';
+        if (!runCommand(line))
+        {
+            fprintf(stderr, "%s:%d: cannot run \"%s\"\n", path, number, line);
+            fclose(file);
+            return 0;
+        }
+    }
+    fclose(file);
+    return 1;
+}
+
+// the particles as the viewer starts them, or count of them at once
+static int makeSystem(int count)
+{
+    ps = particleSystemCreate();
+    if (ps == NULL || !particleSystemResize(ps, count))
+    {
+        fprintf(stderr, "cannot allocate %d particles\n", count);
+        return 0;
+    }
+    ps->seed = seed;
+    if (!particleSystemSetThreads(ps, threads))
+        fprintf(stderr, "cannot start %d update threads, updating on one\n", threads);
+    makeParticleArray(ps);
+    if (scenePath != NULL)
+    {
+        struct scene *scene = sceneLoad(scenePath);
+        if (scene == NULL || !particleSystemSetScene(ps, scene, 0))
+            return 0;
+    }
+    if (loadPath != NULL)
+    {
+        struct snapshot *snapshot = snapshotOpen(loadPath);
+        int loaded = snapshot != NULL && snapshotKind(snapshot, 0) == SNAPSHOT_FULL &&
+                     snapshotRestore(snapshot, 0, ps);
+
+        snapshotClose(snapshot);
+        if (!loaded)
+        {
+            fprintf(stderr, "cannot load the particles from %s\n", loadPath);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// the viewer's settings and view at start-up
+static void startSettings(void)
+{
+    static const GLfloat startEye[3] = { 0.0, 12.0, 20.0 }, startCenter[3] = { 5.0, 3.0, 0.0 };
+
+    memset(&settings, 0, sizeof(settings));
+    settings.point = 1;
+    settings.squareSize = 0.02;
+    settings.slicesStacks = 2;
+    settings.buffered = 1;
+    settings.culled = 1;
+    settings.lodDistance = LOD_DISTANCE;
+    glPointSize(2);
+    memcpy(eye, startEye, sizeof(eye));
+    memcpy(center, startCenter, sizeof(center));
+    angle = turn = 0;
+}
+
+// every configuration of the scenario from fresh particles, count of them
+// unless it sweeps them; returns 0 when a configuration cannot be run, or
+// when one regressed against the baseline
+static int runSweep(int count)
+{
+    struct sweep *sweep = sweepLoad(scenarioPath);
+    char line[256];
+    int configuration, command, i, regressed = 0;
+
+    if (sweep == NULL || profile == NULL)
+    {
+        sweepDestroy(sweep);
+        return 0;
+    }
+    for (configuration = 0; configuration < sweepConfigurations(sweep); configuration++)
+    {
+        particleSystemDestroy(ps);
+        if (!makeSystem(sweepParticles(sweep, configuration, count)) || (onGPU && !useGPU(1)))
+        {
+            sweepDestroy(sweep);
+            return 0;
+        }
+        startSettings();
+        for (command = 0; sweepCommand(sweep, configuration, command, line, sizeof(line)); command++)
+        {
+            if (!runCommand(line))
+            {
+                fprintf(stderr, "%s: cannot run \"%s\"\n", scenarioPath, line);
+                sweepDestroy(sweep);
+                return 0;
+            }
+        }
+
+        // the particles spread out undrawn, then a frame at least to settle
+        // the buffers and the frame clock before any is measured
+        for (i = 0; i < sweepSpread(sweep); i++)
+            particleSystemAdvance(ps, TIME_DELTA);
+        for (i = 0; i < sweepWarmup(sweep) || i < 1; i++)
+        {
+            if (!drawFrame(1))
+            {
+                sweepDestroy(sweep);
+                return 0;
+            }
+        }
+        sweepBegin(sweep, configuration);
+        for (i = 0; i < sweepMeasure(sweep); i++)
+        {
+            if (!drawFrame(1))
+            {
+                sweepDestroy(sweep);
+                return 0;
+            }
+            sweepFrame(sweep, profileLast(profile, PROFILE_FRAME),
+                       profileLast(profile, PROFILE_UPDATE) + profileLast(profile, PROFILE_EMIT),
+                       profileLast(profile, PROFILE_DRAW) + profileLast(profile, PROFILE_UPLOAD) +
+                       profileLast(profile, PROFILE_SORT) + profileLast(profile, PROFILE_CULL),
+                       profileLast(profile, PROFILE_SWAP), ps->numberParticles);
+        }
+        sweepEnd(sweep, stdout);
+    }
+
+    if (resultsPath != NULL && !sweepWrite(sweep, resultsPath))
+    {
+        fprintf(stderr, "cannot write the results to %s\n", resultsPath);
+        regressed = 1;
+    }
+    if (baselinePath != NULL)
+    {
+        int worse = sweepCompare(sweep, baselinePath, threshold, stdout);
+
+        if (worse < 0)
+            fprintf(stderr, "cannot read the baseline %s\n", baselinePath);
+        else
+            printf("%d configurations regressed by more than %.0f%% against %s\n", worse, threshold * 100,
+                   baselinePath);
+        regressed = regressed || worse != 0;
+    }
+    sweepDestroy(sweep);
+    return !regressed;
+}
+
+#define CHECK_QUANTITIES 7
+#define CRITICAL 1.949                          // of the Kolmogorov-Smirnov distance at the 0.1% level
+
+static int compareFloats(const void *a, const void *b)
+{
+    float x = *(const float *) a, y = *(const float *) b;
+
+    return (x > y) - (x < y);
+}
+
+// the largest distance between the distributions of the n values of a and
+// the m of b, both sorted
+static double ksDistance(const float *a, int n, const float *b, int m)
+{
+    double distance = 0;
+    int i = 0, j = 0;
+
+    while (i < n && j < m)
+    {
+        float value = a[i] < b[j] ? a[i] : b[j];
+        double apart;
+
+        while (i < n && a[i] <= value)
+            i++;
+        while (j < m && b[j] <= value)
+            j++;
+        apart = fabs((double) i / n - (double) j / m);
+        distance = apart > distance ? apart : distance;
+    }
+    return distance;
+}
+
+// quantity k of particle i, the colour as the byte both draw
+static float quantity(const struct particleSystem *system, int k, int i)
+{
+    switch (k)
+    {
+        case 0: return system->positionX[i];
+        case 1: return system->positionY[i];
+        case 2: return system->positionZ[i];
+        case 3: return system->velocityY[i];
+        case 4: return system->particleTime[i];
+        case 5: return particleDown(system, i);
+        default:
+            return system->colorList[i][0];
+    }
+}
+
+// the GPU's particles against the CPU's, both from the same half of count
+// particles, emitting the rest on the way, after steps steps. The two only
+// part where a rounding puts a particle's bounce a step earlier or later,
+// so each quantity is compared as a distribution: its mean and spread, and
+// the Kolmogorov-Smirnov distance, which fails the check beyond its critical
+// value at the 0.1% level. Returns 0 when the check fails.
+static int crossCheck(int count, int steps)
+{
+    static const char *const names[CHECK_QUANTITIES] = { "x", "y", "z", "vy", "time", "down", "red" };
+    struct particleSystem *gpu = particleSystemCreate();
+    double cpuSeconds = 0, gpuSeconds = 0, begin;
+    float *a = NULL, *b = NULL;
+    int n, i, k, step, close = 0, passed = 1;
+
+    if (gpu == NULL || !particleSystemResize(gpu, count / 2) || !particleSystemResize(ps, count / 2))
+    {
+        fprintf(stderr, "cannot allocate %d particles\n", count);
+        particleSystemDestroy(gpu);
+        return 0;
+    }
+    gpu->seed = ps->seed;
+    makeParticleArray(gpu);
+    makeParticleArray(ps);
+    particleSystemSetTarget(gpu, count);
+    particleSystemSetTarget(ps, count);
+    if ((device = gpuSimulationCreate()) == NULL || !particleSystemSetDevice(gpu, device))
+    {
+        particleSystemDestroy(gpu);
+        return 0;
+    }
+
+    for (step = 0; step < steps; step++)
+    {
+        begin = profileNow();
+        updateParticleArray(ps);
+        cpuSeconds += profileNow() - begin;
+        begin = profileNow();
+        updateParticleArray(gpu);
+        glFinish();                             // the step has run, not only been queued
+        gpuSeconds += profileNow() - begin;
+    }
+    particleSystemFetch(gpu);
+    particleSystemSetDevice(gpu, NULL);
+
+    n = ps->numberParticles;
+    a = malloc(n * sizeof(float));
+    b = malloc(n * sizeof(float));
+    if (gpu->numberParticles != n || a == NULL || b == NULL)
+    {
+        fprintf(stderr, "the GPU has %d particles, the CPU %d\n", gpu->numberParticles, n);
+        free(a);
+        free(b);
+        particleSystemDestroy(gpu);
+        return 0;
+    }
+    for (i = 0; i < n; i++)
+    {
+        close += fabsf(ps->positionX[i] - gpu->positionX[i]) < 1.0E-3f &&
+                 fabsf(ps->positionY[i] - gpu->positionY[i]) < 1.0E-3f &&
+                 fabsf(ps->positionZ[i] - gpu->positionZ[i]) < 1.0E-3f;
+    }
+
+    printf("%d particles, %d steps: %.3f ms a step on the CPU, %.3f on %s\n", n, steps,
+           cpuSeconds / steps * 1.0E3, gpuSeconds / steps * 1.0E3, (const char *) glGetString(GL_RENDERER));
+    printf("%-8s%12s%12s%12s%12s%10s%10s\n", "", "CPU mean", "GPU mean", "CPU sd", "GPU sd", "KS", "critical");
+    for (k = 0; k < CHECK_QUANTITIES; k++)
+    {
+        double sum[2] = { 0, 0 }, squares[2] = { 0, 0 }, distance;
+        double critical = CRITICAL * sqrt(2.0 / n);
+
+        for (i = 0; i < n; i++)
+        {
+            a[i] = quantity(ps, k, i);
+            b[i] = quantity(gpu, k, i);
+            sum[0] += a[i];
+            sum[1] += b[i];
+            squares[0] += (double) a[i] * a[i];
+            squares[1] += (double) b[i] * b[i];
+        }
+        qsort(a, n, sizeof(float), compareFloats);
+        qsort(b, n, sizeof(float), compareFloats);
+        distance = ksDistance(a, n, b, n);
+        passed = passed && distance <= critical;
+        printf("%-8s%12.5f%12.5f%12.5f%12.5f%10.5f%10.5f%s\n", names[k], sum[0] / n, sum[1] / n,
+               sqrt(fmax(squares[0] / n - sum[0] / n * sum[0] / n, 0)),
+               sqrt(fmax(squares[1] / n - sum[1] / n * sum[1] / n, 0)), distance, critical,
+               distance <= critical ? "" : "  DIFFERS");
+    }
+    printf("%.2f%% of the particles within 1e-3 of where the CPU put them\n", 100.0 * close / n);
+
+    free(a);
+    free(b);
+    particleSystemDestroy(gpu);
+    return passed;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-W width] [-H height] [-n particles] [-F frames] [-x script] [-f scene] [-t threads] [-S seed]\n"
+                    "       [-o prefix] [-p] [-a] [-r prefix] [-e tolerance] [-T trace] [-l snapshot] [-R recording] [-P recording]\n"
+                    "       [-B ms] [-q] [-M scenario] [-O results] [-b baseline] [-g percent] [-G] [-C steps]\n", name);
+    fprintf(stderr, "  -F   frames to draw without a script, %d by default\n", DEFAULT_FRAMES);
+    fprintf(stderr, "  -x   run the camera and settings script in this file (format in headless.c)\n");
+    fprintf(stderr, "  -o   write every frame to prefix00000.ppm, prefix00001.ppm, ...\n");
+    fprintf(stderr, "  -p   write PNG instead of PPM\n");
+    fprintf(stderr, "  -a   read the frames back asynchronously through pixel buffers\n");
+    fprintf(stderr, "  -r   compare every frame with the PPM of the same number under this prefix\n");
+    fprintf(stderr, "  -e   mean difference per channel a frame may have from its reference, 0.5 by default\n");
+    fprintf(stderr, "  -T   write the stage times of every frame to this file, JSON if it ends in .json\n");
+    fprintf(stderr, "  -l   start from the particles saved in this snapshot\n");
+    fprintf(stderr, "  -R   record every frame drawn to this file\n");
+    fprintf(stderr, "  -P   draw the frames of this recording, in a loop, instead of simulating\n");
+    fprintf(stderr, "  -B   hold the work of a frame to this budget, changing the particles and the detail\n");
+    fprintf(stderr, "  -q   draw the particles packed to 16 bytes each, as the viewer's --compact\n");
+    fprintf(stderr, "  -M   run the benchmark sweep in this scenario file (format in sweep.h) instead of a script\n");
+    fprintf(stderr, "  -O   write the sweep's results to this file, JSON if it ends in .json\n");
+    fprintf(stderr, "  -b   fail when the sweep is slower than the results in this CSV file\n");
+    fprintf(stderr, "  -g   percent slower than the baseline that counts, %.0f by default\n", SWEEP_THRESHOLD * 100);
+    fprintf(stderr, "  -G   step the particles on the GPU, drawing them from its buffers\n");
+    fprintf(stderr, "  -C   check the GPU's particles against the CPU's after this many steps, drawing nothing\n");
+}
+
+int main(int argc, char **argv)
+{
+    int count = 100;                            // the viewer's initial number of particles
+    int frames = DEFAULT_FRAMES;
+    const char *scriptPath = NULL;
+    int opt, ok;
+
+    while ((opt = getopt(argc, argv, "W:H:n:F:x:f:t:S:o:par:e:T:l:R:P:B:qM:O:b:g:GC:h")) != -1)
+    {
+        switch (opt)
+        {
+            case 'W':
+                width = atoi(optarg);
+                break;
+            case 'H':
+                height = atoi(optarg);
+                break;
+            case 'n':
+                count = atoi(optarg);
+                break;
+            case 'F':
+                frames = atoi(optarg);
+                break;
+            case 'x':
+                scriptPath = optarg;
+                break;
+            case 'f':
+                scenePath = optarg;
+                break;
+            case 't':
+                threads = atoi(optarg);
+                break;
+            case 'S':
+                seed = strtoull(optarg, NULL, 10);
+                break;
+            case 'o':
+                outputPrefix = optarg;
+                break;
+            case 'p':
+                png = 1;
+                break;
+            case 'a':
+                async = 1;
+                break;
+            case 'r':
+                referencePrefix = optarg;
+                break;
+            case 'e':
+                tolerance = atof(optarg);
+                break;
+            case 'T':
+                tracePath = optarg;
+                break;
+            case 'l':
+                loadPath = optarg;
+                break;
+            case 'R':
+                recordPath = optarg;
+                break;
+            case 'P':
+                playPath = optarg;
+                break;
+            case 'B':
+                frameBudget = atof(optarg) / 1000;
+                break;
+            case 'q':
+                packing = 1;
+                break;
+            case 'M':
+                scenarioPath = optarg;
+                break;
+            case 'O':
+                resultsPath = optarg;
+                break;
+            case 'b':
+                baselinePath = optarg;
+                break;
+            case 'g':
+                threshold = atof(optarg) / 100;
+                break;
+            case 'G':
+                onGPU = 1;
+                break;
+            case 'C':
+                checkSteps = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (width < 1 || height < 1 || count < 1 || frames < 0 || threads < 1 || tolerance < 0 ||
+        threshold < 0 || checkSteps < 0 || (scenarioPath != NULL && (scriptPath != NULL || frameBudget > 0 || playPath != NULL)) ||
+        (checkSteps > 0 && (scenePath != NULL || loadPath != NULL)))
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    profile = profileCreate();
+    if (profile != NULL && tracePath != NULL && !profileTrace(profile, tracePath))
+        fprintf(stderr, "cannot write the frame times to %s\n", tracePath);
+    pixels = malloc((size_t) width * height * 3);
+    image = malloc((size_t) width * height * 3);
+    reference = malloc((size_t) width * height * 3);
+    if (pixels == NULL || image == NULL || reference == NULL || !makeSystem(count) || !startContext())
+        return 1;
+    if (playPath != NULL && (playback = snapshotOpen(playPath)) == NULL)
+        return 1;
+    if (recordPath != NULL && (recording = snapshotWriterCreate(recordPath)) == NULL)
+    {
+        fprintf(stderr, "cannot record to %s\n", recordPath);
+        return 1;
+    }
+    worldDraw = worldDrawCreate(profile);
+    if (worldDraw == NULL || !startReadback())
+    {
+        fprintf(stderr, "cannot allocate the drawing state\n");
+        return 1;
+    }
+
+    startSettings();
+    if (frameBudget > 0 && profile != NULL)
+        budget = budgetCreate(frameBudget, ps->targetParticles, ps->scene != NULL ? ps->targetParticles : 100,
+                              ps->scene != NULL ? ps->targetParticles : MAX_PARTICLES, stdout);
+    glViewport(0, 0, width, height);
+    glMatrixMode(GL_PROJECTION);
+    gluPerspective(40.0,                        // field of view in degree
+                   (GLdouble) width / height,   // aspect ratio
+                   0.5,                         // z near
+                   40.0);                       // z far
+    if (onGPU && scenarioPath == NULL && checkSteps == 0 && !useGPU(1))
+        fprintf(stderr, "cannot simulate on the GPU, simulating on the CPU\n");
+
+    if (checkSteps > 0)
+        ok = crossCheck(count, checkSteps);
+    else if (scenarioPath != NULL)
+        ok = runSweep(count);
+    else if (scriptPath != NULL)
+        ok = runScript(scriptPath);
+    else
+    {
+        for (ok = 1; ok && frame < frames; )
+            ok = drawFrame(1);
+    }
+    ok = ok && flushReadback();
+
+    printf("%d frames of %d x %d, %d particles at the end\n", frame, width, height, ps->numberParticles);
+    if (scenarioPath == NULL && checkSteps == 0)        // a sweep has printed its own times
+        printf("%-8s%8s%8s%8s\n", "ms", "p50", "p95", "p99");
+    for (opt = 0; opt < NUMBER_STAGES && scenarioPath == NULL && checkSteps == 0; opt++)
+    {
+        printf("%-8s%8.2f%8.2f%8.2f\n", stageName(opt),
+               profilePercentile(profile, opt, 0.50) * 1.0E3,
+               profilePercentile(profile, opt, 0.95) * 1.0E3,
+               profilePercentile(profile, opt, 0.99) * 1.0E3);
+    }
+    if (referencePrefix != NULL)
+        printf("%d frames differ from their reference, the most by %.3f per channel\n", differing, worstDifference);
+
+    if (!snapshotWriterClose(recording))
+    {
+        fprintf(stderr, "cannot record to %s\n", recordPath);
+        ok = 0;
+    }
+    snapshotClose(playback);
+    budgetDestroy(budget);
+    compactFree(&packed);
+    worldDrawDestroy(worldDraw);
+    particleSystemDestroy(ps);
+    gpuSimulationDestroy(device);
+    profileDestroy(profile);
+    free(pixels);
+    free(image);
+    free(reference);
+    return ok && differing == 0 ? 0 : 1;
+}
+
+/* end of headless.c */
@@ -0,0 +1,664 @@
+//
+//  particles.c
+//
+//
+//  Created by BOWEN LI
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "particles.h"
+#include "update.h"
+#include "pool.h"
+#include "rng.h"
+#include "analytic.h"
+#include "scene.h"
+
+// particles are updated in chunks of this many, a multiple of every vector width
+#define CHUNK_SIZE 16384
+
+// particles are emitted in batches of this many: first all their random
+// values, then all their attributes, both loops free of calls and branches
+#define EMIT_BATCH 256
+
+// the random values every particle draws, in this order
+#define DRAW_HEIGHT 0
+#define DRAW_ANGLE 1
+#define DRAW_DIRECTION 2
+#define DRAW_VELOCITY 3
+#define DRAW_RED 4
+#define DRAW_GREEN 5
+#define DRAW_BLUE 6
+#define DRAW_ALPHA 7
+#define NUMBER_DRAWS 8
+
+#define RANDOM_RANGE(lo, hi, u) ((lo) + ((hi) - (lo)) * (u))
+#define DEGREES(a) ((a) * (float) (PI / 180.0))
+
+// sine and cosine of small angles as Taylor series, good to float precision
+// for |x| below 0.3 (about 17 degrees)
+static inline float smallSin(float x)
+{
+    float x2 = x * x;
+    return x * (1.0f - x2 * (1.0f / 6.0f) * (1.0f - x2 * (1.0f / 20.0f) * (1.0f - x2 * (1.0f / 42.0f))));
+}
+
+static inline float smallCos(float x)
+{
+    float x2 = x * x;
+    return 1.0f - x2 * 0.5f * (1.0f - x2 * (1.0f / 12.0f) * (1.0f - x2 * (1.0f / 30.0f) * (1.0f - x2 * (1.0f / 56.0f))));
+}
+
+// capacities are whole multiples of this, so even the down bits fill cache lines
+#define CAPACITY_STEP (CACHE_LINE * 8)
+
+// every array of the system and the bytes one particle takes in it; the down
+// bits are listed by the bytes of a whole CAPACITY_STEP instead. The arrays
+// of the analytic mode and of a scene follow when they are on, so that they
+// resize together.
+#define NUMBER_ARRAYS 13
+#define BITSET_ARRAY 11
+#define COLOR_ARRAY 12
+#define MAX_ARRAYS (NUMBER_ARRAYS + ANALYTIC_ARRAYS + SCENE_ARRAYS)
+
+static int listArrays(struct particleSystem *ps, void **arrays[MAX_ARRAYS])
+{
+    int numberArrays = NUMBER_ARRAYS;
+
+    arrays[0] = (void **) &ps->positionX;
+    arrays[1] = (void **) &ps->positionY;
+    arrays[2] = (void **) &ps->positionZ;
+    arrays[3] = (void **) &ps->previousX;
+    arrays[4] = (void **) &ps->previousY;
+    arrays[5] = (void **) &ps->previousZ;
+    arrays[6] = (void **) &ps->particleTime;
+    arrays[7] = (void **) &ps->velocityXZ;
+    arrays[8] = (void **) &ps->velocityY;
+    arrays[9] = (void **) &ps->directionX;
+    arrays[10] = (void **) &ps->directionZ;
+    arrays[BITSET_ARRAY] = (void **) &ps->down;
+    arrays[COLOR_ARRAY] = (void **) &ps->colorList;
+    numberArrays += analyticArrays(ps->analytic, arrays + numberArrays);
+    numberArrays += sceneArrays(ps->scene, arrays + numberArrays);
+    return numberArrays;
+}
+
+static size_t arrayBytes(int array, int particles)
+{
+    if (array == BITSET_ARRAY)
+        return particles / 8;
+    if (array == COLOR_ARRAY)
+        return particles * 4;
+    return particles * sizeof(float);
+}
+
+// move every array to a new capacity, keeping the first keep particles
+static int reallocate(struct particleSystem *ps, int capacity, int keep)
+{
+    void **arrays[MAX_ARRAYS];
+    void *fresh[MAX_ARRAYS];
+    int numberArrays = listArrays(ps, arrays);
+    int array;
+
+    for (array = 0; array < numberArrays; array++)
+    {
+        fresh[array] = NULL;
+        if (capacity > 0 && posix_memalign(&fresh[array], CACHE_LINE, arrayBytes(array, capacity)) != 0)
+        {
+            while (array-- > 0)
+                free(fresh[array]);
+            return 0;
+        }
+    }
+
+    // whole bit words are copied, so keep is rounded up; the arrays are
+    // large enough as capacity is a multiple of CAPACITY_STEP
+    keep = (keep + 31) / 32 * 32;
+    for (array = 0; array < numberArrays; array++)
+    {
+        if (keep > 0)
+            memcpy(fresh[array], *arrays[array], arrayBytes(array, keep));
+        free(*arrays[array]);
+        *arrays[array] = fresh[array];
+    }
+    ps->capacity = capacity;
+    return 1;
+}
+
+struct particleSystem *particleSystemCreate(void)
+{
+    struct particleSystem *ps = calloc(1, sizeof(*ps));
+    if (ps == NULL)
+        return NULL;
+
+    ps->meanVelocity = 3.0;
+    ps->gravity = 2.0;
+    ps->kernel = bestKernel();
+    ps->threads = 1;
+    ps->maxSteps = 4;
+    ps->emitRate = 200000;
+    return ps;
+}
+
+void particleSystemDestroy(struct particleSystem *ps)
+{
+    if (ps == NULL)
+        return;
+    analyticDestroy(ps->analytic);
+    ps->analytic = NULL;
+    reallocate(ps, 0, 0);
+    sceneDestroy(ps->scene);
+    poolDestroy(ps->pool);
+    free(ps);
+}
+
+// grow by half again at least, and only give memory back once three quarters
+// of it is unused, so that small changes do not copy the particles around;
+// the memory for the target is kept while the count makes its way there
+static int setNumberParticles(struct particleSystem *ps, int numberParticles)
+{
+    int capacity = ps->capacity;
+    int reserve = numberParticles > ps->targetParticles ? numberParticles : ps->targetParticles;
+    int keep = numberParticles < ps->numberParticles ? numberParticles : ps->numberParticles;
+
+    if (numberParticles < 0)
+        return 0;
+    if (numberParticles > capacity)
+        capacity = numberParticles > capacity + capacity / 2 ? numberParticles : capacity + capacity / 2;
+    else if (reserve < capacity / 4)
+        capacity = reserve;
+    capacity = (capacity + CAPACITY_STEP - 1) / CAPACITY_STEP * CAPACITY_STEP;
+
+    if (capacity != ps->capacity && !reallocate(ps, capacity, keep))
+        return 0;
+    ps->numberParticles = numberParticles;
+    if (ps->analytic != NULL)
+        analyticResized(ps, keep);
+    return 1;
+}
+
+int particleSystemResize(struct particleSystem *ps, int numberParticles)
+{
+    int target = ps->targetParticles;
+
+    ps->targetParticles = numberParticles;
+    if (!setNumberParticles(ps, numberParticles))
+    {
+        ps->targetParticles = target;
+        return 0;
+    }
+    ps->emitCarry = 0;
+    return 1;
+}
+
+// the whole way up is allocated now, so the steps that emit never copy the
+// particles to bigger arrays
+int particleSystemSetTarget(struct particleSystem *ps, int target)
+{
+    int capacity = (target + CAPACITY_STEP - 1) / CAPACITY_STEP * CAPACITY_STEP;
+
+    if (target < 0 || ps->scene != NULL)        // the emitters of a scene keep their counts
+        return 0;
+    if (capacity > ps->capacity && !reallocate(ps, capacity, ps->numberParticles))
+        return 0;
+    ps->targetParticles = target;
+    return 1;
+}
+
+// initialise the attributes of particles [first, end), each from its own
+// stream (seed, i, counter)
+static void emitRange(struct particleSystem *ps, int first, int end, uint64_t counter)
+{
+    const float sin65 = sin(DEGREES(65.0)), cos65 = cos(DEGREES(65.0));
+    float random[NUMBER_DRAWS][EMIT_BATCH];
+    uint32_t key[EMIT_BATCH];
+    uint32_t base = rngBase(ps->seed, counter);
+    float meanVelocity = ps->meanVelocity;
+    float *positionX = ps->positionX, *positionY = ps->positionY, *positionZ = ps->positionZ;
+    float *previousX = ps->previousX, *previousY = ps->previousY, *previousZ = ps->previousZ;
+    float *particleTime = ps->particleTime;
+    float *velocityXZ = ps->velocityXZ, *velocityY = ps->velocityY;
+    float *directionX = ps->directionX, *directionZ = ps->directionZ;
+    uint8_t (*colorList)[4] = ps->colorList;
+    int batch, count, i, k, draw;
+
+    for (batch = first; batch < end; batch += EMIT_BATCH)
+    {
+        count = end - batch < EMIT_BATCH ? end - batch : EMIT_BATCH;
+        for (k = 0; k < count; k++)
+            key[k] = rngKey(base, batch + k);
+        for (draw = 0; draw < NUMBER_DRAWS; draw++)
+        {
+            for (k = 0; k < count; k++)
+                random[draw][k] = rngUniform(key[k], draw);
+        }
+
+        for (k = 0; k < count; k++)
+        {
+            // emitting angle in [60,70] and direction in [-15,15] degrees,
+            // the angle taken as 65 degrees plus a small one
+            float angle = DEGREES(RANDOM_RANGE(-5.0f, 5.0f, random[DRAW_ANGLE][k]));
+            float direction = DEGREES(RANDOM_RANGE(-15.0f, 15.0f, random[DRAW_DIRECTION][k]));
+            float velocity = meanVelocity + RANDOM_RANGE(-1.0f, 1.0f, random[DRAW_VELOCITY][k]);
+            float sinAngle = smallSin(angle), cosAngle = smallCos(angle);
+            float color[4];
+
+            i = batch + k;
+            positionX[i] = 0.0;                                             // x coordinate
+            positionY[i] = RANDOM_RANGE(8.0f, 10.0f, random[DRAW_HEIGHT][k]);
+            positionZ[i] = 0.0;                                             // z coordinate
+            particleTime[i] = 0.0;                                          // initialise the life time of each particle
+            directionX[i] = smallCos(direction);                            // x direction
+            directionZ[i] = smallSin(direction);                            // z direction
+            velocityXZ[i] = velocity * (cos65 * cosAngle - sin65 * sinAngle);
+            velocityY[i] = velocity * (sin65 * cosAngle + cos65 * sinAngle);
+            color[0] = RANDOM_RANGE(0.1f, 1.0f, random[DRAW_RED][k]);
+            color[1] = RANDOM_RANGE(0.1f, 1.0f, random[DRAW_GREEN][k]);
+            color[2] = RANDOM_RANGE(0.1f, 1.0f, random[DRAW_BLUE][k]);
+            color[3] = RANDOM_RANGE(0.7f, 1.0f, random[DRAW_ALPHA][k]);
+            packColor(colorList[i], color);                                 // kept as the bytes drawn
+
+            // a new particle is drawn where it starts, not on its way there
+            previousX[i] = positionX[i];
+            previousY[i] = positionY[i];
+            previousZ[i] = positionZ[i];
+        }
+        // every new particle starts in down direction
+        for (i = batch; i < batch + count; i++)
+            setParticleDown(ps, i, 1);
+    }
+}
+
+struct emitJob
+{
+    struct particleSystem *ps;
+    int first, end;
+    uint64_t counter;
+};
+
+// chunks start at whole multiples of CHUNK_SIZE, so two threads never share
+// a word of down bits
+static void emitChunk(void *context, int chunk)
+{
+    struct emitJob *job = context;
+    int first = (job->first / CHUNK_SIZE + chunk) * CHUNK_SIZE;
+    int end = first + CHUNK_SIZE < job->end ? first + CHUNK_SIZE : job->end;
+
+    emitRange(job->ps, first > job->first ? first : job->first, end, job->counter);
+}
+
+// spawns between two steps and respawns inside a step use different counters,
+// so a particle never draws the same numbers twice
+void emitParticles(struct particleSystem *ps, int first, int count)
+{
+    struct emitJob job = { ps, first, first + count, 2 * ps->step };
+    int chunks = (first + count + CHUNK_SIZE - 1) / CHUNK_SIZE - first / CHUNK_SIZE;
+
+    if (ps->scene != NULL)
+    {
+        sceneEmit(ps, first, count, job.counter);
+        return;
+    }
+    if (ps->pool != NULL && chunks > 1)
+        poolRun(ps->pool, chunks, emitChunk, &job);
+    else
+        emitRange(ps, first, first + count, job.counter);
+    if (ps->analytic != NULL)
+        analyticEmit(ps, first, count);
+    if (ps->device != NULL)
+        ps->device->emitted(ps->device, ps, first, count);
+}
+
+// initialise each particle's attributes
+void pointInt(struct particleSystem *ps, int i)
+{
+    emitParticles(ps, i, 1);
+}
+
+void respawnParticle(struct particleSystem *ps, int i)
+{
+    respawnParticleStep(ps, i, ps->step);
+}
+
+// a particle past the target dies instead, marked by a negative time until
+// retireParticles() takes it out; the index decides, so threads need not agree
+void respawnParticleStep(struct particleSystem *ps, int i, uint64_t step)
+{
+    if (i >= ps->targetParticles)
+        ps->particleTime[i] = -1;
+    else
+        emitRange(ps, i, i + 1, 2 * step + 1);
+}
+
+// emit this step's share of emitRate, seconds long, while below the target
+static void emitDue(struct particleSystem *ps, double seconds)
+{
+    int first = ps->numberParticles, count;
+
+    if (first >= ps->targetParticles)
+    {
+        ps->emitCarry = 0;
+        return;
+    }
+    ps->emitCarry += ps->emitRate * seconds;
+    count = (int) ps->emitCarry;
+    ps->emitCarry -= count;
+    if (count > ps->targetParticles - first)
+        count = ps->targetParticles - first;
+    if (count == 0)
+        return;
+    if (!setNumberParticles(ps, first + count))
+    {
+        ps->targetParticles = first;            // stay where the memory ran out
+        return;
+    }
+    emitParticles(ps, first, count);
+}
+
+// the particles of the last step that outlived the lifetime start again, or
+// die when past the target
+static void expireParticles(struct particleSystem *ps)
+{
+    const float lifetime = ps->lifetime;
+    int i;
+
+    for (i = 0; i < ps->numberParticles; i++)
+    {
+        if (ps->particleTime[i] > lifetime)
+            respawnParticle(ps, i);
+    }
+}
+
+// take the dead particles out, keeping the live ones in [0, numberParticles):
+// the last live particle moves into each hole. Only particles past the target
+// die, so only those are looked at.
+static void retireParticles(struct particleSystem *ps)
+{
+    void **arrays[MAX_ARRAYS];
+    int numberArrays, array;
+    int end = ps->numberParticles;
+    int i = ps->targetParticles;
+
+    if (end <= i)
+        return;
+    numberArrays = listArrays(ps, arrays);
+    while (i < end)
+    {
+        if (ps->particleTime[i] >= 0)
+        {
+            i++;
+            continue;
+        }
+        if (i != --end)
+        {
+            for (array = 0; array < numberArrays; array++)
+            {
+                size_t bytes = arrayBytes(array, 1);
+                char *base = *arrays[array];
+
+                if (array != BITSET_ARRAY)
+                    memcpy(base + i * bytes, base + end * bytes, bytes);
+            }
+            setParticleDown(ps, i, particleDown(ps, end));
+        }
+    }
+    if (end == ps->numberParticles)
+        return;
+    setNumberParticles(ps, end);                // shrinking always succeeds
+    if (ps->analytic != NULL)
+        analyticReschedule(ps);
+}
+
+// create particles
+void makeParticleArray(struct particleSystem *ps)
+{
+    emitParticles(ps, 0, ps->numberParticles);
+}
+
+// the kernels in the order of the KERNEL_ constants
+static const struct
+{
+    const char *name;
+    updateKernel update;
+} kernels[NUMBER_KERNELS] = {
+    { "reference", updateReference },
+    { "scalar", updateScalar },
+#ifdef HAVE_X86_KERNELS
+    { "sse", updateSSE },
+    { "avx2", updateAVX2 },
+#else
+    { "sse", NULL },
+    { "avx2", NULL },
+#endif
+};
+
+const char *kernelName(int kernel)
+{
+    if (kernel < 0 || kernel >= NUMBER_KERNELS)
+        return "unknown";
+    return kernels[kernel].name;
+}
+
+int kernelByName(const char *name)
+{
+    int kernel;
+    for (kernel = 0; kernel < NUMBER_KERNELS; kernel++)
+    {
+        if (strcmp(kernels[kernel].name, name) == 0)
+            return kernel;
+    }
+    return -1;
+}
+
+// whether this processor can run the kernel
+int kernelSupported(int kernel)
+{
+    if (kernel < 0 || kernel >= NUMBER_KERNELS || kernels[kernel].update == NULL)
+        return 0;
+#ifdef HAVE_X86_KERNELS
+    if (kernel == KERNEL_SSE)
+        return __builtin_cpu_supports("sse2");
+    if (kernel == KERNEL_AVX2)
+        return __builtin_cpu_supports("avx2");
+#endif
+    return 1;
+}
+
+int bestKernel(void)
+{
+    int kernel;
+    for (kernel = NUMBER_KERNELS - 1; kernel > KERNEL_SCALAR; kernel--)
+    {
+        if (kernelSupported(kernel))
+            return kernel;
+    }
+    return KERNEL_SCALAR;
+}
+
+// choose the update kernel, returns 0 when the processor cannot run it
+int particleSystemSetKernel(struct particleSystem *ps, int kernel)
+{
+    if (!kernelSupported(kernel))
+        return 0;
+    ps->kernel = kernel;
+    return 1;
+}
+
+// update threads as many as the caller asks for, 1 keeps everything on the calling thread
+int particleSystemSetThreads(struct particleSystem *ps, int threads)
+{
+    struct workerPool *pool = NULL;
+
+    if (threads < 1)
+        return 0;
+    if (threads == ps->threads)
+        return 1;
+    if (threads > 1)
+    {
+        pool = poolCreate(threads);
+        if (pool == NULL)
+            return 0;
+    }
+    poolDestroy(ps->pool);
+    ps->pool = pool;
+    ps->threads = threads;
+    return 1;
+}
+
+static void updateChunk(void *context, int chunk)
+{
+    struct particleSystem *ps = context;
+    int begin = chunk * CHUNK_SIZE;
+    int end = begin + CHUNK_SIZE < ps->numberParticles ? begin + CHUNK_SIZE : ps->numberParticles;
+
+    kernels[ps->kernel].update(ps, begin, end);
+}
+
+// advance every live particle by TIME_DELTA; every particle only depends on
+// itself and its own random stream, so the result is the same for any number
+// of threads
+void updateParticleArray(struct particleSystem *ps)
+{
+    int chunks = (ps->numberParticles + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    float *current;
+
+    emitDue(ps, TIME_DELTA);
+    if (ps->analytic != NULL)
+    {
+        analyticAdvance(ps, TIME_DELTA);
+        retireParticles(ps);
+        ps->blend = 1;
+        return;
+    }
+
+    // the device cannot move its last particles into holes, so the ones past
+    // the target go now, shrinking always succeeding
+    if (ps->device != NULL)
+    {
+        if (ps->numberParticles > ps->targetParticles)
+            setNumberParticles(ps, ps->targetParticles);
+        ps->device->update(ps->device, ps);
+        ps->step++;
+        ps->blend = 1;
+        return;
+    }
+
+    // the kernels read the old positions from previous and write the new
+    // ones, so keeping the last step costs no copy
+    current = ps->positionX; ps->positionX = ps->previousX; ps->previousX = current;
+    current = ps->positionY; ps->positionY = ps->previousY; ps->previousY = current;
+    current = ps->positionZ; ps->positionZ = ps->previousZ; ps->previousZ = current;
+
+    if (ps->scene != NULL)
+        sceneUpdate(ps);
+    else if (ps->pool != NULL && chunks > 1)
+        poolRun(ps->pool, chunks, updateChunk, ps);
+    else
+        kernels[ps->kernel].update(ps, 0, ps->numberParticles);
+    if (ps->lifetime > 0 && ps->scene == NULL)
+        expireParticles(ps);
+    retireParticles(ps);
+    ps->step++;
+    ps->blend = 1;                              // drawn where the step left them
+}
+
+int particleSystemAdvance(struct particleSystem *ps, double elapsed)
+{
+    int steps = 0;
+
+    // positions from time need no steps, only the same limit on catching up
+    if (ps->analytic != NULL)
+    {
+        if (elapsed > ps->maxSteps * TIME_DELTA)
+            elapsed = ps->maxSteps * TIME_DELTA;
+        if (elapsed <= 0)
+            return 0;
+        emitDue(ps, elapsed);
+        analyticAdvance(ps, elapsed);
+        retireParticles(ps);
+        ps->blend = 1;
+        if (ps->stepped != NULL)
+            ps->stepped(ps);
+        return 1;
+    }
+
+    ps->lag += elapsed;
+    while (ps->lag >= TIME_DELTA && steps < ps->maxSteps)
+    {
+        updateParticleArray(ps);
+        ps->lag -= TIME_DELTA;
+        steps++;
+        if (ps->stepped != NULL)
+            ps->stepped(ps);
+    }
+    if (ps->lag >= TIME_DELTA)                  // too far behind to catch up
+        ps->lag = fmod(ps->lag, TIME_DELTA);
+    ps->blend = ps->lag / TIME_DELTA;
+    return steps;
+}
+
+int particleSystemSetAnalytic(struct particleSystem *ps, int analytic)
+{
+    if (analytic && ps->analytic == NULL)
+    {
+        if (ps->scene != NULL || ps->device != NULL)    // only the waterfall in the arrays has a closed form
+            return 0;
+        ps->analytic = analyticCreate(ps);
+        return ps->analytic != NULL;
+    }
+    if (!analytic && ps->analytic != NULL)
+    {
+        analyticStore(ps, ps->analytic);
+        analyticDestroy(ps->analytic);
+        ps->analytic = NULL;
+    }
+    return 1;
+}
+
+// the particles are all emitted again, from the scene's emitters or the
+// waterfall, so the arrays can be made afresh with the scene's among them
+int particleSystemSetScene(struct particleSystem *ps, struct scene *scene, int numberParticles)
+{
+    struct scene *previous = ps->scene;
+
+    particleSystemSetDevice(ps, NULL);          // the device only steps the waterfall
+    particleSystemSetAnalytic(ps, 0);
+    reallocate(ps, 0, 0);
+    ps->numberParticles = 0;
+    ps->scene = scene;
+    if (scene != NULL)
+        numberParticles = sceneParticles(scene);
+    if (previous != scene)
+        sceneDestroy(previous);
+    if (!particleSystemResize(ps, numberParticles))
+    {
+        sceneDestroy(scene);
+        ps->scene = NULL;
+        return 0;
+    }
+    makeParticleArray(ps);
+    return 1;
+}
+
+int particleSystemSetDevice(struct particleSystem *ps, struct particleDevice *device)
+{
+    if (device == ps->device)
+        return 1;
+    if (device != NULL && (ps->analytic != NULL || ps->scene != NULL))
+        return 0;
+    particleSystemFetch(ps);
+    ps->device = device;
+    if (device != NULL)
+        device->emitted(device, ps, 0, ps->numberParticles);
+    return 1;
+}
+
+void particleSystemFetch(struct particleSystem *ps)
+{
+    if (ps->device != NULL)
+        ps->device->fetch(ps->device, ps);
+}
+
+/* end of particles.c */
@@ -0,0 +1,211 @@
+//
+//  particles.h
+//
+//
+//  Created by BOWEN LI
+//
+//  The waterfall simulation on its own, without any GLUT or OpenGL, so that
+//  the viewer and the headless benchmark share exactly the same update code.
+//
+
+#ifndef PARTICLES_H
+#define PARTICLES_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "compact.h"
+
+#define PI 3.1415926
+
+// the speed of time
+#define TIME_DELTA 0.025
+
+// modelling units of ground extent in each X and Z direction
+#define EDGE 10
+
+// round a particle count up to whole cache lines of floats
+#define CACHE_LINE 64
+#define LINE_FLOATS (CACHE_LINE / sizeof(float))
+
+struct particleSystem;
+
+// somewhere else the particles live and are stepped, such as the GL buffers of
+// gpusim.h. The arrays then only hold the particles as they were emitted,
+// until particleSystemFetch() reads them back.
+struct particleDevice
+{
+    // particles [first, first + count) were just emitted into the arrays,
+    // which have room for capacity particles: take them over
+    void (*emitted)(struct particleDevice *device, const struct particleSystem *ps, int first, int count);
+
+    // advance the numberParticles particles by TIME_DELTA, as the kernels
+    // would, respawning the ones that leave EDGE or outlive the lifetime
+    void (*update)(struct particleDevice *device, const struct particleSystem *ps);
+
+    // the particles back into the arrays
+    void (*fetch)(struct particleDevice *device, struct particleSystem *ps);
+};
+
+// the particles as a structure of arrays, each array 64-byte aligned and
+// sized for capacity particles, which follows numberParticles up and down
+struct particleSystem
+{
+    int numberParticles;                        // number of live particles
+    int capacity;                               // number of particles the arrays can hold
+
+    // hot: read or written by every update
+    float *positionX;                           // the position of each particles
+    float *positionY;
+    float *positionZ;
+    float *previousX;                           // the position one step earlier; an update
+    float *previousY;                           // swaps the two and writes the new positions
+    float *previousZ;
+    float *particleTime;                        // the lifetime of each particles
+    float *velocityXZ;                          // velocity in xz plane
+    float *velocityY;                           // velocity in y direction
+    float *directionX;                          // unit direction in xz plane
+    float *directionZ;
+    uint32_t *down;                             // one bit per particle: in down direction
+
+    // cold: written once when the particle is spawned
+    uint8_t (*colorList)[4];                    // RGBA bytes, as GL takes them
+
+    float meanVelocity;                         // decide the speed of emitting
+    float gravity;                              // decide the speed of dropping
+    int targetParticles;                        // live particles wanted, see particleSystemSetTarget()
+    float emitRate;                             // particles emitted per second on the way there
+    float emitCarry;                            // the part of a particle owed to the next step
+    float lifetime;                             // seconds a particle lives at most, 0 for no limit
+    int kernel;                                 // which KERNEL_ runs updateParticleArray()
+    uint64_t seed;                              // decide all the random values
+    uint64_t step;                              // number of updates so far
+    int threads;                                // threads sharing updateParticleArray()
+    struct workerPool *pool;
+
+    struct analyticState *analytic;             // positions from time instead, NULL when stepped
+    struct scene *scene;                        // emitters, colliders and fields, NULL for the waterfall
+    double lag;                                 // real time not yet simulated, in seconds
+    int maxSteps;                               // steps particleSystemAdvance() may take at once
+    float blend;                                // how far from previous to current to draw
+    const struct compactParticles *compact;     // a drawn copy packed instead of the arrays, or NULL
+    struct particleDevice *device;              // where the particles are stepped instead, or NULL
+    void (*stepped)(struct particleSystem *ps); // run after every step advanced, or NULL
+};
+
+// the down bit of particle i
+static inline int particleDown(const struct particleSystem *ps, int i)
+{
+    return (ps->down[i >> 5] >> (i & 31)) & 1;
+}
+
+static inline void setParticleDown(struct particleSystem *ps, int i, int down)
+{
+    uint32_t bit = 1U << (i & 31);
+    ps->down[i >> 5] = down ? ps->down[i >> 5] | bit : ps->down[i >> 5] & ~bit;
+}
+
+// where to draw particle i: blend of the way from its previous position to
+// its current one. For a particle here and there; the loops over them all
+// choose between the arrays and a compact frame once (see vertices.h).
+static inline void drawPosition(const struct particleSystem *ps, int i, float position[3])
+{
+    float blend = ps->blend;
+
+    if (ps->compact != NULL)
+    {
+        compactPosition(ps->compact, i, blend, position);
+        return;
+    }
+    position[0] = ps->previousX[i] + blend * (ps->positionX[i] - ps->previousX[i]);
+    position[1] = ps->previousY[i] + blend * (ps->positionY[i] - ps->previousY[i]);
+    position[2] = ps->previousZ[i] + blend * (ps->positionZ[i] - ps->previousZ[i]);
+}
+
+// the colour of particle i as the bytes GL takes
+static inline void drawColor(const struct particleSystem *ps, int i, uint8_t color[4])
+{
+    const uint8_t *packed = ps->compact != NULL ? ps->compact->color[i] : ps->colorList[i];
+
+    color[0] = packed[0];
+    color[1] = packed[1];
+    color[2] = packed[2];
+    color[3] = packed[3];
+}
+
+// the update kernels, see update.c for how closely they agree
+#define KERNEL_REFERENCE 0                      // the original loop
+#define KERNEL_SCALAR 1                         // branch-free, any processor
+#define KERNEL_SSE 2
+#define KERNEL_AVX2 3
+#define NUMBER_KERNELS 4
+
+// create a system with no particle alive yet
+struct particleSystem *particleSystemCreate(void);
+void particleSystemDestroy(struct particleSystem *ps);
+
+// change numberParticles, growing or shrinking the arrays to suit; the first
+// particles are kept, new ones still have to be emitted. Returns 0 when the
+// memory cannot be found, leaving the system as it was. The target becomes
+// numberParticles too.
+int particleSystemResize(struct particleSystem *ps, int numberParticles);
+
+// let the count move to target gradually: every step emits its share of
+// emitRate until there are target particles, and particles past target
+// retire instead of respawning, the last live one taking the place of each.
+// The memory for target is found at once; returns 0 when it cannot be.
+int particleSystemSetTarget(struct particleSystem *ps, int target);
+
+// initialise each particle's attributes
+void pointInt(struct particleSystem *ps, int i);
+
+// initialise count particles from first on, as pointInt() does one by one
+void emitParticles(struct particleSystem *ps, int first, int count);
+
+// create particles
+void makeParticleArray(struct particleSystem *ps);
+
+// advance every live particle by TIME_DELTA
+void updateParticleArray(struct particleSystem *ps);
+
+// advance by elapsed seconds of real time: as many whole steps of TIME_DELTA
+// as have come due, but at most maxSteps (4 by default), and set blend to the
+// fraction of a step left over. Time beyond maxSteps is dropped, so a slow
+// frame slows the simulation down rather than making the next frame slower
+// still. stepped, when set, runs after each of the steps, so none of them is
+// missed by what it records; positions from time have no steps between, and
+// run it once per advance. Returns the number of steps taken.
+int particleSystemAdvance(struct particleSystem *ps, double elapsed);
+
+// pick the update kernel; particleSystemCreate() already chooses bestKernel()
+const char *kernelName(int kernel);
+int kernelByName(const char *name);             // -1 if there is no such kernel
+int kernelSupported(int kernel);
+int bestKernel(void);
+int particleSystemSetKernel(struct particleSystem *ps, int kernel);
+
+// share the update among threads (1 by default), returns 0 if they cannot start
+int particleSystemSetThreads(struct particleSystem *ps, int threads);
+
+// compute the positions in closed form from time instead of stepping them
+// (see analytic.h); returns 0 when the memory cannot be found, or with a scene
+int particleSystemSetAnalytic(struct particleSystem *ps, int analytic);
+
+// simulate a scene (see scene.h) instead of the waterfall, or the waterfall
+// again with numberParticles for a NULL scene; the system owns the scene from
+// then on. Every particle is emitted afresh. Returns 0 when the memory cannot
+// be found, leaving the system empty and without a scene.
+int particleSystemSetScene(struct particleSystem *ps, struct scene *scene, int numberParticles);
+
+// step the particles on device instead of in the arrays, from the particles
+// the arrays hold now, or in the arrays again, from what device held, for a
+// NULL device. The system does not own the device. Returns 0 for the
+// analytic mode or a scene, which only the arrays can step. On a device,
+// particles past the target go at once rather than as they land.
+int particleSystemSetDevice(struct particleSystem *ps, struct particleDevice *device);
+
+// read the particles back from the device into the arrays, if they are on one
+void particleSystemFetch(struct particleSystem *ps);
+
+#endif
+
+/* end of particles.h */
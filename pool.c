@@ -0,0 +1,222 @@
+//
+//  pool.c
+//
+//
+//  Created by BOWEN LI
+//
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "pool.h"
+
+// the chunks a worker has left, first in the high half and end in the low
+// half of one word so the owner and the thieves agree through one CAS
+struct share
+{
+    _Atomic uint64_t range;
+    char padding[64 - sizeof(uint64_t)];        // one cache line each
+};
+
+struct worker
+{
+    struct workerPool *pool;
+    int id;
+    pthread_t thread;
+};
+
+struct workerPool
+{
+    int threads;
+    struct worker *workers;                     // workers[0] is the calling thread
+    struct share *shares;
+    poolTask task;
+    void *context;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;                        // a new job or quit
+    pthread_cond_t done;                        // the last worker finished the job
+    unsigned job;                               // counts the jobs handed out
+    int running;                                // workers still busy with the job
+    int quit;
+};
+
+#define RANGE(first, end) (((uint64_t) (first) << 32) | (uint32_t) (end))
+
+// the next chunk from the front of the worker's own share, -1 if empty
+static int takeFirst(struct share *share)
+{
+    uint64_t range = atomic_load(&share->range);
+    for (;;)
+    {
+        uint32_t first = range >> 32, end = (uint32_t) range;
+        if (first >= end)
+            return -1;
+        if (atomic_compare_exchange_weak(&share->range, &range, RANGE(first + 1, end)))
+            return first;
+    }
+}
+
+// the last chunk of somebody else's share, -1 if empty
+static int takeLast(struct share *share)
+{
+    uint64_t range = atomic_load(&share->range);
+    for (;;)
+    {
+        uint32_t first = range >> 32, end = (uint32_t) range;
+        if (first >= end)
+            return -1;
+        if (atomic_compare_exchange_weak(&share->range, &range, RANGE(first, end - 1)))
+            return end - 1;
+    }
+}
+
+// work through the own share, then steal until every share is empty
+static void runChunks(struct workerPool *pool, int id)
+{
+    int chunk, victim;
+
+    while ((chunk = takeFirst(&pool->shares[id])) >= 0)
+        pool->task(pool->context, chunk);
+
+    for (victim = (id + 1) % pool->threads; victim != id; )
+    {
+        chunk = takeLast(&pool->shares[victim]);
+        if (chunk >= 0)
+            pool->task(pool->context, chunk);
+        else
+            victim = (victim + 1) % pool->threads;
+    }
+}
+
+static void *workerMain(void *argument)
+{
+    struct worker *worker = argument;
+    struct workerPool *pool = worker->pool;
+    unsigned seen = 0;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->job == seen && !pool->quit)
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        if (pool->quit)
+        {
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+        seen = pool->job;
+        pthread_mutex_unlock(&pool->lock);
+
+        runChunks(pool, worker->id);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->running == 0)
+            pthread_cond_signal(&pool->done);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+struct workerPool *poolCreate(int threads)
+{
+    struct workerPool *pool;
+    int i;
+
+    if (threads < 1)
+        return NULL;
+    pool = calloc(1, sizeof(*pool));
+    if (pool == NULL)
+        return NULL;
+    pool->workers = calloc(threads, sizeof(*pool->workers));
+    pool->shares = calloc(threads, sizeof(*pool->shares));
+    if (pool->workers == NULL || pool->shares == NULL)
+    {
+        free(pool->workers);
+        free(pool->shares);
+        free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    pthread_cond_init(&pool->done, NULL);
+
+    pool->threads = 1;
+    pool->workers[0].pool = pool;
+    for (i = 1; i < threads; i++)
+    {
+        pool->workers[i].pool = pool;
+        pool->workers[i].id = i;
+        if (pthread_create(&pool->workers[i].thread, NULL, workerMain, &pool->workers[i]) != 0)
+        {
+            poolDestroy(pool);
+            return NULL;
+        }
+        pool->threads++;
+    }
+    return pool;
+}
+
+void poolDestroy(struct workerPool *pool)
+{
+    int i;
+
+    if (pool == NULL)
+        return;
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = 1;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+    for (i = 1; i < pool->threads; i++)
+        pthread_join(pool->workers[i].thread, NULL);
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->wake);
+    pthread_cond_destroy(&pool->done);
+    free(pool->workers);
+    free(pool->shares);
+    free(pool);
+}
+
+int poolThreads(const struct workerPool *pool)
+{
+    return pool->threads;
+}
+
+void poolRun(struct workerPool *pool, int chunks, poolTask task, void *context)
+{
+    int i;
+
+    if (chunks <= 0)
+        return;
+    if (pool->threads == 1 || chunks == 1)
+    {
+        for (i = 0; i < chunks; i++)
+            task(context, i);
+        return;
+    }
+
+    // contiguous shares of nearly equal size, one per worker
+    pool->task = task;
+    pool->context = context;
+    for (i = 0; i < pool->threads; i++)
+    {
+        int first = (int) ((long long) chunks * i / pool->threads);
+        int end = (int) ((long long) chunks * (i + 1) / pool->threads);
+        atomic_store(&pool->shares[i].range, RANGE(first, end));
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->running = pool->threads - 1;
+    pool->job++;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    runChunks(pool, 0);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->running > 0)
+        pthread_cond_wait(&pool->done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* end of pool.c */
@@ -0,0 +1,29 @@
+//
+//  pool.h
+//
+//
+//  Created by BOWEN LI
+//
+//  A set of worker threads that stay alive between steps. poolRun() hands
+//  them a numbered list of chunks; each worker starts on its own share and,
+//  once that is empty, steals chunks from the back of the others' shares.
+//
+
+#ifndef POOL_H
+#define POOL_H
+
+struct workerPool;
+
+typedef void (*poolTask)(void *context, int chunk);
+
+// threads counts the calling thread too, so 1 means no extra threads
+struct workerPool *poolCreate(int threads);
+void poolDestroy(struct workerPool *pool);
+int poolThreads(const struct workerPool *pool);
+
+// run task on every chunk in [0, chunks) and return once all are done
+void poolRun(struct workerPool *pool, int chunks, poolTask task, void *context);
+
+#endif
+
+/* end of pool.h */
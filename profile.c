@@ -0,0 +1,240 @@
+//
+//  profile.c
+//
+//
+//  Created by BOWEN LI
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <stdint.h>
+#include <time.h>
+#include "profile.h"
+
+// times are counted in buckets 1/16 of an octave wide (about 4%), from 1 us
+// up to 16 s; bucket 0 holds the frames in which a stage did not run
+#define BUCKETS_PER_OCTAVE 16
+#define OCTAVES 24
+#define NUMBER_BUCKETS (1 + OCTAVES * BUCKETS_PER_OCTAVE)
+#define SMALLEST_TIME 1.0E-6
+
+#define MAX_DEPTH 8                             // timers open inside each other
+
+struct stageTimes
+{
+    double elapsed;                             // in the frame so far
+    double last;                                // in the frame closed last
+    uint16_t window[PROFILE_WINDOW];            // the bucket of each recent frame
+    int count[NUMBER_BUCKETS];                  // the recent frames in each bucket
+};
+
+struct profile
+{
+    struct stageTimes stages[NUMBER_STAGES];
+    int open[MAX_DEPTH];                        // the stages being timed, innermost last
+    int depth;
+    double mark;                                // when the innermost one was last charged
+    double frameStart;                          // 0 before the first frame
+    long frames;
+    FILE *trace;
+    int json;
+};
+
+static const char *stageNames[NUMBER_STAGES] =
+{
+    "frame", "emit", "update", "upload", "draw", "swap", "sort", "cull"
+};
+
+const char *stageName(int stage)
+{
+    return stage >= 0 && stage < NUMBER_STAGES ? stageNames[stage] : "?";
+}
+
+double profileNow(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1.0E-9;
+}
+
+struct profile *profileCreate(void)
+{
+    return calloc(1, sizeof(struct profile));
+}
+
+void profileDestroy(struct profile *profile)
+{
+    if (profile == NULL)
+        return;
+    if (profile->trace != NULL)
+    {
+        if (profile->json)
+            fprintf(profile->trace, "\n]\n");
+        fclose(profile->trace);
+    }
+    free(profile);
+}
+
+int profileTrace(struct profile *profile, const char *path)
+{
+    size_t length = strlen(path);
+    int stage;
+
+    profile->trace = fopen(path, "w");
+    if (profile->trace == NULL)
+        return 0;
+    profile->json = length >= 5 && strcmp(path + length - 5, ".json") == 0;
+
+    if (profile->json)
+        fprintf(profile->trace, "[");
+    else
+    {
+        fprintf(profile->trace, "frame,particles");
+        for (stage = 0; stage < NUMBER_STAGES; stage++)
+            fprintf(profile->trace, ",%s_ms", stageNames[stage]);
+        fprintf(profile->trace, "\n");
+    }
+    return 1;
+}
+
+// charge the time since the last mark to the innermost open stage; the ones
+// opened past MAX_DEPTH are not recorded, so theirs goes to the deepest that is
+static void charge(struct profile *profile, double now)
+{
+    int depth = profile->depth < MAX_DEPTH ? profile->depth : MAX_DEPTH;
+
+    if (depth > 0)
+        profile->stages[profile->open[depth - 1]].elapsed += now - profile->mark;
+    profile->mark = now;
+}
+
+void profileBegin(struct profile *profile, int stage)
+{
+    if (profile == NULL)
+        return;
+    charge(profile, profileNow());
+    if (profile->depth < MAX_DEPTH)
+        profile->open[profile->depth] = stage;
+    profile->depth++;
+}
+
+void profileEnd(struct profile *profile, int stage)
+{
+    if (profile == NULL || profile->depth == 0)
+        return;
+    charge(profile, profileNow());
+    profile->depth--;
+}
+
+void profileAdd(struct profile *profile, int stage, double seconds)
+{
+    if (profile == NULL || stage < 0 || stage >= NUMBER_STAGES)
+        return;
+    profile->stages[stage].elapsed += seconds;
+}
+
+static int bucketOf(double seconds)
+{
+    int bucket;
+
+    if (seconds <= 0)
+        return 0;
+    bucket = 1 + (int) floor(log2(seconds / SMALLEST_TIME) * BUCKETS_PER_OCTAVE);
+    if (bucket < 1)
+        return 1;
+    return bucket < NUMBER_BUCKETS ? bucket : NUMBER_BUCKETS - 1;
+}
+
+// the geometric middle of a bucket
+static double bucketTime(int bucket)
+{
+    if (bucket == 0)
+        return 0;
+    return SMALLEST_TIME * exp2((bucket - 0.5) / BUCKETS_PER_OCTAVE);
+}
+
+static void writeTrace(struct profile *profile, int numberParticles)
+{
+    int stage;
+
+    if (profile->json)
+    {
+        fprintf(profile->trace, "%s\n  {\"frame\": %ld, \"particles\": %d",
+                profile->frames > 0 ? "," : "", profile->frames, numberParticles);
+        for (stage = 0; stage < NUMBER_STAGES; stage++)
+            fprintf(profile->trace, ", \"%s_ms\": %.4f", stageNames[stage],
+                    profile->stages[stage].elapsed * 1.0E3);
+        fprintf(profile->trace, "}");
+    }
+    else
+    {
+        fprintf(profile->trace, "%ld,%d", profile->frames, numberParticles);
+        for (stage = 0; stage < NUMBER_STAGES; stage++)
+            fprintf(profile->trace, ",%.4f", profile->stages[stage].elapsed * 1.0E3);
+        fprintf(profile->trace, "\n");
+    }
+}
+
+void profileFrame(struct profile *profile, int numberParticles)
+{
+    int slot, stage;
+    double now;
+
+    if (profile == NULL)
+        return;
+    now = profileNow();
+    charge(profile, now);                       // a stage still open carries on into the next frame
+    if (profile->frameStart > 0)
+        profile->stages[PROFILE_FRAME].elapsed = now - profile->frameStart;
+    profile->frameStart = now;
+
+    slot = profile->frames % PROFILE_WINDOW;
+    for (stage = 0; stage < NUMBER_STAGES; stage++)
+    {
+        struct stageTimes *times = &profile->stages[stage];
+        int bucket = bucketOf(times->elapsed);
+
+        if (profile->frames >= PROFILE_WINDOW)  // the frame leaving the window
+            times->count[times->window[slot]]--;
+        times->window[slot] = bucket;
+        times->count[bucket]++;
+    }
+
+    if (profile->trace != NULL)
+        writeTrace(profile, numberParticles);
+    for (stage = 0; stage < NUMBER_STAGES; stage++)
+    {
+        profile->stages[stage].last = profile->stages[stage].elapsed;
+        profile->stages[stage].elapsed = 0;
+    }
+    profile->frames++;
+}
+
+double profilePercentile(const struct profile *profile, int stage, double fraction)
+{
+    const struct stageTimes *times = &profile->stages[stage];
+    long frames = profile->frames < PROFILE_WINDOW ? profile->frames : PROFILE_WINDOW;
+    long rank = (long) ceil(fraction * frames), seen = 0;
+    int bucket;
+
+    if (frames == 0)
+        return 0;
+    if (rank < 1)
+        rank = 1;
+    for (bucket = 0; bucket < NUMBER_BUCKETS; bucket++)
+    {
+        seen += times->count[bucket];
+        if (seen >= rank)
+            return bucketTime(bucket);
+    }
+    return bucketTime(NUMBER_BUCKETS - 1);
+}
+
+double profileLast(const struct profile *profile, int stage)
+{
+    return profile->stages[stage].last;
+}
+
+/* end of profile.c */
@@ -0,0 +1,66 @@
+//
+//  profile.h
+//
+//
+//  Created by BOWEN LI
+//
+//  Frame time profiling. The stages of a frame are timed with a monotonic
+//  clock between profileBegin() and profileEnd(). Timers nest, and a nested
+//  stage pauses the one around it, so every moment counts towards exactly
+//  one stage. profileFrame() closes a frame: the time of every stage in it
+//  goes into a histogram of the last PROFILE_WINDOW frames, from which the
+//  percentiles are read, and into the trace file when one is open.
+//
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#define PROFILE_FRAME 0                         // the whole frame, from the previous one
+#define PROFILE_EMIT 1                          // emitting new particles
+#define PROFILE_UPDATE 2                        // the simulation step
+#define PROFILE_UPLOAD 3                        // writing the particles into vertex buffers
+#define PROFILE_DRAW 4                          // submitting the draw calls
+#define PROFILE_SWAP 5                          // swapping the buffers
+#define PROFILE_SORT 6                          // ordering the particles back to front
+#define PROFILE_CULL 7                          // finding the particles in view
+#define NUMBER_STAGES 8
+
+#define PROFILE_WINDOW 256                      // frames in the rolling percentiles
+
+struct profile;
+
+// seconds on a clock that never jumps
+double profileNow(void);
+
+struct profile *profileCreate(void);
+
+// also closes the trace file
+void profileDestroy(struct profile *profile);
+
+// write every frame to path, as JSON when it ends in ".json" and as CSV
+// otherwise; returns 0 when the file cannot be opened
+int profileTrace(struct profile *profile, const char *path);
+
+// time a stage; all of these accept a NULL profile and do nothing
+void profileBegin(struct profile *profile, int stage);
+void profileEnd(struct profile *profile, int stage);
+
+// charge seconds spent on another thread to the stage in this frame; they
+// overlap this thread's stages instead of adding up with them
+void profileAdd(struct profile *profile, int stage, double seconds);
+
+// close the frame, which had numberParticles particles
+void profileFrame(struct profile *profile, int numberParticles);
+
+// the time of the stage in seconds that fraction of the recent frames stay
+// within, e.g. 0.95 for p95; 0 before the first frame
+double profilePercentile(const struct profile *profile, int stage, double fraction);
+
+// the time of the stage in seconds in the frame closed last
+double profileLast(const struct profile *profile, int stage);
+
+const char *stageName(int stage);
+
+#endif
+
+/* end of profile.h */
@@ -0,0 +1,870 @@
+//
+//  render.c
+//
+//
+//  Created by BOWEN LI
+//
+
+#define GL_GLEXT_PROTOTYPES
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include "render.h"
+#include "gpusim.h"
+#include "vertices.h"
+
+#ifndef MACOSX
+#include <GL/glext.h>
+#endif
+
+#define REGIONS 3                               // frames that may be in flight at once
+#define MAX_RUNS 256                            // compact blocks one packed stream may go through
+
+// a shader program drawing the particles, and its uniforms
+struct particleProgram
+{
+    GLuint program;                             // 0 when it is not available
+    GLint textured;
+    GLint image;
+    GLint size;
+    GLint viewportHeight;
+    GLint blend;
+    GLint boxLow;
+    GLint boxUnit;
+    GLuint offset;                              // the generic attribute of the particle's position
+};
+
+// with buffer storage (GL 4.4) the buffer is mapped once and every frame is
+// written to the next of REGIONS parts of it, guarded by a fence; otherwise
+// the buffer is orphaned and mapped again every frame
+struct particleBuffers
+{
+    GLuint buffer;                              // vertices first, then their colours
+    int persistent;                             // mapped once for good
+    char *mapped;                               // the persistent mapping
+    size_t regionBytes;                         // the size of one frame's part
+    int region;                                 // the part written this frame
+    GLsync fence[REGIONS];                      // the last draw reading each part
+    struct profile *profile;                    // times the uploads, may be NULL
+    const uint32_t *order;                      // the particles in drawing order, NULL for as stored
+    int orderCount;                             // how many of them
+    GLuint resident;                            // the GPU simulation's buffer to draw from, 0 to stream
+    float residentBlend;
+    const struct particleSystem *packed;        // whose compact frame was streamed undecoded, or NULL
+    int runs;                                   // the blocks the packed stream goes through, in turn
+    int runStart[MAX_RUNS + 1];                 // where each run begins in the stream, the end last
+    int runBlock[MAX_RUNS];
+
+    struct particleProgram spheres;             // instances of the mesh
+    struct particleProgram sprites;             // one point sprite per particle
+    struct particleProgram points;              // one point per particle, for the resident buffer and packed frames
+    GLuint mesh;                                // one wire sphere around the origin
+    GLsizei meshVertices;
+    int meshSlicesStacks;                       // what the mesh was built for
+};
+
+#if defined(GL_VERSION_4_4) || defined(GL_ARB_buffer_storage)
+#define HAVE_BUFFER_STORAGE 1
+#endif
+
+// whether the context is at least OpenGL major.minor
+static int versionSupported(int major, int minor)
+{
+    const char *version = (const char *) glGetString(GL_VERSION);
+    int contextMajor = 0, contextMinor = 0;
+
+    if (version == NULL || sscanf(version, "%d.%d", &contextMajor, &contextMinor) != 2)
+        return 0;
+    return contextMajor > major || (contextMajor == major && contextMinor >= minor);
+}
+
+// whether the context can keep a buffer mapped while drawing from it
+static int bufferStorageSupported(void)
+{
+#ifdef HAVE_BUFFER_STORAGE
+    const char *extensions = (const char *) glGetString(GL_EXTENSIONS);
+
+    if (versionSupported(4, 4))
+        return 1;
+    return extensions != NULL && strstr(extensions, "GL_ARB_buffer_storage") != NULL;
+#else
+    return 0;
+#endif
+}
+
+#ifdef GL_VERSION_2_1
+#define HAVE_SHADERS 1
+#ifdef GL_VERSION_3_3
+#define HAVE_INSTANCING 1
+#endif
+
+#define VERTEX_ATTRIBUTE 0                      // generic attributes of the programs
+#define TEXCOORD_ATTRIBUTE 1
+#define OFFSET_ATTRIBUTE 2
+#define COLOR_ATTRIBUTE 3
+#define PREVIOUS_ATTRIBUTE 4
+
+// the attribute names in the order of their indices; attribute 0 stands for
+// glVertex and must be an array for anything to be drawn, so the programs
+// without a mesh put the particle's position there
+static const char *const meshAttributes[] = { "vertex", "texcoord", "offset", "color", "previous" };
+static const char *const particleAttributes[] = { "offset", "texcoord", "vertex", "color", "previous" };
+
+// a particle is drawn blend of the way from previous to offset, in units of
+// boxUnit from boxLow; streamed particles are blended already, with blend 1
+// and no previous array, and in units of 1 from 0 unless they are packed
+//
+// every instance is the mesh moved to its particle, in the particle's colour;
+// with the texture on, it is applied like GL_DECAL
+static const char *sphereVertexShader =
+    "#version 120\n"
+    "uniform float blend;\n"
+    "uniform vec3 boxLow;\n"
+    "uniform vec3 boxUnit;\n"
+    "attribute vec3 vertex;\n"
+    "attribute vec2 texcoord;\n"
+    "attribute vec3 offset;\n"
+    "attribute vec4 color;\n"
+    "attribute vec3 previous;\n"
+    "varying vec4 particleColor;\n"
+    "varying vec2 imageCoord;\n"
+    "void main()\n"
+    "{\n"
+    "    particleColor = color;\n"
+    "    imageCoord = texcoord;\n"
+    "    gl_Position = gl_ModelViewProjectionMatrix * vec4(vertex + boxLow + boxUnit * mix(previous, offset, blend), 1.0);\n"
+    "}\n";
+
+// a sprite is one point, as wide in pixels as 2 * size is in the eye space
+// at its depth, so the square always faces the camera
+static const char *spriteVertexShader =
+    "#version 120\n"
+    "uniform float size;\n"
+    "uniform float viewportHeight;\n"
+    "uniform float blend;\n"
+    "uniform vec3 boxLow;\n"
+    "uniform vec3 boxUnit;\n"
+    "attribute vec3 offset;\n"
+    "attribute vec4 color;\n"
+    "attribute vec3 previous;\n"
+    "varying vec4 particleColor;\n"
+    "void main()\n"
+    "{\n"
+    "    particleColor = color;\n"
+    "    gl_Position = gl_ModelViewProjectionMatrix * vec4(boxLow + boxUnit * mix(previous, offset, blend), 1.0);\n"
+    "    gl_PointSize = size * gl_ProjectionMatrix[1][1] * viewportHeight / gl_Position.w;\n"
+    "}\n";
+
+// a point of the fixed size, which only the resident buffer and packed
+// particles need a shader for
+static const char *pointVertexShader =
+    "#version 120\n"
+    "uniform float blend;\n"
+    "uniform vec3 boxLow;\n"
+    "uniform vec3 boxUnit;\n"
+    "attribute vec3 offset;\n"
+    "attribute vec4 color;\n"
+    "attribute vec3 previous;\n"
+    "varying vec4 particleColor;\n"
+    "void main()\n"
+    "{\n"
+    "    particleColor = color;\n"
+    "    gl_Position = gl_ModelViewProjectionMatrix * vec4(boxLow + boxUnit * mix(previous, offset, blend), 1.0);\n"
+    "}\n";
+
+static const char *pointFragmentShader =
+    "#version 120\n"
+    "varying vec4 particleColor;\n"
+    "void main()\n"
+    "{\n"
+    "    gl_FragColor = particleColor;\n"
+    "}\n";
+
+static const char *spriteFragmentShader =
+    "#version 120\n"
+    "uniform bool textured;\n"
+    "uniform sampler2D image;\n"
+    "varying vec4 particleColor;\n"
+    "void main()\n"
+    "{\n"
+    "    vec4 color = particleColor;\n"
+    "    if (textured)\n"
+    "    {\n"
+    "        vec4 texel = texture2D(image, gl_PointCoord);\n"
+    "        color.rgb = mix(color.rgb, texel.rgb, texel.a);\n"
+    "    }\n"
+    "    gl_FragColor = color;\n"
+    "}\n";
+
+static const char *sphereFragmentShader =
+    "#version 120\n"
+    "uniform bool textured;\n"
+    "uniform sampler2D image;\n"
+    "varying vec4 particleColor;\n"
+    "varying vec2 imageCoord;\n"
+    "void main()\n"
+    "{\n"
+    "    vec4 color = particleColor;\n"
+    "    if (textured)\n"
+    "    {\n"
+    "        vec4 texel = texture2D(image, imageCoord);\n"
+    "        color.rgb = mix(color.rgb, texel.rgb, texel.a);\n"
+    "    }\n"
+    "    gl_FragColor = color;\n"
+    "}\n";
+
+static GLuint compileShader(GLenum type, const char *source)
+{
+    GLuint shader = glCreateShader(type);
+    GLint compiled;
+    char log[512];
+
+    glShaderSource(shader, 1, &source, NULL);
+    glCompileShader(shader);
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &compiled);
+    if (!compiled)
+    {
+        glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+        fprintf(stderr, "cannot compile a shader: %s\n", log);
+        glDeleteShader(shader);
+        return 0;
+    }
+    return shader;
+}
+
+// a program from the two shaders, the attributes bound to their indices in
+// order; 0 when it does not build
+static GLuint linkProgram(const char *vertexSource, const char *fragmentSource,
+                          const char *const *attributes, int numberAttributes)
+{
+    GLuint vertex = compileShader(GL_VERTEX_SHADER, vertexSource);
+    GLuint fragment = compileShader(GL_FRAGMENT_SHADER, fragmentSource);
+    GLuint program = 0;
+    GLint linked;
+    char log[512];
+    int i;
+
+    if (vertex != 0 && fragment != 0)
+    {
+        program = glCreateProgram();
+        glAttachShader(program, vertex);
+        glAttachShader(program, fragment);
+        for (i = 0; i < numberAttributes; i++)
+            glBindAttribLocation(program, i, attributes[i]);
+        glLinkProgram(program);
+        glGetProgramiv(program, GL_LINK_STATUS, &linked);
+        if (!linked)
+        {
+            glGetProgramInfoLog(program, sizeof(log), NULL, log);
+            fprintf(stderr, "cannot link a shader program: %s\n", log);
+            glDeleteProgram(program);
+            program = 0;
+        }
+    }
+    glDeleteShader(vertex);                     // they go with the program
+    glDeleteShader(fragment);
+    return program;
+}
+
+// 0 in program when the shaders do not build; attributes as above
+static void createProgram(struct particleProgram *particles, const char *vertexSource,
+                          const char *fragmentSource, const char *const *attributes)
+{
+    particles->program = linkProgram(vertexSource, fragmentSource, attributes, 5);
+    for (particles->offset = 0; strcmp(attributes[particles->offset], "offset") != 0; particles->offset++)
+        ;
+    if (particles->program != 0)
+    {
+        particles->textured = glGetUniformLocation(particles->program, "textured");
+        particles->image = glGetUniformLocation(particles->program, "image");
+        particles->size = glGetUniformLocation(particles->program, "size");
+        particles->viewportHeight = glGetUniformLocation(particles->program, "viewportHeight");
+        particles->blend = glGetUniformLocation(particles->program, "blend");
+        particles->boxLow = glGetUniformLocation(particles->program, "boxLow");
+        particles->boxUnit = glGetUniformLocation(particles->program, "boxUnit");
+    }
+}
+
+// sprites need shaders (OpenGL 2.1), spheres instancing too (OpenGL 3.3)
+static void createPrograms(struct particleBuffers *buffers)
+{
+    if (versionSupported(2, 1))
+    {
+        createProgram(&buffers->sprites, spriteVertexShader, spriteFragmentShader, particleAttributes);
+        createProgram(&buffers->points, pointVertexShader, pointFragmentShader, particleAttributes);
+    }
+#ifdef HAVE_INSTANCING
+    if (versionSupported(3, 3))
+        createProgram(&buffers->spheres, sphereVertexShader, sphereFragmentShader, meshAttributes);
+#endif
+}
+
+#ifdef HAVE_INSTANCING
+// the lines of glutWireSphere(radius, slicesStacks, slicesStacks) as pairs of
+// vertices (x, y, z, u, v): the rings between the poles, then the meridians
+static void buildSphereMesh(struct particleBuffers *buffers, GLfloat radius, int slicesStacks)
+{
+    int slices = slicesStacks, stacks = slicesStacks;
+    GLsizei vertices = 2 * slices * (stacks - 1) + 2 * slices * stacks;
+    GLfloat *mesh = malloc(vertices * 5 * sizeof(GLfloat));
+    GLfloat *v = mesh;
+    int i, j, k;
+
+    if (mesh == NULL)
+        return;
+
+    for (k = 1; k < stacks; k++)                // rings
+        for (j = 0; j < slices; j++)
+            for (i = 0; i < 2; i++)
+            {
+                double phi = PI * k / stacks, theta = 2 * PI * ((j + i) % slices) / slices;
+                *v++ = radius * sin(phi) * cos(theta);
+                *v++ = radius * sin(phi) * sin(theta);
+                *v++ = radius * cos(phi);
+                *v++ = (GLfloat) (j + i) / slices;
+                *v++ = (GLfloat) k / stacks;
+            }
+    for (j = 0; j < slices; j++)                // meridians, pole to pole
+        for (k = 0; k < stacks; k++)
+            for (i = 0; i < 2; i++)
+            {
+                double phi = PI * (k + i) / stacks, theta = 2 * PI * j / slices;
+                *v++ = radius * sin(phi) * cos(theta);
+                *v++ = radius * sin(phi) * sin(theta);
+                *v++ = radius * cos(phi);
+                *v++ = (GLfloat) j / slices;
+                *v++ = (GLfloat) (k + i) / stacks;
+            }
+
+    if (buffers->mesh == 0)
+        glGenBuffers(1, &buffers->mesh);
+    glBindBuffer(GL_ARRAY_BUFFER, buffers->mesh);
+    glBufferData(GL_ARRAY_BUFFER, vertices * 5 * sizeof(GLfloat), mesh, GL_STATIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    free(mesh);
+
+    buffers->meshVertices = vertices;
+    buffers->meshSlicesStacks = slicesStacks;
+}
+#endif
+#else
+static void createPrograms(struct particleBuffers *buffers)
+{
+}
+#endif
+
+struct particleBuffers *createParticleBuffers(struct profile *profile)
+{
+    struct particleBuffers *buffers = calloc(1, sizeof(*buffers));
+    if (buffers == NULL)
+        return NULL;
+    buffers->profile = profile;
+    glGenBuffers(1, &buffers->buffer);
+    buffers->persistent = bufferStorageSupported();
+    createPrograms(buffers);
+    return buffers;
+}
+
+static void releaseStorage(struct particleBuffers *buffers)
+{
+#ifdef HAVE_BUFFER_STORAGE
+    int region;
+    for (region = 0; region < REGIONS; region++)
+    {
+        if (buffers->fence[region] != NULL)
+            glDeleteSync(buffers->fence[region]);
+        buffers->fence[region] = NULL;
+    }
+#endif
+    glDeleteBuffers(1, &buffers->buffer);
+    buffers->mapped = NULL;
+    buffers->regionBytes = 0;
+}
+
+void destroyParticleBuffers(struct particleBuffers *buffers)
+{
+    if (buffers == NULL)
+        return;
+#ifdef HAVE_SHADERS
+    if (buffers->spheres.program != 0)
+        glDeleteProgram(buffers->spheres.program);
+    if (buffers->sprites.program != 0)
+        glDeleteProgram(buffers->sprites.program);
+    if (buffers->points.program != 0)
+        glDeleteProgram(buffers->points.program);
+    if (buffers->mesh != 0)
+        glDeleteBuffers(1, &buffers->mesh);
+#endif
+    releaseStorage(buffers);
+    free(buffers);
+}
+
+#ifdef HAVE_BUFFER_STORAGE
+// the next part of the persistent mapping, waiting for the draw that last
+// read it; the storage grows by half again when a frame no longer fits
+static void *nextRegion(struct particleBuffers *buffers, size_t bytes, size_t *offset)
+{
+    const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+
+    if (bytes > buffers->regionBytes)
+    {
+        size_t regionBytes = bytes + bytes / 2;
+        releaseStorage(buffers);
+        glGenBuffers(1, &buffers->buffer);
+        glBindBuffer(GL_ARRAY_BUFFER, buffers->buffer);
+        glBufferStorage(GL_ARRAY_BUFFER, REGIONS * regionBytes, NULL, flags);
+        buffers->mapped = glMapBufferRange(GL_ARRAY_BUFFER, 0, REGIONS * regionBytes, flags);
+        if (buffers->mapped == NULL)
+        {
+            // immutable storage cannot be orphaned, so the streaming from
+            // now on goes to a fresh buffer
+            buffers->persistent = 0;
+            glBindBuffer(GL_ARRAY_BUFFER, 0);
+            releaseStorage(buffers);
+            glGenBuffers(1, &buffers->buffer);
+            return NULL;
+        }
+        buffers->regionBytes = regionBytes;
+    }
+
+    buffers->region = (buffers->region + 1) % REGIONS;
+    if (buffers->fence[buffers->region] != NULL)
+    {
+        glClientWaitSync(buffers->fence[buffers->region], GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+        glDeleteSync(buffers->fence[buffers->region]);
+        buffers->fence[buffers->region] = NULL;
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, buffers->buffer);
+    *offset = buffers->region * buffers->regionBytes;
+    return buffers->mapped + *offset;
+}
+#endif
+
+// somewhere to write this frame's bytes, at offset within the bound buffer
+static void *mapStream(struct particleBuffers *buffers, size_t bytes, size_t *offset)
+{
+#ifdef HAVE_BUFFER_STORAGE
+    if (buffers->persistent)
+    {
+        void *region = nextRegion(buffers, bytes, offset);
+        if (region != NULL)
+            return region;
+    }
+#endif
+    // give the driver fresh storage for this frame, so writing never waits
+    // for the previous frame's draw to finish
+    *offset = 0;
+    glBindBuffer(GL_ARRAY_BUFFER, buffers->buffer);
+    glBufferData(GL_ARRAY_BUFFER, bytes, NULL, GL_STREAM_DRAW);
+    return glMapBuffer(GL_ARRAY_BUFFER, GL_WRITE_ONLY);
+}
+
+// the upload is timed from here to finishStream()
+static void *streamBuffer(struct particleBuffers *buffers, size_t bytes, size_t *offset)
+{
+    void *mapped;
+
+    profileBegin(buffers->profile, PROFILE_UPLOAD);
+    mapped = mapStream(buffers, bytes, offset);
+    if (mapped == NULL)
+        profileEnd(buffers->profile, PROFILE_UPLOAD);
+    return mapped;
+}
+
+// done writing this frame's bytes; 0 when the storage was lost on the way
+static int finishStream(struct particleBuffers *buffers)
+{
+    int mapped = buffers->persistent || glUnmapBuffer(GL_ARRAY_BUFFER);
+
+    profileEnd(buffers->profile, PROFILE_UPLOAD);
+    if (!mapped)
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    return mapped;
+}
+
+// done drawing from this frame's bytes
+static void fenceStream(struct particleBuffers *buffers)
+{
+#ifdef HAVE_BUFFER_STORAGE
+    if (buffers->persistent)
+        buffers->fence[buffers->region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+#endif
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+// draw vertices vertices of the given primitive from the bytes just written
+static int drawStream(struct particleBuffers *buffers, GLenum mode, GLsizei vertices,
+                      size_t offset, size_t colorOffset)
+{
+    if (!finishStream(buffers))
+        return 1;                               // skip the frame
+
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_COLOR_ARRAY);
+    glVertexPointer(3, GL_FLOAT, 0, (const GLvoid *) offset);
+    glColorPointer(4, GL_UNSIGNED_BYTE, 0, (const GLvoid *) (offset + colorOffset));
+    glDrawArrays(mode, 0, vertices);
+    glDisableClientState(GL_COLOR_ARRAY);
+    glDisableClientState(GL_VERTEX_ARRAY);
+
+    fenceStream(buffers);
+    return 1;
+}
+
+void setDrawOrder(struct particleBuffers *buffers, const uint32_t *order, int count)
+{
+    buffers->order = order;
+    buffers->orderCount = count;
+}
+
+void setResident(struct particleBuffers *buffers, GLuint state, float blend)
+{
+    buffers->resident = state;
+    buffers->residentBlend = blend;
+}
+
+#ifdef HAVE_SHADERS
+// the attributes of every particle for program: from the resident buffer,
+// blended in the shader, or else the ones just streamed at offset
+static void bindParticles(const struct particleBuffers *buffers, const struct particleProgram *particles,
+                          size_t offset, size_t colorOffset)
+{
+    glEnableVertexAttribArray(particles->offset);
+    glEnableVertexAttribArray(COLOR_ATTRIBUTE);
+    glUseProgram(particles->program);
+    glUniform3f(particles->boxLow, 0, 0, 0);
+    glUniform3f(particles->boxUnit, 1, 1, 1);
+    if (buffers->resident != 0)
+    {
+        glBindBuffer(GL_ARRAY_BUFFER, buffers->resident);
+        glEnableVertexAttribArray(PREVIOUS_ATTRIBUTE);
+        glVertexAttribPointer(particles->offset, 3, GL_FLOAT, GL_FALSE, GPU_STRIDE, (const GLvoid *) GPU_POSITION);
+        glVertexAttribPointer(PREVIOUS_ATTRIBUTE, 3, GL_FLOAT, GL_FALSE, GPU_STRIDE, (const GLvoid *) GPU_PREVIOUS);
+        glVertexAttribPointer(COLOR_ATTRIBUTE, 4, GL_UNSIGNED_BYTE, GL_TRUE, GPU_STRIDE, (const GLvoid *) GPU_COLOR);
+        glUniform1f(particles->blend, buffers->residentBlend);
+        return;
+    }
+    glVertexAttribPointer(particles->offset, 3, GL_FLOAT, GL_FALSE, 0, (const GLvoid *) offset);
+    glVertexAttribPointer(COLOR_ATTRIBUTE, 4, GL_UNSIGNED_BYTE, GL_TRUE, 0, (const GLvoid *) (offset + colorOffset));
+    glUniform1f(particles->blend, 1);
+}
+
+static void unbindParticles(const struct particleProgram *particles)
+{
+    glUseProgram(0);
+    glDisableVertexAttribArray(particles->offset);
+    glDisableVertexAttribArray(COLOR_ATTRIBUTE);
+    glDisableVertexAttribArray(PREVIOUS_ATTRIBUTE);
+}
+#endif
+
+// the streamed bytes are read by now; the resident buffer was not streamed
+static void finishDraw(struct particleBuffers *buffers)
+{
+    if (buffers->resident != 0)
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    else
+        fenceStream(buffers);
+}
+
+// the particles the next draw takes
+static int drawCount(const struct particleBuffers *buffers, const struct particleSystem *ps)
+{
+    return buffers->order != NULL ? buffers->orderCount : ps->numberParticles;
+}
+
+// n points of the drawing order, then their colours, by the loop for the
+// case; a compact frame is decoded here, on its way to GL
+static void writePoints(GLfloat *vertex, uint8_t *color, const struct particleSystem *ps, const uint32_t *order, int n)
+{
+    vertexKernelFor(vertexFeatures(ps, order, 0))(vertex, color, ps, order, 0, n, 0);
+}
+
+#ifdef HAVE_SHADERS
+// whether the particles of a compact frame can be streamed undecoded, for
+// the program to decode: the drawing order must go through the blocks in
+// few runs, as a culled list does and a depth sorted one does not. The runs
+// are kept for drawRuns().
+static int packRuns(struct particleBuffers *buffers, const struct particleSystem *ps, int n)
+{
+    const uint32_t *order = buffers->order;
+    int runs = 0, block, i;
+
+    buffers->packed = NULL;
+    if (ps->compact == NULL || buffers->resident != 0)
+        return 0;
+    if (order == NULL)
+    {
+        for (i = 0; i < n && runs < MAX_RUNS; i += COMPACT_BLOCK)
+        {
+            buffers->runStart[runs] = i;
+            buffers->runBlock[runs++] = i >> COMPACT_SHIFT;
+        }
+        if (i < n)
+            return 0;
+    }
+    else
+    {
+        for (i = 0; i < n; i++)
+        {
+            block = order[i] >> COMPACT_SHIFT;
+            if (runs > 0 && block == buffers->runBlock[runs - 1])
+                continue;
+            if (runs == MAX_RUNS)
+                return 0;
+            buffers->runStart[runs] = i;
+            buffers->runBlock[runs++] = block;
+        }
+    }
+    buffers->runStart[runs] = n;
+    buffers->runs = runs;
+    buffers->packed = ps;
+    return 1;
+}
+
+// the n particles of the drawing order for a program, their positions and
+// then their colours: the six units of a packed particle take the room of
+// three floats, so the colours go to the same place either way
+static void *streamParticles(struct particleBuffers *buffers, const struct particleSystem *ps, int n, size_t *offset)
+{
+    size_t colorOffset = n * 3 * sizeof(GLfloat);
+    uint8_t *mapped = streamBuffer(buffers, colorOffset + n * 4, offset);
+
+    if (mapped == NULL)
+        return NULL;
+    if (buffers->packed != NULL)
+        compactInterleave(ps->compact, buffers->order, n, (uint16_t *) mapped, mapped + colorOffset);
+    else
+        writePoints((GLfloat *) mapped, mapped + colorOffset, ps, buffers->order, n);
+    return mapped;
+}
+
+// n vertices of mode, or n instances of the mesh of meshVertices
+static void drawBound(GLenum mode, GLsizei meshVertices, int n)
+{
+#ifdef HAVE_INSTANCING
+    if (meshVertices > 0)
+    {
+        glDrawArraysInstanced(mode, 0, meshVertices, n);
+        return;
+    }
+#endif
+    glDrawArrays(mode, 0, n);
+}
+
+// draw the n particles bound for program; a packed stream at offset goes a
+// run at a time, its attributes moved to the run and under its block's box
+static void drawRuns(const struct particleBuffers *buffers, const struct particleProgram *particles, GLenum mode,
+                     GLsizei meshVertices, int n, size_t offset)
+{
+    const GLsizei stride = 6 * sizeof(uint16_t);
+    size_t colorOffset = offset + n * stride;
+    int run;
+
+    if (buffers->packed == NULL)
+    {
+        drawBound(mode, meshVertices, n);
+        return;
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, buffers->buffer);
+    glEnableVertexAttribArray(PREVIOUS_ATTRIBUTE);
+    glUniform1f(particles->blend, buffers->packed->blend);
+    for (run = 0; run < buffers->runs; run++)
+    {
+        int first = buffers->runStart[run];
+        const float *box = buffers->packed->compact->box[buffers->runBlock[run]];
+        size_t units = offset + first * stride;
+
+        glVertexAttribPointer(particles->offset, 3, GL_UNSIGNED_SHORT, GL_FALSE, stride, (const GLvoid *) units);
+        glVertexAttribPointer(PREVIOUS_ATTRIBUTE, 3, GL_UNSIGNED_SHORT, GL_FALSE, stride,
+                              (const GLvoid *) (units + 3 * sizeof(uint16_t)));
+        glVertexAttribPointer(COLOR_ATTRIBUTE, 4, GL_UNSIGNED_BYTE, GL_TRUE, 0, (const GLvoid *) (colorOffset + first * 4));
+        glUniform3f(particles->boxLow, box[0], box[1], box[2]);
+        glUniform3f(particles->boxUnit, box[3], box[4], box[5]);
+        drawBound(mode, meshVertices, buffers->runStart[run + 1] - first);
+    }
+}
+#endif
+
+int drawPointsBuffered(struct particleBuffers *buffers, const struct particleSystem *ps)
+{
+    int n = drawCount(buffers, ps);
+    size_t colorOffset = n * 3 * sizeof(GLfloat);
+    size_t offset;
+    GLfloat *vertex;
+
+    if (n == 0)
+        return 1;
+    if (buffers->resident != 0)
+    {
+#ifdef HAVE_SHADERS
+        if (buffers->points.program == 0)
+            return 0;
+        bindParticles(buffers, &buffers->points, 0, 0);
+        glDrawArrays(GL_POINTS, 0, n);
+        unbindParticles(&buffers->points);
+        finishDraw(buffers);
+        return 1;
+#else
+        return 0;
+#endif
+    }
+#ifdef HAVE_SHADERS
+    if (buffers->points.program != 0 && packRuns(buffers, ps, n))
+    {
+        if (streamParticles(buffers, ps, n, &offset) == NULL)
+            return 0;
+        if (!finishStream(buffers))
+            return 1;                           // skip the frame
+        bindParticles(buffers, &buffers->points, offset, colorOffset);
+        drawRuns(buffers, &buffers->points, GL_POINTS, 0, n, offset);
+        unbindParticles(&buffers->points);
+        finishDraw(buffers);
+        return 1;
+    }
+#endif
+    vertex = streamBuffer(buffers, colorOffset + n * 4, &offset);
+    if (vertex == NULL)
+        return 0;
+    writePoints(vertex, (uint8_t *) vertex + colorOffset, ps, buffers->order, n);
+
+    return drawStream(buffers, GL_POINTS, n, offset, colorOffset);
+}
+
+int drawSquaresBuffered(struct particleBuffers *buffers, const struct particleSystem *ps, GLfloat squareSize)
+{
+    int n = drawCount(buffers, ps);
+    size_t colorOffset = n * 4 * 3 * sizeof(GLfloat);
+    size_t offset;
+    GLfloat *vertex;
+
+    if (n == 0)
+        return 1;
+    if (buffers->resident != 0)                 // the corners are made here, from the arrays
+        return 0;
+    vertex = streamBuffer(buffers, colorOffset + n * 4 * 4, &offset);
+    if (vertex == NULL)
+        return 0;
+    vertexKernelFor(vertexFeatures(ps, buffers->order, 1))(vertex, (uint8_t *) vertex + colorOffset, ps,
+                                                           buffers->order, 0, n, squareSize);
+
+    return drawStream(buffers, GL_QUADS, 4 * n, offset, colorOffset);
+}
+
+#ifdef HAVE_INSTANCING
+// draw the mesh (vertices of x, y, z, u, v) once per particle, the particles
+// streamed like point mode as the per instance attributes
+static int drawInstances(struct particleBuffers *buffers, const struct particleSystem *ps,
+                         const struct particleProgram *particles, GLuint mesh, GLenum mode,
+                         GLsizei meshVertices, int textured)
+{
+    int n = drawCount(buffers, ps);
+    size_t colorOffset = n * 3 * sizeof(GLfloat);
+    const GLsizei stride = 5 * sizeof(GLfloat);
+    size_t offset = 0;
+
+    packRuns(buffers, ps, n);
+    if (buffers->resident == 0)
+    {
+        if (streamParticles(buffers, ps, n, &offset) == NULL)
+            return 0;
+        if (!finishStream(buffers))
+            return 1;                           // skip the frame
+    }
+
+    bindParticles(buffers, particles, offset, colorOffset);
+    glVertexAttribDivisor(particles->offset, 1);
+    glVertexAttribDivisor(COLOR_ATTRIBUTE, 1);
+    glVertexAttribDivisor(PREVIOUS_ATTRIBUTE, 1);
+
+    glBindBuffer(GL_ARRAY_BUFFER, mesh);
+    glEnableVertexAttribArray(VERTEX_ATTRIBUTE);
+    glEnableVertexAttribArray(TEXCOORD_ATTRIBUTE);
+    glVertexAttribPointer(VERTEX_ATTRIBUTE, 3, GL_FLOAT, GL_FALSE, stride, (const GLvoid *) 0);
+    glVertexAttribPointer(TEXCOORD_ATTRIBUTE, 2, GL_FLOAT, GL_FALSE, stride,
+                          (const GLvoid *) (3 * sizeof(GLfloat)));
+
+    // the texture state is set once for all the particles
+    glUniform1i(particles->textured, textured);
+    glUniform1i(particles->image, 0);
+    drawRuns(buffers, particles, mode, meshVertices, n, offset);
+
+    glVertexAttribDivisor(particles->offset, 0);
+    glVertexAttribDivisor(COLOR_ATTRIBUTE, 0);
+    glVertexAttribDivisor(PREVIOUS_ATTRIBUTE, 0);
+    glDisableVertexAttribArray(VERTEX_ATTRIBUTE);
+    glDisableVertexAttribArray(TEXCOORD_ATTRIBUTE);
+    unbindParticles(particles);
+
+    finishDraw(buffers);
+    return 1;
+}
+#endif
+
+int drawSpheresInstanced(struct particleBuffers *buffers, const struct particleSystem *ps,
+                         GLfloat radius, int slicesStacks, int textured)
+{
+#ifdef HAVE_INSTANCING
+    if (buffers->spheres.program == 0)
+        return 0;
+    if (drawCount(buffers, ps) == 0)
+        return 1;
+    if (buffers->meshSlicesStacks != slicesStacks)
+        buildSphereMesh(buffers, radius, slicesStacks);
+    if (buffers->meshVertices == 0)
+        return 0;
+    return drawInstances(buffers, ps, &buffers->spheres, buffers->mesh, GL_LINES,
+                         buffers->meshVertices, textured);
+#else
+    return 0;
+#endif
+}
+
+int drawSprites(struct particleBuffers *buffers, const struct particleSystem *ps,
+                GLfloat squareSize, int textured)
+{
+#ifdef HAVE_SHADERS
+    int n = drawCount(buffers, ps);
+    size_t colorOffset = n * 3 * sizeof(GLfloat);
+    GLint viewport[4];
+    size_t offset = 0;
+
+    if (buffers->sprites.program == 0)
+        return 0;
+    if (n == 0)
+        return 1;
+    packRuns(buffers, ps, n);
+    if (buffers->resident == 0)
+    {
+        if (streamParticles(buffers, ps, n, &offset) == NULL)
+            return 0;
+        if (!finishStream(buffers))
+            return 1;                           // skip the frame
+    }
+
+    // the shader sets the size of each point, the rasteriser makes it a
+    // textured square instead of a round dot
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    glEnable(GL_VERTEX_PROGRAM_POINT_SIZE);
+    glEnable(GL_POINT_SPRITE);
+    bindParticles(buffers, &buffers->sprites, offset, colorOffset);
+    glUniform1i(buffers->sprites.textured, textured);
+    glUniform1i(buffers->sprites.image, 0);
+    glUniform1f(buffers->sprites.size, squareSize);
+    glUniform1f(buffers->sprites.viewportHeight, viewport[3]);
+    drawRuns(buffers, &buffers->sprites, GL_POINTS, 0, n, offset);
+    unbindParticles(&buffers->sprites);
+    glDisable(GL_POINT_SPRITE);
+    glDisable(GL_VERTEX_PROGRAM_POINT_SIZE);
+
+    finishDraw(buffers);
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+/* end of render.c */
@@ -0,0 +1,62 @@
+//
+//  render.h
+//
+//
+//  Created by BOWEN LI
+//
+//  Drawing the particles from vertex buffer objects: the positions and the
+//  colours are streamed into a persistently mapped (or else orphaned) buffer
+//  once per frame and every mode is drawn with a single glDrawArrays call,
+//  instead of one driver call per vertex. Spheres are one mesh drawn once per
+//  particle with instancing, sprites one point per particle that a shader
+//  sizes into a square facing the camera. The particles the GPU simulates
+//  are drawn from its buffer instead, blended by the shaders.
+//
+
+#ifndef RENDER_H
+#define RENDER_H
+
+#ifdef MACOSX
+#include <OpenGL/gl.h>
+#else
+#include <GL/gl.h>
+#endif
+
+#include "particles.h"
+#include "profile.h"
+
+struct particleBuffers;
+
+// the time spent filling the buffers goes to the PROFILE_UPLOAD stage of
+// profile, which may be NULL
+struct particleBuffers *createParticleBuffers(struct profile *profile);
+void destroyParticleBuffers(struct particleBuffers *buffers);
+
+// draw the count particles in order, an index each (see depthSortOrder() and
+// cullParticles()), from now on; NULL draws them all as they are stored
+void setDrawOrder(struct particleBuffers *buffers, const uint32_t *order, int count);
+
+// draw the particles straight from state, a buffer of the GPU simulation
+// (see gpusim.h), blend of the way from their previous positions, from now
+// on; nothing is streamed. 0 streams ps again. Squares from quads cannot be
+// drawn from it, only as sprites.
+void setResident(struct particleBuffers *buffers, GLuint state, float blend);
+
+// both return 0 when the buffer cannot be mapped, so the caller can fall back
+// to immediate mode for that frame
+int drawPointsBuffered(struct particleBuffers *buffers, const struct particleSystem *ps);
+int drawSquaresBuffered(struct particleBuffers *buffers, const struct particleSystem *ps, GLfloat squareSize);
+
+// returns 0 also without OpenGL 3.3, which instancing needs; the mesh is
+// rebuilt whenever slicesStacks changes
+int drawSpheresInstanced(struct particleBuffers *buffers, const struct particleSystem *ps,
+                         GLfloat radius, int slicesStacks, int textured);
+
+// squares of side 2 * squareSize facing the camera, drawn as point sprites
+// from one vertex per particle; returns 0 without OpenGL 2.1
+int drawSprites(struct particleBuffers *buffers, const struct particleSystem *ps,
+                GLfloat squareSize, int textured);
+
+#endif
+
+/* end of render.h */
@@ -0,0 +1,52 @@
+//
+//  rng.h
+//
+//
+//  Created by BOWEN LI
+//
+//  Counter based random numbers. Every value is a hash of (seed, stream,
+//  counter, draw), so every particle can draw its own numbers on any thread
+//  and in any order, and still get the same values on every run. There is no
+//  state carried from one value to the next, which lets the emitter compute
+//  a whole batch of them in one vectorisable loop.
+//
+
+#ifndef RNG_H
+#define RNG_H
+
+#include <stdint.h>
+
+// a bijective scramble of 32 bits (the "lowbias32" integer hash)
+static inline uint32_t rngHash(uint32_t x)
+{
+    x ^= x >> 16;
+    x *= 0x7feb352dU;
+    x ^= x >> 15;
+    x *= 0x846ca68bU;
+    x ^= x >> 16;
+    return x;
+}
+
+// the keys of all streams sharing a seed and a counter are derived from one base
+static inline uint32_t rngBase(uint64_t seed, uint64_t counter)
+{
+    uint32_t base = rngHash((uint32_t) seed ^ rngHash((uint32_t) (seed >> 32)));
+    return rngHash(base ^ rngHash((uint32_t) counter ^ rngHash((uint32_t) (counter >> 32))));
+}
+
+// the key of one stream, fed to rngUniform() for each of its values
+static inline uint32_t rngKey(uint32_t base, uint32_t stream)
+{
+    return rngHash(base ^ stream);
+}
+
+// the draw-th value of a stream, uniform in [0, 1)
+static inline float rngUniform(uint32_t key, uint32_t draw)
+{
+    // 24 bits fit an int exactly, which converts to float faster than unsigned
+    return (int32_t) (rngHash(key + draw * 0x9e3779b9U) >> 8) * (1.0f / 16777216.0f);
+}
+
+#endif
+
+/* end of rng.h */
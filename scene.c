@@ -0,0 +1,680 @@
+//
+//  scene.c
+//
+//
+//  Created by BOWEN LI
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "scene.h"
+#include "pool.h"
+#include "rng.h"
+#include "grid.h"
+
+#define SCENE_BATCH 16384                       // most particles of one emitter updated by one task
+#define SCENE_TILE 256                          // particles taken through all the passes together
+#define KILL_HEIGHT -1.0f                       // particles falling below this respawn
+#define SOFTENING 0.01f                         // keeps an attractor finite at its centre
+
+// the random values every particle draws, in this order
+#define DRAW_HEIGHT 0
+#define DRAW_ELEVATION 1
+#define DRAW_HEADING 2
+#define DRAW_VELOCITY 3
+#define DRAW_RED 4
+#define DRAW_GREEN 5
+#define DRAW_BLUE 6
+#define DRAW_ALPHA 7
+
+#define RANDOM_RANGE(lo, hi, u) ((lo) + ((hi) - (lo)) * (u))
+#define DEGREES(a) ((a) * (float) (PI / 180.0))
+
+// the features a tile of particles goes through, which the specialised
+// tile kernels are built for
+#define TILE_ATTRACT 1                          // the scene has attractors
+#define TILE_COLLIDE 2                          // and colliders
+#define TILE_EXPIRE 4                           // the emitter's particles live a limited time
+#define TILE_KERNELS 8
+
+struct sceneBatches;
+
+typedef void (*collideKernel)(const struct collider *collider, int begin, int end,
+                              float *restrict positionX, float *restrict positionY, float *restrict positionZ,
+                              float *restrict velocityX, float *restrict velocityY, float *restrict velocityZ);
+typedef void (*tileKernel)(struct particleSystem *ps, const struct emitter *emitter,
+                           const struct sceneBatches *table, const float a[3], int begin, int end);
+
+// one task of the update: a run of particles of one emitter
+struct batch
+{
+    int emitter;
+    int begin, end;
+    tileKernel update;                          // built for the emitter's features
+};
+
+// the tasks, and what the kernels need chosen once when the scene is loaded
+struct sceneBatches
+{
+    collideKernel collide[MAX_COLLIDERS];       // one for each of the scene's colliders
+    const struct forceField *attractors[MAX_FIELDS];
+    int numberAttractors;
+    int numberBatches;
+    struct batch batches[];
+};
+
+static tileKernel chooseTile(const struct scene *scene, const struct emitter *emitter);
+static collideKernel chooseCollider(const struct collider *collider);
+
+static void listArrays(struct scene *scene, void **arrays[SCENE_ARRAYS])
+{
+    arrays[0] = (void **) &scene->velocityX;
+    arrays[1] = (void **) &scene->velocityY;
+    arrays[2] = (void **) &scene->velocityZ;
+}
+
+int sceneArrays(struct scene *scene, void **arrays[SCENE_ARRAYS])
+{
+    if (scene == NULL)
+        return 0;
+    listArrays(scene, arrays);
+    return SCENE_ARRAYS;
+}
+
+int sceneParticles(const struct scene *scene)
+{
+    int e, count = 0;
+    for (e = 0; e < scene->numberEmitters; e++)
+        count += scene->emitters[e].count;
+    return count;
+}
+
+// split every emitter into batches of at most SCENE_BATCH particles
+static struct sceneBatches *makeBatches(const struct scene *scene)
+{
+    struct sceneBatches *table;
+    int e, begin, n = 0;
+
+    for (e = 0; e < scene->numberEmitters; e++)
+        n += (scene->emitters[e].count + SCENE_BATCH - 1) / SCENE_BATCH;
+    table = malloc(sizeof(*table) + n * sizeof(struct batch));
+    if (table == NULL)
+        return NULL;
+    table->numberBatches = 0;
+    table->numberAttractors = 0;
+    for (e = 0; e < scene->numberFields; e++)
+    {
+        if (scene->fields[e].type == FIELD_ATTRACTOR)
+            table->attractors[table->numberAttractors++] = &scene->fields[e];
+    }
+    for (e = 0; e < scene->numberColliders; e++)
+        table->collide[e] = chooseCollider(&scene->colliders[e]);
+    for (e = 0; e < scene->numberEmitters; e++)
+    {
+        const struct emitter *emitter = &scene->emitters[e];
+        for (begin = emitter->first; begin < emitter->first + emitter->count; begin += SCENE_BATCH)
+        {
+            struct batch *batch = &table->batches[table->numberBatches++];
+            batch->emitter = e;
+            batch->update = chooseTile(scene, emitter);
+            batch->begin = begin;
+            batch->end = begin + SCENE_BATCH < emitter->first + emitter->count ?
+                         begin + SCENE_BATCH : emitter->first + emitter->count;
+        }
+    }
+    return table;
+}
+
+// one line of a scene file; returns 0 when it cannot be read
+static int readLine(struct scene *scene, const char *line)
+{
+    char keyword[16];
+    float f[10];
+    int count, n;
+
+    if (sscanf(line, "%15s", keyword) != 1)
+        return 1;                               // blank
+    if (strcmp(keyword, "emitter") == 0)
+    {
+        struct emitter *emitter = &scene->emitters[scene->numberEmitters];
+
+        f[8] = 0;
+        n = sscanf(line, "%*s %f %f %f %d %f %f %f %f %f",
+                   &f[0], &f[1], &f[2], &count, &f[4], &f[5], &f[6], &f[7], &f[8]);
+        if (n < 8 || count < 0 || scene->numberEmitters == MAX_EMITTERS)
+            return 0;
+        memcpy(emitter->origin, f, sizeof(emitter->origin));
+        emitter->count = count;
+        emitter->velocity = f[4];
+        emitter->elevation = f[5];
+        emitter->heading = f[6];
+        emitter->spread = f[7];
+        emitter->lifetime = f[8];
+        scene->numberEmitters++;
+    }
+    else if (strcmp(keyword, "plane") == 0)
+    {
+        struct collider *collider = &scene->colliders[scene->numberColliders];
+        float length;
+
+        if (sscanf(line, "%*s %f %f %f %f %f", &f[0], &f[1], &f[2], &f[3], &f[4]) != 5 ||
+            scene->numberColliders == MAX_COLLIDERS)
+            return 0;
+        length = sqrtf(f[0] * f[0] + f[1] * f[1] + f[2] * f[2]);
+        if (length == 0)
+            return 0;
+        collider->type = COLLIDER_PLANE;
+        collider->normal[0] = f[0] / length;
+        collider->normal[1] = f[1] / length;
+        collider->normal[2] = f[2] / length;
+        collider->offset = f[3] / length;
+        collider->bounce = f[4];
+        scene->numberColliders++;
+    }
+    else if (strcmp(keyword, "box") == 0)
+    {
+        struct collider *collider = &scene->colliders[scene->numberColliders];
+        int k;
+
+        if (sscanf(line, "%*s %f %f %f %f %f %f %f", &f[0], &f[1], &f[2], &f[3], &f[4], &f[5], &f[6]) != 7 ||
+            scene->numberColliders == MAX_COLLIDERS)
+            return 0;
+        collider->type = COLLIDER_BOX;
+        for (k = 0; k < 3; k++)
+        {
+            collider->low[k] = fminf(f[k], f[k + 3]);
+            collider->high[k] = fmaxf(f[k], f[k + 3]);
+        }
+        collider->bounce = f[6];
+        scene->numberColliders++;
+    }
+    else if (strcmp(keyword, "wind") == 0 || strcmp(keyword, "attractor") == 0)
+    {
+        struct forceField *field = &scene->fields[scene->numberFields];
+        int wind = keyword[0] == 'w';
+
+        n = sscanf(line, "%*s %f %f %f %f", &f[0], &f[1], &f[2], &f[3]);
+        if (n != (wind ? 3 : 4) || scene->numberFields == MAX_FIELDS)
+            return 0;
+        field->type = wind ? FIELD_WIND : FIELD_ATTRACTOR;
+        memcpy(field->vector, f, sizeof(field->vector));
+        field->strength = wind ? 0 : f[3];
+        scene->numberFields++;
+    }
+    else if (strcmp(keyword, "repel") == 0)
+    {
+        f[2] = 0;
+        n = sscanf(line, "%*s %f %f %f", &f[0], &f[1], &f[2]);
+        if (n < 2 || f[0] <= 0 || f[1] < 0 || f[2] < 0)
+            return 0;
+        scene->repelRadius = f[0];
+        scene->repelStiffness = f[1];
+        scene->repelDamping = f[2];
+    }
+    else
+        return 0;
+    return 1;
+}
+
+struct scene *sceneLoad(const char *path)
+{
+    FILE *file = fopen(path, "r");
+    struct scene *scene;
+    char line[256];
+    int number = 0, e, first = 0;
+
+    if (file == NULL)
+    {
+        fprintf(stderr, "cannot open the scene %s\n", path);
+        return NULL;
+    }
+    scene = calloc(1, sizeof(*scene));
+    while (scene != NULL && fgets(line, sizeof(line), file) != NULL)
+    {
+        number++;
+        line[strcspn(line, "#\n")] = '\0';
+        if (!readLine(scene, line))
+        {
+            fprintf(stderr, "%s:%d: cannot read \"%s\"\n", path, number, line);
+            free(scene);
+            scene = NULL;
+        }
+    }
+    fclose(file);
+    if (scene != NULL && scene->numberEmitters == 0)
+    {
+        fprintf(stderr, "%s: no emitter\n", path);
+        free(scene);
+        return NULL;
+    }
+    for (e = 0; scene != NULL && e < scene->numberEmitters; e++)
+    {
+        scene->emitters[e].first = first;
+        first += scene->emitters[e].count;
+    }
+    if (scene != NULL && (scene->batches = makeBatches(scene)) == NULL)
+    {
+        free(scene);
+        return NULL;
+    }
+    if (scene != NULL && scene->repelRadius > 0 && (scene->grid = gridCreate()) == NULL)
+    {
+        sceneDestroy(scene);
+        return NULL;
+    }
+    return scene;
+}
+
+// the particle system frees the per particle arrays
+void sceneDestroy(struct scene *scene)
+{
+    if (scene == NULL)
+        return;
+    free(scene->batches);
+    gridDestroy(scene->grid);
+    free(scene);
+}
+
+// initialise particles [first, end) of one emitter, each from its own
+// stream (seed, i, counter) like the waterfall's
+static void emitFrom(struct particleSystem *ps, const struct emitter *emitter, int first, int end, uint64_t counter)
+{
+    struct scene *scene = ps->scene;
+    uint32_t base = rngBase(ps->seed, counter);
+    int i;
+
+    for (i = first; i < end; i++)
+    {
+        uint32_t key = rngKey(base, i);
+        float elevation = DEGREES(emitter->elevation + RANDOM_RANGE(-5.0f, 5.0f, rngUniform(key, DRAW_ELEVATION)));
+        float heading = DEGREES(emitter->heading + emitter->spread * RANDOM_RANGE(-1.0f, 1.0f, rngUniform(key, DRAW_HEADING)));
+        float velocity = emitter->velocity + RANDOM_RANGE(-1.0f, 1.0f, rngUniform(key, DRAW_VELOCITY));
+        float color[4];
+
+        ps->positionX[i] = ps->previousX[i] = emitter->origin[0];
+        ps->positionY[i] = ps->previousY[i] = emitter->origin[1] + 2.0f * rngUniform(key, DRAW_HEIGHT);
+        ps->positionZ[i] = ps->previousZ[i] = emitter->origin[2];
+        ps->particleTime[i] = 0;
+        scene->velocityX[i] = velocity * cosf(elevation) * cosf(heading);
+        scene->velocityY[i] = velocity * sinf(elevation);
+        scene->velocityZ[i] = velocity * cosf(elevation) * sinf(heading);
+        color[0] = RANDOM_RANGE(0.1f, 1.0f, rngUniform(key, DRAW_RED));
+        color[1] = RANDOM_RANGE(0.1f, 1.0f, rngUniform(key, DRAW_GREEN));
+        color[2] = RANDOM_RANGE(0.1f, 1.0f, rngUniform(key, DRAW_BLUE));
+        color[3] = RANDOM_RANGE(0.7f, 1.0f, rngUniform(key, DRAW_ALPHA));
+        packColor(ps->colorList[i], color);
+    }
+}
+
+void sceneEmit(struct particleSystem *ps, int first, int count, uint64_t counter)
+{
+    const struct scene *scene = ps->scene;
+    int e;
+
+    for (e = 0; e < scene->numberEmitters; e++)
+    {
+        const struct emitter *emitter = &scene->emitters[e];
+        int begin = first > emitter->first ? first : emitter->first;
+        int end = first + count < emitter->first + emitter->count ? first + count : emitter->first + emitter->count;
+
+        if (begin < end)
+            emitFrom(ps, emitter, begin, end, counter);
+    }
+}
+
+// The loops below take the arrays as restrict parameters: they never overlap,
+// and saying so lets the compiler vectorise loops over six arrays or more.
+// Every condition is a select between values computed either way (a select
+// around an arithmetic arm stops GCC from vectorising), so no loop branches
+// per particle.
+
+// the particles inside a solid box leave it through the nearest face, and
+// bounce if they were moving in
+static void collideBox(const struct collider *box, int begin, int end,
+                       float *restrict positionX, float *restrict positionY, float *restrict positionZ,
+                       float *restrict velocityX, float *restrict velocityY, float *restrict velocityZ)
+{
+    const float x0 = box->low[0], y0 = box->low[1], z0 = box->low[2];
+    const float x1 = box->high[0], y1 = box->high[1], z1 = box->high[2];
+    const float rebound = 1.0f + box->bounce;
+    int i;
+
+    for (i = begin; i < end; i++)
+    {
+        float x = positionX[i], y = positionY[i], z = positionZ[i];
+        float depth = x - x0, nx = -1, ny = 0, nz = 0;
+        float d, push, vn;
+        int m;
+
+        // the smallest of the six distances to the faces, and that face's normal;
+        // it is positive only inside the box
+        d = x1 - x; m = d < depth; depth = m ? d : depth; nx = m ? 1 : nx;
+        d = y - y0; m = d < depth; depth = m ? d : depth; nx = m ? 0 : nx; ny = m ? -1 : ny;
+        d = y1 - y; m = d < depth; depth = m ? d : depth; nx = m ? 0 : nx; ny = m ? 1 : ny;
+        d = z - z0; m = d < depth; depth = m ? d : depth; nx = m ? 0 : nx; ny = m ? 0 : ny; nz = m ? -1 : nz;
+        d = z1 - z; m = d < depth; depth = m ? d : depth; nx = m ? 0 : nx; ny = m ? 0 : ny; nz = m ? 1 : nz;
+
+        push = depth > 0 ? depth : 0;
+        positionX[i] = x + nx * push;
+        positionY[i] = y + ny * push;
+        positionZ[i] = z + nz * push;
+
+        vn = nx * velocityX[i] + ny * velocityY[i] + nz * velocityZ[i];
+        vn *= (depth > 0) & (vn < 0) ? rebound : 0;
+        velocityX[i] -= nx * vn;
+        velocityY[i] -= ny * vn;
+        velocityZ[i] -= nz * vn;
+    }
+}
+
+// the particles behind a plane move back onto it, and bounce if they were
+// moving in
+static void collidePlane(const struct collider *plane, int begin, int end,
+                         float *restrict positionX, float *restrict positionY, float *restrict positionZ,
+                         float *restrict velocityX, float *restrict velocityY, float *restrict velocityZ)
+{
+    const float nx = plane->normal[0], ny = plane->normal[1], nz = plane->normal[2];
+    const float offset = plane->offset, rebound = 1.0f + plane->bounce;
+    int i;
+
+    for (i = begin; i < end; i++)
+    {
+        float d = nx * positionX[i] + ny * positionY[i] + nz * positionZ[i] - offset;
+        float push = d < 0 ? d : 0;
+        float vn = nx * velocityX[i] + ny * velocityY[i] + nz * velocityZ[i];
+
+        positionX[i] -= nx * push;
+        positionY[i] -= ny * push;
+        positionZ[i] -= nz * push;
+        vn *= (d < 0) & (vn < 0) ? rebound : 0;
+        velocityX[i] -= nx * vn;
+        velocityY[i] -= ny * vn;
+        velocityZ[i] -= nz * vn;
+    }
+}
+
+// a plane with the normal along one axis, n being +1 or -1: the same as
+// collidePlane() with the two other components 0, on only one of the
+// positions and velocities
+static void collideAxis(const struct collider *plane, int begin, int end, float n,
+                        float *restrict position, float *restrict velocity)
+{
+    const float offset = plane->offset, rebound = 1.0f + plane->bounce;
+    int i;
+
+    for (i = begin; i < end; i++)
+    {
+        float d = n * position[i] - offset;
+        float push = d < 0 ? d : 0;
+        float vn = n * velocity[i];
+
+        position[i] -= n * push;
+        vn *= (d < 0) & (vn < 0) ? rebound : 0;
+        velocity[i] -= n * vn;
+    }
+}
+
+static void collidePlaneX(const struct collider *plane, int begin, int end,
+                          float *restrict positionX, float *restrict positionY, float *restrict positionZ,
+                          float *restrict velocityX, float *restrict velocityY, float *restrict velocityZ)
+{
+    collideAxis(plane, begin, end, plane->normal[0], positionX, velocityX);
+}
+
+static void collidePlaneY(const struct collider *plane, int begin, int end,
+                          float *restrict positionX, float *restrict positionY, float *restrict positionZ,
+                          float *restrict velocityX, float *restrict velocityY, float *restrict velocityZ)
+{
+    collideAxis(plane, begin, end, plane->normal[1], positionY, velocityY);
+}
+
+static void collidePlaneZ(const struct collider *plane, int begin, int end,
+                          float *restrict positionX, float *restrict positionY, float *restrict positionZ,
+                          float *restrict velocityX, float *restrict velocityY, float *restrict velocityZ)
+{
+    collideAxis(plane, begin, end, plane->normal[2], positionZ, velocityZ);
+}
+
+// floors and walls are mostly square to the axes
+static collideKernel chooseCollider(const struct collider *collider)
+{
+    static const collideKernel axes[3] = { collidePlaneX, collidePlaneY, collidePlaneZ };
+    int axis;
+
+    if (collider->type == COLLIDER_BOX)
+        return collideBox;
+    for (axis = 0; axis < 3; axis++)
+    {
+        if (fabsf(collider->normal[axis]) == 1 &&
+            collider->normal[(axis + 1) % 3] == 0 && collider->normal[(axis + 2) % 3] == 0)
+            return axes[axis];
+    }
+    return collidePlane;
+}
+
+// attractors pull with strength / distance^2, from where the particles were
+static void attract(const struct forceField *field, int begin, int end,
+                    const float *restrict previousX, const float *restrict previousY, const float *restrict previousZ,
+                    float *restrict velocityX, float *restrict velocityY, float *restrict velocityZ)
+{
+    const float cx = field->vector[0], cy = field->vector[1], cz = field->vector[2];
+    const float pull = field->strength * TIME_DELTA;
+    int i;
+
+    for (i = begin; i < end; i++)
+    {
+        float dx = cx - previousX[i], dy = cy - previousY[i], dz = cz - previousZ[i];
+        float r2 = dx * dx + dy * dy + dz * dz + SOFTENING;
+        float k = pull / (r2 * sqrtf(r2));
+
+        velocityX[i] += dx * k;
+        velocityY[i] += dy * k;
+        velocityZ[i] += dz * k;
+    }
+}
+
+// constant acceleration a over the step: p += (v + a dt / 2) dt, v += a dt
+static void move(const float a[3], int begin, int end,
+                 const float *restrict previousX, const float *restrict previousY, const float *restrict previousZ,
+                 float *restrict positionX, float *restrict positionY, float *restrict positionZ,
+                 float *restrict velocityX, float *restrict velocityY, float *restrict velocityZ,
+                 float *restrict particleTime)
+{
+    const float dt = TIME_DELTA;
+    const float ax = a[0] * dt, ay = a[1] * dt, az = a[2] * dt;
+    int i;
+
+    for (i = begin; i < end; i++)
+    {
+        positionX[i] = previousX[i] + (velocityX[i] + 0.5f * ax) * dt;
+        positionY[i] = previousY[i] + (velocityY[i] + 0.5f * ay) * dt;
+        positionZ[i] = previousZ[i] + (velocityZ[i] + 0.5f * az) * dt;
+        velocityX[i] += ax;
+        velocityY[i] += ay;
+        velocityZ[i] += az;
+        particleTime[i] += dt;
+    }
+}
+
+// one tile of a batch: every attractor, then the move, then every collider,
+// each over all of the tile with the same constants; last the respawns
+static void updateTile(struct particleSystem *ps, const struct emitter *emitter, const float a[3], int begin, int end)
+{
+    struct scene *scene = ps->scene;
+    float *positionX = ps->positionX, *positionY = ps->positionY, *positionZ = ps->positionZ;
+    float *previousX = ps->previousX, *previousY = ps->previousY, *previousZ = ps->previousZ;
+    float *velocityX = scene->velocityX, *velocityY = scene->velocityY, *velocityZ = scene->velocityZ;
+    float *particleTime = ps->particleTime;
+    const float lifetime = emitter->lifetime > 0 ? emitter->lifetime : INFINITY;
+    const float ox = emitter->origin[0], oz = emitter->origin[2];
+    int f, c, i;
+
+    for (f = 0; f < scene->numberFields; f++)
+    {
+        if (scene->fields[f].type == FIELD_ATTRACTOR)
+            attract(&scene->fields[f], begin, end, previousX, previousY, previousZ, velocityX, velocityY, velocityZ);
+    }
+    move(a, begin, end, previousX, previousY, previousZ, positionX, positionY, positionZ,
+         velocityX, velocityY, velocityZ, particleTime);
+
+    for (c = 0; c < scene->numberColliders; c++)
+    {
+        const struct collider *collider = &scene->colliders[c];
+        if (collider->type == COLLIDER_BOX)
+            collideBox(collider, begin, end, positionX, positionY, positionZ, velocityX, velocityY, velocityZ);
+        else
+            collidePlane(collider, begin, end, positionX, positionY, positionZ, velocityX, velocityY, velocityZ);
+    }
+
+    // too old, fallen off everything, or further than EDGE from the emitter
+    for (i = begin; i < end; i++)
+    {
+        float dx = positionX[i] - ox, dz = positionZ[i] - oz;
+        if ((particleTime[i] > lifetime) | (positionY[i] < KILL_HEIGHT) | (dx * dx + dz * dz > EDGE * EDGE))
+            emitFrom(ps, emitter, i, i + 1, 2 * ps->step + 1);
+    }
+}
+
+// updateTile() built for one set of features: the passes a scene without
+// them does not need are left out, and the colliders go through the kernels
+// chosen for them, so no pass looks at a type
+static inline __attribute__((always_inline))
+void specialisedTile(struct particleSystem *ps, const struct emitter *emitter, const struct sceneBatches *table,
+                     const float a[3], int begin, int end, const int features)
+{
+    struct scene *scene = ps->scene;
+    float *positionX = ps->positionX, *positionY = ps->positionY, *positionZ = ps->positionZ;
+    float *previousX = ps->previousX, *previousY = ps->previousY, *previousZ = ps->previousZ;
+    float *velocityX = scene->velocityX, *velocityY = scene->velocityY, *velocityZ = scene->velocityZ;
+    float *particleTime = ps->particleTime;
+    const float lifetime = emitter->lifetime;
+    const float ox = emitter->origin[0], oz = emitter->origin[2];
+    int f, c, i;
+
+    if (features & TILE_ATTRACT)
+    {
+        for (f = 0; f < table->numberAttractors; f++)
+            attract(table->attractors[f], begin, end, previousX, previousY, previousZ, velocityX, velocityY, velocityZ);
+    }
+    move(a, begin, end, previousX, previousY, previousZ, positionX, positionY, positionZ,
+         velocityX, velocityY, velocityZ, particleTime);
+    if (features & TILE_COLLIDE)
+    {
+        for (c = 0; c < scene->numberColliders; c++)
+            table->collide[c](&scene->colliders[c], begin, end,
+                              positionX, positionY, positionZ, velocityX, velocityY, velocityZ);
+    }
+
+    for (i = begin; i < end; i++)
+    {
+        float dx = positionX[i] - ox, dz = positionZ[i] - oz;
+        int dead = (positionY[i] < KILL_HEIGHT) | (dx * dx + dz * dz > EDGE * EDGE);
+
+        if (features & TILE_EXPIRE)
+            dead |= particleTime[i] > lifetime;
+        if (dead)
+            emitFrom(ps, emitter, i, i + 1, 2 * ps->step + 1);
+    }
+}
+
+#define TILE_KERNEL(features) \
+    static void updateTile##features(struct particleSystem *ps, const struct emitter *emitter, \
+                                     const struct sceneBatches *table, const float a[3], int begin, int end) \
+    { \
+        specialisedTile(ps, emitter, table, a, begin, end, features); \
+    }
+
+TILE_KERNEL(0)
+TILE_KERNEL(1)
+TILE_KERNEL(2)
+TILE_KERNEL(3)
+TILE_KERNEL(4)
+TILE_KERNEL(5)
+TILE_KERNEL(6)
+TILE_KERNEL(7)
+
+static tileKernel chooseTile(const struct scene *scene, const struct emitter *emitter)
+{
+    static const tileKernel kernels[TILE_KERNELS] =
+    {
+        updateTile0, updateTile1, updateTile2, updateTile3, updateTile4, updateTile5, updateTile6, updateTile7
+    };
+    int features = 0, f;
+
+    for (f = 0; f < scene->numberFields; f++)
+    {
+        if (scene->fields[f].type == FIELD_ATTRACTOR)
+            features |= TILE_ATTRACT;
+    }
+    if (scene->numberColliders > 0)
+        features |= TILE_COLLIDE;
+    if (emitter->lifetime > 0)
+        features |= TILE_EXPIRE;
+    return kernels[features];
+}
+
+// a batch goes through in tiles small enough that the passes over a tile
+// find its particles still in the first level cache; the reference kernel
+// keeps to the generic tile, every other one takes the batch's own
+static void updateBatch(struct particleSystem *ps, const struct batch *batch)
+{
+    const struct emitter *emitter = &ps->scene->emitters[batch->emitter];
+    const struct sceneBatches *table = ps->scene->batches;
+    int begin = batch->begin, end = batch->end;
+    const struct scene *scene = ps->scene;
+    float a[3] = { 0, -ps->gravity, 0 };        // gravity and every wind together
+    int f, tile;
+
+    for (f = 0; f < scene->numberFields; f++)
+    {
+        const struct forceField *field = &scene->fields[f];
+        if (field->type == FIELD_WIND)
+        {
+            a[0] += field->vector[0];
+            a[1] += field->vector[1];
+            a[2] += field->vector[2];
+        }
+    }
+    for (tile = begin; tile < end; tile += SCENE_TILE)
+    {
+        int last = tile + SCENE_TILE < end ? tile + SCENE_TILE : end;
+
+        if (ps->kernel == KERNEL_REFERENCE)
+            updateTile(ps, emitter, a, tile, last);
+        else
+            batch->update(ps, emitter, table, a, tile, last);
+    }
+}
+
+static void updateTask(void *context, int task)
+{
+    struct particleSystem *ps = context;
+    updateBatch(ps, &ps->scene->batches->batches[task]);
+}
+
+void sceneUpdate(struct particleSystem *ps)
+{
+    struct scene *scene = ps->scene;
+    const struct sceneBatches *table = scene->batches;
+    int task;
+
+    if (ps->pool != NULL && table->numberBatches > 1)
+        poolRun(ps->pool, table->numberBatches, updateTask, ps);
+    else
+    {
+        for (task = 0; task < table->numberBatches; task++)
+            updateTask(ps, task);
+    }
+
+    // the forces between particles go into the velocities for the next step;
+    // without the memory for the grid a step goes without them
+    if (scene->grid != NULL &&
+        gridBuild(scene->grid, ps->pool, ps->positionX, ps->positionY, ps->positionZ,
+                  ps->numberParticles, scene->repelRadius))
+        gridRepel(scene->grid, ps->pool, scene->repelStiffness, scene->repelDamping, (float) TIME_DELTA,
+                  scene->velocityX, scene->velocityY, scene->velocityZ);
+}
+
+/* end of scene.c */
@@ -0,0 +1,111 @@
+//
+//  scene.h
+//
+//
+//  Created by BOWEN LI
+//
+//  A scene in place of the one built-in waterfall: any number of emitters,
+//  each with its own particles, plus plane and box colliders and force
+//  fields shared by all of them. The particles of an emitter sit next to one
+//  another in the arrays, so the update goes through them in batches that all
+//  share one emitter, and walks every collider and field over a whole batch
+//  at a time with the same constants and no branch per particle.
+//
+//  A scene is read from a text file, one item per line, '#' starting a
+//  comment; angles are in degrees:
+//
+//      emitter   x y z  count  velocity  elevation  heading  spread  [lifetime]
+//      plane     nx ny nz  offset  bounce      keeps particles where n.p >= offset
+//      box       x0 y0 z0  x1 y1 z1  bounce    a solid box they bounce off
+//      wind      ax ay az                      an acceleration everywhere
+//      attractor x y z  strength               pulls with strength / distance^2
+//      repel     radius stiffness [damping]    particles closer than radius push
+//                                              apart, with stiffness when in one
+//                                              place, less damping * their speed apart
+//
+
+#ifndef SCENE_H
+#define SCENE_H
+
+#include "particles.h"
+
+#define MAX_EMITTERS 64
+#define MAX_COLLIDERS 16
+#define MAX_FIELDS 16
+#define SCENE_ARRAYS 3                          // the velocity, one float per particle each
+
+#define COLLIDER_PLANE 0
+#define COLLIDER_BOX 1
+
+#define FIELD_WIND 0
+#define FIELD_ATTRACTOR 1
+
+struct emitter
+{
+    float origin[3];                            // particles start up to 2 units above it
+    int count;                                  // particles it keeps alive
+    float velocity;                             // mean speed, give or take 1
+    float elevation;                            // launch angle above the horizon, give or take 5
+    float heading;                              // direction in the xz plane, from +x towards +z
+    float spread;                               // heading varies this much either side
+    float lifetime;                             // seconds before a respawn, 0 for no limit
+    int first;                                  // its particles are [first, first + count)
+};
+
+struct collider
+{
+    int type;                                   // COLLIDER_
+    float normal[3];                            // plane: unit normal and offset along it
+    float offset;
+    float low[3], high[3];                      // box: opposite corners
+    float bounce;                               // normal speed kept by a bounce
+};
+
+struct forceField
+{
+    int type;                                   // FIELD_
+    float vector[3];                            // wind: acceleration; attractor: centre
+    float strength;
+};
+
+struct sceneBatches;
+struct particleGrid;
+
+struct scene
+{
+    int numberEmitters, numberColliders, numberFields;
+    struct emitter emitters[MAX_EMITTERS];
+    struct collider colliders[MAX_COLLIDERS];
+    struct forceField fields[MAX_FIELDS];
+    struct sceneBatches *batches;               // the tasks of the update, see scene.c
+    float repelRadius;                          // 0 for particles that pass through each other
+    float repelStiffness;                       // acceleration between two particles in one place
+    float repelDamping;                         // and per unit of the speed they part at
+    struct particleGrid *grid;                  // finds the pairs closer than repelRadius
+
+    // per particle, sized like the arrays of the particle system
+    float *velocityX;
+    float *velocityY;
+    float *velocityZ;
+};
+
+// read a scene; prints the offending line and returns NULL on an error
+struct scene *sceneLoad(const char *path);
+void sceneDestroy(struct scene *scene);
+
+// the particles of all emitters together
+int sceneParticles(const struct scene *scene);
+
+// the addresses of the per particle arrays, which particleSystemResize()
+// moves along with its own; returns how many, 0 for a NULL scene
+int sceneArrays(struct scene *scene, void **arrays[SCENE_ARRAYS]);
+
+// initialise particles [first, first + count) from their emitters
+void sceneEmit(struct particleSystem *ps, int first, int count, uint64_t counter);
+
+// advance every particle by TIME_DELTA, from previous to position
+void sceneUpdate(struct particleSystem *ps);
+
+#endif
+
+/* end of scene.h */
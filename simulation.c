@@ -0,0 +1,374 @@
+//
+//  simulation.c
+//
+//
+//  Created by BOWEN LI
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include "simulation.h"
+#include "pool.h"
+
+#define FRAMES 3                                // drawn, published and being written
+#define FRESH 4                                 // on the published index: not yet taken
+#define INDEX (FRESH - 1)
+#define COMMANDS 64                             // queued at most, a power of two
+#define COPY_CHUNK COMPACT_BLOCK                 // fewest particles worth a task of their own
+#define LONGEST_SLEEP 0.005                     // seconds, so commands wait little longer
+
+#define COMMAND_CALL 0
+#define COMMAND_PAUSE 1
+#define COMMAND_RESUME 2
+
+struct command
+{
+    int type;                                   // COMMAND_
+    simulationCommand function;
+    int argument;
+};
+
+// a copy of what is drawn, its arrays its own
+struct frame
+{
+    struct particleSystem view;
+    struct compactParticles compact;            // what the view draws from when the frames are packed
+    float blend;                                // the system's when it was copied
+    double published;                           // when, on profileNow()'s clock
+};
+
+struct simulation
+{
+    struct particleSystem *ps;
+    struct profile *profile;
+    int threaded;
+    int compact;                                // the frames packed instead of copied
+    int paused;                                 // the simulating thread's own
+    double lastUpdate;                          // when the system last caught up, 0 after a pause
+    pthread_t thread;
+    _Atomic int stopping;
+
+    // the frames: the drawing thread owns front, the simulating one back,
+    // and latest, with FRESH until it is taken, passes from one to the other
+    struct frame frames[FRAMES];
+    int front, back;
+    _Atomic int latest;
+    struct workerPool *drawPool;                // the drawing thread's, NULL for none
+
+    // commands from the drawing thread, which only moves tail, to the
+    // simulating one, which only moves head
+    struct command commands[COMMANDS];
+    _Atomic unsigned head, tail;
+
+    _Atomic uint64_t busy;                      // nanoseconds simulated since the last frame taken
+};
+
+// the frame's arrays, or its packed ones when compact, with room for
+// capacity particles
+static int reserveFrame(struct frame *frame, int capacity, int compact)
+{
+    float **arrays[6] = { &frame->view.positionX, &frame->view.positionY, &frame->view.positionZ,
+                          &frame->view.previousX, &frame->view.previousY, &frame->view.previousZ };
+    void *fresh;
+    int array;
+
+    if (capacity <= frame->view.capacity)
+        return 1;
+    if (compact)
+    {
+        if (!compactReserve(&frame->compact, capacity))
+            return 0;
+        frame->view.compact = &frame->compact;
+        frame->view.capacity = capacity;
+        return 1;
+    }
+    for (array = 0; array < 6; array++)
+    {
+        if (posix_memalign(&fresh, CACHE_LINE, capacity * sizeof(float)) != 0)
+            return 0;
+        free(*arrays[array]);
+        *arrays[array] = fresh;
+    }
+    if (posix_memalign(&fresh, CACHE_LINE, capacity * sizeof(*frame->view.colorList)) != 0)
+        return 0;
+    free(frame->view.colorList);
+    frame->view.colorList = fresh;
+    frame->view.capacity = capacity;
+    return 1;
+}
+
+static void freeFrame(struct frame *frame)
+{
+    free(frame->view.positionX);
+    free(frame->view.positionY);
+    free(frame->view.positionZ);
+    free(frame->view.previousX);
+    free(frame->view.previousY);
+    free(frame->view.previousZ);
+    free(frame->view.colorList);
+    compactFree(&frame->compact);
+}
+
+// the system and the frame it is copied into
+struct copyTask
+{
+    const struct particleSystem *ps;
+    struct particleSystem *view;
+    struct compactParticles *compact;           // packed into instead, or NULL
+};
+
+static void copyChunk(void *context, int chunk)
+{
+    const struct copyTask *task = context;
+    const struct particleSystem *ps = task->ps;
+    struct particleSystem *view = task->view;
+    int begin = chunk * COPY_CHUNK, end = begin + COPY_CHUNK;
+    size_t bytes;
+
+    if (task->compact != NULL)
+    {
+        compactBlock(task->compact, ps, chunk);
+        return;
+    }
+    if (end > ps->numberParticles)
+        end = ps->numberParticles;
+    bytes = (end - begin) * sizeof(float);
+    memcpy(view->positionX + begin, ps->positionX + begin, bytes);
+    memcpy(view->positionY + begin, ps->positionY + begin, bytes);
+    memcpy(view->positionZ + begin, ps->positionZ + begin, bytes);
+    memcpy(view->previousX + begin, ps->previousX + begin, bytes);
+    memcpy(view->previousY + begin, ps->previousY + begin, bytes);
+    memcpy(view->previousZ + begin, ps->previousZ + begin, bytes);
+    memcpy(view->colorList + begin, ps->colorList + begin, (end - begin) * sizeof(*ps->colorList));
+}
+
+// copy the system into the back frame and make it the latest; the frame
+// given back in exchange is the next one to write
+static void publish(struct simulation *simulation)
+{
+    const struct particleSystem *ps = simulation->ps;
+    struct frame *frame = &simulation->frames[simulation->back];
+    struct copyTask task;
+    int chunks = (ps->numberParticles + COPY_CHUNK - 1) / COPY_CHUNK, chunk;
+
+    if (!reserveFrame(frame, ps->capacity, simulation->compact))
+        return;                                 // the last frame stays up
+    task.ps = ps;
+    task.view = &frame->view;
+    task.compact = simulation->compact ? &frame->compact : NULL;
+    if (ps->pool != NULL && chunks > 1)
+        poolRun(ps->pool, chunks, copyChunk, &task);
+    else
+    {
+        for (chunk = 0; chunk < chunks; chunk++)
+            copyChunk(&task, chunk);
+    }
+    frame->view.numberParticles = ps->numberParticles;
+    frame->view.targetParticles = ps->targetParticles;
+    frame->view.meanVelocity = ps->meanVelocity;
+    frame->view.gravity = ps->gravity;
+    frame->view.seed = ps->seed;
+    frame->view.step = ps->step;
+    frame->view.scene = ps->scene;              // only its colliders are drawn, which stay put
+    frame->blend = ps->blend;
+    frame->published = profileNow();
+
+    simulation->back = atomic_exchange(&simulation->latest, simulation->back | FRESH) & INDEX;
+}
+
+// run the queued commands; returns how many there were
+static int runCommands(struct simulation *simulation)
+{
+    unsigned head = atomic_load(&simulation->head), tail = atomic_load(&simulation->tail);
+    int count = 0;
+
+    for (; head != tail; head++, count++)
+    {
+        const struct command *command = &simulation->commands[head % COMMANDS];
+
+        if (command->type == COMMAND_CALL)
+            command->function(simulation->ps, command->argument);
+        else
+        {
+            simulation->paused = command->type == COMMAND_PAUSE;
+            simulation->lastUpdate = 0;         // the pause is not simulated
+        }
+    }
+    atomic_store(&simulation->head, head);
+    return count;
+}
+
+// advance the system to now; returns the steps taken
+static int advance(struct simulation *simulation)
+{
+    double now = profileNow();
+    int steps;
+
+    if (simulation->paused)
+        return 0;
+    steps = particleSystemAdvance(simulation->ps, simulation->lastUpdate > 0 ? now - simulation->lastUpdate : 0);
+    simulation->lastUpdate = now;
+    return steps;
+}
+
+static void sleepFor(double seconds)
+{
+    struct timespec wait;
+
+    if (seconds > LONGEST_SLEEP)
+        seconds = LONGEST_SLEEP;
+    if (seconds <= 0)
+        return;
+    wait.tv_sec = 0;
+    wait.tv_nsec = (long) (seconds * 1.0E9);
+    nanosleep(&wait, NULL);
+}
+
+static void *simulate(void *context)
+{
+    struct simulation *simulation = context;
+    const struct particleSystem *ps = simulation->ps;
+
+    while (!atomic_load(&simulation->stopping))
+    {
+        double begin = profileNow();
+        int changed = runCommands(simulation);
+
+        if (advance(simulation) > 0 || changed)
+            publish(simulation);
+        atomic_fetch_add(&simulation->busy, (uint64_t) ((profileNow() - begin) * 1.0E9));
+
+        // until the next step is due, or a while when there is none
+        sleepFor(simulation->paused || ps->analytic != NULL ? LONGEST_SLEEP : (TIME_DELTA - ps->lag));
+    }
+    return NULL;
+}
+
+struct simulation *simulationCreate(struct particleSystem *ps, struct profile *profile, int flags,
+                                    void (*stepped)(struct particleSystem *ps))
+{
+    struct simulation *simulation = calloc(1, sizeof(struct simulation));
+    int k;
+
+    if (simulation == NULL)
+        return NULL;
+    simulation->ps = ps;
+    simulation->profile = profile;
+    simulation->threaded = (flags & SIMULATION_THREADED) != 0;
+    simulation->compact = (flags & SIMULATION_COMPACT) != 0;
+    ps->stepped = stepped;                      // set before the thread can step
+    if (!simulation->threaded)
+        return simulation;
+
+    // the sorting and the culling run beside the update, so on threads of their own
+    if (ps->threads > 1)
+        simulation->drawPool = poolCreate(ps->threads);
+    for (k = 0; k < FRAMES; k++)
+    {
+        simulation->frames[k].view.threads = 1;
+        simulation->frames[k].view.pool = simulation->drawPool;
+    }
+
+    // the frame to draw until the thread publishes its first
+    simulation->front = 0;
+    simulation->back = 1;
+    atomic_init(&simulation->latest, 2);
+    publish(simulation);
+    simulation->front = atomic_exchange(&simulation->latest, simulation->front) & INDEX;
+
+    if (simulation->frames[simulation->front].view.capacity < ps->capacity ||
+        pthread_create(&simulation->thread, NULL, simulate, simulation) != 0)
+    {
+        simulation->threaded = 0;               // so there is no thread to stop
+        simulationDestroy(simulation);
+        return NULL;
+    }
+    return simulation;
+}
+
+void simulationDestroy(struct simulation *simulation)
+{
+    int k;
+
+    if (simulation == NULL)
+        return;
+    if (simulation->threaded)
+    {
+        atomic_store(&simulation->stopping, 1);
+        pthread_join(simulation->thread, NULL);
+    }
+    simulation->ps->stepped = NULL;
+    for (k = 0; k < FRAMES; k++)
+        freeFrame(&simulation->frames[k]);
+    poolDestroy(simulation->drawPool);
+    free(simulation);
+}
+
+// queue a command, waiting while the queue is full, which it is only as long
+// as the simulating thread takes to come round
+static void queue(struct simulation *simulation, int type, simulationCommand function, int argument)
+{
+    unsigned tail = atomic_load(&simulation->tail);
+    struct command *command;
+
+    while (tail - atomic_load(&simulation->head) == COMMANDS)
+        sched_yield();
+    command = &simulation->commands[tail % COMMANDS];
+    command->type = type;
+    command->function = function;
+    command->argument = argument;
+    atomic_store(&simulation->tail, tail + 1);
+}
+
+void simulationCall(struct simulation *simulation, simulationCommand command, int argument)
+{
+    if (simulation->threaded)
+        queue(simulation, COMMAND_CALL, command, argument);
+    else
+        command(simulation->ps, argument);
+}
+
+void simulationPause(struct simulation *simulation, int paused)
+{
+    if (simulation->threaded)
+        queue(simulation, paused ? COMMAND_PAUSE : COMMAND_RESUME, NULL, 0);
+    else
+    {
+        simulation->paused = paused;
+        simulation->lastUpdate = 0;
+    }
+}
+
+void simulationUpdate(struct simulation *simulation)
+{
+    if (simulation->threaded)
+        return;
+    profileBegin(simulation->profile, PROFILE_UPDATE);
+    advance(simulation);
+    profileEnd(simulation->profile, PROFILE_UPDATE);
+}
+
+const struct particleSystem *simulationFrame(struct simulation *simulation)
+{
+    struct frame *frame;
+    float blend;
+
+    if (!simulation->threaded)
+        return simulation->ps;
+
+    if (atomic_load(&simulation->latest) & FRESH)
+        simulation->front = atomic_exchange(&simulation->latest, simulation->front) & INDEX;
+    profileAdd(simulation->profile, PROFILE_UPDATE, atomic_exchange(&simulation->busy, 0) * 1.0E-9);
+
+    // on from where the step was left, as far as the time since then goes
+    frame = &simulation->frames[simulation->front];
+    blend = frame->blend + (profileNow() - frame->published) / TIME_DELTA;
+    frame->view.blend = blend < 1 ? blend : 1;
+    return &frame->view;
+}
+
+/* end of simulation.c */
@@ -0,0 +1,64 @@
+//
+//  simulation.h
+//
+//
+//  Created by BOWEN LI
+//
+//  The particles simulated on a thread of their own while the frames are
+//  drawn. After every step the thread copies what is drawn, the positions,
+//  the previous positions and the colours, into the spare one of three
+//  frames and publishes it with one atomic exchange; the drawing thread
+//  takes the latest published frame the same way, so neither ever waits for
+//  the other. Changes to the system, from the menu or the keyboard, go the
+//  other way through a queue of commands, run by the simulation thread
+//  between steps. A frame is drawn up to one step behind the simulation, and
+//  blended towards the step by how long ago it was published.
+//
+//  Without the thread the caller simulates in simulationUpdate() and the
+//  frame drawn is the system itself, as before. With SIMULATION_COMPACT the
+//  frames are packed (see compact.h) rather than copied.
+//
+
+#ifndef SIMULATION_H
+#define SIMULATION_H
+
+#include "particles.h"
+#include "profile.h"
+
+#define SIMULATION_THREADED 1                   // on a thread of its own
+#define SIMULATION_COMPACT 2                    // the frames packed, with the thread only
+
+struct simulation;
+
+// a change to the system, run on the thread that simulates it
+typedef void (*simulationCommand)(struct particleSystem *ps, int argument);
+
+// simulate ps, on a thread of its own with SIMULATION_THREADED in flags,
+// until destroyed; ps must then be left to it. stepped, when not NULL, runs
+// on the same thread after every step, however many one advance takes. The simulation's
+// time is charged to PROFILE_UPDATE of profile, which may be NULL. NULL when
+// the memory cannot be found or the thread cannot start.
+struct simulation *simulationCreate(struct particleSystem *ps, struct profile *profile, int flags,
+                                    void (*stepped)(struct particleSystem *ps));
+
+// stop the thread; ps is the caller's again
+void simulationDestroy(struct simulation *simulation);
+
+// run command with argument on the system, between two steps; without the
+// thread it runs at once. Call it from one thread only, the one drawing.
+void simulationCall(struct simulation *simulation, simulationCommand command, int argument);
+
+// stop or start the simulation; the time it stood still is not simulated
+void simulationPause(struct simulation *simulation, int paused);
+
+// without the thread, catch the system up with real time; with it nothing
+void simulationUpdate(struct simulation *simulation);
+
+// the latest frame to draw. With the thread it must not be changed and is
+// valid until the next call; its pool, which may be NULL, is the drawing
+// thread's own.
+const struct particleSystem *simulationFrame(struct simulation *simulation);
+
+#endif
+
+/* end of simulation.h */
@@ -0,0 +1,472 @@
+//
+//  snapshot.c
+//
+//
+//  Created by BOWEN LI
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "snapshot.h"
+#include "scene.h"
+#include "stream.h"
+
+#define FILE_MAGIC "PSNAPSHT"
+#define FRAME_MAGIC 0x52465350u                 // "PSFR" in the file
+#define STRIDE_STEP 512                         // particles, so even the down bits fill 64 bytes
+#define QUEUED 2                                // frames copied but not yet written
+
+#define FULL_ARRAYS 13
+#define BITS_ARRAY 11
+#define COLOR_ARRAY 12
+#define DRAWN_ARRAYS 4
+#define DRAWN_COLOR_ARRAY 3
+#define MAX_ARRAYS (FULL_ARRAYS + SCENE_ARRAYS)
+
+struct fileHeader
+{
+    char magic[8];                              // FILE_MAGIC, without its '\0'
+    uint32_t version;                           // SNAPSHOT_VERSION
+    uint32_t frames;                            // 0 until the writer closed the file
+    uint8_t reserved[48];
+};
+
+struct frameHeader
+{
+    uint32_t magic;                             // FRAME_MAGIC
+    uint32_t kind;                              // SNAPSHOT_FULL or SNAPSHOT_DRAWN
+    uint32_t numberParticles;
+    uint32_t stride;                            // particles every array has room for
+    uint32_t arrays;
+    uint32_t targetParticles;
+    uint64_t seed;
+    uint64_t step;
+    uint64_t bytes;                             // of the frame, this header included
+    double lag;
+    float meanVelocity, gravity, emitRate, emitCarry, lifetime, blend;
+    uint8_t reserved[48];
+};
+
+// both headers keep the arrays after them on 64 bytes
+typedef char fileHeaderSize[sizeof(struct fileHeader) == 64 ? 1 : -1];
+typedef char frameHeaderSize[sizeof(struct frameHeader) == 128 ? 1 : -1];
+
+struct snapshotWriter
+{
+    struct fileStream *stream;
+    uint32_t frames;                            // queued so far
+};
+
+struct snapshot
+{
+    const char *data;                           // the mapped file
+    size_t bytes;
+    int frames;
+    size_t *offsets;                            // of every frame header
+    struct particleSystem view;                 // what snapshotView() hands out
+};
+
+// the format is little endian, and only read or written where it needs no
+// conversion
+static int littleEndian(void)
+{
+    const uint32_t one = 1;
+    return *(const uint8_t *) &one == 1;
+}
+
+static size_t arrayBytes(int kind, int array, size_t stride)
+{
+    if (kind == SNAPSHOT_DRAWN)
+        return array == DRAWN_COLOR_ARRAY ? stride * 4 : stride * sizeof(float);
+    if (array == BITS_ARRAY)
+        return stride / 8;
+    if (array == COLOR_ARRAY)
+        return stride * 4;
+    return stride * sizeof(float);
+}
+
+static size_t frameBytes(int kind, int arrays, size_t stride)
+{
+    size_t bytes = sizeof(struct frameHeader);
+    int array;
+
+    for (array = 0; array < arrays; array++)
+        bytes += arrayBytes(kind, array, stride);
+    return bytes;
+}
+
+// the arrays of a full frame of ps in the file's order; returns how many
+static int fullArrays(struct particleSystem *ps, void *arrays[MAX_ARRAYS])
+{
+    void **sceneAddresses[SCENE_ARRAYS];
+    int numberArrays = FULL_ARRAYS, k, n;
+
+    arrays[0] = ps->positionX;
+    arrays[1] = ps->positionY;
+    arrays[2] = ps->positionZ;
+    arrays[3] = ps->previousX;
+    arrays[4] = ps->previousY;
+    arrays[5] = ps->previousZ;
+    arrays[6] = ps->particleTime;
+    arrays[7] = ps->velocityXZ;
+    arrays[8] = ps->velocityY;
+    arrays[9] = ps->directionX;
+    arrays[10] = ps->directionZ;
+    arrays[BITS_ARRAY] = ps->down;
+    arrays[COLOR_ARRAY] = ps->colorList;
+    n = sceneArrays(ps->scene, sceneAddresses);
+    for (k = 0; k < n; k++)
+        arrays[numberArrays++] = *sceneAddresses[k];
+    return numberArrays;
+}
+
+// an empty file header, the frame count filled in on closing
+static void fileHeader(struct fileHeader *header, uint32_t frames)
+{
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, FILE_MAGIC, sizeof(header->magic));
+    header->version = SNAPSHOT_VERSION;
+    header->frames = frames;
+}
+
+struct snapshotWriter *snapshotWriterCreate(const char *path)
+{
+    struct snapshotWriter *writer;
+    struct fileHeader header;
+
+    if (!littleEndian())
+        return NULL;
+    writer = calloc(1, sizeof(struct snapshotWriter));
+    if (writer == NULL)
+        return NULL;
+    fileHeader(&header, 0);
+    writer->stream = streamOpen(path, &header, sizeof(header), QUEUED, NULL, NULL);
+    if (writer->stream == NULL)
+    {
+        free(writer);
+        return NULL;
+    }
+    return writer;
+}
+
+// the n particles of a compact frame where they are drawn, and their colours
+static void copyCompact(float *x, float *y, float *z, uint8_t (*color)[4], const struct particleSystem *ps, int n)
+{
+    float position[3];
+    int i;
+
+    for (i = 0; i < n; i++)
+    {
+        compactPosition(ps->compact, i, ps->blend, position);
+        x[i] = position[0];
+        y[i] = position[1];
+        z[i] = position[2];
+    }
+    memcpy(color, ps->compact->color, n * sizeof(*color));
+}
+
+// the header and arrays of a frame of ps into data, stride particles long
+// each; what lies past the live particles is zero so files compare equal
+static void copyFrame(char *data, const struct particleSystem *ps, int kind, int arrays, size_t stride)
+{
+    struct frameHeader *header = (struct frameHeader *) data;
+    int n = ps->numberParticles, array, i;
+    char *at = data + sizeof(struct frameHeader);
+
+    memset(header, 0, sizeof(*header));
+    header->magic = FRAME_MAGIC;
+    header->kind = kind;
+    header->numberParticles = n;
+    header->stride = stride;
+    header->arrays = arrays;
+    header->targetParticles = ps->targetParticles;
+    header->seed = ps->seed;
+    header->step = ps->step;
+    header->bytes = frameBytes(kind, arrays, stride);
+    header->lag = ps->lag;
+    header->meanVelocity = ps->meanVelocity;
+    header->gravity = ps->gravity;
+    header->emitRate = ps->emitRate;
+    header->emitCarry = ps->emitCarry;
+    header->lifetime = ps->lifetime;
+    header->blend = kind == SNAPSHOT_DRAWN ? 1 : ps->blend;
+
+    if (kind == SNAPSHOT_FULL)
+    {
+        void *source[MAX_ARRAYS];
+
+        fullArrays((struct particleSystem *) ps, source);   // only read
+        for (array = 0; array < arrays; array++)
+        {
+            size_t live = array == BITS_ARRAY ? (n + 31) / 32 * sizeof(uint32_t) : arrayBytes(kind, array, n);
+            size_t bytes = arrayBytes(kind, array, stride);
+
+            memcpy(at, source[array], live);
+            memset(at + live, 0, bytes - live);
+            at += bytes;
+        }
+        return;
+    }
+
+    // where the particles are drawn, the blend taken out
+    {
+        float *x = (float *) at, *y = x + stride, *z = y + stride;
+        const float *positionX = ps->positionX, *positionY = ps->positionY, *positionZ = ps->positionZ;
+        const float *previousX = ps->previousX, *previousY = ps->previousY, *previousZ = ps->previousZ;
+        const float blend = ps->blend;
+
+        if (ps->compact != NULL)
+            copyCompact(x, y, z, (uint8_t (*)[4]) (z + stride), ps, n);
+        else
+        {
+            for (i = 0; i < n; i++)
+            {
+                x[i] = previousX[i] + blend * (positionX[i] - previousX[i]);
+                y[i] = previousY[i] + blend * (positionY[i] - previousY[i]);
+                z[i] = previousZ[i] + blend * (positionZ[i] - previousZ[i]);
+            }
+            memcpy(z + stride, ps->colorList, arrayBytes(kind, DRAWN_COLOR_ARRAY, n));
+        }
+        for (array = 0; array < 3; array++)
+            memset(x + array * stride + n, 0, (stride - n) * sizeof(float));
+        at = (char *) (z + stride);
+        memset(at + arrayBytes(kind, DRAWN_COLOR_ARRAY, n), 0,
+               arrayBytes(kind, DRAWN_COLOR_ARRAY, stride - n));
+    }
+}
+
+int snapshotWrite(struct snapshotWriter *writer, const struct particleSystem *ps, int kind)
+{
+    size_t stride = ((size_t) ps->numberParticles + STRIDE_STEP - 1) / STRIDE_STEP * STRIDE_STEP;
+    int arrays = kind == SNAPSHOT_DRAWN ? DRAWN_ARRAYS : FULL_ARRAYS + (ps->scene != NULL ? SCENE_ARRAYS : 0);
+    size_t bytes = frameBytes(kind, arrays, stride);
+    char *data;
+
+    if ((kind != SNAPSHOT_FULL && kind != SNAPSHOT_DRAWN) || (kind == SNAPSHOT_FULL && ps->analytic != NULL))
+        return 0;
+
+    data = streamBuffer(writer->stream, bytes);
+    if (data == NULL)
+        return 0;
+    copyFrame(data, ps, kind, arrays, stride);
+    streamQueue(writer->stream, bytes);
+    writer->frames++;
+    return 1;
+}
+
+int snapshotWriterClose(struct snapshotWriter *writer)
+{
+    struct fileHeader header;
+    int done;
+
+    if (writer == NULL)
+        return 1;
+
+    // the frame count tells a whole file from one whose writer never finished
+    fileHeader(&header, writer->frames);
+    done = streamClose(writer->stream, &header, sizeof(header));
+    free(writer);
+    return done;
+}
+
+// whether the frame at offset fits in the file and is one this version writes
+static int validFrame(const struct snapshot *snapshot, size_t offset)
+{
+    const struct frameHeader *header = (const struct frameHeader *) (snapshot->data + offset);
+
+    if (offset + sizeof(struct frameHeader) > snapshot->bytes || header->magic != FRAME_MAGIC)
+        return 0;
+    if (header->kind == SNAPSHOT_FULL)
+    {
+        if (header->arrays != FULL_ARRAYS && header->arrays != FULL_ARRAYS + SCENE_ARRAYS)
+            return 0;
+    }
+    else if (header->kind != SNAPSHOT_DRAWN || header->arrays != DRAWN_ARRAYS)
+        return 0;
+    return header->stride % STRIDE_STEP == 0 && header->numberParticles <= header->stride &&
+           header->stride <= (uint32_t) 0x7FFFFFFF &&
+           header->bytes == frameBytes(header->kind, header->arrays, header->stride) &&
+           header->bytes <= snapshot->bytes - offset;
+}
+
+struct snapshot *snapshotOpen(const char *path)
+{
+    struct snapshot *snapshot;
+    const struct fileHeader *header;
+    struct stat status;
+    size_t offset, *offsets;
+    int file, room = 0;
+    void *data;
+
+    if (!littleEndian())
+        return NULL;
+    file = open(path, O_RDONLY);
+    if (file < 0)
+    {
+        fprintf(stderr, "cannot open the snapshot %s\n", path);
+        return NULL;
+    }
+    if (fstat(file, &status) != 0 || status.st_size < (off_t) sizeof(struct fileHeader))
+    {
+        fprintf(stderr, "%s is not a snapshot\n", path);
+        close(file);
+        return NULL;
+    }
+    data = mmap(NULL, status.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+    close(file);
+    if (data == MAP_FAILED)
+    {
+        fprintf(stderr, "cannot map the snapshot %s\n", path);
+        return NULL;
+    }
+    snapshot = calloc(1, sizeof(struct snapshot));
+    if (snapshot == NULL)
+    {
+        munmap(data, status.st_size);
+        return NULL;
+    }
+    snapshot->data = data;
+    snapshot->bytes = status.st_size;
+
+    header = data;
+    if (memcmp(header->magic, FILE_MAGIC, sizeof(header->magic)) != 0 || header->version != SNAPSHOT_VERSION)
+    {
+        fprintf(stderr, "%s is not a snapshot of version %d\n", path, SNAPSHOT_VERSION);
+        snapshotClose(snapshot);
+        return NULL;
+    }
+
+    // a file whose writer never closed it has no count: its frames are the
+    // whole ones at the start
+    for (offset = sizeof(struct fileHeader); validFrame(snapshot, offset);
+         offset += ((const struct frameHeader *) (snapshot->data + offset))->bytes)
+    {
+        if (snapshot->frames == room)
+        {
+            room = room > 0 ? 2 * room : 64;
+            offsets = realloc(snapshot->offsets, room * sizeof(size_t));
+            if (offsets == NULL)
+            {
+                snapshotClose(snapshot);
+                return NULL;
+            }
+            snapshot->offsets = offsets;
+        }
+        snapshot->offsets[snapshot->frames++] = offset;
+    }
+    if (snapshot->frames == 0 || (header->frames != 0 && header->frames != (uint32_t) snapshot->frames))
+    {
+        fprintf(stderr, "%s is cut short\n", path);
+        snapshotClose(snapshot);
+        return NULL;
+    }
+    return snapshot;
+}
+
+void snapshotClose(struct snapshot *snapshot)
+{
+    if (snapshot == NULL)
+        return;
+    munmap((void *) snapshot->data, snapshot->bytes);
+    free(snapshot->offsets);
+    free(snapshot);
+}
+
+int snapshotFrames(const struct snapshot *snapshot)
+{
+    return snapshot->frames;
+}
+
+int snapshotKind(const struct snapshot *snapshot, int frame)
+{
+    return ((const struct frameHeader *) (snapshot->data + snapshot->offsets[frame]))->kind;
+}
+
+// the arrays of a frame in the mapped file
+static const char *frameArray(const struct snapshot *snapshot, int frame, int array)
+{
+    const struct frameHeader *header = (const struct frameHeader *) (snapshot->data + snapshot->offsets[frame]);
+    const char *at = (const char *) (header + 1);
+    int k;
+
+    for (k = 0; k < array; k++)
+        at += arrayBytes(header->kind, k, header->stride);
+    return at;
+}
+
+const struct particleSystem *snapshotView(struct snapshot *snapshot, int frame, struct workerPool *pool)
+{
+    const struct frameHeader *header = (const struct frameHeader *) (snapshot->data + snapshot->offsets[frame]);
+    struct particleSystem *view = &snapshot->view;
+    float **floats[11] = { &view->positionX, &view->positionY, &view->positionZ,
+                           &view->previousX, &view->previousY, &view->previousZ, &view->particleTime,
+                           &view->velocityXZ, &view->velocityY, &view->directionX, &view->directionZ };
+    int array;
+
+    // the system only reads through these, as the view is handed out const
+    memset(view, 0, sizeof(*view));
+    view->pool = pool;
+    if (header->kind == SNAPSHOT_FULL)
+    {
+        for (array = 0; array < 11; array++)
+            *floats[array] = (float *) frameArray(snapshot, frame, array);
+        view->down = (uint32_t *) frameArray(snapshot, frame, BITS_ARRAY);
+        view->colorList = (uint8_t (*)[4]) frameArray(snapshot, frame, COLOR_ARRAY);
+    }
+    else
+    {
+        view->positionX = view->previousX = (float *) frameArray(snapshot, frame, 0);
+        view->positionY = view->previousY = (float *) frameArray(snapshot, frame, 1);
+        view->positionZ = view->previousZ = (float *) frameArray(snapshot, frame, 2);
+        view->colorList = (uint8_t (*)[4]) frameArray(snapshot, frame, DRAWN_COLOR_ARRAY);
+    }
+    view->numberParticles = view->targetParticles = header->numberParticles;
+    view->capacity = header->stride;
+    view->meanVelocity = header->meanVelocity;
+    view->gravity = header->gravity;
+    view->seed = header->seed;
+    view->step = header->step;
+    view->blend = header->blend;
+    view->threads = 1;
+    return view;
+}
+
+int snapshotRestore(const struct snapshot *snapshot, int frame, struct particleSystem *ps)
+{
+    const struct frameHeader *header = (const struct frameHeader *) (snapshot->data + snapshot->offsets[frame]);
+    int arrays = FULL_ARRAYS + (ps->scene != NULL ? SCENE_ARRAYS : 0);
+    void *target[MAX_ARRAYS];
+    int n = header->numberParticles, array;
+
+    if (header->kind != SNAPSHOT_FULL || header->arrays != (uint32_t) arrays || ps->analytic != NULL ||
+        (ps->scene != NULL && sceneParticles(ps->scene) != n))
+        return 0;
+    if (!particleSystemResize(ps, n))
+        return 0;
+
+    // the capacity is a whole multiple of STRIDE_STEP too, so at least the stride
+    fullArrays(ps, target);
+    for (array = 0; array < arrays; array++)
+        memcpy(target[array], frameArray(snapshot, frame, array), arrayBytes(SNAPSHOT_FULL, array, header->stride));
+    if (ps->scene == NULL && !particleSystemSetTarget(ps, header->targetParticles))
+        return 0;
+
+    ps->seed = header->seed;
+    ps->step = header->step;
+    ps->lag = header->lag;
+    ps->meanVelocity = header->meanVelocity;
+    ps->gravity = header->gravity;
+    ps->emitRate = header->emitRate;
+    ps->emitCarry = header->emitCarry;
+    ps->lifetime = header->lifetime;
+    ps->blend = header->blend;
+    return 1;
+}
+
+/* end of snapshot.c */
@@ -0,0 +1,77 @@
+//
+//  snapshot.h
+//
+//
+//  Created by BOWEN LI
+//
+//  The particles saved to a file and read back. A file holds one or more
+//  frames: a full frame is the whole state a system can carry on simulating
+//  from, a drawn frame only where the particles are drawn and their colours,
+//  which is enough to play a recording back without simulating. Writing
+//  copies the particles on the calling thread and leaves the file to a thread
+//  of its own, so a frame only waits for the disk when two frames are still
+//  queued. Reading maps the file, so a frame is drawn straight from it.
+//
+//  The format is little endian throughout; every array starts on 64 bytes:
+//
+//      file header     64 bytes: "PSNAPSHT", version, frames
+//      frame header    128 bytes: kind, particles, stride, parameters
+//      arrays          stride particles each, in the order below
+//      frame header    ...
+//
+//  A full frame has position x, y, z, previous x, y, z, time, velocity xz,
+//  velocity y, direction x, z, the down bits and the colours, then a scene's
+//  velocity x, y, z. A drawn frame has the drawn position x, y, z and the
+//  colours. Every array is of floats but the down bits and the colours,
+//  which are RGBA bytes.
+//
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "particles.h"
+
+#define SNAPSHOT_VERSION 2                      // 1 kept the colours as floats
+
+#define SNAPSHOT_FULL 0                         // everything, to simulate on from
+#define SNAPSHOT_DRAWN 1                        // only what is drawn, to play back
+
+struct snapshotWriter;
+struct snapshot;
+
+// start a file at path, truncating it; NULL when it cannot be written or
+// the writing thread cannot start
+struct snapshotWriter *snapshotWriterCreate(const char *path);
+
+// queue a frame of ps of the kind, SNAPSHOT_FULL or SNAPSHOT_DRAWN. The
+// particles are copied before it returns. A full frame needs the stepped
+// simulation, not the analytic one. Returns 0 when the frame cannot be
+// written, or an earlier one failed.
+int snapshotWrite(struct snapshotWriter *writer, const struct particleSystem *ps, int kind);
+
+// wait for the queued frames and close the file; returns 0 when any write failed
+int snapshotWriterClose(struct snapshotWriter *writer);
+
+// map a file and check every frame header; NULL when it is not a snapshot
+// of this version, or a frame is cut short
+struct snapshot *snapshotOpen(const char *path);
+void snapshotClose(struct snapshot *snapshot);
+
+int snapshotFrames(const struct snapshot *snapshot);
+int snapshotKind(const struct snapshot *snapshot, int frame);
+
+// a system to draw the frame with, its arrays in the mapped file: it must
+// not be updated, resized or destroyed, and is valid until the next
+// snapshotView() or snapshotClose(). The threads of pool, which may be NULL,
+// share sorting and culling it.
+const struct particleSystem *snapshotView(struct snapshot *snapshot, int frame, struct workerPool *pool);
+
+// copy a full frame into ps, which simulates on from there. ps must
+// simulate the scene the frame was saved from, or the waterfall, and
+// neither may be analytic. Returns 0 otherwise, or when the memory cannot be
+// found.
+int snapshotRestore(const struct snapshot *snapshot, int frame, struct particleSystem *ps);
+
+#endif
+
+/* end of snapshot.h */
@@ -0,0 +1,175 @@
+//
+//  stream.c
+//
+//
+//  Created by BOWEN LI
+//
+
+#include <stdlib.h>
+#include <pthread.h>
+#include "stream.h"
+#include "profile.h"
+
+#define MAX_BUFFERS 4
+
+struct streamBuffer
+{
+    char *data;
+    size_t bytes;                               // filled
+    size_t capacity;
+};
+
+struct fileStream
+{
+    FILE *file;
+    streamWriter write;
+    void *context;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t queued;                      // a buffer to write, or closing
+    pthread_cond_t written;                     // a buffer is free again
+    struct streamBuffer buffers[MAX_BUFFERS];
+    int numberBuffers;
+    int head;                                   // the next buffer to write
+    int count;                                  // buffers queued, the one being written included
+    int closing;
+    int failed;
+    double waited;                              // seconds streamBuffer() spent waiting
+};
+
+static int writeAsIs(void *context, FILE *file, const char *data, size_t bytes)
+{
+    return fwrite(data, 1, bytes, file) == bytes;
+}
+
+static void *writeBuffers(void *context)
+{
+    struct fileStream *stream = context;
+    struct streamBuffer *buffer;
+    int done;
+
+    pthread_mutex_lock(&stream->lock);
+    for (;;)
+    {
+        while (stream->count == 0 && !stream->closing)
+            pthread_cond_wait(&stream->queued, &stream->lock);
+        if (stream->count == 0)
+            break;
+        buffer = &stream->buffers[stream->head];
+        pthread_mutex_unlock(&stream->lock);
+
+        done = stream->write(stream->context, stream->file, buffer->data, buffer->bytes);
+
+        pthread_mutex_lock(&stream->lock);
+        stream->failed |= !done;
+        stream->head = (stream->head + 1) % stream->numberBuffers;
+        stream->count--;
+        pthread_cond_signal(&stream->written);
+    }
+    pthread_mutex_unlock(&stream->lock);
+    return NULL;
+}
+
+struct fileStream *streamOpen(const char *path, const void *header, size_t headerBytes, int buffers,
+                              streamWriter write, void *context)
+{
+    struct fileStream *stream = calloc(1, sizeof(struct fileStream));
+
+    if (stream == NULL)
+        return NULL;
+    stream->file = fopen(path, "wb");
+    if (stream->file == NULL || fwrite(header, 1, headerBytes, stream->file) != headerBytes)
+    {
+        if (stream->file != NULL)
+            fclose(stream->file);
+        free(stream);
+        return NULL;
+    }
+    stream->numberBuffers = buffers < 1 ? 1 : buffers > MAX_BUFFERS ? MAX_BUFFERS : buffers;
+    stream->write = write != NULL ? write : writeAsIs;
+    stream->context = context;
+
+    pthread_mutex_init(&stream->lock, NULL);
+    pthread_cond_init(&stream->queued, NULL);
+    pthread_cond_init(&stream->written, NULL);
+    if (pthread_create(&stream->thread, NULL, writeBuffers, stream) != 0)
+    {
+        pthread_mutex_destroy(&stream->lock);
+        pthread_cond_destroy(&stream->queued);
+        pthread_cond_destroy(&stream->written);
+        fclose(stream->file);
+        free(stream);
+        return NULL;
+    }
+    return stream;
+}
+
+char *streamBuffer(struct fileStream *stream, size_t bytes)
+{
+    struct streamBuffer *buffer;
+    double begin = profileNow();
+    int failed;
+
+    // the thread gives a buffer back after every write
+    pthread_mutex_lock(&stream->lock);
+    while (stream->count == stream->numberBuffers && !stream->failed)
+        pthread_cond_wait(&stream->written, &stream->lock);
+    buffer = &stream->buffers[(stream->head + stream->count) % stream->numberBuffers];
+    failed = stream->failed;
+    stream->waited += profileNow() - begin;
+    pthread_mutex_unlock(&stream->lock);
+    if (failed)
+        return NULL;
+
+    if (bytes > buffer->capacity)
+    {
+        free(buffer->data);
+        buffer->capacity = 0;
+        buffer->data = malloc(bytes);
+        if (buffer->data == NULL)
+            return NULL;
+        buffer->capacity = bytes;
+    }
+    return buffer->data;
+}
+
+void streamQueue(struct fileStream *stream, size_t bytes)
+{
+    pthread_mutex_lock(&stream->lock);
+    stream->buffers[(stream->head + stream->count) % stream->numberBuffers].bytes = bytes;
+    stream->count++;
+    pthread_cond_signal(&stream->queued);
+    pthread_mutex_unlock(&stream->lock);
+}
+
+int streamClose(struct fileStream *stream, const void *header, size_t headerBytes)
+{
+    int done, k;
+
+    if (stream == NULL)
+        return 1;
+    pthread_mutex_lock(&stream->lock);
+    stream->closing = 1;
+    pthread_cond_signal(&stream->queued);
+    pthread_mutex_unlock(&stream->lock);
+    pthread_join(stream->thread, NULL);
+
+    done = !stream->failed && fseek(stream->file, 0, SEEK_SET) == 0 &&
+           fwrite(header, 1, headerBytes, stream->file) == headerBytes;
+    done = fclose(stream->file) == 0 && done;
+
+    for (k = 0; k < stream->numberBuffers; k++)
+        free(stream->buffers[k].data);
+    pthread_mutex_destroy(&stream->lock);
+    pthread_cond_destroy(&stream->queued);
+    pthread_cond_destroy(&stream->written);
+    free(stream);
+    return done;
+}
+
+double streamWaited(const struct fileStream *stream)
+{
+    return stream->waited;
+}
+
+/* end of stream.c */
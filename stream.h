@@ -0,0 +1,48 @@
+//
+//  stream.h
+//
+//
+//  Created by BOWEN LI
+//
+//  A file written behind the frame loop. The caller fills one of a few
+//  buffers and queues it; a thread of the stream's own writes the buffers
+//  out in order, through a function that may encode them on the way. The
+//  caller only waits when every buffer is still queued, and the time it
+//  waits is counted, so a writer that cannot keep up shows.
+//
+
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <stdio.h>
+
+// write bytes of data to file, returning 0 when it fails; it runs on the
+// stream's thread, one buffer after the other
+typedef int (*streamWriter)(void *context, FILE *file, const char *data, size_t bytes);
+
+struct fileStream;
+
+// a file at path, truncated, that starts with the header; write, which may
+// be NULL to write the buffers as they are, gets context. NULL when the file
+// cannot be written or the thread cannot start.
+struct fileStream *streamOpen(const char *path, const void *header, size_t headerBytes, int buffers,
+                              streamWriter write, void *context);
+
+// a buffer of at least bytes to fill, once the thread is done with it;
+// NULL when the memory cannot be found, or an earlier write failed
+char *streamBuffer(struct fileStream *stream, size_t bytes);
+
+// hand the buffer from streamBuffer() to the thread, bytes of it filled
+void streamQueue(struct fileStream *stream, size_t bytes);
+
+// wait for the queued buffers, write the header over the start of the file
+// again, now that it can be complete, and close it; returns 0 when any write
+// failed
+int streamClose(struct fileStream *stream, const void *header, size_t headerBytes);
+
+// the seconds streamBuffer() waited so far
+double streamWaited(const struct fileStream *stream);
+
+#endif
+
+/* end of stream.h */
@@ -0,0 +1,393 @@
+//
+//  sweep.c
+//
+//
+//  Created by BOWEN LI
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "sweep.h"
+
+#define MAX_AXES 8
+#define MAX_VALUES 16
+#define MAX_SETUP 32                            // script lines besides the axes
+#define WORD 32
+#define LINE 128
+#define LABEL 256
+
+#define DEFAULT_SPREAD 200                      // for the waterfall to reach the far end of the ground
+#define DEFAULT_WARMUP 10
+#define DEFAULT_MEASURE 60
+
+#define CSV_HEADER "configuration,frames,particles,fps,particles_per_s," \
+                   "frame_p50_ms,frame_p95_ms,frame_p99_ms,work_p95_ms,update_p50_ms,draw_p50_ms"
+
+struct axis
+{
+    char keyword[WORD];
+    char values[MAX_VALUES][WORD];
+    int count;
+};
+
+struct result
+{
+    char label[LABEL];                          // the axes' values, which find it in a baseline
+    int frames;
+    double particles;                           // on average
+    double fps;
+    double throughput;                          // particles drawn per second
+    double frame[3];                            // p50, p95 and p99, in seconds
+    double work;                                // p95 of the frame less the swap
+    double update, draw;                        // p50
+};
+
+struct sweep
+{
+    struct axis axes[MAX_AXES];
+    int numberAxes;
+    char setup[MAX_SETUP][LINE];
+    int numberSetup;
+    int spread, warmup, measure;
+    int configurations;
+    struct result *results;
+    int done;                                   // configurations with results
+
+    // the configuration being measured, a sample per frame
+    int current;
+    int frames;
+    double *frame, *work, *update, *draw;
+    double particles, seconds;
+};
+
+// one line of the scenario; returns 0 when it cannot be read
+static int readLine(struct sweep *sweep, char *line)
+{
+    char keyword[WORD];
+    struct axis *axis;
+    int n, offset;
+
+    if (sscanf(line, "%31s%n", keyword, &offset) != 1)
+        return 1;                               // blank
+    if (strcmp(keyword, "sweep") == 0)
+    {
+        if (sweep->numberAxes == MAX_AXES)
+            return 0;
+        axis = &sweep->axes[sweep->numberAxes];
+        line += offset;
+        if (sscanf(line, "%31s%n", axis->keyword, &offset) != 1)
+            return 0;
+        for (line += offset; axis->count < MAX_VALUES &&
+             sscanf(line, "%31s%n", axis->values[axis->count], &offset) == 1; line += offset)
+            axis->count++;
+        sweep->numberAxes++;
+        return axis->count > 0;
+    }
+    if (strcmp(keyword, "spread") == 0 || strcmp(keyword, "warmup") == 0 || strcmp(keyword, "measure") == 0)
+    {
+        if (sscanf(line + offset, "%d", &n) != 1 || n < 0)
+            return 0;
+        if (keyword[0] == 's')
+            sweep->spread = n;
+        else if (keyword[0] == 'w')
+            sweep->warmup = n;
+        else
+            sweep->measure = n;
+        return 1;
+    }
+    if (sweep->numberSetup == MAX_SETUP || strlen(line) >= LINE)
+        return 0;
+    strcpy(sweep->setup[sweep->numberSetup++], line);
+    return 1;
+}
+
+struct sweep *sweepLoad(const char *path)
+{
+    struct sweep *sweep;
+    FILE *file = fopen(path, "r");
+    char line[LINE * 2];
+    int number = 0, axis;
+
+    if (file == NULL)
+    {
+        fprintf(stderr, "cannot open the scenario %s\n", path);
+        return NULL;
+    }
+    sweep = calloc(1, sizeof(struct sweep));
+    if (sweep == NULL)
+    {
+        fclose(file);
+        return NULL;
+    }
+    sweep->spread = DEFAULT_SPREAD;
+    sweep->warmup = DEFAULT_WARMUP;
+    sweep->measure = DEFAULT_MEASURE;
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        number++;
+        line[strcspn(line, "#\n")] = '\0';
+        if (!readLine(sweep, line))
+        {
+            fprintf(stderr, "%s:%d: cannot read \"%s\"\n", path, number, line);
+            fclose(file);
+            sweepDestroy(sweep);
+            return NULL;
+        }
+    }
+    fclose(file);
+
+    sweep->configurations = 1;
+    for (axis = 0; axis < sweep->numberAxes; axis++)
+        sweep->configurations *= sweep->axes[axis].count;
+    sweep->results = calloc(sweep->configurations, sizeof(struct result));
+    sweep->frame = malloc(4 * (sweep->measure + 1) * sizeof(double));
+    if (sweep->results == NULL || sweep->frame == NULL)
+    {
+        sweepDestroy(sweep);
+        return NULL;
+    }
+    sweep->work = sweep->frame + sweep->measure + 1;
+    sweep->update = sweep->work + sweep->measure + 1;
+    sweep->draw = sweep->update + sweep->measure + 1;
+    return sweep;
+}
+
+void sweepDestroy(struct sweep *sweep)
+{
+    if (sweep == NULL)
+        return;
+    free(sweep->results);
+    free(sweep->frame);
+    free(sweep);
+}
+
+int sweepConfigurations(const struct sweep *sweep)
+{
+    return sweep->configurations;
+}
+
+int sweepSpread(const struct sweep *sweep)
+{
+    return sweep->spread;
+}
+
+int sweepWarmup(const struct sweep *sweep)
+{
+    return sweep->warmup;
+}
+
+int sweepMeasure(const struct sweep *sweep)
+{
+    return sweep->measure;
+}
+
+// the value configuration takes on axis
+static const char *valueOf(const struct sweep *sweep, int configuration, int axis)
+{
+    int later;
+
+    for (later = sweep->numberAxes - 1; later > axis; later--)
+        configuration /= sweep->axes[later].count;
+    return sweep->axes[axis].values[configuration % sweep->axes[axis].count];
+}
+
+int sweepParticles(const struct sweep *sweep, int configuration, int fallback)
+{
+    int axis;
+
+    for (axis = 0; axis < sweep->numberAxes; axis++)
+    {
+        if (strcmp(sweep->axes[axis].keyword, "particles") == 0)
+            return atoi(valueOf(sweep, configuration, axis));
+    }
+    return fallback;
+}
+
+int sweepCommand(const struct sweep *sweep, int configuration, int command, char *line, size_t size)
+{
+    int axis;
+
+    if (command < sweep->numberSetup)
+    {
+        snprintf(line, size, "%s", sweep->setup[command]);
+        return 1;
+    }
+
+    // the axes' own, but for the particles, which are made rather than set
+    command -= sweep->numberSetup;
+    for (axis = 0; axis < sweep->numberAxes; axis++)
+    {
+        if (strcmp(sweep->axes[axis].keyword, "particles") == 0)
+            continue;
+        if (command-- == 0)
+        {
+            snprintf(line, size, "%s %s", sweep->axes[axis].keyword, valueOf(sweep, configuration, axis));
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void sweepBegin(struct sweep *sweep, int configuration)
+{
+    sweep->current = configuration;
+    sweep->frames = 0;
+    sweep->particles = 0;
+    sweep->seconds = 0;
+}
+
+void sweepFrame(struct sweep *sweep, double frame, double update, double draw, double swap, int numberParticles)
+{
+    int k = sweep->frames;
+
+    if (k > sweep->measure)
+        return;
+    sweep->frame[k] = frame;
+    sweep->work[k] = frame - swap;
+    sweep->update[k] = update;
+    sweep->draw[k] = draw;
+    sweep->particles += numberParticles;
+    sweep->seconds += frame;
+    sweep->frames++;
+}
+
+static int compareSeconds(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+
+    return (x > y) - (x < y);
+}
+
+// the time fraction of the n samples stay within, as profilePercentile() ranks them
+static double percentile(double *samples, int n, double fraction)
+{
+    long rank = (long) ceil(fraction * n);
+
+    if (n == 0)
+        return 0;
+    qsort(samples, n, sizeof(double), compareSeconds);
+    return samples[(rank < 1 ? 1 : rank) - 1];
+}
+
+void sweepEnd(struct sweep *sweep, FILE *out)
+{
+    struct result *result = &sweep->results[sweep->current];
+    int n = sweep->frames, axis;
+    size_t used = 0;
+
+    result->label[0] = '\0';
+    for (axis = 0; axis < sweep->numberAxes && used < LABEL; axis++)
+        used += snprintf(result->label + used, LABEL - used, "%s%s=%s", axis > 0 ? " " : "",
+                         sweep->axes[axis].keyword, valueOf(sweep, sweep->current, axis));
+    if (sweep->numberAxes == 0)
+        strcpy(result->label, "default");
+
+    result->frames = n;
+    result->particles = n > 0 ? sweep->particles / n : 0;
+    result->fps = sweep->seconds > 0 ? n / sweep->seconds : 0;
+    result->throughput = sweep->seconds > 0 ? sweep->particles / sweep->seconds : 0;
+    result->frame[0] = percentile(sweep->frame, n, 0.50);
+    result->frame[1] = percentile(sweep->frame, n, 0.95);
+    result->frame[2] = percentile(sweep->frame, n, 0.99);
+    result->work = percentile(sweep->work, n, 0.95);
+    result->update = percentile(sweep->update, n, 0.50);
+    result->draw = percentile(sweep->draw, n, 0.50);
+
+    if (sweep->done == 0)
+        fprintf(out, "%-44s %6s %10s %8s %10s %8s %8s %8s %8s %8s %8s\n", "configuration", "frames", "particles",
+                "fps", "Mpart/s", "p50 ms", "p95 ms", "p99 ms", "work p95", "update", "draw");
+    fprintf(out, "%-44s %6d %10.0f %8.1f %10.2f %8.2f %8.2f %8.2f %8.2f %8.2f %8.2f\n", result->label,
+            result->frames, result->particles, result->fps, result->throughput * 1.0E-6,
+            result->frame[0] * 1.0E3, result->frame[1] * 1.0E3, result->frame[2] * 1.0E3,
+            result->work * 1.0E3, result->update * 1.0E3, result->draw * 1.0E3);
+    fflush(out);
+    sweep->done = sweep->current + 1;
+}
+
+int sweepWrite(const struct sweep *sweep, const char *path)
+{
+    FILE *file = fopen(path, "w");
+    size_t length = strlen(path);
+    int json = length >= 5 && strcmp(path + length - 5, ".json") == 0;
+    int k, ok;
+
+    if (file == NULL)
+        return 0;
+    fprintf(file, json ? "[\n" : CSV_HEADER "\n");
+    for (k = 0; k < sweep->done; k++)
+    {
+        const struct result *r = &sweep->results[k];
+
+        if (json)
+            fprintf(file, "  {\"configuration\": \"%s\", \"frames\": %d, \"particles\": %.0f, \"fps\": %.3f, "
+                    "\"particles_per_s\": %.0f, \"frame_p50_ms\": %.4f, \"frame_p95_ms\": %.4f, "
+                    "\"frame_p99_ms\": %.4f, \"work_p95_ms\": %.4f, \"update_p50_ms\": %.4f, "
+                    "\"draw_p50_ms\": %.4f}%s\n", r->label, r->frames, r->particles, r->fps, r->throughput,
+                    r->frame[0] * 1.0E3, r->frame[1] * 1.0E3, r->frame[2] * 1.0E3, r->work * 1.0E3,
+                    r->update * 1.0E3, r->draw * 1.0E3, k + 1 < sweep->done ? "," : "");
+        else
+            fprintf(file, "%s,%d,%.0f,%.3f,%.0f,%.4f,%.4f,%.4f,%.4f,%.4f,%.4f\n", r->label, r->frames,
+                    r->particles, r->fps, r->throughput, r->frame[0] * 1.0E3, r->frame[1] * 1.0E3,
+                    r->frame[2] * 1.0E3, r->work * 1.0E3, r->update * 1.0E3, r->draw * 1.0E3);
+    }
+    if (json)
+        fprintf(file, "]\n");
+    ok = !ferror(file);
+    return fclose(file) == 0 && ok;
+}
+
+// the result with label, or NULL
+static const struct result *findResult(const struct sweep *sweep, const char *label)
+{
+    int k;
+
+    for (k = 0; k < sweep->done; k++)
+    {
+        if (strcmp(sweep->results[k].label, label) == 0)
+            return &sweep->results[k];
+    }
+    return NULL;
+}
+
+int sweepCompare(const struct sweep *sweep, const char *path, double threshold, FILE *out)
+{
+    FILE *file = fopen(path, "r");
+    char line[LABEL + LINE];
+    int regressed = 0;
+
+    if (file == NULL)
+        return -1;
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        const struct result *result;
+        double particles, fps, throughput, frame50, frame95;
+        char *comma = strchr(line, ',');
+        int frames, slower, fewer;
+
+        if (comma == NULL || strncmp(line, "configuration,", 14) == 0)
+            continue;
+        *comma = '\0';
+        if (sscanf(comma + 1, "%d,%lf,%lf,%lf,%lf,%lf", &frames, &particles, &fps, &throughput,
+                   &frame50, &frame95) != 6)
+            continue;
+        result = findResult(sweep, line);
+        if (result == NULL)
+        {
+            fprintf(out, "%-44s not run\n", line);
+            continue;
+        }
+
+        slower = result->frame[1] * 1.0E3 > frame95 * (1 + threshold);
+        fewer = result->throughput < throughput / (1 + threshold);
+        regressed += slower || fewer;
+        fprintf(out, "%-44s p95 %8.2f ms against %8.2f (%+6.1f%%), %8.2f Mpart/s against %8.2f (%+6.1f%%)%s\n",
+                line, result->frame[1] * 1.0E3, frame95, (result->frame[1] * 1.0E3 / frame95 - 1) * 100,
+                result->throughput * 1.0E-6, throughput * 1.0E-6, (result->throughput / throughput - 1) * 100,
+                slower || fewer ? "  REGRESSED" : "");
+    }
+    fclose(file);
+    return regressed;
+}
+
+/* end of sweep.c */
@@ -0,0 +1,71 @@
+//
+//  sweep.h
+//
+//
+//  Created by BOWEN LI
+//
+//  A benchmark over every combination of a few settings, for the headless
+//  renderer to run. A scenario file holds one line each:
+//
+//      sweep   keyword value value ...     an axis, e.g. "sweep mode point sphere"
+//      spread  n                           steps simulated, undrawn, before a run; 200
+//      warmup  n                           frames drawn before the measured ones; 10
+//      measure n                           frames measured; 60
+//      ...                                 any other script command, see headless.c
+//
+//  '#' starts a comment. Every combination of the axes' values is one
+//  configuration, the last axis changing fastest. Each starts afresh: the
+//  particles are made again, "sweep particles" making that many at once, the
+//  other script commands run, then the axes' own, each as "keyword value".
+//
+//  The results go to a CSV file, or JSON when the name ends in ".json", one
+//  configuration per row. A CSV of results from before is a baseline: a
+//  configuration regresses when its 95th percentile frame is slower than the
+//  baseline's by more than the threshold, or its throughput in particles per
+//  second is lower by as much.
+//
+
+#ifndef SWEEP_H
+#define SWEEP_H
+
+#include <stdio.h>
+
+#define SWEEP_THRESHOLD 0.1                     // slower than the baseline by this, a regression
+
+struct sweep;
+
+// the scenario at path; NULL when it cannot be read, the line at fault reported
+struct sweep *sweepLoad(const char *path);
+void sweepDestroy(struct sweep *sweep);
+
+int sweepConfigurations(const struct sweep *sweep);
+int sweepSpread(const struct sweep *sweep);
+int sweepWarmup(const struct sweep *sweep);
+int sweepMeasure(const struct sweep *sweep);
+
+// the particles to make for configuration, fallback when it does not sweep them
+int sweepParticles(const struct sweep *sweep, int configuration, int fallback);
+
+// the command-th script line that sets configuration up into line; 0 past
+// the last one
+int sweepCommand(const struct sweep *sweep, int configuration, int command, char *line, size_t size);
+
+// time the frames of configuration, frame after frame: its whole time, the
+// update, the drawing with the uploads, sorting and culling, and the swap
+void sweepBegin(struct sweep *sweep, int configuration);
+void sweepFrame(struct sweep *sweep, double frame, double update, double draw, double swap, int numberParticles);
+
+// close the configuration, printing its line of results to out
+void sweepEnd(struct sweep *sweep, FILE *out);
+
+// the results so far to path; returns 0 when it cannot be written
+int sweepWrite(const struct sweep *sweep, const char *path);
+
+// the results against the baseline at path, one line each to out; returns
+// the configurations that regressed by more than threshold, or -1 when the
+// baseline cannot be read
+int sweepCompare(const struct sweep *sweep, const char *path, double threshold, FILE *out);
+
+#endif
+
+/* end of sweep.h */
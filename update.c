@@ -0,0 +1,270 @@
+//
+//  update.c
+//
+//
+//  Created by BOWEN LI
+//
+//  updateReference() is the original loop. The other kernels evaluate both
+//  the up and the down branch for every particle and keep one of them with a
+//  select, so there is nothing data dependent left to stop vectorisation.
+//  They all do the same float operations in the same order (no fused
+//  multiply-add), so the scalar, SSE and AVX2 results are bit for bit equal.
+//  Against the reference, which rounds through double, a step differs by at
+//  most one float rounding, a few 1e-7 relative; a particle sitting right on a
+//  ground test can therefore bounce or respawn one step earlier or later.
+//
+
+#include "update.h"
+
+#ifdef HAVE_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+// there are lots of approxiation: 1. assume the velocity would be 80% whenever particles bounce
+// on the floor to appropriate the actual energy loss 2. assume the velocity in xz plane is constant
+// 3. assume the floor is flat and have perfect reflection 4. ignore the effect between each particle
+void updateReference(struct particleSystem *ps, int begin, int end)
+{
+    float distance;
+    float gravity = ps->gravity;
+    float *positionX = ps->positionX, *positionY = ps->positionY, *positionZ = ps->positionZ;
+    float *previousY = ps->previousY;
+    float *particleTime = ps->particleTime;
+    float *velocityXZ = ps->velocityXZ, *velocityY = ps->velocityY;
+    float *directionX = ps->directionX, *directionZ = ps->directionZ;
+    int i;
+
+    // update all points
+    for (i = begin; i < end; i++) {
+        distance = velocityXZ[i] * particleTime[i];         // the distance in xz plane
+
+        positionX[i] = directionX[i] * distance;            // x distance
+        positionZ[i] = directionZ[i] * distance;            // z distance
+
+        // y
+        if (particleDown(ps, i))    // in down direction
+        {
+            // distance = distance - velocity * time_delta - 1/2 * gravity * (time_delta ^ 2)
+            positionY[i] = previousY[i] - (velocityY[i] + 0.5 * gravity * TIME_DELTA) * TIME_DELTA;
+            velocityY[i] += gravity * TIME_DELTA;           // velocity = velocity + gravity * time_delta
+        }
+        else                        // in up direction
+        {   // approximation as we cannot get the velocity which is exactly equal to 0
+            if (velocityY[i] > 0)   // keep increasing
+            {
+                // distance = distance + velocity * time_delta - 1/2 * gravity * (time_delta ^ 2)
+                positionY[i] = previousY[i] + (velocityY[i] * TIME_DELTA - 0.5 * gravity * TIME_DELTA * TIME_DELTA);
+                velocityY[i] -= gravity * TIME_DELTA;       // velocity = velocity - gravity * time_delta
+            }
+            else                    // reach the peak
+            {
+                positionY[i] = previousY[i];
+                setParticleDown(ps, i, 1);
+            }
+        }
+
+        // if particles hit the ground, bounce the particles upward again
+        if ((positionY[i] <= 5.0 && distance < 3) || (positionY[i] <= 0.0 && distance > 3)) {
+            // if the distance in xz plane exceed the edge, then make this particle die and re-initialise this particle
+            if (distance > EDGE) {
+                respawnParticle(ps, i);
+                continue;
+            }
+            setParticleDown(ps, i, 0);
+            velocityY[i] *= 0.8;    // 80% of previous velocity
+        }
+        particleTime[i] += TIME_DELTA;
+    }
+}
+
+// same rule as updateReference(), every branch turned into a select
+void updateScalar(struct particleSystem *ps, int begin, int end)
+{
+    const float dt = TIME_DELTA;
+    const float gdt = ps->gravity * dt;             // velocity change in one step
+    const float hgdt = 0.5f * gdt;                  // 1/2 * gravity * time_delta
+    const float hgdt2 = hgdt * dt;                  // 1/2 * gravity * (time_delta ^ 2)
+    float *positionX = ps->positionX, *positionY = ps->positionY, *positionZ = ps->positionZ;
+    float *previousY = ps->previousY;
+    float *particleTime = ps->particleTime;
+    float *velocityXZ = ps->velocityXZ, *velocityY = ps->velocityY;
+    float *directionX = ps->directionX, *directionZ = ps->directionZ;
+    int i;
+
+    for (i = begin; i < end; i++)
+    {
+        float distance = velocityXZ[i] * particleTime[i];
+        float y = previousY[i];
+        float vy = velocityY[i];
+        int isDown = particleDown(ps, i);
+        int rising = !isDown && vy > 0;
+        int hit, respawn;
+
+        positionX[i] = directionX[i] * distance;
+        positionZ[i] = directionZ[i] * distance;
+
+        // falling, rising, or at the peak where only the flag changes
+        y = isDown ? y - (vy + hgdt) * dt : (rising ? y + (vy * dt - hgdt2) : y);
+        vy = isDown ? vy + gdt : (rising ? vy - gdt : vy);
+
+        hit = (y <= 5.0f && distance < 3) | (y <= 0.0f && distance > 3);
+        respawn = hit & (distance > EDGE);
+
+        positionY[i] = y;
+        velocityY[i] = hit ? vy * 0.8f : vy;
+        setParticleDown(ps, i, !hit & !rising);
+        particleTime[i] += dt;
+
+        if (respawn)
+            respawnParticle(ps, i);
+    }
+}
+
+// the vector kernels work on the 32 particles of one word of down bits at a
+// time, from the first whole word on; updateScalar() does the rest
+static inline int firstWord(int begin, int end)
+{
+    int aligned = (begin + 31) & ~31;
+    return aligned < end ? aligned : end;
+}
+
+// respawn the particles flagged in bits, lowest index first like the scalar loop
+static inline void respawnBits(struct particleSystem *ps, int i, uint32_t bits)
+{
+    while (bits)
+    {
+        respawnParticle(ps, i + __builtin_ctz(bits));
+        bits &= bits - 1;
+    }
+}
+
+#ifdef HAVE_X86_KERNELS
+
+// bitwise select: mask ? a : b
+#define SELECT(mask, a, b) _mm_or_ps(_mm_and_ps((mask), (a)), _mm_andnot_ps((mask), (b)))
+#define SELECT256(mask, a, b) _mm256_blendv_ps((b), (a), (mask))
+
+void updateSSE(struct particleSystem *ps, int begin, int end)
+{
+    const float dt = TIME_DELTA;
+    const float gdt = ps->gravity * dt;
+    const float hgdt = 0.5f * gdt;
+    const float hgdt2 = hgdt * dt;
+    const __m128 vdt = _mm_set1_ps(dt);
+    const __m128 vgdt = _mm_set1_ps(gdt);
+    const __m128 vhgdt = _mm_set1_ps(hgdt);
+    const __m128 vhgdt2 = _mm_set1_ps(hgdt2);
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 shelf = _mm_set1_ps(5.0f);
+    const __m128 three = _mm_set1_ps(3.0f);
+    const __m128 edge = _mm_set1_ps(EDGE);
+    const __m128 bounce = _mm_set1_ps(0.8f);
+    const __m128i laneBits = _mm_set_epi32(8, 4, 2, 1);
+    int i = firstWord(begin, end);
+    int lane;
+
+    updateScalar(ps, begin, i);
+    for (; i + 32 <= end; i += 32)
+    {
+        uint32_t downIn = ps->down[i >> 5], downOut = 0, respawns = 0;
+
+        for (lane = 0; lane < 32; lane += 4)
+        {
+            int j = i + lane;
+            __m128i bits = _mm_set1_epi32((downIn >> lane) & 15);
+            __m128 isDown = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(bits, laneBits), laneBits));
+            __m128 t = _mm_load_ps(ps->particleTime + j);
+            __m128 y = _mm_load_ps(ps->previousY + j);
+            __m128 vy = _mm_load_ps(ps->velocityY + j);
+            __m128 distance = _mm_mul_ps(_mm_load_ps(ps->velocityXZ + j), t);
+            __m128 rising, hit;
+
+            _mm_store_ps(ps->positionX + j, _mm_mul_ps(_mm_load_ps(ps->directionX + j), distance));
+            _mm_store_ps(ps->positionZ + j, _mm_mul_ps(_mm_load_ps(ps->directionZ + j), distance));
+
+            rising = _mm_andnot_ps(isDown, _mm_cmpgt_ps(vy, zero));
+            y = SELECT(isDown, _mm_sub_ps(y, _mm_mul_ps(_mm_add_ps(vy, vhgdt), vdt)),
+                       SELECT(rising, _mm_add_ps(y, _mm_sub_ps(_mm_mul_ps(vy, vdt), vhgdt2)), y));
+            vy = SELECT(isDown, _mm_add_ps(vy, vgdt), SELECT(rising, _mm_sub_ps(vy, vgdt), vy));
+
+            hit = _mm_or_ps(_mm_and_ps(_mm_cmple_ps(y, shelf), _mm_cmplt_ps(distance, three)),
+                            _mm_and_ps(_mm_cmple_ps(y, zero), _mm_cmpgt_ps(distance, three)));
+            vy = SELECT(hit, _mm_mul_ps(vy, bounce), vy);
+
+            _mm_store_ps(ps->positionY + j, y);
+            _mm_store_ps(ps->velocityY + j, vy);
+            _mm_store_ps(ps->particleTime + j, _mm_add_ps(t, vdt));
+
+            downOut |= (uint32_t) (~_mm_movemask_ps(_mm_or_ps(hit, rising)) & 15) << lane;
+            respawns |= (uint32_t) _mm_movemask_ps(_mm_and_ps(hit, _mm_cmpgt_ps(distance, edge))) << lane;
+        }
+        ps->down[i >> 5] = downOut;
+        respawnBits(ps, i, respawns);
+    }
+    updateScalar(ps, i, end);
+}
+
+__attribute__((target("avx2")))
+void updateAVX2(struct particleSystem *ps, int begin, int end)
+{
+    const float dt = TIME_DELTA;
+    const float gdt = ps->gravity * dt;
+    const float hgdt = 0.5f * gdt;
+    const float hgdt2 = hgdt * dt;
+    const __m256 vdt = _mm256_set1_ps(dt);
+    const __m256 vgdt = _mm256_set1_ps(gdt);
+    const __m256 vhgdt = _mm256_set1_ps(hgdt);
+    const __m256 vhgdt2 = _mm256_set1_ps(hgdt2);
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 shelf = _mm256_set1_ps(5.0f);
+    const __m256 three = _mm256_set1_ps(3.0f);
+    const __m256 edge = _mm256_set1_ps(EDGE);
+    const __m256 bounce = _mm256_set1_ps(0.8f);
+    const __m256i laneBits = _mm256_set_epi32(128, 64, 32, 16, 8, 4, 2, 1);
+    int i = firstWord(begin, end);
+    int lane;
+
+    updateScalar(ps, begin, i);
+    for (; i + 32 <= end; i += 32)
+    {
+        uint32_t downIn = ps->down[i >> 5], downOut = 0, respawns = 0;
+
+        for (lane = 0; lane < 32; lane += 8)
+        {
+            int j = i + lane;
+            __m256i bits = _mm256_set1_epi32((downIn >> lane) & 255);
+            __m256 isDown = _mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_and_si256(bits, laneBits), laneBits));
+            __m256 t = _mm256_load_ps(ps->particleTime + j);
+            __m256 y = _mm256_load_ps(ps->previousY + j);
+            __m256 vy = _mm256_load_ps(ps->velocityY + j);
+            __m256 distance = _mm256_mul_ps(_mm256_load_ps(ps->velocityXZ + j), t);
+            __m256 rising, hit;
+
+            _mm256_store_ps(ps->positionX + j, _mm256_mul_ps(_mm256_load_ps(ps->directionX + j), distance));
+            _mm256_store_ps(ps->positionZ + j, _mm256_mul_ps(_mm256_load_ps(ps->directionZ + j), distance));
+
+            rising = _mm256_andnot_ps(isDown, _mm256_cmp_ps(vy, zero, _CMP_GT_OQ));
+            y = SELECT256(isDown, _mm256_sub_ps(y, _mm256_mul_ps(_mm256_add_ps(vy, vhgdt), vdt)),
+                          SELECT256(rising, _mm256_add_ps(y, _mm256_sub_ps(_mm256_mul_ps(vy, vdt), vhgdt2)), y));
+            vy = SELECT256(isDown, _mm256_add_ps(vy, vgdt), SELECT256(rising, _mm256_sub_ps(vy, vgdt), vy));
+
+            hit = _mm256_or_ps(_mm256_and_ps(_mm256_cmp_ps(y, shelf, _CMP_LE_OQ), _mm256_cmp_ps(distance, three, _CMP_LT_OQ)),
+                               _mm256_and_ps(_mm256_cmp_ps(y, zero, _CMP_LE_OQ), _mm256_cmp_ps(distance, three, _CMP_GT_OQ)));
+            vy = SELECT256(hit, _mm256_mul_ps(vy, bounce), vy);
+
+            _mm256_store_ps(ps->positionY + j, y);
+            _mm256_store_ps(ps->velocityY + j, vy);
+            _mm256_store_ps(ps->particleTime + j, _mm256_add_ps(t, vdt));
+
+            downOut |= (uint32_t) (~_mm256_movemask_ps(_mm256_or_ps(hit, rising)) & 255) << lane;
+            respawns |= (uint32_t) _mm256_movemask_ps(_mm256_and_ps(hit, _mm256_cmp_ps(distance, edge, _CMP_GT_OQ))) << lane;
+        }
+        ps->down[i >> 5] = downOut;
+        respawnBits(ps, i, respawns);
+    }
+    updateScalar(ps, i, end);
+}
+
+#endif
+
+/* end of update.c */
@@ -0,0 +1,43 @@
+//
+//  update.h
+//
+//
+//  Created by BOWEN LI
+//
+//  The update kernels behind updateParticleArray(). Each one advances the
+//  particles in [begin, end) by TIME_DELTA and respawns those leaving EDGE.
+//  The old heights are read from previousY, the new positions are written to
+//  positionX, positionY and positionZ.
+//
+
+#ifndef UPDATE_H
+#define UPDATE_H
+
+#include "particles.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86_KERNELS 1
+#endif
+
+// re-initialise a particle that left the ground during a step
+void respawnParticle(struct particleSystem *ps, int i);
+
+// the same for the given step, which picks the random numbers
+void respawnParticleStep(struct particleSystem *ps, int i, uint64_t step);
+
+typedef void (*updateKernel)(struct particleSystem *ps, int begin, int end);
+
+// the original loop, intermediate values in double precision
+void updateReference(struct particleSystem *ps, int begin, int end);
+
+// the same rule written with selects instead of branches, in float
+void updateScalar(struct particleSystem *ps, int begin, int end);
+
+#ifdef HAVE_X86_KERNELS
+void updateSSE(struct particleSystem *ps, int begin, int end);
+void updateAVX2(struct particleSystem *ps, int begin, int end);
+#endif
+
+#endif
+
+/* end of update.h */
@@ -0,0 +1,149 @@
+//
+//  vertices.c
+//
+//
+//  Created by BOWEN LI
+//
+
+#include <string.h>
+#include "vertices.h"
+#include "compact.h"
+#include "particles.h"
+
+int vertexFeatures(const struct particleSystem *ps, const uint32_t *order, int square)
+{
+    return (order != NULL ? VERTEX_ORDERED : 0) | (ps->compact != NULL ? VERTEX_COMPACT : 0) |
+           (square ? VERTEX_SQUARE : 0);
+}
+
+// the vertices of one case, features a constant in each kernel so that the
+// tests below fold away and no loop looks at the mode
+static inline __attribute__((always_inline))
+void specialisedVertices(float *restrict vertex, uint8_t *restrict color, const struct particleSystem *ps,
+                         const uint32_t *restrict order, int first, int n, float size, const int features)
+{
+    const float *positionX = ps->positionX, *positionY = ps->positionY, *positionZ = ps->positionZ;
+    const float *previousX = ps->previousX, *previousY = ps->previousY, *previousZ = ps->previousZ;
+    const struct compactParticles *compact = ps->compact;
+    const uint8_t (*colors)[4] = features & VERTEX_COMPACT ? compact->color : ps->colorList;
+    const int corners = features & VERTEX_SQUARE ? 4 : 1;
+    float blend = ps->blend;
+    int i, j, corner;
+
+    // as stored, a compact frame decodes a block at a time, and points take the colours as they are
+    if (features == VERTEX_COMPACT)
+        compactPositions(compact, first, n, blend, vertex);
+    if (!(features & (VERTEX_ORDERED | VERTEX_SQUARE)))
+        memcpy(color, colors + first, n * sizeof(*colors));
+    if (features == VERTEX_COMPACT)
+        return;
+
+    // one pass through a drawing order, which jumps about memory; as stored,
+    // the colours go on their own
+    for (i = 0; i < n; i++)
+    {
+        float position[3];
+        uint8_t *packed = color + 4 * corners * i;
+
+        j = features & VERTEX_ORDERED ? (int) order[first + i] : first + i;
+        if (features & VERTEX_COMPACT)
+            compactPosition(compact, j, blend, position);
+        else
+        {
+            position[0] = previousX[j] + blend * (positionX[j] - previousX[j]);
+            position[1] = previousY[j] + blend * (positionY[j] - previousY[j]);
+            position[2] = previousZ[j] + blend * (positionZ[j] - previousZ[j]);
+        }
+        if (features & VERTEX_SQUARE)
+        {
+            float *v = vertex + 12 * i;
+
+            v[0] = position[0] - size;  v[1] = position[1] + size;  v[2] = position[2];     // left top
+            v[3] = position[0] - size;  v[4] = position[1] - size;  v[5] = position[2];     // left bottom
+            v[6] = position[0] + size;  v[7] = position[1] - size;  v[8] = position[2];     // right bottom
+            v[9] = position[0] + size;  v[10] = position[1] + size; v[11] = position[2];    // right top
+        }
+        else
+        {
+            vertex[3 * i + 0] = position[0];
+            vertex[3 * i + 1] = position[1];
+            vertex[3 * i + 2] = position[2];
+        }
+        if (!(features & VERTEX_ORDERED))
+            continue;
+        for (corner = 0; corner < corners; corner++)
+            memcpy(packed + 4 * corner, colors[j], 4);
+    }
+
+    // the corners of squares as stored share their colour
+    if ((features & (VERTEX_ORDERED | VERTEX_SQUARE)) == VERTEX_SQUARE)
+    {
+        for (i = 0; i < n; i++)
+        {
+            for (corner = 0; corner < corners; corner++)
+                memcpy(color + 4 * (corners * i + corner), colors[first + i], 4);
+        }
+    }
+}
+
+#define VERTEX_KERNEL(features) \
+    static void vertices##features(float *vertex, uint8_t *color, const struct particleSystem *ps, \
+                                   const uint32_t *order, int first, int n, float size) \
+    { \
+        specialisedVertices(vertex, color, ps, order, first, n, size, features); \
+    }
+
+VERTEX_KERNEL(0)
+VERTEX_KERNEL(1)
+VERTEX_KERNEL(2)
+VERTEX_KERNEL(3)
+VERTEX_KERNEL(4)
+VERTEX_KERNEL(5)
+VERTEX_KERNEL(6)
+VERTEX_KERNEL(7)
+
+vertexKernel vertexKernelFor(int features)
+{
+    static const vertexKernel kernels[VERTEX_KERNELS] =
+    {
+        vertices0, vertices1, vertices2, vertices3, vertices4, vertices5, vertices6, vertices7
+    };
+
+    return kernels[features & (VERTEX_KERNELS - 1)];
+}
+
+void vertexReference(float *vertex, uint8_t *color, const struct particleSystem *ps,
+                     const uint32_t *order, int first, int n, float size)
+{
+    int square = size > 0, corners = square ? 4 : 1;
+    int i, j, corner;
+
+    for (i = 0; i < n; i++)
+    {
+        float position[3];
+        float *v = vertex + 3 * corners * i;
+
+        j = order != NULL ? (int) order[first + i] : first + i;
+        drawPosition(ps, j, position);
+        if (!square)
+        {
+            v[0] = position[0];
+            v[1] = position[1];
+            v[2] = position[2];
+            continue;
+        }
+        v[0] = position[0] - size;  v[1] = position[1] + size;  v[2] = position[2];     // left top
+        v[3] = position[0] - size;  v[4] = position[1] - size;  v[5] = position[2];     // left bottom
+        v[6] = position[0] + size;  v[7] = position[1] - size;  v[8] = position[2];     // right bottom
+        v[9] = position[0] + size;  v[10] = position[1] + size; v[11] = position[2];    // right top
+    }
+    for (i = 0; i < n; i++)
+    {
+        j = order != NULL ? (int) order[first + i] : first + i;
+        drawColor(ps, j, color + 4 * corners * i);
+        for (corner = 1; corner < corners; corner++)
+            memcpy(color + 4 * (corners * i + corner), color + 4 * corners * i, 4);
+    }
+}
+
+/* end of vertices.c */
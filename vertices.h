@@ -0,0 +1,47 @@
+//
+//  vertices.h
+//
+//
+//  Created by BOWEN LI
+//
+//  The vertices GL draws the particles from: where each is drawn, blended
+//  between its previous and its current position, and its colour as RGBA
+//  bytes. Whether the particles go through a drawing order, whether they
+//  come from a compact frame and whether each becomes a point or the four
+//  corners of a square is decided once per draw, by picking a loop built
+//  for that case from a table, instead of for every particle.
+//
+
+#ifndef VERTICES_H
+#define VERTICES_H
+
+#include <stdint.h>
+
+#define VERTEX_ORDERED 1                        // through a drawing order, not as stored
+#define VERTEX_COMPACT 2                        // from a compact frame, not the arrays
+#define VERTEX_SQUARE 4                         // four corners a particle, not one point
+#define VERTEX_KERNELS 8
+
+struct particleSystem;
+
+// particles [first, first + n) of order, or as stored when order is NULL:
+// their vertices, three floats each, then their colours, four bytes each.
+// A square's corners go left top, left bottom, right bottom, right top, size
+// from its centre, each with the same colour.
+typedef void (*vertexKernel)(float *vertex, uint8_t *color, const struct particleSystem *ps,
+                             const uint32_t *order, int first, int n, float size);
+
+// the VERTEX_ features of drawing ps through order, as squares when square
+int vertexFeatures(const struct particleSystem *ps, const uint32_t *order, int square);
+
+// the loop for features, see vertexFeatures()
+vertexKernel vertexKernelFor(int features);
+
+// the loop the kernels replace, testing the features particle by particle,
+// for particle_bench to time them against
+void vertexReference(float *vertex, uint8_t *color, const struct particleSystem *ps,
+                     const uint32_t *order, int first, int n, float size);
+
+#endif
+
+/* end of vertices.h */